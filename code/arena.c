@@ -0,0 +1,130 @@
+/**
+ * @file arena.c
+ * @brief bump allocator: many small allocations freed all at once
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;    // bytes of data
+    size_t used;
+    max_align_t data[];
+};
+
+static size_t arena_round(size_t size){
+    return (size + ARENA_ALIGN - 1)/ARENA_ALIGN*ARENA_ALIGN;
+}
+
+void arena_init(struct arena *a, size_t chunk_size){
+    a->chunks = NULL;
+    a->chunk_size = (chunk_size == 0) ? ARENA_CHUNK_SIZE : chunk_size;
+}
+
+void *arena_alloc(struct arena *a, size_t size){
+    size = arena_round(size == 0 ? 1 : size);
+    struct arena_chunk *c = a->chunks;
+    if(c == NULL || c->size - c->used < size){
+        const size_t data_size = (size > a->chunk_size) ? size : a->chunk_size;
+        if(data_size > SIZE_MAX - sizeof(struct arena_chunk)){
+            return NULL;
+        }
+        c = malloc(sizeof(struct arena_chunk) + data_size);
+        if(c == NULL){
+            return NULL;
+        }
+        c->size = data_size;
+        c->used = 0;
+        c->next = a->chunks;
+        a->chunks = c;
+    }
+    void *p = (char *)c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+void *arena_calloc(struct arena *a, size_t count, size_t size){
+    if(size != 0 && count > SIZE_MAX/size){
+        return NULL;
+    }
+    void *p = arena_alloc(a, count*size);
+    if(p != NULL){
+        memset(p, 0, count*size);
+    }
+    return p;
+}
+
+void arena_reset(struct arena *a){
+    if(a->chunks == NULL){
+        return;
+    }
+    // keep the last chunk allocated, the others go back to the system
+    struct arena_chunk *keep = a->chunks;
+    struct arena_chunk *c = keep->next;
+    while(c != NULL){
+        struct arena_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    keep->next = NULL;
+    keep->used = 0;
+}
+
+void arena_free(struct arena *a){
+    arena_reset(a);
+    free(a->chunks);
+    a->chunks = NULL;
+}
+
+struct arena_mark arena_mark(const struct arena *a){
+    struct arena_mark mark = { a->chunks, a->chunks == NULL ? 0 : a->chunks->used };
+    return mark;
+}
+
+void arena_release(struct arena *a, struct arena_mark mark){
+    if(mark.chunk == NULL){
+        arena_reset(a);
+        return;
+    }
+    while(a->chunks != mark.chunk){
+        struct arena_chunk *next = a->chunks->next;
+        free(a->chunks);
+        a->chunks = next;
+    }
+    a->chunks->used = mark.used;
+}
+
+
+static __thread struct arena scratch;
+static __thread int scratch_ready;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_destroy(void *a){
+    arena_free(a);
+}
+
+static void scratch_key_create(void){
+    pthread_key_create(&scratch_key, scratch_destroy);
+}
+
+struct arena *arena_scratch(void){
+    if(!scratch_ready){
+        arena_init(&scratch, 0);
+        // the key only serves to free the chunks when the thread exits
+        pthread_once(&scratch_once, scratch_key_create);
+        pthread_setspecific(scratch_key, &scratch);
+        scratch_ready = 1;
+    }
+    return &scratch;
+}
+
+void arena_scope_end(struct arena_scope *scope){
+    arena_release(scope->a, scope->mark);
+}
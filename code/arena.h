@@ -0,0 +1,105 @@
+#pragma once
+
+/**
+ * @file arena.h
+ * @brief bump allocator: many small allocations freed all at once
+ *
+ * An arena hands out memory from large chunks and never frees a single
+ * allocation: arena_reset() makes all its memory reusable, keeping its
+ * first chunk, and arena_free() returns everything to the system.
+ * An arena is not thread-safe: each thread uses its own.
+ *
+ * Each thread also has a scratch arena, arena_scratch(), for the memory of
+ * one operation: ARENA_SCOPE() gives it to a block and, when the block is
+ * left, releases what the block allocated. The top-level operations (CLI
+ * command, FUSE callback) open the first scope, so the functions they call
+ * nest theirs and, once the first chunk is there, never call malloc().
+ */
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE (64 * 1024)    /* default size of a chunk, in bytes */
+
+struct arena_chunk;
+
+struct arena {
+    struct arena_chunk *chunks;     // the current chunk first
+    size_t chunk_size;
+};
+
+struct arena_mark {
+    struct arena_chunk *chunk;      // the current chunk then (NULL if none)
+    size_t used;
+};
+
+struct arena_scope {
+    struct arena *a;
+    struct arena_mark mark;
+};
+
+/**
+ * @brief initialize an empty arena (no memory is allocated yet)
+ * @param a the arena (OUT)
+ * @param chunk_size the size of its chunks (0 for ARENA_CHUNK_SIZE); a
+ *        larger allocation gets a chunk of its own
+ */
+void arena_init(struct arena *a, size_t chunk_size);
+
+/**
+ * @brief allocate memory, aligned for any type, valid until the next
+ *        arena_reset() or arena_free()
+ * @param a the arena
+ * @param size the number of bytes
+ * @return the memory (not zeroed); NULL if out of memory
+ */
+void *arena_alloc(struct arena *a, size_t size);
+
+/**
+ * @brief same as arena_alloc(), the memory being zeroed
+ */
+void *arena_calloc(struct arena *a, size_t count, size_t size);
+
+/**
+ * @brief make all the memory of the arena available again, keeping one chunk
+ * @param a the arena
+ */
+void arena_reset(struct arena *a);
+
+/**
+ * @brief free all the memory of the arena, which is left empty
+ * @param a the arena
+ */
+void arena_free(struct arena *a);
+
+/**
+ * @brief the current position in the arena, for arena_release()
+ * @param a the arena
+ * @return the mark
+ */
+struct arena_mark arena_mark(const struct arena *a);
+
+/**
+ * @brief free all that was allocated since mark, keeping one chunk
+ * @param a the arena
+ * @param mark a mark of the arena, taken after its last reset
+ */
+void arena_release(struct arena *a, struct arena_mark mark);
+
+/**
+ * @brief the scratch arena of the calling thread, freed when it exits
+ * @return the arena
+ */
+struct arena *arena_scratch(void);
+
+/**
+ * @brief end of an ARENA_SCOPE(): releases the scratch arena to its mark
+ */
+void arena_scope_end(struct arena_scope *scope);
+
+/**
+ * Declares a struct arena *name, the scratch arena of the thread, whose
+ * allocations are released when the enclosing block is left.
+ */
+#define ARENA_SCOPE(name) \
+    struct arena *name = arena_scratch(); \
+    struct arena_scope name##_scope __attribute__((cleanup(arena_scope_end))) = { name, arena_mark(name) }
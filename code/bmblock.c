@@ -14,6 +14,7 @@
 #include "bmblock.h"
 #include "error.h"
 #include "unixv6fs.h"
+#include "stats.h"
 
 #define ROUND_UP(_x, _y) ((((_x)+(_y)-1)/(_y))*(_y))
 
@@ -52,6 +53,7 @@ int bm_get(struct bmblock_array *bmblock_array, uint64_t x)
 int bm_find_next(struct bmblock_array *bmblock_array)
 {
     M_REQUIRE_NON_NULL(bmblock_array);
+    STATS_SCOPE(STATS_BM_ALLOC);
 
     uint64_t cursor = bmblock_array->cursor;
 
@@ -73,6 +75,39 @@ int bm_find_next(struct bmblock_array *bmblock_array)
     return ERR_BITMAP_FULL;
 }
 
+int bm_find_run(struct bmblock_array *bmblock_array, size_t count)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+    if (count == 0) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    uint64_t start = bmblock_array->min;
+    size_t run = 0;
+    for (uint64_t x = bmblock_array->min; x <= bmblock_array->max; ++x) {
+        const uint64_t rel = x - bmblock_array->min;
+        // a full word can neither start nor extend a run: skip it at once
+        if (rel % BITS_PER_VECTOR == 0 && x + BITS_PER_VECTOR - 1 <= bmblock_array->max
+            && bmblock_array->bm[rel / BITS_PER_VECTOR] == UINT64_C(-1)) {
+            run = 0;
+            x += BITS_PER_VECTOR - 1;
+            continue;
+        }
+        if (bm_get(bmblock_array, x) != 0) {
+            run = 0;
+            continue;
+        }
+        if (run == 0) {
+            start = x;
+        }
+        if (++run == count) {
+            return (int) start;
+        }
+    }
+
+    return ERR_BITMAP_FULL;
+}
+
 void bm_set(struct bmblock_array *bmblock_array, uint64_t x)
 {
     if (x <= bmblock_array->max && x >= bmblock_array->min) {
@@ -83,6 +118,11 @@ void bm_set(struct bmblock_array *bmblock_array, uint64_t x)
 
 void bm_clear(struct bmblock_array *bmblock_array, uint64_t x)
 {
+    const struct bmblock_array *pinned = bmblock_array->pinned;
+    if (pinned != NULL && x <= pinned->max && x >= pinned->min
+        && ((pinned->bm[(x - pinned->min) / BITS_PER_VECTOR] >> ((x - pinned->min) % BITS_PER_VECTOR)) & UINT64_C(1))) {
+        return;
+    }
     if (x <= bmblock_array->max && x >= bmblock_array->min) {
         bmblock_array->bm[(x - bmblock_array->min) / BITS_PER_VECTOR] &= ~(UINT64_C(1)
                 << ((x - bmblock_array->min) % BITS_PER_VECTOR));
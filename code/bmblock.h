@@ -16,6 +16,7 @@ struct bmblock_array {
     uint64_t cursor;    // the current position of our cursor (used by find_next)
     uint64_t min;       // the minimum value of our struct
     uint64_t max;       // the maximum value of our struct
+    const struct bmblock_array *pinned; // bits bm_clear() leaves set (same bounds), NULL if none
     size_t length;      // the (byte) length of our array of bits
     uint64_t bm[1];     // the array that will be extended and will contain our bits
 };
@@ -47,7 +48,7 @@ int bm_get(struct bmblock_array *bmblock_array, uint64_t x);
 void bm_set(struct bmblock_array *bmblock_array, uint64_t x);
 
 /**
- * @brief set to false (or 0) the bit associated to the given value
+ * @brief set to false (or 0) the bit associated to the given value, unless it is pinned
  * @param bmblock_array the array containing the value we want to clear
  * @param x an integer corresponding to the number of the value we are looking for
  */
@@ -60,6 +61,15 @@ void bm_clear(struct bmblock_array *bmblock_array, uint64_t x);
  */
 int bm_find_next(struct bmblock_array *bmblock_array);
 
+/**
+ * @brief return the first value of a run of count consecutive unused bits
+ *        (the bits are not set: the caller claims them one by one)
+ * @param bmblock_array the array we want to search for place
+ * @param count the length of the wanted run
+ * @return <0 on failure, the first value of the run otherwise
+ */
+int bm_find_run(struct bmblock_array *bmblock_array, size_t count);
+
 /**
  * @brief usefull to see (and debug) content of a bmblock_array
  * @param name the name of the printed block
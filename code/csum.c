@@ -0,0 +1,396 @@
+/**
+ * @file csum.c
+ * @brief checksums of the data sectors, verified when files are read
+ *
+ * The checksum of data sector s is entry s - s_block_start of the area; the
+ * entries of the area sectors themselves are unused. sector_write() only has
+ * the FILE of the disk: the mounts with checksums are found from it in a
+ * small registry, and the area sector of the entry changed is written
+ * through at once, under the lock of the area.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "mount.h"
+#include "sector.h"
+#include "bmblock.h"
+#include "csum.h"
+#include "stats.h"
+#include "util.h"
+
+#define CSUM_BATCH_SECTORS 64   // sectors read at once by csum_enable() and csum_scrub()
+#define CSUM_POLY 0x82F63B78u   // CRC32C, reversed
+
+struct csum_area {
+    FILE *f;
+    uint32_t first;         // first data sector
+    uint32_t count;         // number of data sectors
+    uint32_t start;         // first sector of the area
+    uint32_t size;          // its number of sectors
+    uint32_t *sums;         // size*CSUM_PER_SECTOR entries, as on disk
+    pthread_mutex_t lock;   // updates of sums, and writes of the area
+};
+
+static enum csum_policy csum_policy = CSUM_STRICT;
+
+static struct csum_area *csum_mounts[CSUM_MAX_MOUNTS];
+static int csum_nb_mounts;
+static pthread_mutex_t csum_mounts_lock = PTHREAD_MUTEX_INITIALIZER;   // changes of the two above
+
+
+/* ************************************************************************** *
+ * CRC32C
+ * ************************************************************************** */
+
+static uint32_t csum_table[256];
+static uint32_t (*csum_update)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t csum_once = PTHREAD_ONCE_INIT;
+
+static uint32_t csum_update_table(uint32_t crc, const uint8_t *p, size_t len){
+    while(len-- > 0){
+        crc = csum_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// the crc32 instruction of SSE4.2 computes CRC32C, 8 bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t csum_update_sse42(uint32_t crc, const uint8_t *p, size_t len){
+    uint64_t crc64 = crc;
+    while(len >= sizeof(uint64_t)){
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        p += sizeof(word);
+        len -= sizeof(word);
+    }
+    crc = (uint32_t)crc64;
+    while(len-- > 0){
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static void csum_init(void){
+    for(uint32_t b = 0; b < 256; b++){
+        uint32_t crc = b;
+        for(int k = 0; k < 8; k++){
+            crc = (crc & 1) ? (crc >> 1) ^ CSUM_POLY : crc >> 1;
+        }
+        csum_table[b] = crc;
+    }
+    csum_update = csum_update_table;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if(__builtin_cpu_supports("sse4.2")){
+        csum_update = csum_update_sse42;
+    }
+#endif
+}
+
+uint32_t csum_crc32c(const void *data, size_t len){
+    pthread_once(&csum_once, csum_init);
+    return ~csum_update(~UINT32_C(0), data, len);
+}
+
+
+/* ************************************************************************** *
+ * Mounts
+ * ************************************************************************** */
+
+int csum_set_policy(const char *name){
+    M_REQUIRE_NON_NULL(name);
+    if(strcmp(name, "off") == 0){
+        csum_policy = CSUM_OFF;
+    }else if(strcmp(name, "warn") == 0){
+        csum_policy = CSUM_WARN;
+    }else if(strcmp(name, "strict") == 0){
+        csum_policy = CSUM_STRICT;
+    }else{
+        return ERR_BAD_PARAMETER;
+    }
+    return ERR_NONE;
+}
+
+static int csum_register(struct csum_area *a){
+    int ret = ERR_NOMEM;
+    pthread_mutex_lock(&csum_mounts_lock);
+    for(int k = 0; k < CSUM_MAX_MOUNTS && ret != ERR_NONE; k++){
+        if(csum_mounts[k] == NULL){
+            __atomic_store_n(&csum_mounts[k], a, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&csum_nb_mounts, 1, __ATOMIC_RELEASE);
+            ret = ERR_NONE;
+        }
+    }
+    pthread_mutex_unlock(&csum_mounts_lock);
+    return ret;
+}
+
+static void csum_unregister(const struct csum_area *a){
+    pthread_mutex_lock(&csum_mounts_lock);
+    for(int k = 0; k < CSUM_MAX_MOUNTS; k++){
+        if(csum_mounts[k] == a){
+            __atomic_store_n(&csum_mounts[k], NULL, __ATOMIC_RELEASE);
+            __atomic_sub_fetch(&csum_nb_mounts, 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&csum_mounts_lock);
+}
+
+static struct csum_area *csum_find(const FILE *f){
+    if(__atomic_load_n(&csum_nb_mounts, __ATOMIC_ACQUIRE) == 0){
+        return NULL;
+    }
+    for(int k = 0; k < CSUM_MAX_MOUNTS; k++){
+        struct csum_area *a = __atomic_load_n(&csum_mounts[k], __ATOMIC_ACQUIRE);
+        if(a != NULL && a->f == f){
+            return a;
+        }
+    }
+    return NULL;
+}
+
+// an area of the size needed by u, not yet filled
+static struct csum_area *csum_new(const struct unix_filesystem *u){
+    struct csum_area *a = calloc(1, sizeof(struct csum_area));
+    if(a == NULL){
+        return NULL;
+    }
+    a->f = u->f;
+    a->first = u->s.s_block_start;
+    a->count = (uint32_t)(u->s.s_fsize - u->s.s_block_start);
+    a->size = (uint32_t)((a->count + CSUM_PER_SECTOR - 1)/CSUM_PER_SECTOR);
+    a->sums = calloc(a->size, SECTOR_SIZE);
+    if(a->sums == NULL){
+        free(a);
+        return NULL;
+    }
+    pthread_mutex_init(&a->lock, NULL);
+    return a;
+}
+
+static void csum_free(struct csum_area *a){
+    if(a != NULL){
+        pthread_mutex_destroy(&a->lock);
+        free(a->sums);
+        free(a);
+    }
+}
+
+// whether sector has a checksum in a (a data sector out of the area)
+static int csum_covers(const struct csum_area *a, uint32_t sector){
+    return sector >= a->first && sector - a->first < a->count
+           && (sector < a->start || sector - a->start >= a->size);
+}
+
+static void csum_reserve(struct unix_filesystem *u, const struct csum_area *a, int reserve){
+    for(uint32_t k = 0; k < a->size; k++){
+        if(reserve){
+            bm_set(u->fbm, a->start + k);
+        }else{
+            bm_clear(u->fbm, a->start + k);
+        }
+    }
+}
+
+int csum_mount(struct unix_filesystem *u){
+    M_REQUIRE_NON_NULL(u);
+    u->csum = NULL;
+    if(u->s.s_csum_start == 0){
+        return ERR_NONE;
+    }
+
+    struct csum_area *a = csum_new(u);
+    if(a == NULL){
+        return ERR_NOMEM;
+    }
+    a->start = u->s.s_csum_start;
+    if(u->s.s_csum_size != a->size || a->start < a->first || a->start + a->size > u->s.s_fsize){
+        csum_free(a);
+        return ERR_INCONSISTENT_FS;
+    }
+    int ret = sector_read_many(u->f, a->start, a->size, a->sums);
+    if(ret == ERR_NONE){
+        ret = csum_register(a);
+    }
+    if(ret != ERR_NONE){
+        csum_free(a);
+        return ret;
+    }
+    csum_reserve(u, a, 1);
+    u->csum = a;
+    return ERR_NONE;
+}
+
+void csum_umount(struct unix_filesystem *u){
+    if(u != NULL && u->csum != NULL){
+        csum_unregister(u->csum);
+        csum_free(u->csum);
+        u->csum = NULL;
+    }
+}
+
+
+/* ************************************************************************** *
+ * Writes and reads
+ * ************************************************************************** */
+
+int csum_sector_written(FILE *f, uint32_t sector, const void *data){
+    struct csum_area *a = csum_find(f);
+    if(a == NULL || !csum_covers(a, sector)){
+        return ERR_NONE;
+    }
+    const uint32_t index = sector - a->first;
+    const uint32_t crc = csum_crc32c(data, SECTOR_SIZE);
+
+    int ret = ERR_NONE;
+    pthread_mutex_lock(&a->lock);
+    if(a->sums[index] != crc){
+        __atomic_store_n(&a->sums[index], crc, __ATOMIC_RELAXED);
+        // the area is out of what it covers: this write does not come back here
+        const uint32_t area_sector = (uint32_t)(index/CSUM_PER_SECTOR);
+        ret = sector_write(f, a->start + area_sector, &a->sums[area_sector*CSUM_PER_SECTOR]);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return ret;
+}
+
+// the sectors of [sector, sector + count) whose data do not match, reported on stderr
+static unsigned long csum_check(const struct csum_area *a, uint32_t sector, size_t count, const void *data){
+    unsigned long bad = 0;
+    const uint8_t *bytes = data;
+    for(size_t k = 0; k < count; k++){
+        const uint32_t s = sector + (uint32_t)k;
+        if(csum_covers(a, s)
+           && csum_crc32c(bytes + k*SECTOR_SIZE, SECTOR_SIZE) != __atomic_load_n(&a->sums[s - a->first], __ATOMIC_RELAXED)){
+            fprintf(stderr, "csum: sector %" PRIu32 ": checksum mismatch\n", s);
+            bad++;
+        }
+    }
+    return bad;
+}
+
+int csum_verify(const struct unix_filesystem *u, uint32_t sector, size_t count, const void *data){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(data);
+    if(u->csum == NULL || csum_policy == CSUM_OFF){
+        return ERR_NONE;
+    }
+    STATS_SCOPE(STATS_CSUM_VERIFY);
+    const unsigned long bad = csum_check(u->csum, sector, count, data);
+    return (bad > 0 && csum_policy == CSUM_STRICT) ? ERR_CHECKSUM : ERR_NONE;
+}
+
+
+/* ************************************************************************** *
+ * Commands
+ * ************************************************************************** */
+
+// writes the location of the area in the superblock
+static int csum_write_superblock(struct unix_filesystem *u, uint32_t start, uint32_t size){
+    u->s.s_csum_start = (sector_addr_t)start;
+    u->s.s_csum_size = (sector_addr_t)size;
+    return sector_write(u->f, SUPERBLOCK_SECTOR, &u->s);
+}
+
+int csum_enable(struct unix_filesystem *u){
+    M_REQUIRE_NON_NULL(u);
+    if(u->csum != NULL){
+        return ERR_NONE;
+    }
+    struct csum_area *a = csum_new(u);
+    if(a == NULL){
+        return ERR_NOMEM;
+    }
+    int start = bm_find_run(u->fbm, a->size);
+    if(start >= 0 && (uint32_t)start + a->size > u->s.s_fsize){
+        start = ERR_BITMAP_FULL;
+    }
+    if(start < 0){
+        csum_free(a);
+        return start;
+    }
+    a->start = (uint32_t)start;
+
+    // every data sector gets its checksum, free or not: all stay valid from now on
+    int ret = ERR_NONE;
+    uint8_t data[CSUM_BATCH_SECTORS*SECTOR_SIZE];
+    for(uint32_t done = 0; done < a->count && ret == ERR_NONE; done += CSUM_BATCH_SECTORS){
+        const uint32_t n = MIN(a->count - done, CSUM_BATCH_SECTORS);
+        ret = sector_read_many(u->f, a->first + done, n, data);
+        for(uint32_t k = 0; k < n && ret == ERR_NONE; k++){
+            a->sums[done + k] = csum_covers(a, a->first + done + k) ? csum_crc32c(data + k*SECTOR_SIZE, SECTOR_SIZE) : 0;
+        }
+    }
+    // the area first, the superblock naming it last
+    for(uint32_t k = 0; k < a->size && ret == ERR_NONE; k++){
+        ret = sector_write(u->f, a->start + k, &a->sums[k*CSUM_PER_SECTOR]);
+    }
+    if(ret == ERR_NONE){
+        ret = csum_write_superblock(u, a->start, a->size);
+    }
+    if(ret == ERR_NONE){
+        ret = csum_register(a);
+    }
+    if(ret != ERR_NONE){
+        csum_free(a);
+        return ret;
+    }
+    csum_reserve(u, a, 1);
+    u->csum = a;
+    pps_printf("csum: %" PRIu32 " sectors in %" PRIu32 " sectors from %" PRIu32 "\n", a->count, a->size, a->start);
+    return ERR_NONE;
+}
+
+int csum_disable(struct unix_filesystem *u){
+    M_REQUIRE_NON_NULL(u);
+    if(u->csum == NULL){
+        return ERR_NONE;
+    }
+    int ret = csum_write_superblock(u, 0, 0);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    csum_reserve(u, u->csum, 0);
+    csum_umount(u);
+    return ERR_NONE;
+}
+
+int csum_scrub(const struct unix_filesystem *u){
+    M_REQUIRE_NON_NULL(u);
+    const struct csum_area *a = u->csum;
+    if(a == NULL){
+        pps_printf("csum: no checksums (see \"csum enable\")\n");
+        return ERR_NONE;
+    }
+
+    unsigned long verified = 0;
+    unsigned long bad = 0;
+    uint8_t data[CSUM_BATCH_SECTORS*SECTOR_SIZE];
+    uint32_t sector = a->first;
+    while(sector < a->first + a->count){
+        // the next run of sectors in use
+        if(!csum_covers(a, sector) || bm_get(u->fbm, sector) != 1){
+            sector++;
+            continue;
+        }
+        uint32_t n = 1;
+        while(n < CSUM_BATCH_SECTORS && csum_covers(a, sector + n) && bm_get(u->fbm, sector + n) == 1){
+            n++;
+        }
+        int ret = sector_read_many(u->f, sector, n, data);
+        if(ret != ERR_NONE){
+            return ret;
+        }
+        bad += csum_check(a, sector, n, data);
+        verified += n;
+        sector += n;
+    }
+    pps_printf("csum: %lu sectors verified, %lu mismatches\n", verified, bad);
+    return bad > 0 ? ERR_CHECKSUM : ERR_NONE;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+/**
+ * @file csum.h
+ * @brief checksums of the data sectors, verified when files are read
+ *
+ * A filesystem may hold a CRC32C of each of its data sectors, in an area of
+ * the data sectors named by the superblock (s_csum_start, s_csum_size) and
+ * reserved in the block bitmap at mount. The checksum of a sector is updated
+ * by each sector_write() to it, and checked against the data read by
+ * filev6_readblock() and filev6_readbytes() (so by the FUSE reads). The
+ * checksums are kept in memory while mounted: a check costs one CRC32C,
+ * computed with SSE4.2 where the CPU has it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "mount.h"
+
+#define CSUM_ENV "U6FS_CSUM"    /* verification policy: "off", "warn" or "strict" (default) */
+#define CSUM_PER_SECTOR (SECTOR_SIZE / sizeof(uint32_t))
+#define CSUM_MAX_MOUNTS 16      /* mounted filesystems with checksums at once */
+
+// what a read does with a sector whose checksum does not match
+enum csum_policy {
+    CSUM_OFF,       /* the checksums are not verified */
+    CSUM_WARN,      /* the mismatch is reported on stderr, the data returned */
+    CSUM_STRICT     /* the read fails with ERR_CHECKSUM */
+};
+
+/**
+ * @brief CRC32C (Castagnoli) of a buffer
+ * @param data the bytes
+ * @param len their number
+ * @return the CRC
+ */
+uint32_t csum_crc32c(const void *data, size_t len);
+
+/**
+ * @brief set the verification policy of all the mounts
+ * @param name "off", "warn" or "strict"
+ * @return 0 on success; ERR_BAD_PARAMETER for another name
+ */
+int csum_set_policy(const char *name);
+
+/**
+ * @brief load the checksums of a filesystem being mounted, if it has some,
+ *        and reserve their area in the block bitmap (called by mountv6())
+ * @param u the filesystem, its bitmaps built (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+int csum_mount(struct unix_filesystem *u);
+
+/**
+ * @brief forget the checksums of a filesystem being unmounted (called by umountv6())
+ * @param u the filesystem (IN-OUT)
+ */
+void csum_umount(struct unix_filesystem *u);
+
+/**
+ * @brief update the checksum of a sector being written (called by sector_write())
+ * @param f open file of the virtual disk
+ * @param sector the location of the sector
+ * @param data its new SECTOR_SIZE bytes
+ * @return 0 on success (or if f has no checksums); <0 on error
+ */
+int csum_sector_written(FILE *f, uint32_t sector, const void *data);
+
+/**
+ * @brief verify count consecutive sectors just read, following the policy
+ * @param u the filesystem (IN)
+ * @param sector the location of the first sector
+ * @param count the number of sectors
+ * @param data their count*SECTOR_SIZE bytes (IN)
+ * @return 0 if they match (or are not verified); ERR_CHECKSUM otherwise
+ */
+int csum_verify(const struct unix_filesystem *u, uint32_t sector, size_t count, const void *data);
+
+/**
+ * @brief give a filesystem checksums, computed from the sectors in use
+ *        (the "csum enable" command)
+ * @param u the filesystem (IN-OUT)
+ * @return 0 on success; <0 on error (ERR_BITMAP_FULL: no room for the area)
+ */
+int csum_enable(struct unix_filesystem *u);
+
+/**
+ * @brief remove the checksums of a filesystem; their area is free from the
+ *        next mount on (the "csum disable" command)
+ * @param u the filesystem (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+int csum_disable(struct unix_filesystem *u);
+
+/**
+ * @brief verify all the sectors in use and print those that do not match
+ *        (the "csum verify" command)
+ * @param u the filesystem (IN)
+ * @return 0 if all match; ERR_CHECKSUM if some do not; <0 on other errors
+ */
+int csum_scrub(const struct unix_filesystem *u);
@@ -0,0 +1,548 @@
+/**
+ * @file dedup.c
+ * @brief deduplication of the data sectors of the regular files
+ *
+ * The entry of data sector s is entry s - s_block_start of the area; those
+ * of the sectors out of the regular files stay 0. The indexed entries are
+ * chained by hash: buckets[h] and next[] hold entry numbers plus one (0 ends
+ * a chain). Every change of an entry writes its area sector through, under
+ * the lock of the index.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+
+#include "arena.h"
+#include "error.h"
+#include "mount.h"
+#include "sector.h"
+#include "inode.h"
+#include "bmblock.h"
+#include "dedup.h"
+#include "u6fs_utils.h"
+#include "util.h"
+
+struct dedup_index {
+    uint32_t first;                 // first data sector
+    uint32_t count;                 // number of data sectors
+    uint32_t start;                 // first sector of the area
+    uint32_t size;                  // its number of sectors
+    struct dedup_entry *entries;    // size*DEDUP_PER_SECTOR, as on disk
+    uint32_t *buckets;              // nb_buckets chains of the indexed entries
+    uint32_t *next;                 // count links
+    uint32_t nb_buckets;            // a power of two
+    pthread_mutex_t lock;           // changes of the above, and writes of the area
+};
+
+
+/* ************************************************************************** *
+ * Index
+ * ************************************************************************** */
+
+// 32 bits of a SHA-256, never 0
+static uint32_t dedup_hash_of(const unsigned char *sha){
+    uint32_t hash = 0;
+    memcpy(&hash, sha, sizeof(hash));
+    return hash == 0 ? 1 : hash;
+}
+
+static int dedup_hash(const void *data, uint32_t *hash){
+    unsigned char sha[UTILS_SHA_LENGTH];
+    if(!EVP_Digest(data, SECTOR_SIZE, sha, NULL, EVP_sha256(), NULL)){
+        return ERR_NOMEM;
+    }
+    *hash = dedup_hash_of(sha);
+    return ERR_NONE;
+}
+
+// whether sector has an entry in d (a data sector out of the area)
+static int dedup_covers(const struct dedup_index *d, uint32_t sector){
+    return sector >= d->first && sector - d->first < d->count
+           && (sector < d->start || sector - d->start >= d->size);
+}
+
+static void dedup_link(struct dedup_index *d, uint32_t index){
+    const uint32_t b = d->entries[index].hash & (d->nb_buckets - 1);
+    d->next[index] = d->buckets[b];
+    d->buckets[b] = index + 1;
+}
+
+static void dedup_unlink(struct dedup_index *d, uint32_t index){
+    uint32_t *link = &d->buckets[d->entries[index].hash & (d->nb_buckets - 1)];
+    while(*link != 0 && *link != index + 1){
+        link = &d->next[*link - 1];
+    }
+    if(*link != 0){
+        *link = d->next[index];
+    }
+}
+
+// chains all the indexed entries
+static void dedup_link_all(struct dedup_index *d){
+    memset(d->buckets, 0, d->nb_buckets*sizeof(uint32_t));
+    for(uint32_t k = 0; k < d->count; k++){
+        if(d->entries[k].hash != 0){
+            dedup_link(d, k);
+        }
+    }
+}
+
+// writes the area sector holding entry index
+static int dedup_write_entry(const struct unix_filesystem *u, const struct dedup_index *d, uint32_t index){
+    const uint32_t area_sector = (uint32_t)(index/DEDUP_PER_SECTOR);
+    return sector_write(u->f, d->start + area_sector, &d->entries[area_sector*DEDUP_PER_SECTOR]);
+}
+
+// an index of the size needed by u, empty
+static struct dedup_index *dedup_new(const struct unix_filesystem *u){
+    struct dedup_index *d = calloc(1, sizeof(struct dedup_index));
+    if(d == NULL){
+        return NULL;
+    }
+    d->first = u->s.s_block_start;
+    d->count = (uint32_t)(u->s.s_fsize - u->s.s_block_start);
+    d->size = (uint32_t)((d->count + DEDUP_PER_SECTOR - 1)/DEDUP_PER_SECTOR);
+    d->nb_buckets = 1;
+    while(d->nb_buckets < d->count){
+        d->nb_buckets *= 2;
+    }
+    d->entries = calloc(d->size, SECTOR_SIZE);
+    d->buckets = calloc(d->nb_buckets, sizeof(uint32_t));
+    d->next = calloc(d->count + 1, sizeof(uint32_t));
+    if(d->entries == NULL || d->buckets == NULL || d->next == NULL){
+        free(d->entries);
+        free(d->buckets);
+        free(d->next);
+        free(d);
+        return NULL;
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    return d;
+}
+
+static void dedup_free(struct dedup_index *d){
+    if(d != NULL){
+        pthread_mutex_destroy(&d->lock);
+        free(d->entries);
+        free(d->buckets);
+        free(d->next);
+        free(d);
+    }
+}
+
+static void dedup_reserve(struct unix_filesystem *u, const struct dedup_index *d){
+    for(uint32_t k = 0; k < d->size; k++){
+        bm_set(u->fbm, d->start + k);
+    }
+}
+
+
+/* ************************************************************************** *
+ * Mounts
+ * ************************************************************************** */
+
+int dedup_mount(struct unix_filesystem *u){
+    M_REQUIRE_NON_NULL(u);
+    u->dedup = NULL;
+    if(u->s.s_dedup_start == 0){
+        return ERR_NONE;
+    }
+
+    struct dedup_index *d = dedup_new(u);
+    if(d == NULL){
+        return ERR_NOMEM;
+    }
+    d->start = u->s.s_dedup_start;
+    if(u->s.s_dedup_size != d->size || d->start < d->first || d->start + d->size > u->s.s_fsize){
+        dedup_free(d);
+        return ERR_INCONSISTENT_FS;
+    }
+    int ret = sector_read_many(u->f, d->start, d->size, d->entries);
+    if(ret != ERR_NONE){
+        dedup_free(d);
+        return ret;
+    }
+    dedup_link_all(d);
+    dedup_reserve(u, d);
+    u->dedup = d;
+    return ERR_NONE;
+}
+
+void dedup_umount(struct unix_filesystem *u){
+    if(u != NULL && u->dedup != NULL){
+        dedup_free(u->dedup);
+        u->dedup = NULL;
+    }
+}
+
+
+/* ************************************************************************** *
+ * Writes and frees
+ * ************************************************************************** */
+
+int dedup_lookup(struct unix_filesystem *u, const void *data){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(data);
+    struct dedup_index *d = u->dedup;
+    if(d == NULL){
+        return 0;
+    }
+    uint32_t hash = 0;
+    int ret = dedup_hash(data, &hash);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    // the 32 bits are only a hint: the bytes are compared
+    uint8_t candidate[SECTOR_SIZE];
+    pthread_mutex_lock(&d->lock);
+    for(uint32_t link = d->buckets[hash & (d->nb_buckets - 1)]; link != 0 && ret == ERR_NONE; link = d->next[link - 1]){
+        struct dedup_entry *e = &d->entries[link - 1];
+        if(e->hash != hash){
+            continue;
+        }
+        const uint32_t sector = d->first + link - 1;
+        ret = sector_read(u->f, sector, candidate);
+        if(ret == ERR_NONE && memcmp(candidate, data, SECTOR_SIZE) == 0){
+            e->refs++;
+            ret = dedup_write_entry(u, d, link - 1);
+            ret = (ret == ERR_NONE) ? (int)sector : ret;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ret;
+}
+
+int dedup_add(struct unix_filesystem *u, uint32_t sector, const void *data){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(data);
+    struct dedup_index *d = u->dedup;
+    if(d == NULL || !dedup_covers(d, sector)){
+        return ERR_NONE;
+    }
+    uint32_t hash = 0;
+    int ret = dedup_hash(data, &hash);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    const uint32_t index = sector - d->first;
+    pthread_mutex_lock(&d->lock);
+    if(d->entries[index].hash != 0){ // left by a sector freed without dedup_release()
+        dedup_unlink(d, index);
+    }
+    d->entries[index].hash = hash;
+    d->entries[index].refs = 1;
+    dedup_link(d, index);
+    ret = dedup_write_entry(u, d, index);
+    pthread_mutex_unlock(&d->lock);
+    return ret;
+}
+
+// drops the entry of a sector with one reference left: it leaves the index
+static int dedup_forget(const struct unix_filesystem *u, struct dedup_index *d, uint32_t index){
+    struct dedup_entry *e = &d->entries[index];
+    if(e->hash == 0 && e->refs == 0){
+        return ERR_NONE;
+    }
+    if(e->hash != 0){
+        dedup_unlink(d, index);
+    }
+    e->hash = 0;
+    e->refs = 0;
+    return dedup_write_entry(u, d, index);
+}
+
+int dedup_own(struct unix_filesystem *u, uint32_t sector){
+    M_REQUIRE_NON_NULL(u);
+    struct dedup_index *d = u->dedup;
+    if(d == NULL || !dedup_covers(d, sector)){
+        return 1;
+    }
+    const uint32_t index = sector - d->first;
+    pthread_mutex_lock(&d->lock);
+    int ret = 0; // shared
+    if(d->entries[index].refs <= 1){
+        ret = dedup_forget(u, d, index);
+        ret = (ret == ERR_NONE) ? 1 : ret;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ret;
+}
+
+int dedup_release(struct unix_filesystem *u, uint32_t sector){
+    M_REQUIRE_NON_NULL(u);
+    struct dedup_index *d = u->dedup;
+    if(d == NULL || !dedup_covers(d, sector)){
+        return 1;
+    }
+    const uint32_t index = sector - d->first;
+    int ret = ERR_NONE;
+    int last = 0;
+    pthread_mutex_lock(&d->lock);
+    if(d->entries[index].refs > 1){
+        d->entries[index].refs--;
+        ret = dedup_write_entry(u, d, index);
+    }else{
+        ret = dedup_forget(u, d, index);
+        last = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ret != ERR_NONE ? ret : last;
+}
+
+int dedup_shared(const struct unix_filesystem *u, uint32_t sector){
+    if(u == NULL || u->dedup == NULL || !dedup_covers(u->dedup, sector)){
+        return 0;
+    }
+    struct dedup_index *d = u->dedup;
+    pthread_mutex_lock(&d->lock);
+    const int shared = d->entries[sector - d->first].refs > 1;
+    pthread_mutex_unlock(&d->lock);
+    return shared;
+}
+
+
+/* ************************************************************************** *
+ * Commands
+ * ************************************************************************** */
+
+// writes the whole area, then its location in the superblock
+static int dedup_write_area(struct unix_filesystem *u, const struct dedup_index *d){
+    int ret = ERR_NONE;
+    for(uint32_t k = 0; k < d->size && ret == ERR_NONE; k++){
+        ret = sector_write(u->f, d->start + k, &d->entries[k*DEDUP_PER_SECTOR]);
+    }
+    if(ret == ERR_NONE && u->s.s_dedup_start != d->start){
+        u->s.s_dedup_start = (sector_addr_t)d->start;
+        u->s.s_dedup_size = (sector_addr_t)d->size;
+        ret = sector_write(u->f, SUPERBLOCK_SECTOR, &u->s);
+    }
+    return ret;
+}
+
+int dedup_enable(struct unix_filesystem *u){
+    M_REQUIRE_NON_NULL(u);
+    if(u->dedup != NULL){
+        return ERR_NONE;
+    }
+    struct dedup_index *d = dedup_new(u);
+    if(d == NULL){
+        return ERR_NOMEM;
+    }
+    int start = bm_find_run(u->fbm, d->size);
+    if(start >= 0 && (uint32_t)start + d->size > u->s.s_fsize){
+        start = ERR_BITMAP_FULL;
+    }
+    if(start < 0){
+        dedup_free(d);
+        return start;
+    }
+    d->start = (uint32_t)start;
+
+    // the area first, the superblock naming it last
+    int ret = dedup_write_area(u, d);
+    if(ret != ERR_NONE){
+        dedup_free(d);
+        return ret;
+    }
+    dedup_reserve(u, d);
+    u->dedup = d;
+    pps_printf("dedup: %" PRIu32 " sectors indexed in %" PRIu32 " sectors from %" PRIu32 "\n", d->count, d->size, d->start);
+    return ERR_NONE;
+}
+
+#define DEDUP_MAP_BATCH ADDRESSES_PER_SECTOR    // entries of a block map read or changed at once
+
+/* calls visit on the block map of each regular file, by batches of at most
+ * DEDUP_MAP_BATCH entries; when visit changes a batch, it is written back */
+typedef int (*dedup_visit_t)(struct dedup_index *d, sector_addr_t *sectors, size_t count, void *arg);
+
+static int dedup_walk(struct unix_filesystem *u, dedup_visit_t visit, void *arg){
+    sector_addr_t sectors[DEDUP_MAP_BATCH];
+    for(uint32_t inr = ROOT_INUMBER; inr < (uint32_t)u->s.s_isize*INODES_PER_SECTOR; inr++){
+        struct inode i;
+        int ret = inode_read(u, (uint16_t)inr, &i);
+        if(ret == ERR_UNALLOCATED_INODE || (ret == ERR_NONE && (i.i_mode & (IFMT | IINLINE)))){
+            continue;
+        }
+        const int32_t nb = (inode_getsize(&i) + SECTOR_SIZE - 1)/SECTOR_SIZE;
+        int changed = 0;
+        for(int32_t off = 0; off < nb && ret == ERR_NONE; off += DEDUP_MAP_BATCH){
+            const size_t count = (size_t)MIN(nb - off, DEDUP_MAP_BATCH);
+            ret = inode_findsectors(u, &i, off, sectors, count);
+            int visit_changed = (ret == ERR_NONE) ? visit(u->dedup, sectors, count, arg) : 0;
+            if(visit_changed > 0){
+                ret = inode_setsectors(u, &i, off, sectors, count);
+                changed = 1;
+            }
+        }
+        if(ret == ERR_NONE && changed){
+            ret = inode_write(u, (uint16_t)inr, &i);
+        }
+        if(ret != ERR_NONE){
+            return ret;
+        }
+    }
+    return ERR_NONE;
+}
+
+struct dedup_scan {
+    uint32_t *refs;         // references found, per entry
+    uint32_t *canonical;    // per entry: the sector it is merged into (0: none)
+};
+
+static int dedup_count_refs(struct dedup_index *d, sector_addr_t *sectors, size_t count, void *arg){
+    struct dedup_scan *scan = arg;
+    for(size_t k = 0; k < count; k++){
+        if(dedup_covers(d, sectors[k])){
+            scan->refs[sectors[k] - d->first]++;
+        }
+    }
+    return 0;
+}
+
+static int dedup_remap(struct dedup_index *d, sector_addr_t *sectors, size_t count, void *arg){
+    struct dedup_scan *scan = arg;
+    int changed = 0;
+    for(size_t k = 0; k < count; k++){
+        if(dedup_covers(d, sectors[k]) && scan->canonical[sectors[k] - d->first] != 0){
+            sectors[k] = (sector_addr_t)scan->canonical[sectors[k] - d->first];
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+struct dedup_hashed {
+    unsigned char sha[UTILS_SHA_LENGTH];
+    uint32_t sector;
+};
+
+static int dedup_cmp_hashed(const void *a, const void *b){
+    const struct dedup_hashed *x = a;
+    const struct dedup_hashed *y = b;
+    int cmp = memcmp(x->sha, y->sha, UTILS_SHA_LENGTH);
+    return cmp != 0 ? cmp : (x->sector > y->sector) - (x->sector < y->sector);
+}
+
+// whether two sectors hold the same bytes
+static int dedup_same(const struct unix_filesystem *u, uint32_t a, uint32_t b){
+    uint8_t data_a[SECTOR_SIZE];
+    uint8_t data_b[SECTOR_SIZE];
+    int ret = sector_read(u->f, a, data_a);
+    if(ret == ERR_NONE){
+        ret = sector_read(u->f, b, data_b);
+    }
+    return ret != ERR_NONE ? ret : memcmp(data_a, data_b, SECTOR_SIZE) == 0;
+}
+
+int dedup_scan(struct unix_filesystem *u, int nb_threads){
+    M_REQUIRE_NON_NULL(u);
+    if(nb_threads < 1 || nb_threads > DEDUP_MAX_THREADS){
+        return ERR_BAD_PARAMETER;
+    }
+    int ret = dedup_enable(u);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    struct dedup_index *d = u->dedup;
+
+    ARENA_SCOPE(scratch);
+    struct dedup_scan scan;
+    scan.refs = arena_calloc(scratch, d->count, sizeof(uint32_t));
+    scan.canonical = arena_calloc(scratch, d->count, sizeof(uint32_t));
+    if(scan.refs == NULL || scan.canonical == NULL){
+        return ERR_NOMEM;
+    }
+    ret = dedup_walk(u, dedup_count_refs, &scan);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    // the sectors of the regular files, in disk order, hashed on the threads
+    size_t nb = 0;
+    for(uint32_t k = 0; k < d->count; k++){
+        nb += (scan.refs[k] > 0);
+    }
+    uint32_t *sectors = arena_alloc(scratch, (nb + 1)*sizeof(uint32_t));
+    unsigned char *shas = arena_alloc(scratch, (nb + 1)*UTILS_SHA_LENGTH);
+    struct dedup_hashed *hashed = arena_alloc(scratch, (nb + 1)*sizeof(struct dedup_hashed));
+    if(sectors == NULL || shas == NULL || hashed == NULL){
+        return ERR_NOMEM;
+    }
+    size_t n = 0;
+    for(uint32_t k = 0; k < d->count; k++){
+        if(scan.refs[k] > 0){
+            sectors[n++] = d->first + k;
+        }
+    }
+    ret = utils_sha_sectors(u, sectors, nb, shas, nb_threads);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    for(size_t k = 0; k < nb; k++){
+        memcpy(hashed[k].sha, &shas[k*UTILS_SHA_LENGTH], UTILS_SHA_LENGTH);
+        hashed[k].sector = sectors[k];
+    }
+    qsort(hashed, nb, sizeof(struct dedup_hashed), dedup_cmp_hashed);
+
+    // in each run of equal hashes, the sectors with the bytes of the first go into it
+    unsigned long merged = 0;
+    for(size_t k = 0; k < nb; ){
+        size_t end = k + 1;
+        while(end < nb && memcmp(hashed[end].sha, hashed[k].sha, UTILS_SHA_LENGTH) == 0){
+            end++;
+        }
+        for(size_t j = k + 1; j < end; j++){
+            int same = dedup_same(u, hashed[k].sector, hashed[j].sector);
+            if(same < 0){
+                return same;
+            }
+            if(same){
+                scan.canonical[hashed[j].sector - d->first] = hashed[k].sector;
+                merged++;
+            }
+        }
+        k = end;
+    }
+    ret = merged > 0 ? dedup_walk(u, dedup_remap, &scan) : ERR_NONE;
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    // the entries from what was found: the merged sectors are free
+    unsigned long shared = 0;
+    pthread_mutex_lock(&d->lock);
+    for(uint32_t k = 0; k < d->count; k++){
+        d->entries[k].hash = 0;
+        d->entries[k].refs = 0;
+    }
+    for(size_t k = 0; k < nb; k++){
+        const uint32_t index = hashed[k].sector - d->first;
+        const uint32_t canonical = scan.canonical[index];
+        if(canonical != 0){
+            d->entries[canonical - d->first].refs += scan.refs[index];
+            bm_clear(u->fbm, hashed[k].sector);
+        }else{
+            d->entries[index].hash = dedup_hash_of(hashed[k].sha);
+            d->entries[index].refs += scan.refs[index];
+        }
+    }
+    for(uint32_t k = 0; k < d->count; k++){
+        shared += (d->entries[k].refs > 1);
+    }
+    dedup_link_all(d);
+    ret = dedup_write_area(u, d);
+    pthread_mutex_unlock(&d->lock);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    pps_printf("dedup: %lu sectors hashed on %d threads, %lu merged, %lu shared\n",
+               (unsigned long)nb, nb_threads, merged, shared);
+    return ERR_NONE;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+/**
+ * @file dedup.h
+ * @brief deduplication of the data sectors of the regular files
+ *
+ * A filesystem may share the data sectors with the same bytes between its
+ * regular files. Each data sector then has an entry in an area of the data
+ * sectors named by the superblock (s_dedup_start, s_dedup_size), reserved in
+ * the block bitmap at mount: 32 bits of the SHA-256 of its bytes and the
+ * number of block map entries pointing at it. The entries of the indexed
+ * sectors are chained by hash in memory at mount.
+ *
+ * The full sectors appended to a regular file (filev6_writesectors()) are
+ * looked up in the index and shared when a sector with the same bytes is
+ * found, else indexed. A shared sector is never written in place: the file
+ * writing it gets a copy of its own first (see dedup_own()), and the sector
+ * is freed with its last reference (see dedup_release()). The "dedup scan"
+ * command shares the identical sectors already on the disk.
+ */
+
+#include <stdint.h>
+#include "mount.h"
+
+#define DEDUP_PER_SECTOR (SECTOR_SIZE / sizeof(struct dedup_entry))
+#define DEDUP_MAX_THREADS 16    /* hashing threads of dedup_scan() */
+
+// the entry of a data sector, on disk
+struct dedup_entry {
+    uint32_t hash;      /* 32 bits of the SHA-256 of its bytes (0: not indexed) */
+    uint32_t refs;      /* block map entries pointing at it (0: not indexed) */
+};
+
+/**
+ * @brief load the dedup entries of a filesystem being mounted, if it has
+ *        some, index them and reserve their area in the block bitmap
+ *        (called by mountv6())
+ * @param u the filesystem, its bitmaps built (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+int dedup_mount(struct unix_filesystem *u);
+
+/**
+ * @brief forget the dedup entries of a filesystem being unmounted (called by umountv6())
+ * @param u the filesystem (IN-OUT)
+ */
+void dedup_umount(struct unix_filesystem *u);
+
+/**
+ * @brief find an indexed sector holding the given bytes, and take a reference to it
+ * @param u the filesystem (IN-OUT)
+ * @param data SECTOR_SIZE bytes about to be written to a new sector (IN)
+ * @return the sector (>0); 0 if there is none (or no deduplication); <0 on error
+ */
+int dedup_lookup(struct unix_filesystem *u, const void *data);
+
+/**
+ * @brief index a new sector, just written, with its single reference
+ * @param u the filesystem (IN-OUT)
+ * @param sector the sector
+ * @param data its SECTOR_SIZE bytes (IN)
+ * @return 0 on success; <0 on error
+ */
+int dedup_add(struct unix_filesystem *u, uint32_t sector, const void *data);
+
+/**
+ * @brief before writing a data sector in place: whether the file writing it
+ *        is its only user, in which case it leaves the index
+ * @param u the filesystem (IN-OUT)
+ * @param sector the sector
+ * @return 1 if it may be written in place; 0 if shared (the file must take
+ *         a copy and release it); <0 on error
+ */
+int dedup_own(struct unix_filesystem *u, uint32_t sector);
+
+/**
+ * @brief drop one reference to a data sector no longer used by a file
+ * @param u the filesystem (IN-OUT)
+ * @param sector the sector
+ * @return 1 if it was the last one (the caller frees the sector); 0 if the
+ *         sector is still used; <0 on error
+ */
+int dedup_release(struct unix_filesystem *u, uint32_t sector);
+
+/**
+ * @brief whether a data sector is shared by several block map entries
+ * @param u the filesystem (IN)
+ * @param sector the sector
+ * @return 1 if shared; 0 otherwise
+ */
+int dedup_shared(const struct unix_filesystem *u, uint32_t sector);
+
+/**
+ * @brief give a filesystem an empty dedup index, so that the sectors written
+ *        from now on are deduplicated (the "dedup enable" command)
+ * @param u the filesystem (IN-OUT)
+ * @return 0 on success; <0 on error (ERR_BITMAP_FULL: no room for the area)
+ */
+int dedup_enable(struct unix_filesystem *u);
+
+/**
+ * @brief hash the data sectors of all the regular files on several threads,
+ *        share those with the same bytes and index them all (the "dedup
+ *        scan" command); deduplication is enabled first if needed
+ * @param u the filesystem (IN-OUT)
+ * @param nb_threads the number of hashing threads (1 to DEDUP_MAX_THREADS)
+ * @return 0 on success; <0 on error
+ */
+int dedup_scan(struct unix_filesystem *u, int nb_threads);
@@ -0,0 +1,312 @@
+/**
+ * @file defrag.c
+ * @brief defragmenter of a mounted UV6 filesystem
+ *
+ * A fragmented file is copied, in file order, to the first run of free
+ * sectors large enough for all its data sectors; its new sector map is built
+ * in a copy of its inode, whose indirect sectors are all new, and the copy
+ * replaces the inode in a single inode_write(). Until then nothing the old
+ * inode uses has changed: the bitmaps being rebuilt by mountv6(), a crash
+ * leaves at worst some sectors written for nothing.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+#include "error.h"
+#include "mount.h"
+#include "sector.h"
+#include "inode.h"
+#include "bmblock.h"
+#include "defrag.h"
+#include "dedup.h"
+#include "snapshot.h"
+#include "util.h"
+
+#define DEFRAG_BATCH_SECTORS 64     // consecutive sectors read at once when copying
+#define DEFRAG_MAX_INDIRECT (ADDR_DINDIRECT + 1 + ADDRESSES_PER_SECTOR)
+
+// the sector map of a file, holes included (NULL for an inline or empty file)
+static int defrag_map(const struct unix_filesystem *u, const struct inode *i, struct arena *a,
+                      sector_addr_t **map, size_t *nb){
+    *map = NULL;
+    *nb = 0;
+    if(i->i_mode & IINLINE){
+        return ERR_NONE;
+    }
+    const size_t count = (size_t)inode_getsectorsize(i)/SECTOR_SIZE;
+    if(count == 0){
+        return ERR_NONE;
+    }
+    *map = arena_alloc(a, count*sizeof(sector_addr_t));
+    if(*map == NULL){
+        return ERR_NOMEM;
+    }
+    *nb = count;
+    return inode_findsectors(u, i, 0, *map, count);
+}
+
+// adds the measure of one sector map to score
+static void defrag_count(const sector_addr_t *map, size_t nb, struct defrag_score *score){
+    uint64_t sectors = 0;
+    uint64_t extents = 0;
+    sector_addr_t prev = 0;
+    for(size_t k = 0; k < nb; k++){
+        if(map[k] == 0){
+            continue; // a hole does not break an extent
+        }
+        if(prev == 0 || map[k] != prev + 1){
+            extents++;
+        }
+        prev = map[k];
+        sectors++;
+    }
+    if(sectors > 0){
+        score->files++;
+        score->sectors += sectors;
+        score->extents += extents;
+        score->fragmented += (extents > 1);
+    }
+}
+
+double defrag_score_percent(const struct defrag_score *score){
+    if(score == NULL || score->sectors <= score->files){
+        return 0.0;
+    }
+    return 100.0*(double)(score->extents - score->files)/(double)(score->sectors - score->files);
+}
+
+int defrag_measure(const struct unix_filesystem *u, struct defrag_score *score){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(score);
+    memset(score, 0, sizeof(*score));
+
+    for(uint32_t inr = ROOT_INUMBER; inr < (uint32_t)u->s.s_isize*INODES_PER_SECTOR; inr++){
+        ARENA_SCOPE(scratch);
+        struct inode i;
+        int read = inode_read(u, (uint16_t)inr, &i);
+        if(read == ERR_UNALLOCATED_INODE){
+            continue;
+        }
+        if(read != ERR_NONE){
+            return read;
+        }
+        sector_addr_t *map = NULL;
+        size_t nb = 0;
+        int find = defrag_map(u, &i, scratch, &map, &nb);
+        if(find != ERR_NONE){
+            return find;
+        }
+        defrag_count(map, nb, score);
+    }
+    return ERR_NONE;
+}
+
+// the indirect sectors of a large file of nb sectors, double-indirect included
+static int defrag_indirects(const struct unix_filesystem *u, const struct inode *i, size_t nb,
+                            sector_addr_t *indirects, size_t *count){
+    *count = 0;
+    if(inode_getsize(i) < ADDR_SMALL_LENGTH*SECTOR_SIZE){
+        return ERR_NONE;
+    }
+    for(size_t off = 0; off < nb; off += ADDRESSES_PER_SECTOR){
+        int indirect = inode_findindirect(u, i, (int32_t)off);
+        if(indirect < 0){
+            return indirect;
+        }
+        if(indirect > 0){
+            indirects[(*count)++] = (sector_addr_t)indirect;
+        }
+    }
+    if(i->i_addr[ADDR_DINDIRECT] != 0){
+        indirects[(*count)++] = i->i_addr[ADDR_DINDIRECT];
+    }
+    return ERR_NONE;
+}
+
+// copies the data sectors of map, in order, to the sectors from start on
+// (indexed for deduplication, see dedup.h, if they are those of a regular file)
+static int defrag_copy(struct unix_filesystem *u, const sector_addr_t *map, size_t nb, uint32_t start, int index){
+    uint8_t data[DEFRAG_BATCH_SECTORS*SECTOR_SIZE];
+    uint32_t dest = start;
+    size_t k = 0;
+    while(k < nb){
+        if(map[k] == 0){
+            k++;
+            continue;
+        }
+        size_t run = 1;
+        while(run < DEFRAG_BATCH_SECTORS && k + run < nb && map[k + run] == map[k] + run){
+            run++;
+        }
+        int err = sector_read_many(u->f, map[k], run, data);
+        for(size_t j = 0; j < run && err == ERR_NONE; j++){
+            err = sector_write(u->f, dest + (uint32_t)j, data + j*SECTOR_SIZE);
+            if(err == ERR_NONE && index){
+                err = dedup_add(u, dest + (uint32_t)j, data + j*SECTOR_SIZE);
+            }
+        }
+        if(err != ERR_NONE){
+            return err;
+        }
+        dest += (uint32_t)run;
+        k += run;
+    }
+    return ERR_NONE;
+}
+
+// frees the sectors of the run and the indirect sectors of the copy, after a failure
+static void defrag_undo(struct unix_filesystem *u, const struct inode *copy, size_t nb,
+                        uint32_t start, size_t count){
+    for(size_t k = 0; k < count; k++){
+        (void)dedup_release(u, (uint32_t)(start + k));
+        bm_clear(u->fbm, start + k);
+    }
+    sector_addr_t indirects[DEFRAG_MAX_INDIRECT];
+    size_t nb_indirects = 0;
+    if(defrag_indirects(u, copy, nb, indirects, &nb_indirects) == ERR_NONE){
+        for(size_t k = 0; k < nb_indirects; k++){
+            bm_clear(u->fbm, indirects[k]);
+        }
+    }
+}
+
+int defrag_inode(struct unix_filesystem *u, uint16_t inr){
+    M_REQUIRE_NON_NULL(u);
+    ARENA_SCOPE(scratch);
+
+    struct inode old;
+    int err = inode_read(u, inr, &old);
+    if(err != ERR_NONE){
+        return err;
+    }
+    sector_addr_t *map = NULL;
+    size_t nb = 0;
+    err = defrag_map(u, &old, scratch, &map, &nb);
+    if(err != ERR_NONE){
+        return err;
+    }
+    struct defrag_score score = {0};
+    defrag_count(map, nb, &score);
+    if(score.fragmented == 0){
+        return 0;
+    }
+    for(size_t k = 0; k < nb; k++){
+        if(map[k] != 0 && dedup_shared(u, map[k])){
+            return 0; // moving it would copy the sectors shared with other files
+        }
+        if(map[k] != 0 && snapshot_frozen(u, map[k])){
+            return 0; // or those a snapshot keeps where they are
+        }
+    }
+
+    const size_t count = (size_t)score.sectors;
+    int start = bm_find_run(u->fbm, count);
+    if(start == ERR_BITMAP_FULL || (start >= 0 && (uint64_t)start + count > u->s.s_fsize)){
+        return 0; // no room: the file stays where it is
+    }
+    if(start < 0){
+        return start;
+    }
+
+    sector_addr_t old_indirects[DEFRAG_MAX_INDIRECT];
+    size_t nb_old_indirects = 0;
+    err = defrag_indirects(u, &old, nb, old_indirects, &nb_old_indirects);
+    if(err != ERR_NONE){
+        return err;
+    }
+
+    // the run is taken before the new indirect sectors are allocated
+    for(size_t k = 0; k < count; k++){
+        bm_set(u->fbm, (uint64_t)start + k);
+    }
+    err = defrag_copy(u, map, nb, (uint32_t)start, (old.i_mode & IFMT) == 0);
+
+    sector_addr_t *new_map = arena_alloc(scratch, nb*sizeof(sector_addr_t));
+    if(err == ERR_NONE && new_map == NULL){
+        err = ERR_NOMEM;
+    }
+    struct inode copy = old;
+    if(err == ERR_NONE){
+        uint32_t dest = (uint32_t)start;
+        for(size_t k = 0; k < nb; k++){
+            new_map[k] = (map[k] == 0) ? 0 : (sector_addr_t)dest++;
+        }
+        if(inode_getsize(&copy) >= ADDR_SMALL_LENGTH*SECTOR_SIZE){
+            memset(copy.i_addr, 0, sizeof(copy.i_addr));
+        }
+        // one indirect sector at a time, so that no sector is allocated to map only holes
+        for(size_t off = 0; off < nb && err == ERR_NONE; off += ADDRESSES_PER_SECTOR){
+            const size_t n = MIN(nb - off, ADDRESSES_PER_SECTOR);
+            int empty = 1;
+            for(size_t k = 0; k < n && empty; k++){
+                empty = (new_map[off + k] == 0);
+            }
+            if(!empty){
+                err = inode_setsectors(u, &copy, (int32_t)off, &new_map[off], n);
+            }
+        }
+    }
+    if(err == ERR_NONE){
+        err = inode_write(u, inr, &copy);
+    }
+    if(err != ERR_NONE){
+        defrag_undo(u, &copy, nb, (uint32_t)start, count);
+        return err;
+    }
+
+    for(size_t k = 0; k < nb; k++){
+        if(map[k] != 0 && dedup_release(u, map[k]) > 0){
+            bm_clear(u->fbm, map[k]);
+        }
+    }
+    for(size_t k = 0; k < nb_old_indirects; k++){
+        bm_clear(u->fbm, old_indirects[k]);
+    }
+    inode_indirect_changed();
+    return (int)count;
+}
+
+static void defrag_print(const char *when, const struct defrag_score *score){
+    pps_printf("defrag: %s: %lu files, %lu sectors in %lu extents, %lu fragmented (score %.2f%%)\n",
+               when, (unsigned long)score->files, (unsigned long)score->sectors,
+               (unsigned long)score->extents, (unsigned long)score->fragmented,
+               defrag_score_percent(score));
+}
+
+int defrag_run(struct unix_filesystem *u){
+    M_REQUIRE_NON_NULL(u);
+
+    struct defrag_score before;
+    int err = defrag_measure(u, &before);
+    if(err != ERR_NONE){
+        return err;
+    }
+    defrag_print("before", &before);
+
+    unsigned long moved = 0;
+    unsigned long moved_sectors = 0;
+    for(uint32_t inr = ROOT_INUMBER; inr < (uint32_t)u->s.s_isize*INODES_PER_SECTOR; inr++){
+        if(!bm_get(u->ibm, inr)){
+            continue;
+        }
+        int n = defrag_inode(u, (uint16_t)inr);
+        if(n < 0){
+            return n;
+        }
+        if(n > 0){
+            moved++;
+            moved_sectors += (unsigned long)n;
+        }
+    }
+
+    struct defrag_score after;
+    err = defrag_measure(u, &after);
+    if(err != ERR_NONE){
+        return err;
+    }
+    pps_printf("defrag: %lu files moved (%lu sectors)\n", moved, moved_sectors);
+    defrag_print("after", &after);
+    return ERR_NONE;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+/**
+ * @file defrag.h
+ * @brief defragmenter of a mounted UV6 filesystem
+ */
+
+#include <stdint.h>
+#include "mount.h"
+
+// fragmentation of the files of a filesystem, from their sector maps
+struct defrag_score {
+    uint64_t files;         // files with at least one data sector
+    uint64_t sectors;       // data sectors of these files (holes and indirect sectors excluded)
+    uint64_t extents;       // runs of consecutive sectors, in file order
+    uint64_t fragmented;    // files of more than one extent
+};
+
+/**
+ * @brief the score of a measure: the percentage of the breaks between two
+ *        data sectors of a file that are not consecutive on the disk
+ *        (0: every file is contiguous)
+ */
+double defrag_score_percent(const struct defrag_score *score);
+
+/**
+ * @brief measure the fragmentation of all the files of a filesystem
+ * @param u the filesystem (IN)
+ * @param score the measure (OUT)
+ * @return 0 on success; <0 on error
+ */
+int defrag_measure(const struct unix_filesystem *u, struct defrag_score *score);
+
+/**
+ * @brief move the data sectors of a fragmented file to a single run of free
+ *        sectors. The data and new indirect sectors are written first and
+ *        the inode last, so the file is either all in its old sectors or
+ *        all in its new ones; the old sectors are then freed in the bitmap.
+ *        An inline or contiguous file is left as it is.
+ * @param u the filesystem (IN)
+ * @param inr the inode number of the file
+ * @return the number of sectors moved (0: left as it is, or no run large
+ *         enough); <0 on error
+ */
+int defrag_inode(struct unix_filesystem *u, uint16_t inr);
+
+/**
+ * @brief defragment every file of a filesystem (the "defrag" command) and
+ *        print the fragmentation before and after
+ * @param u the filesystem (IN)
+ * @return 0 on success; <0 on error
+ */
+int defrag_run(struct unix_filesystem *u);
@@ -1,11 +1,15 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include "arena.h"
 #include "error.h"
 #include "filev6.h"
 #include "direntv6.h"
 #include "unixv6fs.h"
 #include "inode.h"
+#include "dirtree.h"
+#include "stats.h"
+#include "trace.h"
 
 #define SUCCESS 1
 
@@ -31,7 +35,11 @@ int direntv6_opendir(const struct unix_filesystem *u, uint16_t inr, struct direc
     d->fv6 = fv6;
     d->cur = 0;
     d->last = 0;
+    d->node = 0;
     memset(d->dirs, 0, sizeof(d->dirs));
+    if(fv6.i_node.i_mode & IDIRTREE){
+        return dirtree_opendir(d);
+    }
     return ERR_NONE;
 }
 
@@ -40,16 +48,26 @@ int direntv6_readdir(struct directory_reader *d, char *name, uint16_t *child_inr
     M_REQUIRE_NON_NULL(d);
     M_REQUIRE_NON_NULL(name);
     M_REQUIRE_NON_NULL(child_inr);
-    if(d->cur == d->last){
-        d->cur = 0;
-        int bytes_read = filev6_readblock(&(d->fv6), d->dirs);
-        if(bytes_read < 0){
-            return bytes_read;
+    TRACE_SUBSYS(TRACE_SUB_DIR);
+    if(d->fv6.i_node.i_mode & IDIRTREE){
+        return dirtree_readdir(d, name, child_inr);
+    }
+    for(;;){
+        if(d->cur == d->last){
+            d->cur = 0;
+            int bytes_read = filev6_readblock(&(d->fv6), d->dirs);
+            if(bytes_read < 0){
+                return bytes_read;
+            }
+            d->last = bytes_read/sizeof(struct direntv6); 
+            if(d->last == 0){
+                return ERR_NONE;
+            }
         }
-        d->last = bytes_read/sizeof(struct direntv6); 
-        if(d->last == 0){
-            return ERR_NONE;
+        if((d->dirs)[d->cur].d_inumber != 0){
+            break;
         }
+        d->cur += 1; // a free slot
     }
     strncpy(name, (d->dirs)[d->cur].d_name, DIRENT_MAXLEN);
 
@@ -62,6 +80,44 @@ int direntv6_readdir(struct directory_reader *d, char *name, uint16_t *child_inr
 }
 
 
+int direntv6_seekdir(struct directory_reader *d, uint32_t index){
+    M_REQUIRE_NON_NULL(d);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
+    if(d->fv6.i_node.i_mode & IDIRTREE){
+        return dirtree_seekdir(d, index);
+    }
+
+    int32_t size_dir = inode_getsize(&(d->fv6.i_node));
+    int64_t offset = (int64_t)index*(int64_t)sizeof(struct direntv6);
+    d->cur = 0;
+    d->last = 0;
+    if(offset >= size_dir){
+        return filev6_lseek(&(d->fv6), size_dir);
+    }
+
+    int seek = filev6_lseek(&(d->fv6), (int32_t)(offset - offset%SECTOR_SIZE));
+    if(seek != ERR_NONE){
+        return seek;
+    }
+    int bytes_read = filev6_readblock(&(d->fv6), d->dirs);
+    if(bytes_read < 0){
+        return bytes_read;
+    }
+    d->last = bytes_read/(int)sizeof(struct direntv6);
+    d->cur = (int)(index%DIRENTRIES_PER_SECTOR);
+    return ERR_NONE;
+}
+
+
+uint32_t direntv6_telldir(const struct directory_reader *d){
+    if(d->fv6.i_node.i_mode & IDIRTREE){
+        return dirtree_telldir(d);
+    }
+    // the block in d->dirs ends at the cursor of the file
+    return (uint32_t)(d->fv6.offset/(int32_t)sizeof(struct direntv6) - d->last + d->cur);
+}
+
+
 int direntv6_print_tree(const struct unix_filesystem *u, uint16_t inr, const char *prefix){
     M_REQUIRE_NON_NULL(u);
     M_REQUIRE_NON_NULL(prefix);
@@ -92,12 +148,14 @@ int direntv6_print_tree(const struct unix_filesystem *u, uint16_t inr, const cha
         if(read != SUCCESS){
             return read;
         }
+        ARENA_SCOPE(scratch);
         size_t new_len = (strlen(prefix)+strlen(name)+2);
-        char* new_prefix = calloc(new_len, sizeof(char));
+        char* new_prefix = arena_alloc(scratch, new_len);
+        if(new_prefix == NULL){
+            return ERR_NOMEM;
+        }
         snprintf(new_prefix, new_len, "%s/%s", prefix, name);
         int recursive_print = direntv6_print_tree(u, child_inr, new_prefix);
-        free(new_prefix);
-        new_prefix = NULL;
 
         if(recursive_print != ERR_NONE){
             return recursive_print;
@@ -111,64 +169,188 @@ int direntv6_print_tree(const struct unix_filesystem *u, uint16_t inr, const cha
 int direntv6_dirlookup(const struct unix_filesystem *u, uint16_t inr, const char* entry){
     M_REQUIRE_NON_NULL(u);
     M_REQUIRE_NON_NULL(entry);
+    STATS_SCOPE(STATS_DIR_LOOKUP);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
 
     return direntv6_dirlookup_core(u, inr, entry, (size_t)strlen(entry));
 }
 
 
 int direntv6_dirlookup_core(const struct unix_filesystem *u, uint16_t inr, const char* entry, size_t len){
-    if (len == 0){
-        return inr;
+    // one reader for all the levels of the path
+    struct directory_reader d;
+    char repertory_name[DIRENT_MAXLEN+1];
+    char name[DIRENT_MAXLEN+1];
+    const char *end = entry + len;
+
+    for(;;){
+        while(entry < end && entry[0] == '/'){
+            entry += 1;
+        }
+        if(entry == end || entry[0] == '\0'){
+            return inr;
+        }
+        // names are compared on their first DIRENT_MAXLEN characters
+        size_t pos = 0;
+        memset(repertory_name, 0, sizeof(repertory_name));
+        while(entry < end && entry[0] != '/' && entry[0] != '\0'){
+            if(pos < DIRENT_MAXLEN){
+                repertory_name[pos] = entry[0];
+            }
+            pos += 1;
+            entry += 1;
+        }
+
+        int read = filev6_open(u, inr, &(d.fv6));
+        if(read != ERR_NONE){
+            return read;
+        }
+        if(!(d.fv6.i_node.i_mode & IFDIR)){
+            return ERR_INVALID_DIRECTORY_INODE;
+        }
+
+        uint16_t newInr;
+        if(d.fv6.i_node.i_mode & IDIRTREE){
+            // one node per level instead of the whole directory
+            read = dirtree_lookup(&(d.fv6), repertory_name, &newInr);
+        }else{
+            d.cur = 0;
+            d.last = 0;
+            do{
+                read = direntv6_readdir(&d, name, &newInr);
+            } while (read > 0 && strncmp(repertory_name, name, DIRENT_MAXLEN));
+        }
+        if(read < 0){
+            return read;
+        }
+        if(read == 0){
+            return ERR_NO_SUCH_FILE;
+        }
+        inr = newInr;
     }
+}
+
 
-    size_t pos = 0;
-    size_t new_len = len;
-    char repertory_name[DIRENT_MAXLEN+1] = {0};
-    while(entry[pos] == '/'){
-        entry += 1;
-        new_len -= 1;
+// one pass over a directory: 1 if name is in it, and its slot in *slot, else 0
+// and its first free slot (d_inumber 0) in *slot, or its number of slots if none is free
+static int direntv6_scan_slots(const struct unix_filesystem *u, uint16_t inr, const char *name, uint32_t *slot){
+    struct filev6 fv6 = {0};
+    int read = filev6_open(u, inr, &fv6);
+    if(read != ERR_NONE){
+        return read;
     }
-    if(strlen(entry) == 0){
-        return inr;
+    if(!(fv6.i_node.i_mode & IFDIR)){
+        return ERR_INVALID_DIRECTORY_INODE;
     }
-    while(entry[pos] != '/' && entry[pos] != '\0'){
-        repertory_name[pos] = entry[pos];
-        pos += 1;
-        new_len -= 1;
+
+    struct direntv6 dirs[DIRENTRIES_PER_SECTOR];
+    uint32_t index = 0;
+    int found_free = 0;
+    while((read = filev6_readblock(&fv6, dirs)) > 0){
+        for(int k = 0; k < read/(int)sizeof(struct direntv6); k++, index++){
+            if(dirs[k].d_inumber == 0){
+                if(!found_free){
+                    *slot = index;
+                    found_free = 1;
+                }
+            }else if(strncmp(dirs[k].d_name, name, DIRENT_MAXLEN) == 0){
+                *slot = index;
+                return 1;
+            }
+        }
     }
-    entry += pos; //shift the pointer to the start of the next '/'
+    if(read < 0){
+        return read;
+    }
+    if(!found_free){
+        *slot = index;
+    }
+    return 0;
+}
 
-    struct directory_reader d = {0};
+// 1 if name is in the directory dir, else 0 and, for a classic directory,
+// the slot of a new entry in *slot
+static int direntv6_find(struct filev6 *dir, const char *name, uint32_t *slot){
+    uint16_t found_inr = 0;
+    return (dir->i_node.i_mode & IDIRTREE)
+           ? dirtree_lookup(dir, name, &found_inr)
+           : direntv6_scan_slots(dir->u, dir->i_number, name, slot);
+}
 
-    int read = direntv6_opendir(u, inr, &d);
-    if(read != ERR_NONE){
-        return read;
+// in the slot given by direntv6_find(); in its leaf for a B+tree
+static int direntv6_insert(struct filev6 *dir, uint32_t slot, const struct direntv6 *entry){
+    return (dir->i_node.i_mode & IDIRTREE)
+           ? dirtree_insert(dir, entry)
+           : filev6_writeat(dir, (int32_t)(slot*sizeof(struct direntv6)), entry, sizeof(struct direntv6));
+}
+
+
+static int direntv6_cmp_name(const void *a, const void *b){
+    return strncmp(((const struct direntv6 *)a)->d_name, ((const struct direntv6 *)b)->d_name, DIRENT_MAXLEN);
+}
+
+// rewrite a directory from its entries but those named skip (if not NULL), sorted
+// by name: dense for a classic one, as full nodes for a B+tree (which it becomes if to_tree)
+static int direntv6_rewrite(struct unix_filesystem *u, uint16_t inr, int to_tree, const char *skip){
+    struct directory_reader d;
+    int ret = direntv6_opendir(u, inr, &d);
+    if(ret != ERR_NONE){
+        return ret;
     }
 
-    uint16_t newInr;
+    // never more entries than slots, whatever the format
+    const size_t nb_slots = (size_t)inode_getsize(&(d.fv6.i_node))/sizeof(struct direntv6);
+    ARENA_SCOPE(scratch);
+    struct direntv6 *entries = arena_calloc(scratch, nb_slots + 1, sizeof(struct direntv6));
+    if(entries == NULL){
+        return ERR_NOMEM;
+    }
+    size_t used = 0;
     char name[DIRENT_MAXLEN+1];
-    
-    do{
-        read = direntv6_readdir(&d, name, &newInr);
-        if (read < 0){
-            return read;
+    uint16_t child_inr;
+    while(used < nb_slots && (ret = direntv6_readdir(&d, name, &child_inr)) == SUCCESS){
+        if(skip != NULL && strncmp(name, skip, DIRENT_MAXLEN) == 0){
+            continue;
         }
-    } while (read > 0 && strncmp(repertory_name, name, DIRENT_MAXLEN));
-    
+        entries[used].d_inumber = child_inr;
+        strncpy(entries[used].d_name, name, DIRENT_MAXLEN);
+        used++;
+    }
 
-    if(read == 0){
-        return ERR_NO_SUCH_FILE;
+    if(ret >= 0){
+        qsort(entries, used, sizeof(struct direntv6), direntv6_cmp_name);
+        if(to_tree || (d.fv6.i_node.i_mode & IDIRTREE)){
+            ret = dirtree_build(&(d.fv6), entries, used);
+        }else{
+            // then the sectors past the last entry are freed
+            ret = filev6_writeat(&(d.fv6), 0, entries, used*sizeof(struct direntv6));
+            if(ret == ERR_NONE){
+                ret = filev6_truncate(&(d.fv6), (int32_t)(used*sizeof(struct direntv6)));
+            }
+        }
     }
+    return ret == ERR_NONE ? (int)used : ret;
+}
 
-    int inode = direntv6_dirlookup_core(u, newInr, entry, new_len);
+int direntv6_compact(struct unix_filesystem *u, uint16_t inr){
+    M_REQUIRE_NON_NULL(u);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
 
-    return inode;
+    return direntv6_rewrite(u, inr, 0, NULL);
+}
+
+int direntv6_make_tree(struct unix_filesystem *u, uint16_t inr){
+    M_REQUIRE_NON_NULL(u);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
+
+    return direntv6_rewrite(u, inr, 1, NULL);
 }
 
 
 int direntv6_create(struct unix_filesystem *u, const char *entry, uint16_t mode){
     M_REQUIRE_NON_NULL(u);
     M_REQUIRE_NON_NULL(entry);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
 
     size_t len = strlen(entry);
     
@@ -178,7 +360,8 @@ int direntv6_create(struct unix_filesystem *u, const char *entry, uint16_t mode)
         len -= 1;
     }
 
-    char* temp_entry = calloc(len+1, 1);
+    ARENA_SCOPE(scratch);
+    char* temp_entry = arena_calloc(scratch, len+1, 1);
     if(temp_entry == NULL){
         return ERR_NOMEM;
     }
@@ -194,58 +377,45 @@ int direntv6_create(struct unix_filesystem *u, const char *entry, uint16_t mode)
     }
     
     if(strlen(start_relativ) > DIRENT_MAXLEN){
-        free(temp_entry);
-        temp_entry = NULL;
         return ERR_FILENAME_TOO_LONG;
     } 
 
-    char* parent_path = calloc(len_parent+1, 1);
+    char* parent_path = arena_calloc(scratch, len_parent+1, 1);
     if(parent_path == NULL){
-        free(temp_entry);
-        temp_entry = NULL;
         return ERR_NOMEM;
     }
     strncpy(parent_path, temp_entry, len_parent);
 
     int parent_inr = direntv6_dirlookup(u, ROOT_INUMBER, parent_path);
     if(parent_inr < ROOT_INUMBER){
-        free(temp_entry);
-        temp_entry = NULL;
-        free(parent_path);
-        parent_path = NULL;
         return ERR_NO_SUCH_FILE;
     }
-    free(parent_path);
-    parent_path = NULL;
 
-    int inr_if_exists = direntv6_dirlookup(u, ROOT_INUMBER, entry);
-    if(inr_if_exists >= ROOT_INUMBER){
-        free(temp_entry);
-        temp_entry = NULL;
-        return ERR_FILENAME_ALREADY_EXISTS; 
+    struct filev6 fv6 = {0};
+    int open = filev6_open(u, (uint16_t)parent_inr, &fv6);
+    if(open != ERR_NONE){
+        return open;
+    }
+
+    uint32_t slot = 0;
+    int exists = direntv6_find(&fv6, start_relativ, &slot);
+    if(exists != 0){
+        return exists < 0 ? exists : ERR_FILENAME_ALREADY_EXISTS;
     }
 
     struct filev6 child_fv6 = {0};
     int create_file = filev6_create(u, mode, &child_fv6);
     if(create_file != ERR_NONE){
-        free(temp_entry);
-        temp_entry = NULL;
         return create_file;
     }
     
 
     struct direntv6 direntv6 = {0}; 
     direntv6.d_inumber = child_fv6.i_number;
-    strncpy(direntv6.d_name, start_relativ, len - len_parent);
-    
-    free(temp_entry); //no need to free start_relative, place in memory already freed
-    temp_entry = NULL;
+    strncpy(direntv6.d_name, start_relativ, DIRENT_MAXLEN);
 
-    struct inode parent_inode = {0};
-    int read_inode = inode_read(u, parent_inr, &parent_inode);
-    struct filev6 fv6 = {u, parent_inr, parent_inode, 0};
-
-    int write = filev6_writebytes(&fv6, &direntv6, sizeof(struct direntv6));
+    // in the first free slot, or appended
+    int write = direntv6_insert(&fv6, slot, &direntv6);
     if(write != ERR_NONE){
         return write;
     }
@@ -254,6 +424,65 @@ int direntv6_create(struct unix_filesystem *u, const char *entry, uint16_t mode)
 }
 
 
+int direntv6_link(struct unix_filesystem *u, uint16_t inr, const char *name, uint16_t child_inr){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(name);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
+
+    if(strlen(name) > DIRENT_MAXLEN){
+        return ERR_FILENAME_TOO_LONG;
+    }
+    struct filev6 fv6 = {0};
+    int ret = filev6_open(u, inr, &fv6);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    if(!(fv6.i_node.i_mode & IFDIR)){
+        return ERR_INVALID_DIRECTORY_INODE;
+    }
+
+    uint32_t slot = 0;
+    int exists = direntv6_find(&fv6, name, &slot);
+    if(exists != 0){
+        return exists < 0 ? exists : ERR_FILENAME_ALREADY_EXISTS;
+    }
+    struct direntv6 entry = {0};
+    entry.d_inumber = child_inr;
+    strncpy(entry.d_name, name, DIRENT_MAXLEN);
+    return direntv6_insert(&fv6, slot, &entry);
+}
+
+
+int direntv6_unlink(struct unix_filesystem *u, uint16_t inr, const char *name){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(name);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
+
+    struct filev6 fv6 = {0};
+    int ret = filev6_open(u, inr, &fv6);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    if(!(fv6.i_node.i_mode & IFDIR)){
+        return ERR_INVALID_DIRECTORY_INODE;
+    }
+
+    uint32_t slot = 0;
+    int exists = direntv6_find(&fv6, name, &slot);
+    if(exists <= 0){
+        return exists < 0 ? exists : ERR_NO_SUCH_FILE;
+    }
+    if(fv6.i_node.i_mode & IDIRTREE){
+        // no removal from a node: the tree is rebuilt without the entry
+        ret = direntv6_rewrite(u, inr, 1, name);
+        return ret < 0 ? ret : ERR_NONE;
+    }
+    // a free slot, reused by the next entry created
+    const struct direntv6 entry = {0};
+    return filev6_writeat(&fv6, (int32_t)(slot*sizeof(struct direntv6)), &entry, sizeof(entry));
+}
+
+
 int direntv6_addfile(struct unix_filesystem *u, const char *entry, uint16_t mode, char *buf, size_t size){
     M_REQUIRE_NON_NULL(u);
     M_REQUIRE_NON_NULL(entry);
@@ -21,6 +21,7 @@ struct directory_reader {
     struct direntv6 dirs[DIRENTRIES_PER_SECTOR];
     int cur;
     int last;
+    uint16_t node;      // B+tree directory: the leaf held in dirs (dirs[0] is its header)
 };
 
 /* *************************************************** *
@@ -39,7 +40,7 @@ int direntv6_opendir(const struct unix_filesystem *u, uint16_t inr, struct direc
  * TODO WEEK 06										   *
  * *************************************************** */
 /**
- * @brief return the next directory entry.
+ * @brief return the next directory entry (free slots, of inode number 0, are skipped).
  * @param d the directory reader
  * @param name pointer to at least DIRENTMAX_LEN+1 bytes.  Filled in with the NULL-terminated string of the entry (OUT)
  * @param child_inr pointer to the inode number in the entry (OUT)
@@ -47,6 +48,23 @@ int direntv6_opendir(const struct unix_filesystem *u, uint16_t inr, struct direc
  */
 int direntv6_readdir(struct directory_reader *d, char *name, uint16_t *child_inr);
 
+/**
+ * @brief position the reader on the entry of the given index (its slot in
+ *        the directory), reading only the directory sector holding it
+ * @param d the directory reader (IN-OUT)
+ * @param index the index of the next entry to return; past the last one,
+ *        the reader is at the end of the directory
+ * @return 0 on success; <0 on error
+ */
+int direntv6_seekdir(struct directory_reader *d, uint32_t index);
+
+/**
+ * @brief the index of the entry the next direntv6_readdir() returns
+ * @param d the directory reader (IN)
+ * @return the index of the entry (its slot in the directory)
+ */
+uint32_t direntv6_telldir(const struct directory_reader *d);
+
 /* *************************************************** *
  * TODO WEEK 06										   *
  * *************************************************** */
@@ -75,7 +93,8 @@ int direntv6_dirlookup(const struct unix_filesystem *u, uint16_t inr, const char
  * TODO WEEK 12										   *
  * *************************************************** */
 /**
- * @brief create a new direntv6 with the given name and given mode
+ * @brief create a new direntv6 with the given name and given mode, in the
+ *        first free slot of the parent directory if it has one
  * @param u a mounted filesystem
  * @param entry the path of the new entry
  * @param mode the mode of the new inode
@@ -96,3 +115,41 @@ int direntv6_create(struct unix_filesystem *u, const char *entry, uint16_t mode)
  * @return 0 on success; <0 on error
  */
 int direntv6_addfile(struct unix_filesystem *u, const char *entry, uint16_t mode, char *buf, size_t size);
+
+/**
+ * @brief add an entry for an existing inode to a directory
+ * @param u a mounted filesystem
+ * @param inr the inode of the directory
+ * @param name the name of the entry
+ * @param child_inr the inode the entry points at
+ * @return 0 on success; <0 on error
+ */
+int direntv6_link(struct unix_filesystem *u, uint16_t inr, const char *name, uint16_t child_inr);
+
+/**
+ * @brief remove an entry from a directory; the inode it points at is left as is
+ * @param u a mounted filesystem
+ * @param inr the inode of the directory
+ * @param name the name of the entry
+ * @return 0 on success; <0 on error
+ */
+int direntv6_unlink(struct unix_filesystem *u, uint16_t inr, const char *name);
+
+/**
+ * @brief rewrite a directory without its free slots, its entries sorted by
+ *        name, and free the sectors it no longer needs (a B+tree directory
+ *        is rebuilt with full nodes)
+ * @param u a mounted filesystem
+ * @param inr the inode of the directory
+ * @return the number of entries on success; <0 on error
+ */
+int direntv6_compact(struct unix_filesystem *u, uint16_t inr);
+
+/**
+ * @brief convert a directory to the B+tree format (IDIRTREE), for
+ *        logarithmic lookups and inserts in very large directories
+ * @param u a mounted filesystem
+ * @param inr the inode of the directory
+ * @return the number of entries on success; <0 on error
+ */
+int direntv6_make_tree(struct unix_filesystem *u, uint16_t inr);
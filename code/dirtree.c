@@ -0,0 +1,372 @@
+/**
+ * @file dirtree.c
+ * @brief B+tree directories (IDIRTREE)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "error.h"
+#include "unixv6fs.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "dirtree.h"
+#include "inode.h"
+#include "util.h"
+#include "trace.h"
+
+#define SUCCESS 1
+#define DIRTREE_MAX_DEPTH 16
+
+/* a node as read from disk: its header, then its entries in slots[1..count];
+ * the spare slot holds the entry that overflows a full node until it is split */
+union dirtree_node {
+    struct dirtree_header header;
+    struct direntv6 slots[DIRENTRIES_PER_SECTOR + 1];
+};
+
+static void dirtree_init(union dirtree_node *n, int leaf){
+    memset(n, 0, sizeof(*n));
+    n->header.magic = DIRTREE_MAGIC;
+    n->header.leaf = (uint8_t)leaf;
+}
+
+static int dirtree_read(struct filev6 *dir, uint16_t node, struct direntv6 *slots){
+    int ret = filev6_lseek(dir, (int32_t)node*SECTOR_SIZE);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    ret = filev6_readblock(dir, slots);
+    if(ret < 0){
+        return ret;
+    }
+    struct dirtree_header header;
+    memcpy(&header, slots, sizeof(header));
+    if(ret != SECTOR_SIZE || header.magic != DIRTREE_MAGIC || header.count > DIRTREE_MAX_KEYS){
+        return ERR_INVALID_DIRECTORY_INODE;
+    }
+    return ERR_NONE;
+}
+
+static int dirtree_write(struct filev6 *dir, uint16_t node, const union dirtree_node *n){
+    return filev6_writeat(dir, (int32_t)node*SECTOR_SIZE, n->slots, SECTOR_SIZE);
+}
+
+// the first slot (1 to count+1) whose name is >= name, or > name if after_equal
+static int dirtree_search(const union dirtree_node *n, const char *name, int after_equal){
+    int lo = 1;
+    int hi = n->header.count + 1;
+    while(lo < hi){
+        const int mid = (lo + hi)/2;
+        const int cmp = strncmp(n->slots[mid].d_name, name, DIRENT_MAXLEN);
+        if(cmp < 0 || (after_equal && cmp == 0)){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the child of an internal node where name belongs
+static uint16_t dirtree_child(const union dirtree_node *n, const char *name){
+    const int slot = dirtree_search(n, name, 1) - 1;  // the last key <= name
+    return slot == 0 ? n->header.next : n->slots[slot].d_inumber;
+}
+
+
+static int dirtree_load_leaf(struct directory_reader *d, uint16_t node){
+    int ret = dirtree_read(&(d->fv6), node, d->dirs);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    struct dirtree_header header;
+    memcpy(&header, d->dirs, sizeof(header));
+    if(!header.leaf){
+        return ERR_INVALID_DIRECTORY_INODE;
+    }
+    d->node = node;
+    d->cur = 1;
+    d->last = 1 + header.count;
+    return ERR_NONE;
+}
+
+int dirtree_opendir(struct directory_reader *d){
+    M_REQUIRE_NON_NULL(d);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
+
+    uint16_t node = 0;
+    for(int depth = 0; depth < DIRTREE_MAX_DEPTH; depth++){
+        int ret = dirtree_read(&(d->fv6), node, d->dirs);
+        if(ret != ERR_NONE){
+            return ret;
+        }
+        struct dirtree_header header;
+        memcpy(&header, d->dirs, sizeof(header));
+        if(header.leaf){
+            return dirtree_load_leaf(d, node);
+        }
+        node = header.next;  // down the leftmost branch
+    }
+    return ERR_INVALID_DIRECTORY_INODE;
+}
+
+int dirtree_readdir(struct directory_reader *d, char *name, uint16_t *child_inr){
+    M_REQUIRE_NON_NULL(d);
+    M_REQUIRE_NON_NULL(name);
+    M_REQUIRE_NON_NULL(child_inr);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
+
+    while(d->cur >= d->last){
+        struct dirtree_header header;
+        memcpy(&header, d->dirs, sizeof(header));
+        if(header.next == 0){
+            return ERR_NONE;  // after the last leaf
+        }
+        int ret = dirtree_load_leaf(d, header.next);
+        if(ret != ERR_NONE){
+            return ret;
+        }
+    }
+    strncpy(name, (d->dirs)[d->cur].d_name, DIRENT_MAXLEN);
+    name[DIRENT_MAXLEN] = '\0';
+    *child_inr = (d->dirs)[d->cur].d_inumber;
+    d->cur += 1;
+    return SUCCESS;
+}
+
+int dirtree_seekdir(struct directory_reader *d, uint32_t index){
+    M_REQUIRE_NON_NULL(d);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
+
+    if(index == 0){
+        return dirtree_opendir(d);
+    }
+    const uint32_t node = index/DIRENTRIES_PER_SECTOR;
+    if((int64_t)(node + 1)*SECTOR_SIZE > inode_getsize(&(d->fv6.i_node))){
+        // past the end: an empty leaf with no next one
+        memset(d->dirs, 0, sizeof(d->dirs));
+        d->cur = d->last = 1;
+        return ERR_NONE;
+    }
+    int ret = dirtree_load_leaf(d, (uint16_t)node);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    d->cur = MIN((int)(index%DIRENTRIES_PER_SECTOR) + 1, d->last);
+    return ERR_NONE;
+}
+
+uint32_t dirtree_telldir(const struct directory_reader *d){
+    return (uint32_t)d->node*DIRENTRIES_PER_SECTOR + (uint32_t)(d->cur - 1);
+}
+
+
+int dirtree_lookup(struct filev6 *dir, const char *name, uint16_t *inr){
+    M_REQUIRE_NON_NULL(dir);
+    M_REQUIRE_NON_NULL(name);
+    M_REQUIRE_NON_NULL(inr);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
+
+    union dirtree_node n;
+    uint16_t node = 0;
+    for(int depth = 0; ; depth++){
+        if(depth == DIRTREE_MAX_DEPTH){
+            return ERR_INVALID_DIRECTORY_INODE;
+        }
+        int ret = dirtree_read(dir, node, n.slots);
+        if(ret != ERR_NONE){
+            return ret;
+        }
+        if(n.header.leaf){
+            break;
+        }
+        node = dirtree_child(&n, name);
+    }
+
+    const int slot = dirtree_search(&n, name, 0);
+    if(slot <= n.header.count && strncmp(n.slots[slot].d_name, name, DIRENT_MAXLEN) == 0){
+        *inr = n.slots[slot].d_inumber;
+        return 1;
+    }
+    return 0;
+}
+
+
+int dirtree_insert(struct filev6 *dir, const struct direntv6 *entry){
+    M_REQUIRE_NON_NULL(dir);
+    M_REQUIRE_NON_NULL(entry);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
+
+    uint16_t path[DIRTREE_MAX_DEPTH];
+    int depth = 0;
+    union dirtree_node n;
+    uint16_t node = 0;
+    for(;;){
+        if(depth == DIRTREE_MAX_DEPTH){
+            return ERR_INVALID_DIRECTORY_INODE;
+        }
+        int ret = dirtree_read(dir, node, n.slots);
+        if(ret != ERR_NONE){
+            return ret;
+        }
+        path[depth++] = node;
+        if(n.header.leaf){
+            break;
+        }
+        node = dirtree_child(&n, entry->d_name);
+    }
+    int slot = dirtree_search(&n, entry->d_name, 0);
+    if(slot <= n.header.count && strncmp(n.slots[slot].d_name, entry->d_name, DIRENT_MAXLEN) == 0){
+        return ERR_FILENAME_ALREADY_EXISTS;
+    }
+
+    // from the leaf up, as long as the node receiving an entry overflows
+    struct direntv6 ins = *entry;
+    for(int level = depth - 1; ; level--){
+        memmove(&n.slots[slot + 1], &n.slots[slot], (size_t)(n.header.count + 1 - slot)*sizeof(struct direntv6));
+        n.slots[slot] = ins;
+        n.header.count++;
+        if(n.header.count <= DIRTREE_MAX_KEYS){
+            return dirtree_write(dir, path[level], &n);
+        }
+
+        // split: the upper half goes to a new node, and a key for it to the parent
+        const int total = n.header.count;
+        const int keep = total/2;
+        union dirtree_node right;
+        dirtree_init(&right, n.header.leaf);
+        struct direntv6 separator = n.slots[keep + 1];
+        if(n.header.leaf){
+            right.header.count = (uint16_t)(total - keep);
+            memcpy(&right.slots[1], &n.slots[keep + 1], (size_t)right.header.count*sizeof(struct direntv6));
+        }else{
+            // the middle key moves up, its child becomes the leftmost one of the new node
+            right.header.next = separator.d_inumber;
+            right.header.count = (uint16_t)(total - keep - 1);
+            memcpy(&right.slots[1], &n.slots[keep + 2], (size_t)right.header.count*sizeof(struct direntv6));
+        }
+        n.header.count = (uint16_t)keep;
+        memset(&n.slots[keep + 1], 0, (size_t)(DIRENTRIES_PER_SECTOR - keep)*sizeof(struct direntv6));
+
+        // new nodes go at the end of the directory
+        const int32_t first_new = inode_getsize(&(dir->i_node))/SECTOR_SIZE;
+        if(first_new + 1 > UINT16_MAX){
+            return ERR_FILE_TOO_LARGE;
+        }
+        if(path[level] == 0){
+            // the root stays node 0: both halves move out, it keeps one key
+            const uint16_t left_node = (uint16_t)first_new, right_node = (uint16_t)(first_new + 1);
+            if(n.header.leaf){
+                right.header.next = n.header.next;
+                n.header.next = right_node;
+            }
+            int ret = dirtree_write(dir, left_node, &n);
+            if(ret == ERR_NONE){
+                ret = dirtree_write(dir, right_node, &right);
+            }
+            if(ret != ERR_NONE){
+                return ret;
+            }
+            union dirtree_node root;
+            dirtree_init(&root, 0);
+            root.header.count = 1;
+            root.header.next = left_node;
+            root.slots[1].d_inumber = right_node;
+            memcpy(root.slots[1].d_name, separator.d_name, DIRENT_MAXLEN);
+            return dirtree_write(dir, 0, &root);
+        }
+
+        const uint16_t right_node = (uint16_t)first_new;
+        if(n.header.leaf){
+            right.header.next = n.header.next;
+            n.header.next = right_node;
+        }
+        int ret = dirtree_write(dir, right_node, &right);
+        if(ret == ERR_NONE){
+            ret = dirtree_write(dir, path[level], &n);
+        }
+        if(ret == ERR_NONE){
+            ret = dirtree_read(dir, path[level - 1], n.slots);
+        }
+        if(ret != ERR_NONE){
+            return ret;
+        }
+        memset(&ins, 0, sizeof(ins));
+        ins.d_inumber = right_node;
+        memcpy(ins.d_name, separator.d_name, DIRENT_MAXLEN);
+        slot = dirtree_search(&n, ins.d_name, 1);
+    }
+}
+
+
+int dirtree_build(struct filev6 *dir, const struct direntv6 *entries, size_t count){
+    M_REQUIRE_NON_NULL(dir);
+    M_REQUIRE_NON_NULL(entries);
+    TRACE_SUBSYS(TRACE_SUB_DIR);
+
+    // the leaves are nodes 1 to nb_leaves, then come the levels of internal
+    // nodes; the top one is node 0 (so is a single leaf)
+    const size_t nb_leaves = MAX((count + DIRTREE_MAX_KEYS - 1)/DIRTREE_MAX_KEYS, 1);
+    const size_t max_nodes = 2*nb_leaves + DIRTREE_MAX_DEPTH;
+    if(max_nodes*SECTOR_SIZE > FILEV6_MAX_SIZE){
+        return ERR_FILE_TOO_LARGE;
+    }
+    ARENA_SCOPE(scratch);
+    union dirtree_node *nodes = arena_calloc(scratch, max_nodes, sizeof(union dirtree_node));
+    struct direntv6 *sectors = arena_alloc(scratch, max_nodes*SECTOR_SIZE);
+    uint16_t *level = arena_alloc(scratch, nb_leaves*sizeof(uint16_t));  // the nodes of the level being built
+    const char **firsts = arena_alloc(scratch, nb_leaves*sizeof(char *));  // and the first name below each
+    if(nodes == NULL || sectors == NULL || level == NULL || firsts == NULL){
+        return ERR_NOMEM;
+    }
+
+    size_t nb_nodes = (nb_leaves == 1) ? 0 : 1;
+    for(size_t l = 0; l < nb_leaves; l++){
+        union dirtree_node *leaf = &nodes[nb_nodes];
+        dirtree_init(leaf, 1);
+        const size_t first = l*DIRTREE_MAX_KEYS;
+        leaf->header.count = (uint16_t)MIN(count - MIN(first, count), DIRTREE_MAX_KEYS);
+        memcpy(&leaf->slots[1], &entries[first], leaf->header.count*sizeof(struct direntv6));
+        leaf->header.next = (l + 1 < nb_leaves) ? (uint16_t)(nb_nodes + 1) : 0;
+        level[l] = (uint16_t)nb_nodes;
+        firsts[l] = entries[MIN(first, count - (count > 0))].d_name;
+        nb_nodes++;
+    }
+
+    size_t nb_level = nb_leaves;
+    while(nb_level > 1){
+        // each internal node takes up to DIRENTRIES_PER_SECTOR children
+        const size_t nb_parents = (nb_level + DIRENTRIES_PER_SECTOR - 1)/DIRENTRIES_PER_SECTOR;
+        for(size_t p = 0; p < nb_parents; p++){
+            const size_t index = (nb_parents == 1) ? 0 : nb_nodes++;
+            union dirtree_node *parent = &nodes[index];
+            dirtree_init(parent, 0);
+            const size_t first = p*DIRENTRIES_PER_SECTOR;
+            const size_t nb_children = MIN(nb_level - first, (size_t)DIRENTRIES_PER_SECTOR);
+            parent->header.next = level[first];
+            parent->header.count = (uint16_t)(nb_children - 1);
+            for(size_t c = 1; c < nb_children; c++){
+                parent->slots[c].d_inumber = level[first + c];
+                memcpy(parent->slots[c].d_name, firsts[first + c], DIRENT_MAXLEN);
+            }
+            level[p] = (uint16_t)index;
+            firsts[p] = firsts[first];
+        }
+        nb_level = nb_parents;
+    }
+
+    for(size_t k = 0; k < nb_nodes; k++){
+        memcpy(&sectors[k*DIRENTRIES_PER_SECTOR], nodes[k].slots, SECTOR_SIZE);
+    }
+    int ret = filev6_writeat(dir, 0, sectors, nb_nodes*SECTOR_SIZE);
+    if(ret == ERR_NONE){
+        ret = filev6_truncate(dir, (int32_t)(nb_nodes*SECTOR_SIZE));
+    }
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    dir->i_node.i_mode |= IDIRTREE;
+    return inode_write(dir->u, dir->i_number, &(dir->i_node));
+}
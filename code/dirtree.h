@@ -0,0 +1,74 @@
+#pragma once
+
+/**
+ * @file dirtree.h
+ * @brief B+tree directories (IDIRTREE): lookups and inserts read one node
+ *        per level of the tree instead of the whole directory
+ *
+ * The on-disk format is described in unixv6fs.h. The direntv6_* functions
+ * dispatch to these for the directories flagged IDIRTREE.
+ */
+
+#include <stdint.h>
+#include "unixv6fs.h"
+#include "filev6.h"
+#include "direntv6.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief position a reader opened on a B+tree directory on its first entry
+ * @param d the directory reader (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+int dirtree_opendir(struct directory_reader *d);
+
+/**
+ * @brief same as direntv6_readdir(), for a B+tree directory (entries in name order)
+ */
+int dirtree_readdir(struct directory_reader *d, char *name, uint16_t *child_inr);
+
+/**
+ * @brief same as direntv6_seekdir(), for a B+tree directory: an index is
+ *        a leaf and a slot in it, as given by dirtree_telldir()
+ */
+int dirtree_seekdir(struct directory_reader *d, uint32_t index);
+
+/**
+ * @brief same as direntv6_telldir(), for a B+tree directory
+ */
+uint32_t dirtree_telldir(const struct directory_reader *d);
+
+/**
+ * @brief look for a name in a B+tree directory
+ * @param dir the directory (IN-OUT; its cursor is moved)
+ * @param name the name, NUL-terminated, at most DIRENT_MAXLEN characters
+ * @param inr the inode number of the entry, if found (OUT)
+ * @return 1 if found; 0 if not; <0 on error
+ */
+int dirtree_lookup(struct filev6 *dir, const char *name, uint16_t *inr);
+
+/**
+ * @brief insert an entry in a B+tree directory, splitting the full nodes
+ *        on its path; the inode of the directory is written back to disk
+ * @param dir the directory (IN-OUT)
+ * @param entry the entry to insert (IN)
+ * @return 0 on success; ERR_FILENAME_ALREADY_EXISTS if the name is taken; <0 on error
+ */
+int dirtree_insert(struct filev6 *dir, const struct direntv6 *entry);
+
+/**
+ * @brief rewrite a directory as a B+tree holding the given entries, with
+ *        full nodes, and flag it IDIRTREE; the inode is written back to disk
+ * @param dir the directory (IN-OUT)
+ * @param entries the entries, sorted by name, without free slots (IN)
+ * @param count the number of entries
+ * @return 0 on success; <0 on error
+ */
+int dirtree_build(struct filev6 *dir, const struct direntv6 *entries, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -35,6 +35,8 @@ enum error_codes {
     ERR_OFFSET_OUT_OF_RANGE,
     ERR_BAD_PARAMETER,
     ERR_NO_SUCH_FILE,
+    ERR_INCONSISTENT_FS,
+    ERR_CHECKSUM,
     ERR_LAST // not an actual error but to have e.g. the total number of errors
 };
 
@@ -4,9 +4,22 @@
 #include "filev6.h"
 #include "inode.h"
 #include "sector.h"
+#include "bmblock.h"
+#include "util.h"
+#include "trace.h"
+#include "csum.h"
+#include "lz4.h"
+#include "dedup.h"
+#include "snapshot.h"
+
+// the contents of a directory read through filev6 stay tagged as directory accesses
+#define FILEV6_TRACE_SUBSYS() \
+    TRACE_SUBSYS(trace_current_subsys == TRACE_SUB_DIR ? TRACE_SUB_DIR : TRACE_SUB_FILE)
 
 #define END_OF_FILE 0
 
+_Static_assert(COMPR_CLUSTER_SIZE <= LZ4_MAX_INPUT, "a cluster must be compressible as one LZ4 block");
+
 
 int filev6_open(const struct unix_filesystem *u, uint16_t inr, struct filev6 *fv6){
     M_REQUIRE_NON_NULL(u);
@@ -18,29 +31,182 @@ int filev6_open(const struct unix_filesystem *u, uint16_t inr, struct filev6 *fv
     }
     fv6->i_number = inr;
     fv6->offset = 0;
+    fv6->alloc_hint = 0;
     fv6->u = u;
 
     return ERR_NONE;
 }
 
 
+
+/* Compressed files (ICOMPR): a per-thread copy of the last cluster read, so
+ * that reading a cluster sector by sector decompresses it once. It is tagged
+ * with a global generation, bumped whenever a cluster is written or a
+ * filesystem is (un)mounted. */
+struct cluster_cache {
+    const struct unix_filesystem *u;
+    uint16_t inr;
+    uint32_t cluster;
+    uint64_t generation;    // 0: empty
+    uint8_t data[COMPR_CLUSTER_SIZE];
+};
+
+static uint64_t cluster_generation = 1;
+static __thread struct cluster_cache cluster_cache;
+
+void filev6_clusters_changed(void){
+    __atomic_add_fetch(&cluster_generation, 1, __ATOMIC_RELEASE);
+}
+
+static int filev6_is_compressed(const struct inode *i){
+    return (i->i_mode & ICOMPR) && !(i->i_mode & (IINLINE | IFMT));
+}
+
+// the number of sectors of the file in cluster c
+static size_t filev6_cluster_sectors(int32_t size_file, uint32_t c){
+    const int64_t left = (int64_t)size_file - (int64_t)c*COMPR_CLUSTER_SIZE;
+    return left <= 0 ? 0 : (size_t)MIN((left + SECTOR_SIZE - 1)/SECTOR_SIZE, COMPR_CLUSTER_SECTORS);
+}
+
+// reads cluster c of a compressed file into data (COMPR_CLUSTER_SIZE bytes, zeroes past the end of the file)
+static int filev6_read_cluster(const struct unix_filesystem *u, const struct inode *i, uint32_t c, uint8_t *data){
+    const int32_t size_file = inode_getsize(i);
+    const size_t n = filev6_cluster_sectors(size_file, c);
+    memset(data, 0, COMPR_CLUSTER_SIZE);
+    if(n == 0){
+        return ERR_NONE;
+    }
+    sector_addr_t sectors[COMPR_CLUSTER_SECTORS];
+    int find = inode_findsectors(u, i, (int32_t)(c*COMPR_CLUSTER_SECTORS), sectors, n);
+    if(find != ERR_NONE){
+        return find;
+    }
+    size_t m = 0;
+    while(m < n && sectors[m] != 0){
+        m++;
+    }
+    for(size_t k = m; k < n; k++){
+        if(sectors[k] != 0){
+            return ERR_INCONSISTENT_FS;
+        }
+    }
+
+    uint8_t stored[COMPR_CLUSTER_SIZE];
+    uint8_t *dest = (m == n) ? data : stored;
+    size_t k = 0;
+    while(k < m){
+        size_t run = 1;
+        while(k + run < m && sectors[k + run] == sectors[k] + run){
+            run++;
+        }
+        int read = sector_read_many(u->f, sectors[k], run, &dest[k*SECTOR_SIZE]);
+        if(read == ERR_NONE){
+            read = csum_verify(u, sectors[k], run, &dest[k*SECTOR_SIZE]);
+        }
+        if(read != ERR_NONE){
+            return read;
+        }
+        k += run;
+    }
+    if(m == n || m == 0){
+        return ERR_NONE;
+    }
+
+    struct compr_header header;
+    memcpy(&header, stored, sizeof(header));
+    if(header.length > m*SECTOR_SIZE - sizeof(header)){
+        return ERR_INCONSISTENT_FS;
+    }
+    const size_t len = MIN(COMPR_CLUSTER_SIZE, (size_t)size_file - (size_t)c*COMPR_CLUSTER_SIZE);
+    int decompress = lz4_decompress(&stored[sizeof(header)], header.length, data, len);
+    if(decompress >= 0 && (size_t)decompress != len){
+        return ERR_INCONSISTENT_FS;
+    }
+    return decompress < 0 ? decompress : ERR_NONE;
+}
+
+// cluster c of the file, from the cache of the thread; valid until the next call
+static int filev6_cached_cluster(const struct filev6 *fv6, uint32_t c, const uint8_t **data){
+    const uint64_t generation = __atomic_load_n(&cluster_generation, __ATOMIC_ACQUIRE);
+    struct cluster_cache *e = &cluster_cache;
+    if(e->generation != generation || e->u != fv6->u || e->inr != fv6->i_number || e->cluster != c){
+        e->generation = 0;
+        int read = filev6_read_cluster(fv6->u, &(fv6->i_node), c, e->data);
+        if(read != ERR_NONE){
+            return read;
+        }
+        e->u = fv6->u;
+        e->inr = fv6->i_number;
+        e->cluster = c;
+        e->generation = generation;
+    }
+    *data = e->data;
+    return ERR_NONE;
+}
+
+// filev6_readbytes() of a compressed file: the whole clusters are decompressed straight into buf
+static int filev6_readbytes_compressed(struct filev6 *fv6, uint8_t *bytes, size_t to_read){
+    size_t done = 0;
+    while(done < to_read){
+        const size_t pos = (size_t)fv6->offset + done;
+        const uint32_t c = (uint32_t)(pos/COMPR_CLUSTER_SIZE);
+        const size_t in_cluster = pos%COMPR_CLUSTER_SIZE;
+        const size_t nb_bytes = MIN(COMPR_CLUSTER_SIZE - in_cluster, to_read - done);
+        int read = ERR_NONE;
+        if(nb_bytes == COMPR_CLUSTER_SIZE){
+            read = filev6_read_cluster(fv6->u, &(fv6->i_node), c, &bytes[done]);
+        }else{
+            const uint8_t *cluster = NULL;
+            read = filev6_cached_cluster(fv6, c, &cluster);
+            if(read == ERR_NONE){
+                memcpy(&bytes[done], &cluster[in_cluster], nb_bytes);
+            }
+        }
+        if(read != ERR_NONE){
+            return read;
+        }
+        done += nb_bytes;
+    }
+    fv6->offset += (int32_t)done;
+    return (int)done;
+}
+
 int filev6_readblock(struct filev6 *fv6, void *buf){
     M_REQUIRE_NON_NULL(fv6);
     M_REQUIRE_NON_NULL(buf);
+    FILEV6_TRACE_SUBSYS();
 
     uint32_t file_size = inode_getsize(&(fv6->i_node));
 
     if(fv6->offset == file_size){
         return END_OF_FILE;
     }
+    if(fv6->i_node.i_mode & IINLINE){ // no sector to read, the data came with the inode
+        memset(buf, 0, SECTOR_SIZE);
+        memcpy(buf, (const uint8_t *)fv6->i_node.i_addr + fv6->offset, file_size - fv6->offset);
+        int bytes_read = (int)(file_size - fv6->offset);
+        fv6->offset = (int32_t)file_size;
+        return bytes_read;
+    }
+    if(filev6_is_compressed(&(fv6->i_node))){
+        memset(buf, 0, SECTOR_SIZE);
+        return filev6_readbytes_compressed(fv6, buf, MIN(SECTOR_SIZE, file_size - fv6->offset));
+    }
 
     int sector_id = inode_findsector(fv6->u, &(fv6->i_node), (fv6->offset)/SECTOR_SIZE); 
     if(sector_id < END_OF_FILE){
         return sector_id;
     }
-    int read = sector_read((fv6->u)->f, sector_id, buf);
-    if(read != ERR_NONE){
-        return read;
+    if(sector_id == 0){ // a hole
+        memset(buf, 0, SECTOR_SIZE);
+    }else{
+        int read = sector_read((fv6->u)->f, sector_id, buf);
+        if(read == ERR_NONE){
+            read = csum_verify(fv6->u, (uint32_t)sector_id, 1, buf);
+        }
+        if(read != ERR_NONE){
+            return read;
+        }
     }
 
     uint32_t bytes_to_read = ((fv6->offset + SECTOR_SIZE) <= file_size) ? SECTOR_SIZE : (file_size - fv6->offset);
@@ -50,6 +216,89 @@ int filev6_readblock(struct filev6 *fv6, void *buf){
 }
 
 
+#define FILEV6_READ_BATCH 64 // sectors located per call to inode_findsectors
+
+int filev6_readbytes(struct filev6 *fv6, void *buf, size_t len){
+    M_REQUIRE_NON_NULL(fv6);
+    M_REQUIRE_NON_NULL(buf);
+    FILEV6_TRACE_SUBSYS();
+
+    int32_t file_size = inode_getsize(&(fv6->i_node));
+    if(fv6->offset == file_size){
+        return END_OF_FILE;
+    }
+    if(fv6->offset%SECTOR_SIZE != 0){
+        return ERR_BAD_PARAMETER;
+    }
+    size_t to_read = MIN(len, (size_t)(file_size - fv6->offset));
+    if(fv6->i_node.i_mode & IINLINE){
+        memcpy(buf, (const uint8_t *)fv6->i_node.i_addr + fv6->offset, to_read);
+        fv6->offset += (int32_t)to_read;
+        return (int)to_read;
+    }
+    if(filev6_is_compressed(&(fv6->i_node))){
+        return filev6_readbytes_compressed(fv6, buf, to_read);
+    }
+
+    uint8_t *bytes = buf;
+    uint8_t last_sector[SECTOR_SIZE];
+    size_t done = 0;
+    while(done < to_read){
+        size_t nb_sectors = MIN((to_read - done + SECTOR_SIZE - 1)/SECTOR_SIZE, FILEV6_READ_BATCH);
+        sector_addr_t sectors[FILEV6_READ_BATCH];
+        int find = inode_findsectors(fv6->u, &(fv6->i_node), (fv6->offset + (int32_t)done)/SECTOR_SIZE, sectors, nb_sectors);
+        if(find != ERR_NONE){
+            return find;
+        }
+
+        size_t i = 0;
+        while(i < nb_sectors){
+            size_t run = 1; // sectors consecutive on disk, or holes
+            if(sectors[i] == 0){
+                while(i + run < nb_sectors && sectors[i + run] == 0){
+                    run++;
+                }
+                size_t run_bytes = MIN(run*SECTOR_SIZE, to_read - done);
+                memset(&bytes[done], 0, run_bytes);
+                done += run_bytes;
+                i += run;
+                continue;
+            }
+            while(i + run < nb_sectors && sectors[i + run] == sectors[i] + run){
+                run++;
+            }
+            size_t run_bytes = MIN(run*SECTOR_SIZE, to_read - done);
+            // the last partial sector goes through a bounce buffer not to overflow buf
+            size_t full = run_bytes/SECTOR_SIZE;
+            if(full > 0){
+                int read = sector_read_many((fv6->u)->f, sectors[i], full, &bytes[done]);
+                if(read == ERR_NONE){
+                    read = csum_verify(fv6->u, sectors[i], full, &bytes[done]);
+                }
+                if(read != ERR_NONE){
+                    return read;
+                }
+            }
+            if(run_bytes%SECTOR_SIZE != 0){
+                int read = sector_read((fv6->u)->f, sectors[i] + (uint32_t)full, last_sector);
+                if(read == ERR_NONE){
+                    read = csum_verify(fv6->u, sectors[i] + (uint32_t)full, 1, last_sector);
+                }
+                if(read != ERR_NONE){
+                    return read;
+                }
+                memcpy(&bytes[done + full*SECTOR_SIZE], last_sector, run_bytes%SECTOR_SIZE);
+            }
+            done += run_bytes;
+            i += run;
+        }
+    }
+
+    fv6->offset += (int32_t)done;
+    return (int)done;
+}
+
+
 int filev6_lseek(struct filev6 *fv6, int32_t offset){
     M_REQUIRE_NON_NULL(fv6);
 
@@ -92,91 +341,415 @@ int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6){
     fv6->i_number = inr;
     fv6->i_node = inode;
     fv6->offset = 0;
+    fv6->alloc_hint = 0;
 
     return ERR_NONE;
 }
 
 
-int filev6_writesector(struct filev6 *fv6, const void *buf, size_t len, size_t left_to_write, size_t bytes_writen, size_t size_file){ //len should be either 512 to write a full sector or less
+static int filev6_alloc_sector(struct filev6 *fv6){
+    struct unix_filesystem *u = fv6->u;
+
+    int sector = -1;
+    if(fv6->alloc_hint != 0 && bm_get(u->fbm, fv6->alloc_hint) == 0){
+        sector = fv6->alloc_hint;  //keeps the file contiguous
+    }else{
+        sector = bm_find_next(u->fbm);
+    }
+    if(sector < u->s.s_block_start || sector >= u->s.s_fsize){  //then not a valid sector
+        return sector < 0 ? sector : ERR_BITMAP_FULL;
+    }
+    bm_set(u->fbm, sector);
+    fv6->alloc_hint = (sector_addr_t)(sector + 1);
+
+    return sector;
+}
+
+
+// the sector of file sector file_sec_off, about to be written in place: if it
+// is shared with other files (see dedup.h) or frozen by a snapshot (see
+// snapshot.h), the file gets a sector of its own
+static int filev6_private_sector(struct filev6 *fv6, int32_t file_sec_off, int sector_id){
+    int own = snapshot_frozen(fv6->u, (uint32_t)sector_id) ? 0 : dedup_own(fv6->u, (uint32_t)sector_id);
+    if(own != 0){
+        return own < 0 ? own : sector_id;
+    }
+    int copy = filev6_alloc_sector(fv6);
+    if(copy < 0){
+        return copy;
+    }
+    sector_addr_t copy_sector = (sector_addr_t)copy;
+    int set = inode_setsectors(fv6->u, &(fv6->i_node), file_sec_off, &copy_sector, 1);
+    int last_ref = (set != ERR_NONE) ? set : dedup_release(fv6->u, (uint32_t)sector_id);
+    if(last_ref < 0){
+        return last_ref;
+    }
+    if(last_ref){
+        bm_clear(fv6->u->fbm, (uint64_t)sector_id);
+    }
+    return copy;
+}
+
+
+// a regular file stays inline (IINLINE) as long as it fits in i_addr
+static int filev6_fits_inline(const struct filev6 *fv6, int64_t end){
+    const struct inode *i = &(fv6->i_node);
+    int inlinable = (i->i_mode & IINLINE) || (inode_getsize(i) == 0 && (i->i_mode & IFMT) == 0);
+    return inlinable && end <= INODE_INLINE_SIZE;
+}
+
+// the bytes of an inline file past its end are zeroes, so a gap needs no filling
+static int filev6_write_inline(struct filev6 *fv6, int32_t offset, const void *buf, size_t len){
+    memcpy((uint8_t *)fv6->i_node.i_addr + offset, buf, len);
+    fv6->i_node.i_mode |= IINLINE;
+    int32_t end = offset + (int32_t)len;
+    return end > inode_getsize(&(fv6->i_node)) ? inode_setsize(&(fv6->i_node), end) : ERR_NONE;
+}
+
+
+static int filev6_is_zero(const uint8_t *bytes, size_t len){
+    uint8_t any = 0;
+    for(size_t k = 0; k < len; k++){
+        any |= bytes[k];
+    }
+    return any == 0;
+}
+
+
+int filev6_writesector(struct filev6 *fv6, const void *buf, size_t len){ //writes at most up to the end of the last sector of the file
     M_REQUIRE_NON_NULL(fv6);
-    M_REQUIRE_NON_NULL(buf); 
+    M_REQUIRE_NON_NULL(buf);
+    FILEV6_TRACE_SUBSYS();
+
+    int32_t size_file = inode_getsize(&(fv6->i_node));
+    size_t in_sector = size_file%SECTOR_SIZE;
+    size_t nb_bytes = MIN(SECTOR_SIZE - in_sector, len);
+    int32_t offset_sector = size_file/SECTOR_SIZE;
+
+    uint8_t sector_to_write[SECTOR_SIZE] = {0};
+    int sector_id = 0;
+    int in_hole = 0;
+    if(in_sector != 0){ //we need to fill the last sector
+        sector_id = inode_findsector(fv6->u, &(fv6->i_node), offset_sector);
+        if(sector_id < 0){
+            return sector_id;
+        }
+    }
+    if(sector_id == 0 && filev6_is_zero(buf, nb_bytes)){ // zeroes in a hole: it stays one
+        int grow = inode_grow(fv6->u, &(fv6->i_node), size_file + (int32_t)nb_bytes);
+        return grow != ERR_NONE ? grow : (int)nb_bytes;
+    }
+    if(in_sector != 0){
+        if(sector_id == 0){ // a hole, now backed by a sector
+            sector_id = filev6_alloc_sector(fv6);
+            if(sector_id < 0){
+                return sector_id;
+            }
+            in_hole = 1;
+        }else{
+            int read = sector_read((fv6->u)->f, sector_id, sector_to_write);
+            if(read != ERR_NONE){
+                return read;
+            }
+            sector_id = filev6_private_sector(fv6, offset_sector, sector_id);
+            if(sector_id < 0){
+                return sector_id;
+            }
+        }
+    }else{
+        sector_id = filev6_alloc_sector(fv6);
+        if(sector_id < 0){
+            return sector_id;
+        }
+    }
 
-    size_t nb_bytes = size_file%SECTOR_SIZE; 
-    if(nb_bytes != 0){ //we need to fill a sector
-        nb_bytes = SECTOR_SIZE - nb_bytes;
-        nb_bytes = (nb_bytes < len) ? nb_bytes : len;
+    memcpy(&sector_to_write[in_sector], buf, nb_bytes);
+    int write = sector_write((fv6->u)->f, sector_id, sector_to_write);
+    if(write != ERR_NONE){
+        return write;
+    }
 
-        int offset_sector = size_file/SECTOR_SIZE;
-        uint8_t sector_to_fill[SECTOR_SIZE+1] = {0};
-        int read = sector_read((fv6->u)->f, (fv6->i_node).i_addr[offset_sector], sector_to_fill);
-        
-        if(read != ERR_NONE){
-            return read;
+    int grow = inode_grow(fv6->u, &(fv6->i_node), size_file + (int32_t)nb_bytes);
+    if(grow != ERR_NONE){
+        return grow;
+    }
+    if(in_sector == 0 || in_hole){
+        sector_addr_t added_sector = (sector_addr_t)sector_id;
+        int set = inode_setsectors(fv6->u, &(fv6->i_node), offset_sector, &added_sector, 1);
+        if(set != ERR_NONE){
+            return set;
         }
-        memcpy(&(sector_to_fill[size_file%SECTOR_SIZE]), buf, nb_bytes);
-        
-        int write = sector_write((fv6->u)->f, (fv6->i_node).i_addr[offset_sector], sector_to_fill);
-        if(write != ERR_NONE){
-            return write;
+    }
+
+    return (int)nb_bytes;
+}
+
+
+#define FILEV6_BATCH_SECTORS 64
+
+/* writes count full sectors at the end of a file whose size is a multiple of
+ * SECTOR_SIZE, updating the sector map once for the whole batch.
+ * Sectors of zeroes are not written: they stay holes; in a regular file, a
+ * sector already on the disk is shared (see dedup.h) */
+static int filev6_writesectors(struct filev6 *fv6, const uint8_t *buf, size_t count){
+    sector_addr_t sectors[FILEV6_BATCH_SECTORS] = {0};
+    int32_t size_file = inode_getsize(&(fv6->i_node));
+    const int dedup = (fv6->i_node.i_mode & IFMT) == 0;
+
+    for(size_t i = 0; i < count; i++){
+        if(filev6_is_zero(&buf[i*SECTOR_SIZE], SECTOR_SIZE)){
+            continue;
+        }
+        int sector_id = dedup ? dedup_lookup(fv6->u, &buf[i*SECTOR_SIZE]) : 0;
+        if(sector_id == 0){
+            sector_id = filev6_alloc_sector(fv6);
+            int write = (sector_id < 0) ? sector_id : sector_write((fv6->u)->f, sector_id, &buf[i*SECTOR_SIZE]);
+            if(write == ERR_NONE && dedup){
+                write = dedup_add(fv6->u, (uint32_t)sector_id, &buf[i*SECTOR_SIZE]);
+            }
+            if(write != ERR_NONE){
+                return write;
+            }
+        }
+        if(sector_id < 0){
+            return sector_id;
+        }
+        sectors[i] = (sector_addr_t)sector_id;
+    }
+
+    int grow = inode_grow(fv6->u, &(fv6->i_node), size_file + (int32_t)(count*SECTOR_SIZE));
+    if(grow != ERR_NONE){
+        return grow;
+    }
+    // the holes are already zero in the sector map
+    size_t i = 0;
+    while(i < count){
+        size_t run = 0;
+        while(i + run < count && sectors[i + run] != 0){
+            run++;
+        }
+        if(run > 0){
+            int set = inode_setsectors(fv6->u, &(fv6->i_node), size_file/SECTOR_SIZE + (int32_t)i, &sectors[i], run);
+            if(set != ERR_NONE){
+                return set;
+            }
+        }
+        i += run + 1;
+    }
+    return ERR_NONE;
+}
+
+
+// frees the sectors of cluster c (see dedup_release()), which becomes a hole; the next ones allocated start at its place
+static int filev6_free_cluster(struct filev6 *fv6, uint32_t c){
+    const size_t n = filev6_cluster_sectors(inode_getsize(&(fv6->i_node)), c);
+    sector_addr_t sectors[COMPR_CLUSTER_SECTORS];
+    int find = (n == 0) ? ERR_NONE : inode_findsectors(fv6->u, &(fv6->i_node), (int32_t)(c*COMPR_CLUSTER_SECTORS), sectors, n);
+    if(find != ERR_NONE){
+        return find;
+    }
+    int any = 0;
+    for(size_t k = 0; k < n; k++){
+        if(sectors[k] == 0){
+            continue;
+        }
+        any = 1;
+        int last_ref = dedup_release(fv6->u, sectors[k]);
+        if(last_ref < 0){
+            return last_ref;
+        }
+        if(last_ref){
+            if(fv6->alloc_hint == 0){
+                fv6->alloc_hint = sectors[k];
+            }
+            bm_clear(fv6->u->fbm, sectors[k]);
         }
-        bytes_writen = nb_bytes;
-        left_to_write -= nb_bytes;
-        size_file += nb_bytes;
     }
-    else{
-        nb_bytes = (left_to_write >= SECTOR_SIZE) ? SECTOR_SIZE : left_to_write;
+    const sector_addr_t no_address[COMPR_CLUSTER_SECTORS] = {0};
+    return any ? inode_setsectors(fv6->u, &(fv6->i_node), (int32_t)(c*COMPR_CLUSTER_SECTORS), no_address, n)
+               : ERR_NONE;
+}
 
-        int added_sector_id = bm_find_next((fv6->u)->fbm);
-        if(added_sector_id < (fv6->u)->s.s_block_start){       //then not a valid sector
-            return added_sector_id;
+/* writes the len bytes of data (COMPR_CLUSTER_SIZE, zeroes after them) as
+ * cluster c, a hole of the file: compressed if that saves a sector, else as
+ * is; in an ordinary file, the sectors of zeroes stay holes */
+static int filev6_write_cluster(struct filev6 *fv6, uint32_t c, const uint8_t *data, size_t len, int compressed){
+    const size_t n = (len + SECTOR_SIZE - 1)/SECTOR_SIZE;
+    if(filev6_is_zero(data, len)){
+        return ERR_NONE;
+    }
+    uint8_t stored[COMPR_CLUSTER_SIZE] = {0};
+    const uint8_t *src = data;
+    size_t m = n;
+    if(compressed && n > 1){
+        struct compr_header header;
+        // as is (length 0) if its block does not save a sector, or does not fit header.length
+        int length = lz4_compress(data, len, &stored[sizeof(header)],
+                                  MIN((n - 1)*SECTOR_SIZE - sizeof(header), UINT16_MAX));
+        if(length < 0){
+            return length;
+        }
+        if(length > 0){
+            header.length = (uint16_t)length;
+            memcpy(stored, &header, sizeof(header));
+            src = stored;
+            m = (sizeof(header) + (size_t)length + SECTOR_SIZE - 1)/SECTOR_SIZE;
         }
-        bm_set((fv6->u)->fbm, added_sector_id); 
+    }
 
-        uint8_t sector_to_write[SECTOR_SIZE] = {0};
-        memcpy(sector_to_write, &buf[bytes_writen], nb_bytes);
-        int write = sector_write((fv6->u)->f, added_sector_id, sector_to_write);
+    sector_addr_t sectors[COMPR_CLUSTER_SECTORS] = {0};
+    for(size_t k = 0; k < m; k++){
+        if(!compressed && filev6_is_zero(&src[k*SECTOR_SIZE], SECTOR_SIZE)){
+            continue;
+        }
+        int sector_id = filev6_alloc_sector(fv6);
+        if(sector_id < 0){
+            return sector_id;
+        }
+        int write = sector_write((fv6->u)->f, sector_id, &src[k*SECTOR_SIZE]);
         if(write != ERR_NONE){
             return write;
         }
+        sectors[k] = (sector_addr_t)sector_id;
+    }
+    int set = inode_setsectors(fv6->u, &(fv6->i_node), (int32_t)(c*COMPR_CLUSTER_SECTORS), sectors, n);
+    filev6_clusters_changed();
+    return set;
+}
 
-        int offset_sector = size_file/SECTOR_SIZE;
-        (fv6->i_node).i_addr[offset_sector] = added_sector_id;
+// filev6_append() to a compressed file: the last cluster, if partial, is written again with the new bytes
+static int filev6_append_compressed(struct filev6 *fv6, const uint8_t *bytes, size_t len){
+    uint8_t cluster[COMPR_CLUSTER_SIZE];
+    while(len > 0){
+        const int32_t size_file = inode_getsize(&(fv6->i_node));
+        const uint32_t c = (uint32_t)size_file/COMPR_CLUSTER_SIZE;
+        const size_t in_cluster = (size_t)size_file%COMPR_CLUSTER_SIZE;
+        const size_t nb_bytes = MIN(COMPR_CLUSTER_SIZE - in_cluster, len);
+
+        int err = filev6_read_cluster(fv6->u, &(fv6->i_node), c, cluster);
+        if(err == ERR_NONE){
+            err = filev6_free_cluster(fv6, c);
+        }
+        memcpy(&cluster[in_cluster], bytes, nb_bytes);
+        if(err == ERR_NONE){
+            err = inode_grow(fv6->u, &(fv6->i_node), size_file + (int32_t)nb_bytes);
+        }
+        if(err == ERR_NONE){
+            err = filev6_write_cluster(fv6, c, cluster, in_cluster + nb_bytes, 1);
+        }
+        if(err != ERR_NONE){
+            return err;
+        }
+        bytes += nb_bytes;
+        len -= nb_bytes;
     }
+    return ERR_NONE;
+}
 
-    return nb_bytes;
+// rewrites each cluster of the file in the other format, without writing the inode
+static int filev6_convert(struct filev6 *fv6, int compressed){
+    struct inode *i = &(fv6->i_node);
+    const int32_t size_file = inode_getsize(i);
+    const int32_t offset = fv6->offset;
+    uint8_t cluster[COMPR_CLUSTER_SIZE];
+    int err = ERR_NONE;
+    for(uint32_t c = 0; err == ERR_NONE && !(i->i_mode & IINLINE) && c*COMPR_CLUSTER_SIZE < (uint32_t)size_file; c++){
+        const size_t len = MIN(COMPR_CLUSTER_SIZE, (size_t)size_file - (size_t)c*COMPR_CLUSTER_SIZE);
+        if(compressed){ // an ordinary file is read as such
+            memset(cluster, 0, sizeof(cluster));
+            fv6->offset = (int32_t)(c*COMPR_CLUSTER_SIZE);
+            int read = filev6_readbytes(fv6, cluster, len);
+            err = read < 0 ? read : ERR_NONE;
+        }else{
+            err = filev6_read_cluster(fv6->u, i, c, cluster);
+        }
+        if(err == ERR_NONE){
+            err = filev6_free_cluster(fv6, c);
+        }
+        if(err == ERR_NONE){
+            err = filev6_write_cluster(fv6, c, cluster, len, compressed);
+        }
+    }
+    fv6->offset = offset;
+    if(err != ERR_NONE){
+        return err;
+    }
+    i->i_mode = (uint16_t)(compressed ? (i->i_mode | ICOMPR) : (i->i_mode & ~ICOMPR));
+    filev6_clusters_changed();
+    return ERR_NONE;
 }
 
+int filev6_set_compressed(struct filev6 *fv6, int compressed){
+    M_REQUIRE_NON_NULL(fv6);
+    FILEV6_TRACE_SUBSYS();
+
+    if((fv6->i_node.i_mode & IFMT) != 0){
+        return ERR_BAD_PARAMETER;
+    }
+    if(!(fv6->i_node.i_mode & ICOMPR) == !compressed){
+        return ERR_NONE;
+    }
+    int convert = filev6_convert(fv6, compressed);
+    if(convert != ERR_NONE){
+        return convert;
+    }
+    return inode_write(fv6->u, fv6->i_number, &(fv6->i_node));
+}
 
-int filev6_writebytes(struct filev6 *fv6, const void *buf, size_t len){
+int filev6_append(struct filev6 *fv6, const void *buf, size_t len){
     M_REQUIRE_NON_NULL(fv6);
     M_REQUIRE_NON_NULL(buf);
+    FILEV6_TRACE_SUBSYS();
 
+    const uint8_t *bytes = buf;
     size_t left_to_write = len;
-    size_t bytes_writen = 0;
 
     uint32_t size_file = inode_getsize(&(fv6->i_node));
-    if(size_file + len > (ADDR_SMALL_LENGTH-1)*ADDRESSES_PER_SECTOR*SECTOR_SIZE){ //file too large to fit
+    if(size_file + len > FILEV6_MAX_SIZE){ //file too large to fit
         return ERR_FILE_TOO_LARGE;
     }
-    if(size_file + len >= ADDR_SMALL_LENGTH*SECTOR_SIZE){
-        return ERR_FILE_TOO_LARGE; //we need to return an error because our function doesn't treat this case
+    if(filev6_fits_inline(fv6, (int64_t)size_file + (int64_t)len)){
+        return filev6_write_inline(fv6, (int32_t)size_file, buf, len);
+    }
+    int uninline = inode_uninline(fv6->u, &(fv6->i_node));
+    if(uninline != ERR_NONE){
+        return uninline;
+    }
+    if(filev6_is_compressed(&(fv6->i_node))){
+        return filev6_append_compressed(fv6, bytes, len);
     }
 
-    size_t nb_bytes = 0; 
     while(left_to_write != 0){
-        nb_bytes = filev6_writesector(fv6, buf, len, left_to_write, bytes_writen, size_file);
-        if(nb_bytes < 0){
-            return nb_bytes;
+        size_file = inode_getsize(&(fv6->i_node));
+        if(size_file%SECTOR_SIZE == 0 && left_to_write >= SECTOR_SIZE){
+            size_t count = MIN(left_to_write/SECTOR_SIZE, FILEV6_BATCH_SECTORS);
+            int write = filev6_writesectors(fv6, bytes, count);
+            if(write != ERR_NONE){
+                return write;
+            }
+            bytes += count*SECTOR_SIZE;
+            left_to_write -= count*SECTOR_SIZE;
+        }else{
+            int nb_bytes = filev6_writesector(fv6, bytes, left_to_write);
+            if(nb_bytes < 0){
+                return nb_bytes;
+            }
+            bytes += nb_bytes;  //we shift the pointer of buf by this value
+            left_to_write -= (size_t)nb_bytes;
         }
-
-        bytes_writen += nb_bytes;  //we shift the pointer of buf by this value
-        left_to_write -= nb_bytes;  
-        size_file += nb_bytes; //we update the size of the file to change the size of the inode in the end
     }
 
-    int set_size = inode_setsize(&(fv6->i_node), size_file);
-    if(set_size != ERR_NONE){
-        return set_size;
+    return ERR_NONE;
+}
+
+
+int filev6_writebytes(struct filev6 *fv6, const void *buf, size_t len){
+    M_REQUIRE_NON_NULL(fv6);
+    M_REQUIRE_NON_NULL(buf);
+
+    int append = filev6_append(fv6, buf, len);
+    if(append != ERR_NONE){
+        return append;
     }
 
     int write_inode = inode_write(fv6->u, fv6->i_number, &(fv6->i_node));
@@ -186,3 +759,145 @@ int filev6_writebytes(struct filev6 *fv6, const void *buf, size_t len){
 
     return ERR_NONE;
 }
+
+
+// overwrites at most one sector of the file, within its current size
+static int filev6_overwrite(struct filev6 *fv6, int32_t offset, const uint8_t *buf, size_t len){
+    int32_t size_file = inode_getsize(&(fv6->i_node));
+    int32_t file_sec_off = offset/SECTOR_SIZE;
+    size_t in_sector = (size_t)offset%SECTOR_SIZE;
+    size_t nb_bytes = MIN(MIN(SECTOR_SIZE - in_sector, len), (size_t)(size_file - offset));
+
+    int sector_id = inode_findsector(fv6->u, &(fv6->i_node), file_sec_off);
+    if(sector_id < 0){
+        return sector_id;
+    }
+    uint8_t sector[SECTOR_SIZE] = {0};
+    if(sector_id == 0){ // a hole, now backed by a sector
+        sector_id = filev6_alloc_sector(fv6);
+        if(sector_id < 0){
+            return sector_id;
+        }
+        sector_addr_t added_sector = (sector_addr_t)sector_id;
+        int set = inode_setsectors(fv6->u, &(fv6->i_node), file_sec_off, &added_sector, 1);
+        if(set != ERR_NONE){
+            return set;
+        }
+    }else{
+        if(nb_bytes < SECTOR_SIZE){
+            int read = sector_read((fv6->u)->f, sector_id, sector);
+            if(read != ERR_NONE){
+                return read;
+            }
+        }
+        sector_id = filev6_private_sector(fv6, file_sec_off, sector_id);
+        if(sector_id < 0){
+            return sector_id;
+        }
+    }
+
+    memcpy(&sector[in_sector], buf, nb_bytes);
+    int write = sector_write((fv6->u)->f, sector_id, sector);
+    return write == ERR_NONE ? (int)nb_bytes : write;
+}
+
+
+int filev6_writeat(struct filev6 *fv6, int32_t offset, const void *buf, size_t len){
+    M_REQUIRE_NON_NULL(fv6);
+    M_REQUIRE_NON_NULL(buf);
+    FILEV6_TRACE_SUBSYS();
+
+    if(offset < 0){
+        return ERR_BAD_PARAMETER;
+    }
+    if((int64_t)offset + (int64_t)len > FILEV6_MAX_SIZE){
+        return ERR_FILE_TOO_LARGE;
+    }
+    if(filev6_fits_inline(fv6, (int64_t)offset + (int64_t)len)){
+        int write = filev6_write_inline(fv6, offset, buf, len);
+        return write != ERR_NONE ? write : inode_write(fv6->u, fv6->i_number, &(fv6->i_node));
+    }
+    int uninline = inode_uninline(fv6->u, &(fv6->i_node));
+    if(uninline != ERR_NONE){
+        return uninline;
+    }
+
+    int32_t size_file = inode_getsize(&(fv6->i_node));
+    if((fv6->i_node.i_mode & (ICOMPR | IFMT)) == ICOMPR && offset != size_file){ // only the appends keep it compressed
+        int convert = filev6_convert(fv6, 0);
+        if(convert != ERR_NONE){
+            return convert;
+        }
+    }
+    if(offset > size_file){
+        // the gap is left as holes
+        int grow = inode_grow(fv6->u, &(fv6->i_node), offset);
+        if(grow != ERR_NONE){
+            return grow;
+        }
+        size_file = offset;
+    }
+
+    const uint8_t *bytes = buf;
+    while(len > 0 && offset < size_file){
+        int nb_bytes = filev6_overwrite(fv6, offset, bytes, len);
+        if(nb_bytes < 0){
+            return nb_bytes;
+        }
+        offset += nb_bytes;
+        bytes += nb_bytes;
+        len -= (size_t)nb_bytes;
+    }
+    int append = (len > 0) ? filev6_append(fv6, bytes, len) : ERR_NONE;
+    if(append != ERR_NONE){
+        return append;
+    }
+
+    return inode_write(fv6->u, fv6->i_number, &(fv6->i_node));
+}
+
+
+int filev6_truncate(struct filev6 *fv6, int32_t new_size){
+    M_REQUIRE_NON_NULL(fv6);
+    FILEV6_TRACE_SUBSYS();
+
+    if(new_size < 0){
+        return ERR_BAD_PARAMETER;
+    }
+    if(new_size > FILEV6_MAX_SIZE){
+        return ERR_FILE_TOO_LARGE;
+    }
+
+    int32_t size_file = inode_getsize(&(fv6->i_node));
+    int ret = ((fv6->i_node.i_mode & (ICOMPR | IFMT)) == ICOMPR) ? filev6_convert(fv6, 0) : ERR_NONE;
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    if(new_size >= size_file){
+        ret = inode_grow(fv6->u, &(fv6->i_node), new_size);
+    }else{
+        ret = inode_shrink(fv6->u, &(fv6->i_node), new_size);
+        if(ret == ERR_NONE && new_size%SECTOR_SIZE != 0 && !(fv6->i_node.i_mode & IINLINE)){
+            // the rest of the last sector must read as zeroes if the file grows again
+            int sector_id = inode_findsector(fv6->u, &(fv6->i_node), new_size/SECTOR_SIZE);
+            uint8_t sector[SECTOR_SIZE];
+            ret = sector_id <= 0 ? sector_id : sector_read((fv6->u)->f, (uint32_t)sector_id, sector);
+            if(sector_id > 0 && ret == ERR_NONE){
+                sector_id = filev6_private_sector(fv6, new_size/SECTOR_SIZE, sector_id);
+                ret = sector_id < 0 ? sector_id : ERR_NONE;
+            }
+            if(sector_id > 0 && ret == ERR_NONE){
+                memset(&sector[new_size%SECTOR_SIZE], 0, SECTOR_SIZE - (size_t)new_size%SECTOR_SIZE);
+                ret = sector_write((fv6->u)->f, (uint32_t)sector_id, sector);
+            }
+        }
+    }
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    if(fv6->offset > new_size){
+        fv6->offset = new_size;
+    }
+
+    return inode_write(fv6->u, fv6->i_number, &(fv6->i_node));
+}
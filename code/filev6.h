@@ -15,11 +15,16 @@
 extern "C" {
 #endif
 
+// largest size of a file (the sector map holds ADDR_SMALL_LENGTH-1 indirect sectors)
+#define FILEV6_INDIR_MAX_SIZE ((int64_t)(ADDR_DINDIRECT + ADDRESSES_PER_SECTOR)*ADDRESSES_PER_SECTOR*SECTOR_SIZE - 1)
+#define FILEV6_MAX_SIZE (FILEV6_INDIR_MAX_SIZE < INODE_MAX_SIZE ? FILEV6_INDIR_MAX_SIZE : INODE_MAX_SIZE)
+
 struct filev6 {
     struct unix_filesystem *u;    // the filesystem
     uint16_t i_number;            // the inode number (on disk)
     struct inode i_node;          // the content of the inode
     int32_t offset;               // the current cursor within the file (in bytes)
+    sector_addr_t alloc_hint;     // preferred disk sector for the next data sector (0: none)
 };
 
 /* *************************************************** *
@@ -57,6 +62,17 @@ int filev6_lseek(struct filev6 *fv6, int32_t offset);
  */
 int filev6_readblock(struct filev6 *fv6, void *buf);
 
+/**
+ * @brief read at most len bytes from the file at the current cursor, reading
+ *        the sectors that are consecutive on disk with one I/O
+ * @param fv6 the filev6 (IN-OUT; offset will be changed, must be a multiple of SECTOR_SIZE)
+ * @param buf points to len bytes of available memory (OUT)
+ * @param len the number of bytes wanted
+ * @return >0: the number of bytes of the file read; 0: end of file;
+ *             the appropriate error code (<0) on error
+ */
+int filev6_readbytes(struct filev6 *fv6, void *buf, size_t len);
+
 /* *************************************************** *
  * TODO WEEK 1										   *
  * *************************************************** */
@@ -82,6 +98,58 @@ int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6);
  */
 int filev6_writebytes(struct filev6 *fv6, const void *buf, size_t len);
 
+/**
+ * @brief append the len bytes of the given buffer to the given filev6, like
+ *        filev6_writebytes() but without writing the inode back to disk:
+ *        fv6->i_node is updated and the caller is in charge of inode_write()
+ * @param fv6 the filev6 (IN-OUT)
+ * @param buf the data we want to write (IN)
+ * @param len the length of the bytes we want to write
+ * @return 0 on success; <0 on error
+ */
+int filev6_append(struct filev6 *fv6, const void *buf, size_t len);
+
+/**
+ * @brief write len bytes at the given offset of the file, growing it if
+ *        needed; a gap between the end of the file and offset is left as
+ *        holes (no sector allocated, reads as zeroes). The inode is written
+ *        back to disk.
+ * @param fv6 the filev6 (IN-OUT; the cursor is not changed)
+ * @param offset the byte offset where to write, any alignment
+ * @param buf the data we want to write (IN)
+ * @param len the length of the bytes we want to write
+ * @return 0 on success; <0 on error
+ */
+int filev6_writeat(struct filev6 *fv6, int32_t offset, const void *buf, size_t len);
+
+/**
+ * @brief set the size of the file: growing it adds holes, shrinking it
+ *        frees the sectors past the new end. The inode is written back to disk.
+ * @param fv6 the filev6 (IN-OUT; the cursor is moved back to the new end if past it)
+ * @param new_size the new size in bytes
+ * @return 0 on success; <0 on error
+ */
+int filev6_truncate(struct filev6 *fv6, int32_t new_size);
+
+/**
+ * @brief store a regular file in compressed clusters (ICOMPR), or back as an
+ *        ordinary one, rewriting its data cluster by cluster; a cluster is
+ *        compressed only if that saves a sector. The inode is written back to disk.
+ *        Once compressed, the appends keep compressing the file; the other
+ *        writes (filev6_writeat() but at the end, filev6_truncate()) store it
+ *        back as an ordinary file first.
+ * @param fv6 the filev6 (IN-OUT; the cursor is not changed)
+ * @param compressed 1 to compress the file, 0 to uncompress it
+ * @return 0 on success; <0 on error (ERR_BAD_PARAMETER if not a regular file)
+ */
+int filev6_set_compressed(struct filev6 *fv6, int compressed);
+
+/**
+ * @brief to be called when a filesystem is (un)mounted: drops the clusters
+ *        of compressed files cached by all the threads
+ */
+void filev6_clusters_changed(void);
+
 
 #ifdef __cplusplus
 }
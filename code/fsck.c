@@ -0,0 +1,730 @@
+/**
+ * @file fsck.c
+ * @brief consistency checker of a mounted UV6 filesystem
+ *
+ * Pass 1 runs on a pool of threads, each taking ranges of inode sectors: the
+ * block maps are walked and every sector they use is marked in a bitmap of
+ * the disk (a bit already set is a sector used twice), and the entries of
+ * the directories are read. The inodes found bad are only marked, so that
+ * pass 2 reports (and repairs) them in inode order on one thread. Pass 3
+ * walks the directories from the root.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "error.h"
+#include "mount.h"
+#include "sector.h"
+#include "inode.h"
+#include "bmblock.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "fsck.h"
+#include "dedup.h"
+#include "snapshot.h"
+#include "util.h"
+
+#define SUCCESS 1
+#define FSCK_BATCH_SECTORS 16   // inode sectors taken by a worker at once
+#define FSCK_NB_INDIR ADDR_DINDIRECT
+#define FSCK_MAX_SECTORS ((int32_t)(FSCK_NB_INDIR + ADDRESSES_PER_SECTOR)*ADDRESSES_PER_SECTOR)
+#define FSCK_DIR_MODE (IFDIR | IREAD | IWRITE | IEXEC)
+
+// what a sector address points at, from the bottom of the block map
+enum fsck_kind { FSCK_DATA, FSCK_INDIRECT, FSCK_DINDIRECT };
+static const char * const FSCK_KIND_NAMES[] = { "data", "indirect", "double-indirect" };
+
+struct fsck_entry {
+    uint16_t parent;
+    uint16_t child;     // 0 once removed
+    char name[DIRENT_MAXLEN+1];
+};
+
+struct fsck_worker {
+    struct fsck_ctx *ctx;
+    struct fsck_entry *entries;     // of the directories it read
+    size_t nb_entries;
+    size_t max_entries;
+    int error;
+};
+
+struct fsck_dup {
+    uint32_t sector;
+    uint16_t owner;     // first inode met using it in pass 2 (0: none yet)
+};
+
+struct fsck_ctx {
+    struct unix_filesystem *u;
+    int repair;
+    uint32_t nb_inodes;
+    uint32_t next_sector;   // next inode sector to hand out in pass 1
+
+    // one bit per inode
+    uint64_t *allocated;
+    uint64_t *dirs;
+    uint64_t *bad;          // problem in the size or the block map
+    uint64_t *unread;       // directory whose entries could not be read
+    uint64_t *reached;      // from the root
+    // one bit per sector of the disk
+    uint64_t *used;
+    uint64_t *shared;       // used more than once
+
+    struct fsck_dup *dups;  // the shared sectors, in increasing order
+    size_t nb_dups;
+    unsigned long problems;
+    unsigned long repaired;
+
+    struct fsck_worker workers[FSCK_MAX_THREADS];
+    int nb_workers;
+};
+
+
+/* the bitmaps are written by several threads in pass 1 */
+
+static int fsck_test(const uint64_t *bm, uint32_t x){
+    return (int)((__atomic_load_n(&bm[x/64], __ATOMIC_RELAXED) >> (x%64)) & 1);
+}
+
+// sets the bit, returns its previous value
+static int fsck_test_and_set(uint64_t *bm, uint32_t x){
+    const uint64_t bit = UINT64_C(1) << (x%64);
+    return (__atomic_fetch_or(&bm[x/64], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+static unsigned long fsck_count(const uint64_t *bm, size_t nb_words){
+    unsigned long count = 0;
+    for(size_t k = 0; k < nb_words; k++){
+        count += (unsigned long)__builtin_popcountll(bm[k]);
+    }
+    return count;
+}
+
+static void fsck_problem(struct fsck_ctx *ctx, const char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    pps_printf("fsck: ");
+    vprintf(fmt, ap);
+    pps_printf("\n");
+    va_end(ap);
+    ctx->problems++;
+}
+
+static int fsck_valid(const struct fsck_ctx *ctx, uint32_t sector){
+    return sector >= ctx->u->s.s_block_start && sector < ctx->u->s.s_fsize;
+}
+
+// what is wrong with the size of an inode, NULL if nothing
+static const char *fsck_bad_size(const struct inode *i){
+    const int32_t size = inode_getsize(i);
+    if(i->i_mode & IINLINE){
+        return size > (int32_t)sizeof(i->i_addr) ? "inline file larger than i_addr" : NULL;
+    }
+    return (size + SECTOR_SIZE - 1)/SECTOR_SIZE > FSCK_MAX_SECTORS ? "size beyond the block map" : NULL;
+}
+
+
+/* ************************************************************************** *
+ * Block maps
+ * ************************************************************************** */
+
+// called on each address of a block map (holes included), may change *addr and
+// then sets *changed: returns 1 to go through the sector (if not a data one), 0 not to
+typedef int (*fsck_visit_t)(struct fsck_ctx *ctx, uint16_t inr, sector_addr_t *addr, enum fsck_kind kind,
+                            int *changed);
+
+// the sector at *addr and those below it, mapping nb data sectors
+static int fsck_walk_sector(struct fsck_ctx *ctx, uint16_t inr, sector_addr_t *addr, enum fsck_kind kind,
+                            int32_t nb, fsck_visit_t visit, int *changed){
+    int ret = visit(ctx, inr, addr, kind, changed);
+    if(ret <= 0 || kind == FSCK_DATA){
+        return ret < 0 ? ret : ERR_NONE;
+    }
+
+    sector_addr_t addresses[ADDRESSES_PER_SECTOR];
+    ret = sector_read(ctx->u->f, *addr, addresses);
+    const int32_t per_address = (kind == FSCK_DINDIRECT) ? ADDRESSES_PER_SECTOR : 1;
+    int sub_changed = 0;
+    for(int32_t k = 0; ret == ERR_NONE && k*per_address < nb; k++){
+        ret = fsck_walk_sector(ctx, inr, &addresses[k], (enum fsck_kind)(kind - 1),
+                               MIN(per_address, nb - k*per_address), visit, &sub_changed);
+    }
+    if(ret == ERR_NONE && sub_changed){
+        ret = sector_write(ctx->u->f, *addr, addresses);
+        inode_indirect_changed();
+    }
+    return ret;
+}
+
+// the whole block map of an inode, as laid out by inode_findsector()
+static int fsck_walk(struct fsck_ctx *ctx, uint16_t inr, struct inode *i, fsck_visit_t visit, int *changed){
+    if(i->i_mode & IINLINE){ // no sector
+        return ERR_NONE;
+    }
+    const int32_t size = inode_getsize(i);
+    const int32_t nb = MIN((size + SECTOR_SIZE - 1)/SECTOR_SIZE, FSCK_MAX_SECTORS);
+    int ret = ERR_NONE;
+    if(size < ADDR_SMALL_LENGTH*SECTOR_SIZE){
+        for(int32_t k = 0; ret == ERR_NONE && k < nb; k++){
+            ret = fsck_walk_sector(ctx, inr, &(i->i_addr[k]), FSCK_DATA, 1, visit, changed);
+        }
+        return ret;
+    }
+    for(int32_t k = 0; ret == ERR_NONE && k < FSCK_NB_INDIR && k*ADDRESSES_PER_SECTOR < nb; k++){
+        ret = fsck_walk_sector(ctx, inr, &(i->i_addr[k]), FSCK_INDIRECT,
+                               MIN(ADDRESSES_PER_SECTOR, nb - k*ADDRESSES_PER_SECTOR), visit, changed);
+    }
+    if(ret == ERR_NONE && nb > FSCK_NB_INDIR*ADDRESSES_PER_SECTOR){
+        ret = fsck_walk_sector(ctx, inr, &(i->i_addr[ADDR_DINDIRECT]), FSCK_DINDIRECT,
+                               nb - FSCK_NB_INDIR*ADDRESSES_PER_SECTOR, visit, changed);
+    }
+    return ret;
+}
+
+
+/* ************************************************************************** *
+ * Pass 1: the inode table, in parallel
+ * ************************************************************************** */
+
+static int fsck_scan_visit(struct fsck_ctx *ctx, uint16_t inr, sector_addr_t *addr, enum fsck_kind kind,
+                           int *changed){
+    (void)kind;
+    (void)changed;
+    if(*addr == 0){ // a hole
+        return 0;
+    }
+    if(!fsck_valid(ctx, *addr)){
+        fsck_test_and_set(ctx->bad, inr);
+        return 0;
+    }
+    if(fsck_test_and_set(ctx->used, *addr)){
+        fsck_test_and_set(ctx->shared, *addr);
+    }
+    return 1;
+}
+
+static int fsck_add_entry(struct fsck_worker *w, uint16_t parent, uint16_t child, const char *name){
+    if(w->nb_entries == w->max_entries){
+        size_t max = MAX(2*w->max_entries, 256);
+        struct fsck_entry *entries = realloc(w->entries, max*sizeof(struct fsck_entry));
+        if(entries == NULL){
+            return ERR_NOMEM;
+        }
+        w->entries = entries;
+        w->max_entries = max;
+    }
+    struct fsck_entry *e = &w->entries[w->nb_entries++];
+    e->parent = parent;
+    e->child = child;
+    strncpy(e->name, name, DIRENT_MAXLEN);
+    e->name[DIRENT_MAXLEN] = '\0';
+    return ERR_NONE;
+}
+
+// a directory that cannot be read is marked, only a lack of memory fails
+static int fsck_read_dir(struct fsck_worker *w, uint16_t inr){
+    struct directory_reader d;
+    char name[DIRENT_MAXLEN+1] = {0};
+    uint16_t child = 0;
+    int ret = direntv6_opendir(w->ctx->u, inr, &d);
+    while(ret == ERR_NONE && (ret = direntv6_readdir(&d, name, &child)) == SUCCESS){
+        ret = fsck_add_entry(w, inr, child, name);
+    }
+    if(ret == ERR_NOMEM){
+        return ret;
+    }
+    if(ret < 0){
+        fsck_test_and_set(w->ctx->unread, inr);
+    }
+    return ERR_NONE;
+}
+
+static int fsck_scan_inode(struct fsck_worker *w, uint16_t inr, struct inode *i){
+    struct fsck_ctx *ctx = w->ctx;
+    if(!(i->i_mode & IALLOC)){
+        return ERR_NONE;
+    }
+    fsck_test_and_set(ctx->allocated, inr);
+    if(fsck_bad_size(i) != NULL){
+        fsck_test_and_set(ctx->bad, inr);
+    }
+    int changed = 0;
+    int ret = fsck_walk(ctx, inr, i, fsck_scan_visit, &changed);
+    if(ret != ERR_NONE || !(i->i_mode & IFDIR)){
+        return ret;
+    }
+    fsck_test_and_set(ctx->dirs, inr);
+    // with a bad block map, read in pass 2 once repaired
+    return fsck_test(ctx->bad, inr) ? ERR_NONE : fsck_read_dir(w, inr);
+}
+
+static void *fsck_worker_run(void *arg){
+    struct fsck_worker *w = arg;
+    struct fsck_ctx *ctx = w->ctx;
+    const struct superblock *s = &(ctx->u->s);
+
+    ARENA_SCOPE(scratch);
+    struct inode_sector *batch = arena_alloc(scratch, FSCK_BATCH_SECTORS*sizeof(struct inode_sector));
+    if(batch == NULL){
+        w->error = ERR_NOMEM;
+        return NULL;
+    }
+    for(;;){
+        const uint32_t first = __atomic_fetch_add(&ctx->next_sector, FSCK_BATCH_SECTORS, __ATOMIC_RELAXED);
+        if(first >= s->s_isize){
+            break;
+        }
+        const uint32_t count = MIN(FSCK_BATCH_SECTORS, s->s_isize - first);
+        int ret = sector_read_many(ctx->u->f, s->s_inode_start + first, count, batch);
+        for(uint32_t k = 0; ret == ERR_NONE && k < count*INODES_PER_SECTOR; k++){
+            const uint32_t inr = first*(uint32_t)INODES_PER_SECTOR + k;
+            if(inr >= ROOT_INUMBER){
+                ret = fsck_scan_inode(w, (uint16_t)inr, &(batch[k/INODES_PER_SECTOR].inodes[k%INODES_PER_SECTOR]));
+            }
+        }
+        if(ret != ERR_NONE){
+            w->error = ret;
+            break;
+        }
+    }
+    return NULL;
+}
+
+
+/* ************************************************************************** *
+ * Pass 2: the bad inodes and the shared sectors, in inode order
+ * ************************************************************************** */
+
+static struct fsck_dup *fsck_find_dup(struct fsck_ctx *ctx, uint32_t sector){
+    size_t lo = 0;
+    size_t hi = ctx->nb_dups;
+    while(lo + 1 < hi){
+        const size_t mid = (lo + hi)/2;
+        if(ctx->dups[mid].sector <= sector){
+            lo = mid;
+        }else{
+            hi = mid;
+        }
+    }
+    return &ctx->dups[lo];
+}
+
+// a free sector, neither used nor the one of a bad address
+static int fsck_alloc_sector(struct fsck_ctx *ctx){
+    for(;;){
+        int sector = bm_find_next(ctx->u->fbm);
+        if(sector < 0){
+            return sector;
+        }
+        bm_set(ctx->u->fbm, (uint64_t)sector);
+        if(fsck_valid(ctx, (uint32_t)sector) && !fsck_test_and_set(ctx->used, (uint32_t)sector)){
+            return sector;
+        }
+    }
+}
+
+static int fsck_fix_visit(struct fsck_ctx *ctx, uint16_t inr, sector_addr_t *addr, enum fsck_kind kind,
+                          int *changed){
+    if(*addr == 0){
+        return 0;
+    }
+    if(!fsck_valid(ctx, *addr)){
+        fsck_problem(ctx, "inode %" PRIu16 ": %s sector %" PRIsector " out of the data region",
+                     inr, FSCK_KIND_NAMES[kind], *addr);
+        if(ctx->repair){
+            *addr = 0;
+            *changed = 1;
+            ctx->repaired++;
+        }
+        return 0;
+    }
+    if(!fsck_test(ctx->shared, *addr) || (kind == FSCK_DATA && dedup_shared(ctx->u, *addr))){
+        return 1; // a data sector may be shared on purpose
+    }
+
+    struct fsck_dup *dup = fsck_find_dup(ctx, *addr);
+    if(dup->owner == 0){
+        dup->owner = inr;
+        return 1;
+    }
+    fsck_problem(ctx, "inode %" PRIu16 ": %s sector %" PRIsector " already used by inode %" PRIu16,
+                 inr, FSCK_KIND_NAMES[kind], *addr, dup->owner);
+    if(!ctx->repair){
+        return 1;
+    }
+    // this inode gets its own copy
+    uint8_t data[SECTOR_SIZE];
+    int copy = fsck_alloc_sector(ctx);
+    int ret = (copy < 0) ? copy : sector_read(ctx->u->f, *addr, data);
+    if(ret == ERR_NONE){
+        ret = sector_write(ctx->u->f, (uint32_t)copy, data);
+    }
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    *addr = (sector_addr_t)copy;
+    *changed = 1;
+    ctx->repaired++;
+    return 1;
+}
+
+static int fsck_fix_inode(struct fsck_ctx *ctx, uint16_t inr){
+    struct inode i;
+    int ret = inode_read(ctx->u, inr, &i);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    int changed = 0;
+    const char *bad_size = fsck_bad_size(&i);
+    if(bad_size != NULL){
+        fsck_problem(ctx, "inode %" PRIu16 ": %s (%" PRId32 " bytes)", inr, bad_size, inode_getsize(&i));
+        if(ctx->repair){
+            // what the block map can address, within what i_size0/i_size1 can hold
+            const uint64_t max_size = MIN((uint64_t)FSCK_MAX_SECTORS*SECTOR_SIZE, (uint64_t)INODE_MAX_SIZE);
+            ret = inode_setsize(&i, (i.i_mode & IINLINE) ? (int)sizeof(i.i_addr) : (int)max_size);
+            if(ret != ERR_NONE){
+                return ret;
+            }
+            changed = 1;
+            ctx->repaired++;
+        }
+    }
+    ret = fsck_walk(ctx, inr, &i, fsck_fix_visit, &changed);
+    if(ret == ERR_NONE && changed){
+        ret = inode_write(ctx->u, inr, &i);
+    }
+    // its entries were not read in pass 1
+    if(ret == ERR_NONE && ctx->repair && fsck_test(ctx->bad, inr) && fsck_test(ctx->dirs, inr)){
+        ret = fsck_read_dir(&ctx->workers[0], inr);
+    }
+    return ret;
+}
+
+static int fsck_pass2(struct fsck_ctx *ctx, struct arena *scratch){
+    const uint32_t nb_sectors = ctx->u->s.s_fsize;
+    for(uint32_t s = 0; s < nb_sectors; s++){
+        ctx->nb_dups += (size_t)fsck_test(ctx->shared, s);
+    }
+    if(ctx->nb_dups > 0){
+        ctx->dups = arena_calloc(scratch, ctx->nb_dups, sizeof(struct fsck_dup));
+        if(ctx->dups == NULL){
+            return ERR_NOMEM;
+        }
+        size_t k = 0;
+        for(uint32_t s = 0; s < nb_sectors; s++){
+            if(fsck_test(ctx->shared, s)){
+                ctx->dups[k++].sector = s;
+            }
+        }
+    }
+
+    // the first user of a shared sector is the one met first: all the inodes are seen
+    int ret = ERR_NONE;
+    for(uint32_t inr = ROOT_INUMBER; ret == ERR_NONE && inr < ctx->nb_inodes; inr++){
+        if(fsck_test(ctx->bad, inr) || (ctx->nb_dups > 0 && fsck_test(ctx->allocated, inr))){
+            ret = fsck_fix_inode(ctx, (uint16_t)inr);
+        }
+    }
+    return ret;
+}
+
+
+/* ************************************************************************** *
+ * Bitmaps
+ * ************************************************************************** */
+
+// the bitmaps of the mount against what pass 1 found
+static void fsck_check_bitmaps(struct fsck_ctx *ctx){
+    const struct superblock *s = &(ctx->u->s);
+    unsigned long sectors_free = 0;
+    unsigned long sectors_lost = 0;
+    for(uint32_t sector = s->s_block_start; sector < s->s_fsize; sector++){
+        const int in_bm = bm_get(ctx->u->fbm, sector) == 1;
+        const int in_use = fsck_test(ctx->used, sector);
+        sectors_free += (in_use && !in_bm);
+        sectors_lost += (!in_use && in_bm);
+    }
+    unsigned long inodes_free = 0;
+    unsigned long inodes_lost = 0;
+    for(uint32_t inr = ROOT_INUMBER; inr < ctx->nb_inodes; inr++){
+        const int in_bm = bm_get(ctx->u->ibm, inr) == 1;
+        const int in_use = fsck_test(ctx->allocated, inr);
+        inodes_free += (in_use && !in_bm);
+        inodes_lost += (!in_use && in_bm);
+    }
+
+    if(sectors_free > 0){
+        fsck_problem(ctx, "bitmap: %lu sectors in use marked free", sectors_free);
+        ctx->repaired += (ctx->repair != 0);
+    }
+    if(sectors_lost > 0){
+        fsck_problem(ctx, "bitmap: %lu sectors not used marked in use", sectors_lost);
+        ctx->repaired += (ctx->repair != 0);
+    }
+    if(inodes_free > 0){
+        fsck_problem(ctx, "bitmap: %lu inodes in use marked free", inodes_free);
+        ctx->repaired += (ctx->repair != 0);
+    }
+    if(inodes_lost > 0){
+        fsck_problem(ctx, "bitmap: %lu unallocated inodes marked in use", inodes_lost);
+        ctx->repaired += (ctx->repair != 0);
+    }
+}
+
+// once pass 2 is done: the bitmaps of the mount become what is in use
+static void fsck_sync_bitmaps(struct fsck_ctx *ctx){
+    for(uint64_t sector = ctx->u->fbm->min; sector <= ctx->u->fbm->max; sector++){
+        if(sector < ctx->u->s.s_fsize && fsck_test(ctx->used, (uint32_t)sector)){
+            bm_set(ctx->u->fbm, sector);
+        }else{
+            bm_clear(ctx->u->fbm, sector);
+        }
+    }
+    for(uint64_t inr = ctx->u->ibm->min; inr <= ctx->u->ibm->max; inr++){
+        if(inr < ctx->nb_inodes && fsck_test(ctx->allocated, (uint32_t)inr)){
+            bm_set(ctx->u->ibm, inr);
+        }else{
+            bm_clear(ctx->u->ibm, inr);
+        }
+    }
+}
+
+
+/* ************************************************************************** *
+ * Pass 3: the directories, from the root
+ * ************************************************************************** */
+
+// the entries of all the workers grouped by directory (in the order read),
+// the ones of directory inr being entries[first[inr]..first[inr+1]-1]
+static int fsck_group_entries(struct fsck_ctx *ctx, struct arena *scratch, struct fsck_entry **entries,
+                              uint32_t **first){
+    size_t total = 0;
+    for(int t = 0; t < ctx->nb_workers; t++){
+        total += ctx->workers[t].nb_entries;
+    }
+    *entries = arena_calloc(scratch, total + 1, sizeof(struct fsck_entry));
+    *first = arena_calloc(scratch, ctx->nb_inodes + 1, sizeof(uint32_t));
+    if(*entries == NULL || *first == NULL){
+        return ERR_NOMEM;
+    }
+
+    // a counting sort: next[inr] goes from the first entry of inr to the
+    // first one of inr+1, then the array is shifted by one
+    uint32_t *next = *first;
+    for(int t = 0; t < ctx->nb_workers; t++){
+        for(size_t k = 0; k < ctx->workers[t].nb_entries; k++){
+            next[ctx->workers[t].entries[k].parent + 1]++;
+        }
+    }
+    for(uint32_t inr = 0; inr < ctx->nb_inodes; inr++){
+        next[inr + 1] += next[inr];
+    }
+    for(int t = 0; t < ctx->nb_workers; t++){
+        for(size_t k = 0; k < ctx->workers[t].nb_entries; k++){
+            const struct fsck_entry *e = &ctx->workers[t].entries[k];
+            (*entries)[next[e->parent]++] = *e;
+        }
+    }
+    memmove(&next[1], &next[0], ctx->nb_inodes*sizeof(uint32_t));
+    next[0] = 0;
+    return ERR_NONE;
+}
+
+// marks what is reachable from the directories in queue[0..nb-1]
+static void fsck_reach(struct fsck_ctx *ctx, const struct fsck_entry *entries, const uint32_t *first,
+                       uint16_t *queue, size_t nb){
+    for(size_t head = 0; head < nb; head++){
+        const uint16_t dir = queue[head];
+        for(uint32_t k = first[dir]; k < first[dir + 1]; k++){
+            const uint16_t child = entries[k].child;
+            if(child != 0 && !fsck_test_and_set(ctx->reached, child) && fsck_test(ctx->dirs, child)){
+                queue[nb++] = child;
+            }
+        }
+    }
+}
+
+// an inode not reachable from the root, linked in FSCK_LOST_FOUND by the
+// repair: what is below it is marked reached with it
+static int fsck_orphan(struct fsck_ctx *ctx, const struct fsck_entry *entries, const uint32_t *first,
+                       uint16_t *queue, uint16_t inr, int *lost_found){
+    const unsigned long before = fsck_count(ctx->reached, ctx->nb_inodes/64 + 1);
+    fsck_test_and_set(ctx->reached, inr);
+    queue[0] = inr;
+    fsck_reach(ctx, entries, first, queue, fsck_test(ctx->dirs, inr) ? 1 : 0);
+    fsck_problem(ctx, "inode %" PRIu16 ": not reachable from the root (%lu inodes below)",
+                 inr, fsck_count(ctx->reached, ctx->nb_inodes/64 + 1) - before - 1);
+    if(!ctx->repair){
+        return ERR_NONE;
+    }
+
+    if(*lost_found == 0){
+        int ret = direntv6_dirlookup(ctx->u, ROOT_INUMBER, FSCK_LOST_FOUND);
+        if(ret == ERR_NO_SUCH_FILE){
+            ret = direntv6_create(ctx->u, FSCK_LOST_FOUND, FSCK_DIR_MODE);
+        }
+        if(ret < 0){
+            return ret;
+        }
+        *lost_found = ret;
+    }
+    char name[DIRENT_MAXLEN+1];
+    snprintf(name, sizeof(name), "#%" PRIu16, inr);
+    int ret = direntv6_link(ctx->u, (uint16_t)*lost_found, name, inr);
+    ctx->repaired += (ret == ERR_NONE);
+    return ret;
+}
+
+static int fsck_pass3(struct fsck_ctx *ctx, struct arena *scratch){
+    if(!fsck_test(ctx->dirs, ROOT_INUMBER)){
+        fsck_problem(ctx, "inode %d: the root is not a directory", ROOT_INUMBER);
+        return ERR_NONE;
+    }
+    struct fsck_entry *entries = NULL;
+    uint32_t *first = NULL;
+    int ret = fsck_group_entries(ctx, scratch, &entries, &first);
+    uint16_t *queue = arena_calloc(scratch, ctx->nb_inodes, sizeof(uint16_t));
+    if(ret != ERR_NONE || queue == NULL){
+        return ERR_NOMEM;
+    }
+
+    for(uint32_t inr = ROOT_INUMBER; inr < ctx->nb_inodes; inr++){
+        if(fsck_test(ctx->unread, inr)){
+            fsck_problem(ctx, "directory %" PRIu32 ": its entries cannot be read", inr);
+        }
+    }
+    for(uint32_t k = 0; ret == ERR_NONE && k < first[ctx->nb_inodes]; k++){
+        struct fsck_entry *e = &entries[k];
+        if(e->child < ctx->nb_inodes && fsck_test(ctx->allocated, e->child)){
+            continue;
+        }
+        fsck_problem(ctx, "directory %" PRIu16 ": entry %s points at unallocated inode %" PRIu16,
+                     e->parent, e->name, e->child);
+        if(ctx->repair){
+            ret = direntv6_unlink(ctx->u, e->parent, e->name);
+            ctx->repaired += (ret == ERR_NONE);
+        }
+        e->child = 0;
+    }
+
+    fsck_test_and_set(ctx->reached, ROOT_INUMBER);
+    queue[0] = ROOT_INUMBER;
+    fsck_reach(ctx, entries, first, queue, 1);
+
+    uint64_t *referenced = arena_calloc(scratch, ctx->nb_inodes/64 + 1, sizeof(uint64_t));
+    if(referenced == NULL){
+        return ERR_NOMEM;
+    }
+    for(uint32_t k = 0; k < first[ctx->nb_inodes]; k++){
+        if(entries[k].child != 0){
+            fsck_test_and_set(referenced, entries[k].child);
+        }
+    }
+    // the tops of the unreachable trees, then what is left: directories in a loop
+    int lost_found = 0;
+    for(int loops = 0; loops <= 1; loops++){
+        for(uint32_t inr = ROOT_INUMBER + 1; ret == ERR_NONE && inr < ctx->nb_inodes; inr++){
+            if(fsck_test(ctx->allocated, inr) && !fsck_test(ctx->reached, inr)
+               && (loops || !fsck_test(referenced, inr))){
+                ret = fsck_orphan(ctx, entries, first, queue, (uint16_t)inr, &lost_found);
+            }
+        }
+    }
+    return ret;
+}
+
+
+int fsck_run(struct unix_filesystem *u, int repair, int nb_threads){
+    M_REQUIRE_NON_NULL(u);
+    if(nb_threads < 1 || nb_threads > FSCK_MAX_THREADS){
+        return ERR_BAD_PARAMETER;
+    }
+    // pass 1 reads the inode table from the disk
+    int ret = inode_wb_flush(u);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    ARENA_SCOPE(scratch);
+    struct fsck_ctx *ctx = arena_calloc(scratch, 1, sizeof(struct fsck_ctx));
+    if(ctx == NULL){
+        return ERR_NOMEM;
+    }
+    ctx->u = u;
+    ctx->repair = repair;
+    ctx->nb_inodes = u->s.s_isize*INODES_PER_SECTOR;
+    ctx->nb_workers = nb_threads;
+    const size_t inode_words = ctx->nb_inodes/64 + 1;
+    const size_t sector_words = (size_t)u->s.s_fsize/64 + 1;
+    uint64_t **bitmaps[] = { &ctx->allocated, &ctx->dirs, &ctx->bad, &ctx->unread, &ctx->reached,
+                             &ctx->used, &ctx->shared };
+    for(size_t k = 0; k < sizeof(bitmaps)/sizeof(bitmaps[0]); k++){
+        const size_t nb_words = (bitmaps[k] == &ctx->used || bitmaps[k] == &ctx->shared) ? sector_words : inode_words;
+        *bitmaps[k] = arena_calloc(scratch, nb_words, sizeof(uint64_t));
+        if(*bitmaps[k] == NULL){
+            return ERR_NOMEM;
+        }
+    }
+    // the checksums and the dedup entries are in use, though no inode has them
+    for(uint32_t k = 0; k < u->s.s_csum_size && u->s.s_csum_start != 0; k++){
+        fsck_test_and_set(ctx->used, (uint32_t)u->s.s_csum_start + k);
+    }
+    for(uint32_t k = 0; k < u->s.s_dedup_size && u->s.s_dedup_start != 0; k++){
+        fsck_test_and_set(ctx->used, (uint32_t)u->s.s_dedup_start + k);
+    }
+
+    pthread_t threads[FSCK_MAX_THREADS];
+    int started = 1;
+    for(int t = 0; t < nb_threads; t++){
+        ctx->workers[t].ctx = ctx;
+    }
+    for(; started < nb_threads; started++){
+        if(pthread_create(&threads[started], NULL, fsck_worker_run, &ctx->workers[started])){
+            break;
+        }
+    }
+    fsck_worker_run(&ctx->workers[0]);
+    for(int t = 1; t < started; t++){
+        pthread_join(threads[t], NULL);
+    }
+    for(int t = 0; t < nb_threads && ret == ERR_NONE; t++){
+        ret = ctx->workers[t].error;
+    }
+
+    // so are the sectors of the snapshots, once the files have claimed theirs
+    for(uint32_t sector = u->s.s_block_start; sector < u->s.s_fsize && u->snap != NULL; sector++){
+        if(snapshot_keeps(u, sector)){
+            (void)fsck_test_and_set(ctx->used, sector);
+        }
+    }
+
+    if(ret == ERR_NONE){
+        fsck_check_bitmaps(ctx);
+        ret = fsck_pass2(ctx, scratch);
+    }
+    if(ret == ERR_NONE && repair){
+        fsck_sync_bitmaps(ctx);
+    }
+    if(ret == ERR_NONE){
+        ret = fsck_pass3(ctx, scratch);
+    }
+
+    if(ret == ERR_NONE){
+        pps_printf("fsck: %lu inodes, %lu sectors in use, %lu problems, %lu repaired\n",
+                   fsck_count(ctx->allocated, inode_words), fsck_count(ctx->used, sector_words),
+                   ctx->problems, ctx->repaired);
+        if(ctx->problems > ctx->repaired){
+            ret = ERR_INCONSISTENT_FS;
+        }
+    }
+    for(int t = 0; t < nb_threads; t++){
+        free(ctx->workers[t].entries);
+    }
+    return ret;
+}
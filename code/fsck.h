@@ -0,0 +1,29 @@
+#pragma once
+
+/**
+ * @file fsck.h
+ * @brief consistency checker of a mounted UV6 filesystem
+ */
+
+#include "mount.h"
+
+#define FSCK_MAX_THREADS 64
+#define FSCK_LOST_FOUND "/lost+found"  /* where the repair links the orphan inodes */
+
+/**
+ * @brief check a filesystem and print each problem found: sector addresses
+ *        out of the data region, sectors used twice, directory entries
+ *        pointing at unallocated inodes, inodes not reachable from the root,
+ *        and differences with the bitmaps built by mountv6(). The inode table
+ *        is checked by a pool of worker threads, by ranges of inode sectors.
+ *        The repair clears the bad addresses (they become holes), gives a
+ *        copy of a shared sector to all its users but the first, removes the
+ *        bad entries, links the orphan inodes in FSCK_LOST_FOUND as #<inr>
+ *        and rebuilds the bitmaps.
+ * @param u the mounted filesystem
+ * @param repair whether to repair the problems found
+ * @param nb_threads the number of worker threads (1 to FSCK_MAX_THREADS)
+ * @return 0 if the filesystem is consistent (once repaired); ERR_INCONSISTENT_FS
+ *         if problems are left; <0 on other errors
+ */
+int fsck_run(struct unix_filesystem *u, int repair, int nb_threads);
@@ -1,17 +1,52 @@
 #include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
+#include "arena.h"
 #include "error.h"
 #include "unixv6fs.h"
 #include "sector.h"
 #include "inode.h"
+#include "filev6.h"
 #include "bmblock.h"
+#include "util.h"
+#include "stats.h"
+#include "trace.h"
+#include "dedup.h"
+#include "snapshot.h"
 
-#define NB_INDIR_SECTORS (ADDR_SMALL_LENGTH-1)
+#define NB_INDIR_SECTORS ADDR_DINDIRECT	/* i_addr[0..6] of a large file: single indirect */
+#define NB_INDIR_ADDRESSES (NB_INDIR_SECTORS*ADDRESSES_PER_SECTOR)	/* file sectors mapped by them */
+#define LARGE_MAX_SECTORS ((int64_t)(NB_INDIR_SECTORS + ADDRESSES_PER_SECTOR)*ADDRESSES_PER_SECTOR)
+
+/* Per-thread cache of indirect sectors, so that the double-indirect level
+ * adds no disk read per data sector. Entries are tagged with the global
+ * generation, bumped whenever an indirect sector is written or a filesystem
+ * is (un)mounted, which drops every cached copy. */
+#define INDIR_CACHE_ENTRIES MAX(2, (16*1024)/SECTOR_SIZE)
+
+struct indir_cache_entry {
+	const struct unix_filesystem *u;
+	uint32_t sector;	// 0: empty
+	uint64_t generation;
+	sector_addr_t addresses[ADDRESSES_PER_SECTOR];
+};
+
+static uint64_t indir_generation = 1;
+static __thread struct indir_cache_entry indir_cache[INDIR_CACHE_ENTRIES];
+static const sector_addr_t indir_none[ADDRESSES_PER_SECTOR];
+
+struct inode_wb {
+	uint32_t sector;	// the inode sector held in data (0: none)
+	int dirty;
+	struct inode_sector data;
+};
 
 
 int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inode){
 	M_REQUIRE_NON_NULL(u);
 	M_REQUIRE_NON_NULL(inode);
+	STATS_SCOPE(STATS_INODE_READ);
+	TRACE_SUBSYS(TRACE_SUB_INODE);
 
 	if(inr < ROOT_INUMBER || inr >= (u->s).s_isize*INODES_PER_SECTOR){ 
 		return ERR_INODE_OUT_OF_RANGE; 
@@ -19,13 +54,16 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
 
 	uint32_t num_sector = (u->s).s_inode_start + inr/INODES_PER_SECTOR; 
 	uint16_t place_in_sector = inr%INODES_PER_SECTOR;
-	struct inode_sector inodes_in_sector;
-	int read_output = sector_read(u->f, num_sector, inodes_in_sector.inodes);
-	if(read_output != ERR_NONE){
-		return read_output;
+	if(u->iwb != NULL && u->iwb->sector == num_sector){
+		memcpy(inode, &(u->iwb->data.inodes[place_in_sector]), sizeof(*inode));
+	}else{
+		struct inode_sector inodes_in_sector;
+		int read_output = sector_read(u->f, num_sector, inodes_in_sector.inodes);
+		if(read_output != ERR_NONE){
+			return read_output;
+		}
+		memcpy(inode, &(inodes_in_sector.inodes[place_in_sector]), sizeof(*inode));
 	}
-	
-	memcpy(inode, &(inodes_in_sector.inodes[place_in_sector]), sizeof(*inode)); 
 	if (!(inode->i_mode & IALLOC)){ 
 		return ERR_UNALLOCATED_INODE; 
 	}
@@ -33,33 +71,156 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
 	
 }
 
+#define INODE_BATCH_SECTORS 16 // inode sectors read with one I/O
+
+struct inode_batch_entry {
+	uint16_t inr;
+	size_t index;	// in the arrays of inode_read_batch()
+};
+
+static int inode_cmp_batch(const void *a, const void *b){
+	const struct inode_batch_entry *x = a, *y = b;
+	return (x->inr > y->inr) - (x->inr < y->inr);
+}
+
+int inode_read_batch(const struct unix_filesystem *u, const uint16_t *inrs, size_t count, struct inode *inodes){
+	M_REQUIRE_NON_NULL(u);
+	M_REQUIRE_NON_NULL(inrs);
+	M_REQUIRE_NON_NULL(inodes);
+	STATS_SCOPE(STATS_INODE_READ);
+	TRACE_SUBSYS(TRACE_SUB_INODE);
+
+	ARENA_SCOPE(scratch);
+	struct inode_batch_entry *order = arena_alloc(scratch, count*sizeof(struct inode_batch_entry));
+	if(order == NULL && count > 0){
+		return ERR_NOMEM;
+	}
+	size_t nb = 0;
+	for(size_t k = 0; k < count; k++){
+		if(inrs[k] < ROOT_INUMBER || inrs[k] >= (u->s).s_isize*INODES_PER_SECTOR){
+			memset(&inodes[k], 0, sizeof(struct inode));
+		}else{
+			order[nb].inr = inrs[k];
+			order[nb].index = k;
+			nb++;
+		}
+	}
+	qsort(order, nb, sizeof(struct inode_batch_entry), inode_cmp_batch);
+
+	struct inode_sector run[INODE_BATCH_SECTORS];
+	uint32_t run_first = 0;
+	uint32_t run_count = 0;
+	int ret = ERR_NONE;
+	for(size_t k = 0; k < nb && ret == ERR_NONE; k++){
+		const uint32_t num_sector = (u->s).s_inode_start + order[k].inr/INODES_PER_SECTOR;
+		if(run_count == 0 || num_sector >= run_first + run_count){
+			// from this sector to the last one wanted within the buffer
+			run_first = num_sector;
+			run_count = 1;
+			for(size_t next = k + 1; next < nb; next++){
+				const uint32_t next_sector = (u->s).s_inode_start + order[next].inr/INODES_PER_SECTOR;
+				if(next_sector >= run_first + INODE_BATCH_SECTORS){
+					break;
+				}
+				run_count = next_sector - run_first + 1;
+			}
+			ret = sector_read_many(u->f, run_first, run_count, run);
+			if(ret != ERR_NONE){
+				break;
+			}
+		}
+		const struct inode_sector *sector = (u->iwb != NULL && u->iwb->sector == num_sector)
+		                                    ? &(u->iwb->data) : &run[num_sector - run_first];
+		memcpy(&inodes[order[k].index], &(sector->inodes[order[k].inr%INODES_PER_SECTOR]), sizeof(struct inode));
+	}
+	return ret;
+}
+
 int inode_scan_print(const struct unix_filesystem *u){
 	M_REQUIRE_NON_NULL(u);
 
-	uint16_t inr;
-	for(inr = ROOT_INUMBER; inr < (u->s).s_isize*INODES_PER_SECTOR; inr++){
-		struct inode inode;
-		int output_scan = inode_read(u, inr, &inode); 
-		if (output_scan != ERR_UNALLOCATED_INODE){
-			if(output_scan != ERR_NONE){
-				return output_scan;
-			}else{
-				int32_t size_inode = inode_getsize(&inode);
-				pps_printf("inode %" PRIu16 " (%s) len %" PRIu32 "\n", inr, inode.i_mode & IFDIR ? SHORT_DIR_NAME : SHORT_FIL_NAME,size_inode);	
+	// INODE_BATCH_SECTORS inode sectors per I/O
+	uint16_t inrs[INODE_BATCH_SECTORS*INODES_PER_SECTOR];
+	struct inode inodes[INODE_BATCH_SECTORS*INODES_PER_SECTOR];
+	const uint32_t nb_inodes = (u->s).s_isize*INODES_PER_SECTOR;
+	for(uint32_t first = ROOT_INUMBER; first < nb_inodes; first += INODE_BATCH_SECTORS*INODES_PER_SECTOR){
+		const size_t count = MIN(nb_inodes - first, INODE_BATCH_SECTORS*INODES_PER_SECTOR);
+		for(size_t k = 0; k < count; k++){
+			inrs[k] = (uint16_t)(first + k);
+		}
+		int output_scan = inode_read_batch(u, inrs, count, inodes);
+		if(output_scan != ERR_NONE){
+			return output_scan;
+		}
+		for(size_t k = 0; k < count; k++){
+			if(inodes[k].i_mode & IALLOC){
+				int32_t size_inode = inode_getsize(&inodes[k]);
+				pps_printf("inode %" PRIu16 " (%s) len %" PRIu32 "\n", inrs[k], inodes[k].i_mode & IFDIR ? SHORT_DIR_NAME : SHORT_FIL_NAME,size_inode);	
 			}
 		}
 	}
 	return ERR_NONE;
 }
 
+void inode_indirect_changed(void){
+	__atomic_add_fetch(&indir_generation, 1, __ATOMIC_RELEASE);
+}
+
+
+// the addresses held by an indirect sector (none if it is 0), valid until the next call
+static int inode_read_indirect(const struct unix_filesystem *u, uint32_t sector, const sector_addr_t **addresses){
+	if(sector == 0){
+		*addresses = indir_none;
+		return ERR_NONE;
+	}
+	const uint64_t generation = __atomic_load_n(&indir_generation, __ATOMIC_ACQUIRE);
+	struct indir_cache_entry *e = &indir_cache[sector % INDIR_CACHE_ENTRIES];
+	if(e->sector != sector || e->u != u || e->generation != generation){
+		int read = sector_read(u->f, sector, e->addresses);
+		if(read != ERR_NONE){
+			e->sector = 0;
+			return read;
+		}
+		e->u = u;
+		e->sector = sector;
+		e->generation = generation;
+	}
+	*addresses = e->addresses;
+	return ERR_NONE;
+}
+
+
+// the indirect sector of a large file holding the address of file sector
+// file_sec_off, and the index of that address in it
+static int inode_indirect_of(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off, size_t *index){
+	*index = (size_t)file_sec_off%ADDRESSES_PER_SECTOR;
+	if(file_sec_off < NB_INDIR_ADDRESSES){
+		return (i->i_addr)[file_sec_off/ADDRESSES_PER_SECTOR];
+	}
+	if(file_sec_off >= LARGE_MAX_SECTORS){
+		return ERR_FILE_TOO_LARGE;
+	}
+	const sector_addr_t *dindirect = NULL;
+	int read = inode_read_indirect(u, (i->i_addr)[ADDR_DINDIRECT], &dindirect);
+	if(read != ERR_NONE){
+		return read;
+	}
+	return dindirect[(file_sec_off - NB_INDIR_ADDRESSES)/ADDRESSES_PER_SECTOR];
+}
+
+
 int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off){
 	M_REQUIRE_NON_NULL(u);
 	M_REQUIRE_NON_NULL(i);
+	TRACE_SUBSYS(TRACE_SUB_INODE);
 	
 	int32_t size_file = inode_getsize(i);
 	if(!(i->i_mode & IALLOC)){
 		return ERR_UNALLOCATED_INODE;
 	}
+	if(i->i_mode & IINLINE){ // no sector: the data is in i_addr
+		return ERR_BAD_PARAMETER;
+	}
 	if(file_sec_off < 0 || file_sec_off*SECTOR_SIZE >= size_file){
 		return ERR_OFFSET_OUT_OF_RANGE;
 	}
@@ -67,29 +228,86 @@ int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int
 	if(size_file < ADDR_SMALL_LENGTH*SECTOR_SIZE){
 		size_t index_sector = file_sec_off;
 		return (i->i_addr)[index_sector];
+	}
 
-	}else if(size_file < NB_INDIR_SECTORS*ADDRESSES_PER_SECTOR*SECTOR_SIZE){
-		size_t index_sector = file_sec_off/ADDRESSES_PER_SECTOR;
-		uint16_t data_sector = (i->i_addr)[index_sector];
+	size_t index_inode = 0;
+	int indirect = inode_indirect_of(u, i, file_sec_off, &index_inode);
+	if(indirect < 0){
+		return indirect;
+	}
+	const sector_addr_t *data_addresses = NULL;
+	int read = inode_read_indirect(u, (uint32_t)indirect, &data_addresses);
+	if(read != ERR_NONE){
+		return read;
+	}
+	return data_addresses[index_inode];
+}
 
-		uint16_t data_addresses[ADDRESSES_PER_SECTOR] = {0};
-		int read = sector_read(u->f, data_sector, data_addresses);
 
+int inode_findindirect(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off){
+	M_REQUIRE_NON_NULL(u);
+	M_REQUIRE_NON_NULL(i);
+
+	if(inode_getsize(i) < ADDR_SMALL_LENGTH*SECTOR_SIZE || (i->i_mode & IINLINE)){
+		return 0;
+	}
+	size_t index_inode = 0;
+	return inode_indirect_of(u, i, file_sec_off, &index_inode);
+}
+
+
+int inode_findsectors(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off,
+                      sector_addr_t *sectors, size_t count){
+	M_REQUIRE_NON_NULL(u);
+	M_REQUIRE_NON_NULL(i);
+	M_REQUIRE_NON_NULL(sectors);
+	TRACE_SUBSYS(TRACE_SUB_INODE);
+
+	int32_t size_file = inode_getsize(i);
+	if(!(i->i_mode & IALLOC)){
+		return ERR_UNALLOCATED_INODE;
+	}
+	if(i->i_mode & IINLINE){
+		return ERR_BAD_PARAMETER;
+	}
+	if(file_sec_off < 0 || (file_sec_off + (int32_t)count - 1)*SECTOR_SIZE >= size_file){
+		return ERR_OFFSET_OUT_OF_RANGE;
+	}
+
+	if(size_file < ADDR_SMALL_LENGTH*SECTOR_SIZE){
+		memcpy(sectors, &(i->i_addr[file_sec_off]), count*sizeof(sector_addr_t));
+		return ERR_NONE;
+	}
+
+	// the single and double indirect regions both start on an indirect sector boundary
+	size_t done = 0;
+	while(done < count){
+		int32_t offset = file_sec_off + (int32_t)done;
+		size_t first = 0;
+		int indirect = inode_indirect_of(u, i, offset, &first);
+		if(indirect < 0){
+			return indirect;
+		}
+		size_t nb = MIN(count - done, ADDRESSES_PER_SECTOR - first);
+
+		const sector_addr_t *data_addresses = NULL;
+		int read = inode_read_indirect(u, (uint32_t)indirect, &data_addresses);
 		if(read != ERR_NONE){
 			return read;
 		}
-		uint16_t index_inode = file_sec_off%ADDRESSES_PER_SECTOR;
-		
-		return data_addresses[index_inode];
-	}else{
-		return ERR_FILE_TOO_LARGE;
+		memcpy(&sectors[done], &data_addresses[first], nb*sizeof(sector_addr_t));
+		done += nb;
 	}
+
+	return ERR_NONE;
 }
 
 
 int inode_write(struct unix_filesystem *u, uint16_t inr, const struct inode *inode){
 	M_REQUIRE_NON_NULL(u);
 	M_REQUIRE_NON_NULL(inode);
+	STATS_SCOPE(STATS_INODE_WRITE);
+	TRACE_SUBSYS(TRACE_SUB_INODE);
 	
 	if(inr < ROOT_INUMBER || inr >= (u->s).s_isize*INODES_PER_SECTOR){ 
 		return ERR_INODE_OUT_OF_RANGE; 
@@ -97,6 +315,25 @@ int inode_write(struct unix_filesystem *u, uint16_t inr, const struct inode *ino
 
 	uint32_t num_sector = (u->s).s_inode_start + inr/INODES_PER_SECTOR; 
 	uint16_t place_in_sector = inr%INODES_PER_SECTOR;
+
+	if(u->iwb != NULL){
+		if(u->iwb->sector != num_sector){
+			int flush = inode_wb_flush(u);
+			if(flush != ERR_NONE){
+				return flush;
+			}
+			int read = sector_read(u->f, num_sector, u->iwb->data.inodes);
+			if(read != ERR_NONE){
+				u->iwb->sector = 0;
+				return read;
+			}
+			u->iwb->sector = num_sector;
+		}
+		memcpy(&(u->iwb->data.inodes[place_in_sector]), inode, sizeof(struct inode));
+		u->iwb->dirty = 1;
+		return ERR_NONE;
+	}
+
 	struct inode_sector inodes_in_sector;
 	int read = sector_read(u->f, num_sector, inodes_in_sector.inodes);
 	if(read != ERR_NONE){
@@ -134,9 +371,477 @@ int inode_setsize(struct inode *inode, int new_size){
 	if(new_size < 0){
 		return ERR_BAD_PARAMETER;
 	}
+	if(new_size > INODE_MAX_SIZE){
+		return ERR_FILE_TOO_LARGE;
+	}
 
 	inode->i_size0 = (new_size >> 16);
 	inode->i_size1 = (new_size & 0xFFFF);
 
 	return ERR_NONE;
 }
+
+
+// a free sector for addresses, marked as used
+static int inode_alloc_indirect(struct unix_filesystem *u){
+	int indirect = bm_find_next(u->fbm);
+	if(indirect < 0 || (uint32_t)indirect < u->s.s_block_start){
+		return indirect < 0 ? indirect : ERR_BITMAP_FULL;
+	}
+	bm_set(u->fbm, (uint64_t)indirect);
+	return indirect;
+}
+
+// the indirect sector *slot, about to be written: if a snapshot holds it
+// (see snapshot.h), *slot becomes a copy of its own
+static int inode_private_indirect(struct unix_filesystem *u, sector_addr_t *slot){
+	if(!snapshot_frozen(u, *slot)){
+		return *slot;
+	}
+	sector_addr_t addresses[ADDRESSES_PER_SECTOR];
+	int read = sector_read(u->f, *slot, addresses);
+	int copy = (read != ERR_NONE) ? read : inode_alloc_indirect(u);
+	if(copy < 0){
+		return copy;
+	}
+	int write = sector_write(u->f, (uint32_t)copy, addresses);
+	if(write != ERR_NONE){
+		bm_clear(u->fbm, (uint64_t)copy);
+		return write;
+	}
+	*slot = (sector_addr_t)copy;
+	inode_indirect_changed();
+	return copy;
+}
+
+
+int inode_grow(struct unix_filesystem *u, struct inode *inode, int32_t new_size){
+	M_REQUIRE_NON_NULL(u);
+	M_REQUIRE_NON_NULL(inode);
+	TRACE_SUBSYS(TRACE_SUB_INODE);
+
+	int32_t size_file = inode_getsize(inode);
+	if(new_size < size_file){
+		return ERR_BAD_PARAMETER;
+	}
+	if(new_size > FILEV6_MAX_SIZE){ // one bound, whatever the geometry
+		return ERR_FILE_TOO_LARGE;
+	}
+	if((inode->i_mode & IINLINE) && new_size > INODE_INLINE_SIZE){
+		int uninline = inode_uninline(u, inode);
+		if(uninline != ERR_NONE){
+			return uninline;
+		}
+	}
+	if(inode->i_mode & IINLINE){ // the bytes past the end are zeroes already
+		return inode_setsize(inode, new_size);
+	}
+
+	const sector_addr_t no_address[ADDR_SMALL_LENGTH] = {0};
+	if(size_file < ADDR_SMALL_LENGTH*SECTOR_SIZE && new_size >= ADDR_SMALL_LENGTH*SECTOR_SIZE
+	   && memcmp(inode->i_addr, no_address, sizeof(no_address)) != 0){
+		// the direct addresses move to a first indirect sector (none if they are all holes)
+		int indirect = inode_alloc_indirect(u);
+		if(indirect < 0){
+			return indirect;
+		}
+		sector_addr_t data_addresses[ADDRESSES_PER_SECTOR] = {0};
+		size_t nb_direct = (size_t)(size_file + SECTOR_SIZE - 1)/SECTOR_SIZE;
+		memcpy(data_addresses, inode->i_addr, nb_direct*sizeof(sector_addr_t));
+
+		int write = sector_write(u->f, (uint32_t)indirect, data_addresses);
+		inode_indirect_changed();
+		if(write != ERR_NONE){
+			return write;
+		}
+
+		memset(inode->i_addr, 0, sizeof(inode->i_addr));
+		inode->i_addr[0] = (sector_addr_t)indirect;
+	}
+
+	return inode_setsize(inode, new_size);
+}
+
+
+// the indirect sector mapping file sector offset of a large file, allocated
+// (with the double-indirect sector) if needed, or copied if a snapshot holds
+// it; *fresh tells if it is new, i.e. all zeroes
+static int inode_indirect_alloc(struct unix_filesystem *u, struct inode *inode, int32_t offset, int *fresh){
+	*fresh = 0;
+	if(offset < NB_INDIR_ADDRESSES){
+		sector_addr_t *slot = &(inode->i_addr[offset/ADDRESSES_PER_SECTOR]);
+		if(*slot != 0){
+			return inode_private_indirect(u, slot);
+		}
+		int indirect = inode_alloc_indirect(u);
+		if(indirect < 0){
+			return indirect;
+		}
+		*slot = (sector_addr_t)indirect;
+		*fresh = 1;
+		return *slot;
+	}
+
+	sector_addr_t dindirect[ADDRESSES_PER_SECTOR] = {0};
+	if(inode->i_addr[ADDR_DINDIRECT] == 0){
+		int sector = inode_alloc_indirect(u);
+		if(sector < 0){
+			return sector;
+		}
+		inode->i_addr[ADDR_DINDIRECT] = (sector_addr_t)sector;
+	}else{
+		int own = inode_private_indirect(u, &(inode->i_addr[ADDR_DINDIRECT]));
+		int read = (own < 0) ? own : sector_read(u->f, inode->i_addr[ADDR_DINDIRECT], dindirect);
+		if(read != ERR_NONE){
+			return read;
+		}
+	}
+
+	size_t index_sector = (size_t)(offset - NB_INDIR_ADDRESSES)/ADDRESSES_PER_SECTOR;
+	const sector_addr_t indirect = dindirect[index_sector];
+	if(indirect == 0){
+		int sector = inode_alloc_indirect(u);
+		if(sector < 0){
+			return sector;
+		}
+		dindirect[index_sector] = (sector_addr_t)sector;
+		*fresh = 1;
+	}else{
+		int own = inode_private_indirect(u, &dindirect[index_sector]);
+		if(own < 0){
+			return own;
+		}
+	}
+	if(dindirect[index_sector] != indirect){
+		int write = sector_write(u->f, inode->i_addr[ADDR_DINDIRECT], dindirect);
+		if(write != ERR_NONE){
+			return write;
+		}
+	}
+	return dindirect[index_sector];
+}
+
+
+int inode_setsectors(struct unix_filesystem *u, struct inode *inode, int32_t file_sec_off,
+                     const sector_addr_t *sectors, size_t count){
+	M_REQUIRE_NON_NULL(u);
+	M_REQUIRE_NON_NULL(inode);
+	M_REQUIRE_NON_NULL(sectors);
+	TRACE_SUBSYS(TRACE_SUB_INODE);
+
+	int32_t size_file = inode_getsize(inode);
+	if(inode->i_mode & IINLINE){
+		return ERR_BAD_PARAMETER;
+	}
+	if(file_sec_off < 0 || (file_sec_off + (int32_t)count - 1)*SECTOR_SIZE >= size_file){
+		return ERR_OFFSET_OUT_OF_RANGE;
+	}
+
+	if(size_file < ADDR_SMALL_LENGTH*SECTOR_SIZE){
+		memcpy(&(inode->i_addr[file_sec_off]), sectors, count*sizeof(sector_addr_t));
+		return ERR_NONE;
+	}
+
+	// one read-modify-write per indirect sector touched
+	int ret = ERR_NONE;
+	size_t done = 0;
+	while(done < count && ret == ERR_NONE){
+		int32_t offset = file_sec_off + (int32_t)done;
+		size_t first = (size_t)offset%ADDRESSES_PER_SECTOR;
+		size_t nb = MIN(count - done, ADDRESSES_PER_SECTOR - first);
+		if(offset >= LARGE_MAX_SECTORS){
+			ret = ERR_FILE_TOO_LARGE;
+			break;
+		}
+
+		int fresh = 0;
+		int indirect = inode_indirect_alloc(u, inode, offset, &fresh);
+		if(indirect < 0){
+			ret = indirect;
+			break;
+		}
+		sector_addr_t data_addresses[ADDRESSES_PER_SECTOR] = {0};
+		if(!fresh){
+			ret = sector_read(u->f, (uint32_t)indirect, data_addresses);
+		}
+		if(ret == ERR_NONE){
+			memcpy(&data_addresses[first], &sectors[done], nb*sizeof(sector_addr_t));
+			ret = sector_write(u->f, (uint32_t)indirect, data_addresses);
+		}
+		done += nb;
+	}
+
+	inode_indirect_changed();
+	return ret;
+}
+
+
+#define INODE_SCAN_BATCH 256 // sectors located per call to inode_findsectors
+
+// frees the data sectors of the file sectors [first, last) (holes are skipped),
+// but those still shared with other files (see dedup.h)
+static int inode_free_range(struct unix_filesystem *u, const struct inode *inode, int32_t first, int32_t last){
+	sector_addr_t sectors[INODE_SCAN_BATCH];
+	for(int32_t off = first; off < last; off += INODE_SCAN_BATCH){
+		size_t count = (size_t)MIN(last - off, INODE_SCAN_BATCH);
+		int find = inode_findsectors(u, inode, off, sectors, count);
+		if(find != ERR_NONE){
+			return find;
+		}
+		for(size_t k = 0; k < count; k++){
+			int last_ref = (sectors[k] == 0) ? 0 : dedup_release(u, sectors[k]);
+			if(last_ref < 0){
+				return last_ref;
+			}
+			if(last_ref){
+				bm_clear(u->fbm, sectors[k]);
+			}
+		}
+	}
+	return ERR_NONE;
+}
+
+
+// frees the indirect sectors of a large file from the one mapping file sector
+// first_indirect*ADDRESSES_PER_SECTOR on (and the double-indirect sector if unused)
+static int inode_free_indirect(struct unix_filesystem *u, struct inode *inode, size_t first_indirect){
+	for(size_t k = first_indirect; k < NB_INDIR_SECTORS; k++){
+		bm_clear(u->fbm, inode->i_addr[k]);
+		inode->i_addr[k] = 0;
+	}
+	if(inode->i_addr[ADDR_DINDIRECT] == 0){
+		return ERR_NONE;
+	}
+
+	sector_addr_t dindirect[ADDRESSES_PER_SECTOR] = {0};
+	int read = sector_read(u->f, inode->i_addr[ADDR_DINDIRECT], dindirect);
+	if(read != ERR_NONE){
+		return read;
+	}
+	size_t first = first_indirect > NB_INDIR_SECTORS ? first_indirect - NB_INDIR_SECTORS : 0;
+	for(size_t k = first; k < ADDRESSES_PER_SECTOR; k++){
+		bm_clear(u->fbm, dindirect[k]);
+		dindirect[k] = 0;
+	}
+	if(first == 0){
+		bm_clear(u->fbm, inode->i_addr[ADDR_DINDIRECT]);
+		inode->i_addr[ADDR_DINDIRECT] = 0;
+		return ERR_NONE;
+	}
+	int own = inode_private_indirect(u, &(inode->i_addr[ADDR_DINDIRECT]));
+	if(own < 0){
+		return own;
+	}
+	int write = sector_write(u->f, inode->i_addr[ADDR_DINDIRECT], dindirect);
+	inode_indirect_changed();
+	return write;
+}
+
+
+int inode_shrink(struct unix_filesystem *u, struct inode *inode, int32_t new_size){
+	M_REQUIRE_NON_NULL(u);
+	M_REQUIRE_NON_NULL(inode);
+	TRACE_SUBSYS(TRACE_SUB_INODE);
+
+	int32_t size_file = inode_getsize(inode);
+	if(new_size < 0 || new_size > size_file){
+		return ERR_BAD_PARAMETER;
+	}
+	if(inode->i_mode & IINLINE){ // no sector to free, the bytes past the end are cleared
+		memset((uint8_t *)inode->i_addr + new_size, 0, (size_t)(size_file - new_size));
+		return inode_setsize(inode, new_size);
+	}
+	int32_t old_nb = (size_file + SECTOR_SIZE - 1)/SECTOR_SIZE;
+	int32_t new_nb = (new_size + SECTOR_SIZE - 1)/SECTOR_SIZE;
+
+	int ret = inode_free_range(u, inode, new_nb, old_nb);
+	if(ret != ERR_NONE){
+		return ret;
+	}
+
+	if(size_file < ADDR_SMALL_LENGTH*SECTOR_SIZE){
+		memset(&(inode->i_addr[new_nb]), 0, (size_t)(ADDR_SMALL_LENGTH - new_nb)*sizeof(sector_addr_t));
+	}else if(new_size < ADDR_SMALL_LENGTH*SECTOR_SIZE){
+		// back to direct addressing
+		sector_addr_t direct[ADDR_SMALL_LENGTH] = {0};
+		if(new_nb > 0){
+			ret = inode_findsectors(u, inode, 0, direct, (size_t)new_nb);
+		}
+		if(ret == ERR_NONE){
+			ret = inode_free_indirect(u, inode, 0);
+		}
+		memcpy(inode->i_addr, direct, sizeof(direct));
+	}else{
+		// the indirect sectors past the new end go, the last one kept is trimmed
+		// (in a copy of its own if a snapshot holds it)
+		ret = inode_free_indirect(u, inode, (size_t)(new_nb + ADDRESSES_PER_SECTOR - 1)/ADDRESSES_PER_SECTOR);
+		int indirect = (ret == ERR_NONE && new_nb%ADDRESSES_PER_SECTOR != 0) ? inode_findindirect(u, inode, new_nb) : 0;
+		int fresh = 0;
+		if(indirect > 0){
+			indirect = inode_indirect_alloc(u, inode, new_nb, &fresh);
+		}
+		if(indirect != 0){
+			sector_addr_t data_addresses[ADDRESSES_PER_SECTOR] = {0};
+			ret = indirect < 0 ? indirect : sector_read(u->f, (uint32_t)indirect, data_addresses);
+			if(ret == ERR_NONE){
+				memset(&data_addresses[new_nb%ADDRESSES_PER_SECTOR], 0,
+				       (size_t)(ADDRESSES_PER_SECTOR - new_nb%ADDRESSES_PER_SECTOR)*sizeof(sector_addr_t));
+				ret = sector_write(u->f, (uint32_t)indirect, data_addresses);
+			}
+		}
+	}
+	inode_indirect_changed();
+	if(ret != ERR_NONE){
+		return ret;
+	}
+
+	return inode_setsize(inode, new_size);
+}
+
+
+int inode_nbsectors(const struct unix_filesystem *u, const struct inode *i){
+	M_REQUIRE_NON_NULL(u);
+	M_REQUIRE_NON_NULL(i);
+
+	if(i->i_mode & IINLINE){
+		return 0;
+	}
+	int32_t size_file = inode_getsize(i);
+	int32_t nb = (size_file + SECTOR_SIZE - 1)/SECTOR_SIZE;
+	int allocated = 0;
+
+	sector_addr_t sectors[INODE_SCAN_BATCH];
+	for(int32_t off = 0; off < nb; off += INODE_SCAN_BATCH){
+		size_t count = (size_t)MIN(nb - off, INODE_SCAN_BATCH);
+		int find = inode_findsectors(u, i, off, sectors, count);
+		if(find != ERR_NONE){
+			return find;
+		}
+		for(size_t k = 0; k < count; k++){
+			allocated += (sectors[k] != 0);
+		}
+	}
+
+	if(size_file >= ADDR_SMALL_LENGTH*SECTOR_SIZE){
+		for(int32_t off = 0; off < nb; off += ADDRESSES_PER_SECTOR){
+			int indirect = inode_findindirect(u, i, off);
+			if(indirect < 0){
+				return indirect;
+			}
+			allocated += (indirect != 0);
+		}
+		allocated += ((i->i_addr)[ADDR_DINDIRECT] != 0);
+	}
+	return allocated;
+}
+
+
+int inode_marksectors(const struct unix_filesystem *u, const struct inode *i, struct bmblock_array *bm){
+	M_REQUIRE_NON_NULL(u);
+	M_REQUIRE_NON_NULL(i);
+	M_REQUIRE_NON_NULL(bm);
+
+	// an inline file has no sector, its i_addr holds data
+	int32_t size_file = inode_getsize(i);
+	int32_t nb = (i->i_mode & IINLINE) ? 0 : (size_file + SECTOR_SIZE - 1)/SECTOR_SIZE;
+	sector_addr_t sectors[INODE_SCAN_BATCH];
+	for(int32_t off = 0; off < nb; off += INODE_SCAN_BATCH){
+		size_t count = (size_t)MIN(nb - off, INODE_SCAN_BATCH);
+		int find = inode_findsectors(u, i, off, sectors, count);
+		if(find != ERR_NONE){
+			return find;
+		}
+		for(size_t k = 0; k < count; k++){
+			if(sectors[k] != 0){ // 0: a hole
+				bm_set(bm, sectors[k]);
+			}
+		}
+	}
+
+	if(nb > 0 && size_file >= ADDR_SMALL_LENGTH*SECTOR_SIZE){
+		for(int32_t off = 0; off < nb; off += ADDRESSES_PER_SECTOR){
+			int indirect = inode_findindirect(u, i, off);
+			if(indirect < 0){
+				return indirect;
+			}
+			if(indirect > 0){
+				bm_set(bm, (uint64_t)indirect);
+			}
+		}
+		if(i->i_addr[ADDR_DINDIRECT] != 0){
+			bm_set(bm, i->i_addr[ADDR_DINDIRECT]);
+		}
+	}
+	return ERR_NONE;
+}
+
+
+
+int inode_uninline(struct unix_filesystem *u, struct inode *inode){
+	M_REQUIRE_NON_NULL(u);
+	M_REQUIRE_NON_NULL(inode);
+	TRACE_SUBSYS(TRACE_SUB_INODE);
+
+	if(!(inode->i_mode & IINLINE)){
+		return ERR_NONE;
+	}
+	int32_t size_file = inode_getsize(inode);
+	sector_addr_t data_sector = 0;
+	if(size_file > 0){
+		int sector = inode_alloc_indirect(u);  // any free sector will do
+		if(sector < 0){
+			return sector;
+		}
+		uint8_t data[SECTOR_SIZE] = {0};
+		memcpy(data, inode->i_addr, (size_t)size_file);
+		int write = sector_write(u->f, (uint32_t)sector, data);
+		if(write != ERR_NONE){
+			bm_clear(u->fbm, (uint64_t)sector);
+			return write;
+		}
+		data_sector = (sector_addr_t)sector;
+	}
+
+	memset(inode->i_addr, 0, sizeof(inode->i_addr));
+	inode->i_addr[0] = data_sector;
+	inode->i_mode &= (uint16_t)~IINLINE;
+	return ERR_NONE;
+}
+
+int inode_wb_enable(struct unix_filesystem *u){
+	M_REQUIRE_NON_NULL(u);
+
+	if(u->iwb == NULL){
+		u->iwb = calloc(1, sizeof(struct inode_wb));
+		if(u->iwb == NULL){
+			return ERR_NOMEM;
+		}
+	}
+	return ERR_NONE;
+}
+
+
+int inode_wb_flush(struct unix_filesystem *u){
+	M_REQUIRE_NON_NULL(u);
+	TRACE_SUBSYS(TRACE_SUB_INODE);
+
+	if(u->iwb == NULL || !u->iwb->dirty){
+		return ERR_NONE;
+	}
+	int write = sector_write(u->f, u->iwb->sector, u->iwb->data.inodes);
+	if(write != ERR_NONE){
+		return write;
+	}
+	u->iwb->dirty = 0;
+	return ERR_NONE;
+}
+
+
+int inode_wb_disable(struct unix_filesystem *u){
+	M_REQUIRE_NON_NULL(u);
+
+	int flush = inode_wb_flush(u);
+	free(u->iwb);
+	u->iwb = NULL;
+	return flush;
+}
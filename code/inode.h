@@ -81,6 +81,18 @@ int inode_scan_print(const struct unix_filesystem *u);
  */
 int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inode);
 
+/**
+ * @brief read the content of several inodes, reading each inode sector
+ *        involved once (consecutive inode sectors with one I/O)
+ * @param u the filesystem (IN)
+ * @param inrs the inode numbers, in any order (IN)
+ * @param count the number of inodes
+ * @param inodes the inode structures, read from disk; zeroed (hence not
+ *        IALLOC) for an inode number out of range (OUT)
+ * @return 0 on success; <0 on error
+ */
+int inode_read_batch(const struct unix_filesystem *u, const uint16_t *inrs, size_t count, struct inode *inodes);
+
 /* *************************************************** *
  * TODO WEEK 05										   *
  * *************************************************** */
@@ -89,10 +101,41 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
  * @param u the filesystem (IN)
  * @param inode the inode (IN)
  * @param file_sec_off the offset within the file (in sector-size units)
- * @return >0: the sector on disk;  <0 error
+ * @return >0: the sector on disk; 0: a hole (reads as zeroes); <0 error
+ *         (ERR_BAD_PARAMETER for an inline file, which has no sector)
  */
 int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off);
 
+/**
+ * @brief identify the indirect sector holding the address of a given portion
+ *        of a large file (in the single- or in the double-indirect region)
+ * @param u the filesystem (IN)
+ * @param inode the inode (IN)
+ * @param file_sec_off the offset within the file (in sector-size units)
+ * @return >=0: the indirect sector on disk (0: small file, or none allocated); <0 error
+ */
+int inode_findindirect(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off);
+
+/**
+ * @brief to be called after writing an indirect sector without
+ *        inode_setsectors()/inode_grow(): drops the cached indirect sectors
+ *        of all the threads
+ */
+void inode_indirect_changed(void);
+
+/**
+ * @brief identify the sectors of count consecutive portions of a file,
+ *        reading each indirect sector only once
+ * @param u the filesystem (IN)
+ * @param inode the inode (IN)
+ * @param file_sec_off the offset within the file of the first sector (in sector-size units)
+ * @param sectors the sectors on disk (OUT)
+ * @param count the number of sectors wanted; must stay within the file
+ * @return 0 on success; <0 on error
+ */
+int inode_findsectors(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off,
+                      sector_addr_t *sectors, size_t count);
+
 /* *************************************************** *
  * TODO WEEK 11										   *
  * *************************************************** */
@@ -114,3 +157,91 @@ int inode_alloc(struct unix_filesystem *u);
  * @return 0 on success; <0 on error
  */
 int inode_write(struct unix_filesystem *u, uint16_t inr, const struct inode *inode);
+
+/**
+ * @brief grow the size of an inode, switching its sector map from direct
+ *        to indirect addressing when the new size requires it (and an
+ *        inline file that no longer fits to a data sector)
+ * @param u the filesystem (IN)
+ * @param inode the inode (IN-OUT)
+ * @param new_size the new size, not smaller than the current one
+ * @return 0 on success; <0 on error
+ */
+int inode_grow(struct unix_filesystem *u, struct inode *inode, int32_t new_size);
+
+/**
+ * @brief shrink the size of an inode, freeing the data sectors past the new
+ *        end and the indirect sectors left unused (switching back to direct
+ *        addressing if the new size allows it)
+ * @param u the filesystem (IN)
+ * @param inode the inode (IN-OUT)
+ * @param new_size the new size, not larger than the current one
+ * @return 0 on success; <0 on error
+ */
+int inode_shrink(struct unix_filesystem *u, struct inode *inode, int32_t new_size);
+
+/**
+ * @brief count the sectors allocated to a file: data sectors (holes excluded)
+ *        and indirect sectors
+ * @param u the filesystem (IN)
+ * @param inode the inode (IN)
+ * @return the number of sectors; <0 on error
+ */
+int inode_nbsectors(const struct unix_filesystem *u, const struct inode *i);
+
+/**
+ * @brief set in a block bitmap the sectors allocated to a file: data sectors
+ *        (holes excluded) and indirect sectors
+ * @param u the filesystem (IN)
+ * @param i the inode (IN)
+ * @param bm a bitmap of the data sectors (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+int inode_marksectors(const struct unix_filesystem *u, const struct inode *i, struct bmblock_array *bm);
+
+/**
+ * @brief move the data of an inline file (IINLINE) to a data sector, so
+ *        that i_addr holds a sector map again; nothing to do for other files
+ * @param u the filesystem (IN)
+ * @param inode the inode (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+int inode_uninline(struct unix_filesystem *u, struct inode *inode);
+
+/**
+ * @brief record the disk sectors of count consecutive file sectors in the
+ *        sector map of an inode (allocating indirect sectors as needed).
+ *        The size of the inode must already cover these file sectors.
+ * @param u the filesystem (IN)
+ * @param inode the inode (IN-OUT)
+ * @param file_sec_off the offset within the file of the first sector (in sector-size units)
+ * @param sectors the disk sectors (IN)
+ * @param count the number of sectors
+ * @return 0 on success; <0 on error
+ */
+int inode_setsectors(struct unix_filesystem *u, struct inode *inode, int32_t file_sec_off,
+                     const sector_addr_t *sectors, size_t count);
+
+/**
+ * @brief start batching inode writes: inode_write() then only updates an
+ *        in-memory copy of the current inode sector, which reaches the disk
+ *        when another sector is written, on inode_wb_flush() or on umountv6().
+ *        Does nothing if batching is already enabled.
+ * @param u the filesystem (IN)
+ * @return 0 on success; <0 on error
+ */
+int inode_wb_enable(struct unix_filesystem *u);
+
+/**
+ * @brief write the batched inode sector (if any) to disk
+ * @param u the filesystem (IN)
+ * @return 0 on success; <0 on error
+ */
+int inode_wb_flush(struct unix_filesystem *u);
+
+/**
+ * @brief flush and stop batching inode writes
+ * @param u the filesystem (IN)
+ * @return 0 on success; <0 on error
+ */
+int inode_wb_disable(struct unix_filesystem *u);
@@ -0,0 +1,173 @@
+/**
+ * @file lz4.c
+ * @brief LZ4 block format (no frame), for the compressed files (ICOMPR)
+ *
+ * A block is a list of sequences: a token (literal length in the high
+ * nibble, match length - 4 in the low one, 15 meaning that bytes of 255
+ * follow), the literals, then a 2-byte little-endian offset back into the
+ * output. The last sequence only has literals; it holds at least the last
+ * LZ4_LAST_LITERALS bytes, and no match starts in the last LZ4_MFLIMIT.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "error.h"
+#include "lz4.h"
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_HASH_BITS 12
+
+static uint32_t lz4_read32(const uint8_t *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz4_hash(uint32_t sequence){
+    return (sequence*2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// a length in a token nibble, and in bytes of 255 after it if it does not fit
+static uint8_t *lz4_put_length(uint8_t *op, size_t length){
+    if(length >= 15){
+        length -= 15;
+        while(length >= 255){
+            *op++ = 255;
+            length -= 255;
+        }
+        *op++ = (uint8_t)length;
+    }
+    return op;
+}
+
+// the bytes taken by the literals and the extra length bytes of a sequence
+static size_t lz4_sequence_size(size_t literals, size_t match){
+    return 1 + literals + literals/255 + 1 + 2 + match/255 + 1;
+}
+
+int lz4_compress(const void *src, size_t len, void *dst, size_t cap){
+    M_REQUIRE_NON_NULL(src);
+    M_REQUIRE_NON_NULL(dst);
+    if(len > LZ4_MAX_INPUT){
+        return ERR_BAD_PARAMETER;
+    }
+    const uint8_t *in = src;
+    const uint8_t *end = in + len;
+    const uint8_t *anchor = in;
+    uint8_t *op = dst;
+    const uint8_t *oend = op + cap;
+    uint32_t table[1 << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    if(len >= LZ4_MFLIMIT){
+        const uint8_t *ip = in;
+        const uint8_t *match_limit = end - LZ4_LAST_LITERALS;
+        while(ip <= end - LZ4_MFLIMIT){
+            const uint32_t sequence = lz4_read32(ip);
+            const uint32_t h = lz4_hash(sequence);
+            const uint8_t *ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+            if(ref >= ip || ip - ref > LZ4_MAX_DISTANCE || lz4_read32(ref) != sequence){
+                ip++;
+                continue;
+            }
+            const uint8_t *match_end = ip + LZ4_MIN_MATCH;
+            const uint8_t *r = ref + LZ4_MIN_MATCH;
+            while(match_end < match_limit && *match_end == *r){
+                match_end++;
+                r++;
+            }
+            const size_t literals = (size_t)(ip - anchor);
+            const size_t match = (size_t)(match_end - ip) - LZ4_MIN_MATCH;
+            if(lz4_sequence_size(literals, match) > (size_t)(oend - op)){
+                return 0;
+            }
+            uint8_t *token = op++;
+            *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+            op = lz4_put_length(op, literals);
+            memcpy(op, anchor, literals);
+            op += literals;
+            const size_t offset = (size_t)(ip - ref);
+            *op++ = (uint8_t)(offset & 0xFF);
+            *op++ = (uint8_t)(offset >> 8);
+            *token |= (uint8_t)(match >= 15 ? 15 : match);
+            op = lz4_put_length(op, match);
+            ip = match_end;
+            anchor = ip;
+        }
+    }
+
+    const size_t literals = (size_t)(end - anchor);
+    if(1 + literals + literals/255 + 1 > (size_t)(oend - op)){
+        return 0;
+    }
+    *op++ = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+    op = lz4_put_length(op, literals);
+    memcpy(op, anchor, literals);
+    op += literals;
+    return (int)(op - (uint8_t *)dst);
+}
+
+// the rest of a length after its token nibble; 0 if the block ends first
+static int lz4_get_length(const uint8_t **ip, const uint8_t *iend, size_t *length){
+    if(*length != 15){
+        return 1;
+    }
+    uint8_t b = 255;
+    while(b == 255){
+        if(*ip >= iend){
+            return 0;
+        }
+        b = *(*ip)++;
+        *length += b;
+    }
+    return 1;
+}
+
+int lz4_decompress(const void *src, size_t len, void *dst, size_t cap){
+    M_REQUIRE_NON_NULL(src);
+    M_REQUIRE_NON_NULL(dst);
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + cap;
+
+    while(ip < iend){
+        const uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if(!lz4_get_length(&ip, iend, &literals)
+           || literals > (size_t)(iend - ip) || literals > (size_t)(oend - op)){
+            return ERR_INCONSISTENT_FS;
+        }
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if(ip == iend){
+            break; // the last sequence has no match
+        }
+
+        if(iend - ip < 2){
+            return ERR_INCONSISTENT_FS;
+        }
+        const size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match = token & 0x0F;
+        if(offset == 0 || offset > (size_t)(op - (uint8_t *)dst) || !lz4_get_length(&ip, iend, &match)){
+            return ERR_INCONSISTENT_FS;
+        }
+        match += LZ4_MIN_MATCH;
+        if(match > (size_t)(oend - op)){
+            return ERR_INCONSISTENT_FS;
+        }
+        // byte by byte: the match may overlap the bytes it produces
+        const uint8_t *m = op - offset;
+        for(size_t k = 0; k < match; k++){
+            op[k] = m[k];
+        }
+        op += match;
+    }
+    return (int)(op - (uint8_t *)dst);
+}
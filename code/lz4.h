@@ -0,0 +1,36 @@
+#pragma once
+
+/**
+ * @file lz4.h
+ * @brief LZ4 block format (no frame), for the compressed files (ICOMPR)
+ *
+ * A small single-pass compressor (one hash table of 4-byte sequences, no
+ * search) and a decoder that checks every length and offset, so that a
+ * corrupted block gives an error, never a write out of the output buffer.
+ */
+
+#include <stddef.h>
+
+#define LZ4_MAX_DISTANCE 65535  /* farthest match back (offsets are 16 bits) */
+#define LZ4_MAX_INPUT (1 << 24) /* largest block compressed: a whole file at most (INODE_MAX_SIZE) */
+
+/**
+ * @brief compress a block
+ * @param src the bytes to compress
+ * @param len their number (at most LZ4_MAX_INPUT)
+ * @param dst where the compressed block is written (OUT)
+ * @param cap the size of dst
+ * @return the size of the compressed block (never 0); 0 if it does not fit in cap;
+ *         ERR_BAD_PARAMETER if len is above LZ4_MAX_INPUT
+ */
+int lz4_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * @brief decompress a block
+ * @param src the compressed block
+ * @param len its size
+ * @param dst where the bytes are written (OUT)
+ * @param cap the size of dst
+ * @return the number of bytes decompressed; ERR_INCONSISTENT_FS if the block is malformed
+ */
+int lz4_decompress(const void *src, size_t len, void *dst, size_t cap);
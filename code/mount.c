@@ -9,18 +9,27 @@
 #include <string.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "error.h"
 #include "mount.h"
 #include "sector.h"
 #include "inode.h"
 #include "bmblock.h"
+#include "trace.h"
+#include "csum.h"
+#include "dedup.h"
+#include "snapshot.h"
+#include "filev6.h"
 
 int mountv6(const char *filename, struct unix_filesystem *u){
     M_REQUIRE_NON_NULL(filename);
     M_REQUIRE_NON_NULL(u);
+    TRACE_SUBSYS(TRACE_SUB_MOUNT);
     
     memset(u, 0, sizeof(*u));
+    inode_indirect_changed(); // u may be at the address of a previous mount
+    filev6_clusters_changed();
     u->f = fopen(filename, "rb+");
     if(u->f == NULL){
         return ERR_IO;
@@ -63,20 +72,28 @@ int mountv6(const char *filename, struct unix_filesystem *u){
 		int output_scan = inode_read(u, inr, &inode); 
 		if (output_scan != ERR_UNALLOCATED_INODE){
             bm_set(u->ibm, inr);
-
-            int32_t size_file = inode_getsize(&inode);
-            int sector_nbr;
-            int32_t offset = 0;
-            while((sector_nbr = inode_findsector(u, &inode, offset)) > 0 ){
-                if((size_file > ADDR_SMALL_LENGTH*SECTOR_SIZE) && (offset%ADDRESSES_PER_SECTOR == 0)){
-                    bm_set(u->fbm, inode.i_addr[offset/ADDRESSES_PER_SECTOR]);
-                }
-                bm_set(u->fbm, sector_nbr);
-                offset++;
-            }
+            (void)inode_marksectors(u, &inode, u->fbm);
 		}
 	}
-	
+
+    // the optional areas of the data sectors
+    int areas = csum_mount(u);
+    if(areas == ERR_NONE){
+        areas = dedup_mount(u);
+    }
+    if(areas == ERR_NONE){
+        areas = snapshot_mount(u);
+    }
+    if(areas != ERR_NONE){
+        csum_umount(u);
+        dedup_umount(u);
+        free(u->ibm);
+        u->ibm = NULL;
+        free(u->fbm);
+        u->fbm = NULL;
+        fclose(u->f);
+        return areas;
+    }
     return ERR_NONE;
 }
 
@@ -88,6 +105,13 @@ int umountv6(struct unix_filesystem *u){
         return ERR_IO;
     }
 
+    int flush = inode_wb_disable(u);
+    inode_indirect_changed();
+    filev6_clusters_changed();
+    csum_umount(u);
+    dedup_umount(u);
+    snapshot_umount(u);
+
     free(u->ibm);
     u->ibm = NULL;
 
@@ -98,6 +122,57 @@ int umountv6(struct unix_filesystem *u){
     if(success){
         return ERR_IO;
     }
-    return ERR_NONE;
+    return flush;
 }
 
+
+#define MKFS_BITS_PER_SECTOR (SECTOR_SIZE*8)
+
+int mountv6_mkfs(const char *filename, sector_addr_t num_blocks, uint16_t num_inodes){
+    M_REQUIRE_NON_NULL(filename);
+
+    struct superblock s;
+    memset(&s, 0, sizeof(s));
+    s.s_fbmsize = (sector_addr_t)((num_blocks + MKFS_BITS_PER_SECTOR - 1)/MKFS_BITS_PER_SECTOR);
+    s.s_ibmsize = (sector_addr_t)((num_inodes + MKFS_BITS_PER_SECTOR - 1)/MKFS_BITS_PER_SECTOR);
+    s.s_isize = (sector_addr_t)((num_inodes + INODES_PER_SECTOR - 1)/INODES_PER_SECTOR);
+    s.s_fsize = num_blocks;
+    s.s_fbm_start = SUPERBLOCK_SECTOR + 1;
+    s.s_ibm_start = (sector_addr_t)(s.s_fbm_start + s.s_fbmsize);
+    s.s_inode_start = (sector_addr_t)(s.s_ibm_start + s.s_ibmsize);
+    s.s_block_start = (sector_addr_t)(s.s_inode_start + s.s_isize);
+    if(s.s_isize == 0 || s.s_block_start >= num_blocks
+       || (uint32_t)s.s_isize*INODES_PER_SECTOR > UINT16_MAX){ // inode numbers are 16 bits
+        return ERR_BAD_PARAMETER;
+    }
+
+    FILE *f = fopen(filename, "wb+");
+    if(f == NULL){
+        return ERR_IO;
+    }
+
+    // the whole disk is zeroed: bitmaps and inodes are all free
+    int ret = ftruncate(fileno(f), (off_t)num_blocks*SECTOR_SIZE) ? ERR_IO : ERR_NONE;
+
+    uint8_t data[SECTOR_SIZE] = {0};
+
+    data[BOOTBLOCK_MAGIC_NUM_OFFSET] = BOOTBLOCK_MAGIC_NUM;
+    if(ret == ERR_NONE){
+        ret = sector_write(f, BOOTBLOCK_SECTOR, data);
+    }
+    if(ret == ERR_NONE){
+        ret = sector_write(f, SUPERBLOCK_SECTOR, &s);
+    }
+
+    struct inode_sector inodes;
+    memset(&inodes, 0, sizeof(inodes));
+    inodes.inodes[ROOT_INUMBER % INODES_PER_SECTOR].i_mode = IALLOC | IFDIR | IREAD | IWRITE | IEXEC;
+    if(ret == ERR_NONE){
+        ret = sector_write(f, s.s_inode_start + ROOT_INUMBER/INODES_PER_SECTOR, inodes.inodes);
+    }
+
+    if(fclose(f) && ret == ERR_NONE){
+        ret = ERR_IO;
+    }
+    return ret;
+}
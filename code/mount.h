@@ -12,11 +12,20 @@
 #include "unixv6fs.h"
 #include "bmblock.h"
 
+struct inode_wb;
+struct csum_area;
+struct dedup_index;
+struct snapshot_set;
+
 struct unix_filesystem {
     FILE *f;
     struct superblock s;           /* copy of the superblock */
     struct bmblock_array *fbm;     /* block bitmap -- ignore before WEEK 10 */
     struct bmblock_array *ibm;     /* inode bitmap  -- ignore before WEEK 10 */
+    struct inode_wb *iwb;          /* write-back inode sector, NULL unless batching (see inode.h) */
+    struct csum_area *csum;        /* checksums of the data sectors, NULL if none (see csum.h) */
+    struct dedup_index *dedup;     /* shared data sectors, NULL if no deduplication (see dedup.h) */
+    struct snapshot_set *snap;     /* the snapshots, NULL if none (see snapshot.h) */
 };
 
 
@@ -48,6 +57,7 @@ int umountv6(struct unix_filesystem *u);
  * @brief create a new filesystem
  * @param num_blocks the total number of blocks (= max size of disk), in sectors
  * @param num_inodes the total number of inodes
+ * @return 0 on success; <0 on error
  */
-int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes);
+int mountv6_mkfs(const char *filename, sector_addr_t num_blocks, uint16_t num_inodes);
 
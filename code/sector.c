@@ -1,17 +1,22 @@
+#include <unistd.h>
 #include "error.h"
 #include "unixv6fs.h"
+#include "sector.h"
+#include "stats.h"
+#include "trace.h"
+#include "csum.h"
 
+/* positioned I/O on the descriptor: no shared file cursor, so that several
+ * threads can read the same mounted filesystem */
 
 int sector_read(FILE *f, uint32_t sector, void *data){
 	M_REQUIRE_NON_NULL(f);
 	M_REQUIRE_NON_NULL(data);
+	STATS_SCOPE(STATS_SECTOR_READ);
+	TRACE_SCOPE(TRACE_SECTOR_READ, sector, 1, 0);
 
-	int success = fseek(f, sector*SECTOR_SIZE, SEEK_SET);
-	if(success){
-		return ERR_IO;
-	}
-	unsigned long nb_read = fread(data, SECTOR_SIZE, 1, f);
-	if(nb_read != 1){
+	ssize_t nb_read = pread(fileno(f), data, SECTOR_SIZE, (off_t)sector*SECTOR_SIZE);
+	if(nb_read != SECTOR_SIZE){
 		return ERR_IO;
 	}
 	
@@ -19,19 +24,36 @@ int sector_read(FILE *f, uint32_t sector, void *data){
 }
 
 
+int sector_read_many(FILE *f, uint32_t sector, size_t count, void *data){
+	M_REQUIRE_NON_NULL(f);
+	M_REQUIRE_NON_NULL(data);
+	STATS_SCOPE(STATS_SECTOR_READ);
+	TRACE_SCOPE(TRACE_SECTOR_READ, sector, count, 0);
+
+	size_t len = count*SECTOR_SIZE;
+	size_t done = 0;
+	while(done < len){
+		ssize_t nb_read = pread(fileno(f), (char*)data + done, len - done, (off_t)sector*SECTOR_SIZE + (off_t)done);
+		if(nb_read <= 0){
+			return ERR_IO;
+		}
+		done += (size_t)nb_read;
+	}
+
+	return ERR_NONE;
+}
+
+
 int sector_write(FILE *f, uint32_t sector, const void *data){
 	M_REQUIRE_NON_NULL(f);
 	M_REQUIRE_NON_NULL(data);
+	STATS_SCOPE(STATS_SECTOR_WRITE);
+	TRACE_SCOPE(TRACE_SECTOR_WRITE, sector, 1, 0);
 
-	int success = fseek(f, sector*SECTOR_SIZE, SEEK_SET);
-	if(success){
-		return ERR_IO;
-	}
-	size_t nb_written = fwrite(data, SECTOR_SIZE, 1, f);
-	if(nb_written != 1){  
+	ssize_t nb_written = pwrite(fileno(f), data, SECTOR_SIZE, (off_t)sector*SECTOR_SIZE);
+	if(nb_written != SECTOR_SIZE){  
 		return ERR_IO;
 	}
 
-	return ERR_NONE;
+	return csum_sector_written(f, sector, data);
 }
-
@@ -8,6 +8,7 @@
  * @date summer 2022
  */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -19,23 +20,33 @@ extern "C" {
  * TODO WEEK 04										   *
  * *************************************************** */
 /**
- * @brief read one 512-byte sector from the virtual disk
+ * @brief read one sector (SECTOR_SIZE bytes) from the virtual disk
  * @param f open file of the virtual disk
  * @param sector the location (in sector units, not bytes) within the virtual disk
- * @param data a pointer to 512-bytes of memory (OUT)
+ * @param data a pointer to SECTOR_SIZE bytes of memory (OUT)
  * @return 0 on success; <0 on error
  */
 int sector_read(FILE *f, uint32_t sector, void *data);
 
+/**
+ * @brief read count consecutive sectors from the virtual disk at once
+ * @param f open file of the virtual disk
+ * @param sector the location of the first sector (in sector units, not bytes)
+ * @param count the number of sectors
+ * @param data a pointer to count*SECTOR_SIZE bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_read_many(FILE *f, uint32_t sector, size_t count, void *data);
+
 
 /* *************************************************** *
  * TODO WEEK 11										   *
  * *************************************************** */
 /**
- * @brief write one 512-byte sector from the virtual disk
+ * @brief write one sector (SECTOR_SIZE bytes) to the virtual disk
  * @param f open file of the virtual disk
  * @param sector the location (in sector units, not bytes) within the virtual disk
- * @param data a pointer to 512-bytes of memory (IN)
+ * @param data a pointer to SECTOR_SIZE bytes of memory (IN)
  * @return 0 on success; <0 on error
  */
 int sector_write(FILE *f, uint32_t sector, const void *data);
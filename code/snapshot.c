@@ -0,0 +1,501 @@
+/**
+ * @file snapshot.c
+ * @brief copy-on-write snapshots of a filesystem
+ *
+ * The area of a snapshot holds s_isize sectors of inodes, then its bitmap:
+ * the words of a bitmap of the data sectors (bm_alloc(s_block_start,
+ * s_fsize)), as in memory. The union of the bitmaps of the snapshots is kept
+ * while mounted, pinned in the block bitmap. The snapshots only change
+ * through the commands, on one thread: they need no lock.
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "error.h"
+#include "mount.h"
+#include "sector.h"
+#include "inode.h"
+#include "bmblock.h"
+#include "filev6.h"
+#include "snapshot.h"
+#include "util.h"
+
+#define SNAPSHOT_BATCH_SECTORS 16   // inode sectors copied at once
+#define SNAPSHOT_TIME_FORMAT "%Y-%m-%d %H:%M:%S"
+
+struct snapshot_set {
+    uint32_t table;                                 // the sector listing them
+    struct snapshot_entry entries[SNAPSHOT_MAX];    // as on disk
+    struct bmblock_array *frozen;                   // union of their bitmaps
+};
+
+
+/* ************************************************************************** *
+ * Bitmaps and areas
+ * ************************************************************************** */
+
+// the size in sectors of the bitmap of a snapshot of u
+static uint32_t snapshot_fbmsize(const struct unix_filesystem *u){
+    return (uint32_t)((u->fbm->length*sizeof(uint64_t) + SECTOR_SIZE - 1)/SECTOR_SIZE);
+}
+
+static struct bmblock_array *snapshot_new_bitmap(const struct unix_filesystem *u){
+    return bm_alloc(u->s.s_block_start, u->s.s_fsize);
+}
+
+static int snapshot_read_bitmap(const struct unix_filesystem *u, const struct snapshot_entry *e,
+                                struct bmblock_array *bm){
+    uint8_t *data = malloc((size_t)e->fbmsize*SECTOR_SIZE);
+    if(data == NULL){
+        return ERR_NOMEM;
+    }
+    int ret = sector_read_many(u->f, e->start + e->isize, e->fbmsize, data);
+    if(ret == ERR_NONE){
+        memcpy(bm->bm, data, bm->length*sizeof(uint64_t));
+    }
+    free(data);
+    return ret;
+}
+
+static int snapshot_write_bitmap(const struct unix_filesystem *u, const struct snapshot_entry *e,
+                                 const struct bmblock_array *bm){
+    uint8_t *data = calloc(e->fbmsize, SECTOR_SIZE);
+    if(data == NULL){
+        return ERR_NOMEM;
+    }
+    memcpy(data, bm->bm, bm->length*sizeof(uint64_t));
+    int ret = ERR_NONE;
+    for(uint32_t k = 0; k < e->fbmsize && ret == ERR_NONE; k++){
+        ret = sector_write(u->f, e->start + e->isize + k, data + (size_t)k*SECTOR_SIZE);
+    }
+    free(data);
+    return ret;
+}
+
+static unsigned long snapshot_count(const struct bmblock_array *bm){
+    unsigned long count = 0;
+    for(size_t w = 0; w < bm->length; w++){
+        count += (unsigned long)__builtin_popcountll(bm->bm[w]);
+    }
+    return count;
+}
+
+// the union of the bitmaps of the snapshots of set, NULL if there is none
+static int snapshot_union(const struct unix_filesystem *u, const struct snapshot_set *set,
+                          struct bmblock_array **frozen){
+    *frozen = NULL;
+    struct bmblock_array *one = snapshot_new_bitmap(u);
+    struct bmblock_array *all = snapshot_new_bitmap(u);
+    int ret = (one == NULL || all == NULL) ? ERR_NOMEM : ERR_NONE;
+    int any = 0;
+    for(size_t k = 0; k < SNAPSHOT_MAX && ret == ERR_NONE; k++){
+        if(set->entries[k].name[0] == '\0'){
+            continue;
+        }
+        ret = snapshot_read_bitmap(u, &set->entries[k], one);
+        for(size_t w = 0; w < all->length && ret == ERR_NONE; w++){
+            all->bm[w] |= one->bm[w];
+        }
+        any = 1;
+    }
+    free(one);
+    if(ret != ERR_NONE || !any){
+        free(all);
+        return ret;
+    }
+    *frozen = all;
+    return ERR_NONE;
+}
+
+// the block bitmap pins the sectors of frozen (which may be NULL) from now on
+static void snapshot_pin(struct unix_filesystem *u, struct snapshot_set *set, struct bmblock_array *frozen){
+    free(set->frozen);
+    set->frozen = frozen;
+    u->fbm->pinned = frozen;
+}
+
+static void snapshot_reserve(struct unix_filesystem *u, const struct snapshot_entry *e, int reserve){
+    for(uint32_t k = 0; k < e->isize + e->fbmsize; k++){
+        if(reserve){
+            bm_set(u->fbm, e->start + k);
+        }else{
+            bm_clear(u->fbm, e->start + k);
+        }
+    }
+}
+
+// the index of the snapshot of that name in set, -1 if none
+static int snapshot_find(const struct snapshot_set *set, const char *name){
+    for(size_t k = 0; set != NULL && k < SNAPSHOT_MAX; k++){
+        if(set->entries[k].name[0] != '\0' && strcmp(set->entries[k].name, name) == 0){
+            return (int)k;
+        }
+    }
+    return -1;
+}
+
+// a free data sector for the table, marked as used
+static int snapshot_alloc_table(struct unix_filesystem *u){
+    int sector = bm_find_next(u->fbm);
+    if(sector >= 0 && ((uint32_t)sector < u->s.s_block_start || (uint32_t)sector >= u->s.s_fsize)){
+        sector = ERR_BITMAP_FULL;
+    }
+    if(sector >= 0){
+        bm_set(u->fbm, (uint64_t)sector);
+    }
+    return sector;
+}
+
+static int snapshot_write_superblock(struct unix_filesystem *u, uint32_t table){
+    u->s.s_snap_start = (sector_addr_t)table;
+    return sector_write(u->f, SUPERBLOCK_SECTOR, &u->s);
+}
+
+
+/* ************************************************************************** *
+ * Mounts
+ * ************************************************************************** */
+
+int snapshot_mount(struct unix_filesystem *u){
+    M_REQUIRE_NON_NULL(u);
+    u->snap = NULL;
+    if(u->s.s_snap_start == 0){
+        return ERR_NONE;
+    }
+
+    struct snapshot_set *set = calloc(1, sizeof(struct snapshot_set));
+    if(set == NULL){
+        return ERR_NOMEM;
+    }
+    set->table = u->s.s_snap_start;
+    int ret = (set->table < u->s.s_block_start || set->table >= u->s.s_fsize)
+              ? ERR_INCONSISTENT_FS : sector_read(u->f, set->table, set->entries);
+    for(size_t k = 0; k < SNAPSHOT_MAX && ret == ERR_NONE; k++){
+        const struct snapshot_entry *e = &set->entries[k];
+        if(e->name[0] != '\0'
+           && (e->name[SNAPSHOT_NAME_MAX] != '\0' || e->isize != u->s.s_isize || e->fbmsize != snapshot_fbmsize(u)
+               || e->start < u->s.s_block_start || e->start + e->isize + e->fbmsize > u->s.s_fsize)){
+            ret = ERR_INCONSISTENT_FS;
+        }
+    }
+    struct bmblock_array *frozen = NULL;
+    if(ret == ERR_NONE){
+        ret = snapshot_union(u, set, &frozen);
+    }
+    if(ret != ERR_NONE){
+        free(set);
+        return ret;
+    }
+
+    bm_set(u->fbm, set->table);
+    for(size_t k = 0; k < SNAPSHOT_MAX; k++){
+        if(set->entries[k].name[0] != '\0'){
+            snapshot_reserve(u, &set->entries[k], 1);
+        }
+    }
+    for(size_t w = 0; frozen != NULL && w < u->fbm->length; w++){
+        u->fbm->bm[w] |= frozen->bm[w];
+    }
+    snapshot_pin(u, set, frozen);
+    u->snap = set;
+    return ERR_NONE;
+}
+
+void snapshot_umount(struct unix_filesystem *u){
+    if(u != NULL && u->snap != NULL){
+        if(u->fbm != NULL){
+            u->fbm->pinned = NULL;
+        }
+        free(u->snap->frozen);
+        free(u->snap);
+        u->snap = NULL;
+    }
+}
+
+int snapshot_frozen(const struct unix_filesystem *u, uint32_t sector){
+    return u != NULL && u->snap != NULL && u->snap->frozen != NULL && bm_get(u->snap->frozen, sector) == 1;
+}
+
+int snapshot_keeps(const struct unix_filesystem *u, uint32_t sector){
+    if(u == NULL || u->snap == NULL){
+        return 0;
+    }
+    if(sector == u->snap->table || snapshot_frozen(u, sector)){
+        return 1;
+    }
+    for(size_t k = 0; k < SNAPSHOT_MAX; k++){
+        const struct snapshot_entry *e = &u->snap->entries[k];
+        if(e->name[0] != '\0' && sector >= e->start && sector - e->start < e->isize + e->fbmsize){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* ************************************************************************** *
+ * Commands
+ * ************************************************************************** */
+
+// copies the inode table to the area of e, and sets the sectors of its files in bm
+static int snapshot_copy_inodes(struct unix_filesystem *u, const struct snapshot_entry *e,
+                                struct bmblock_array *bm, unsigned long *files){
+    struct inode_sector inodes[SNAPSHOT_BATCH_SECTORS];
+    int ret = ERR_NONE;
+    for(uint32_t done = 0; done < e->isize && ret == ERR_NONE; done += SNAPSHOT_BATCH_SECTORS){
+        const uint32_t n = MIN(e->isize - done, SNAPSHOT_BATCH_SECTORS);
+        ret = sector_read_many(u->f, u->s.s_inode_start + done, n, inodes);
+        for(uint32_t k = 0; k < n && ret == ERR_NONE; k++){
+            for(size_t j = 0; j < INODES_PER_SECTOR && ret == ERR_NONE; j++){
+                const struct inode *i = &inodes[k].inodes[j];
+                const uint32_t inr = (done + k)*(uint32_t)INODES_PER_SECTOR + (uint32_t)j;
+                if(inr < ROOT_INUMBER || !(i->i_mode & IALLOC)){
+                    continue;
+                }
+                ret = inode_marksectors(u, i, bm);
+                (*files)++;
+            }
+            if(ret == ERR_NONE){
+                ret = sector_write(u->f, e->start + done + k, &inodes[k]);
+            }
+        }
+    }
+    return ret;
+}
+
+int snapshot_create(struct unix_filesystem *u, const char *name){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(name);
+    if(u->s.s_ronly || name[0] == '\0'){
+        return ERR_BAD_PARAMETER;
+    }
+    if(strlen(name) > SNAPSHOT_NAME_MAX){
+        return ERR_FILENAME_TOO_LONG;
+    }
+    if(snapshot_find(u->snap, name) >= 0){
+        return ERR_FILENAME_ALREADY_EXISTS;
+    }
+    // the inodes copied are those on the disk
+    int ret = inode_wb_flush(u);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    struct snapshot_set *set = u->snap;
+    if(set == NULL){
+        set = calloc(1, sizeof(struct snapshot_set));
+        int table = (set == NULL) ? ERR_NOMEM : snapshot_alloc_table(u);
+        if(table < 0){
+            free(set);
+            return table;
+        }
+        set->table = (uint32_t)table;
+    }
+    size_t slot = 0;
+    while(slot < SNAPSHOT_MAX && set->entries[slot].name[0] != '\0'){
+        slot++;
+    }
+
+    struct snapshot_entry e;
+    memset(&e, 0, sizeof(e));
+    strcpy(e.name, name);
+    e.time = (uint32_t)time(NULL);
+    e.isize = u->s.s_isize;
+    e.fbmsize = snapshot_fbmsize(u);
+    int start = (slot == SNAPSHOT_MAX) ? ERR_BITMAP_FULL : bm_find_run(u->fbm, e.isize + e.fbmsize);
+    if(start >= 0 && (uint32_t)start + e.isize + e.fbmsize > u->s.s_fsize){
+        start = ERR_BITMAP_FULL;
+    }
+    ret = (start < 0) ? start : ERR_NONE;
+    e.start = (uint32_t)MAX(start, 0);
+
+    // the area first, then the table, the superblock naming a new table last
+    struct bmblock_array *bm = NULL;
+    unsigned long files = 0;
+    if(ret == ERR_NONE){
+        snapshot_reserve(u, &e, 1);
+        bm = snapshot_new_bitmap(u);
+        ret = (bm == NULL) ? ERR_NOMEM : snapshot_copy_inodes(u, &e, bm, &files);
+    }
+    if(ret == ERR_NONE){
+        ret = snapshot_write_bitmap(u, &e, bm);
+    }
+    if(ret == ERR_NONE){
+        set->entries[slot] = e;
+        ret = sector_write(u->f, set->table, set->entries);
+        if(ret != ERR_NONE){
+            memset(&set->entries[slot], 0, sizeof(e));
+        }
+    }
+    if(ret == ERR_NONE && u->snap == NULL){
+        ret = snapshot_write_superblock(u, set->table);
+    }
+    if(ret != ERR_NONE){
+        if(start >= 0){
+            snapshot_reserve(u, &e, 0);
+        }
+        if(u->snap == NULL){
+            bm_clear(u->fbm, set->table);
+            free(set);
+        }
+        free(bm);
+        return ret;
+    }
+
+    // the sectors of the files are in use already: from now on they are pinned too
+    if(set->frozen != NULL){
+        for(size_t w = 0; w < bm->length; w++){
+            bm->bm[w] |= set->frozen->bm[w];
+        }
+    }
+    snapshot_pin(u, set, bm);
+    u->snap = set;
+    pps_printf("snapshot %s: %lu files, area of %" PRIu32 " sectors from %" PRIu32 "\n",
+               name, files, e.isize + e.fbmsize, e.start);
+    return ERR_NONE;
+}
+
+// the number of files in the inode table of snapshot e
+static int snapshot_files(const struct unix_filesystem *u, const struct snapshot_entry *e, unsigned long *files){
+    struct inode_sector inodes[SNAPSHOT_BATCH_SECTORS];
+    *files = 0;
+    for(uint32_t done = 0; done < e->isize; done += SNAPSHOT_BATCH_SECTORS){
+        const uint32_t n = MIN(e->isize - done, SNAPSHOT_BATCH_SECTORS);
+        int read = sector_read_many(u->f, e->start + done, n, inodes);
+        if(read != ERR_NONE){
+            return read;
+        }
+        for(uint32_t k = 0; k < n; k++){
+            for(size_t j = 0; j < INODES_PER_SECTOR; j++){
+                const uint32_t inr = (done + k)*(uint32_t)INODES_PER_SECTOR + (uint32_t)j;
+                *files += (inr >= ROOT_INUMBER && (inodes[k].inodes[j].i_mode & IALLOC));
+            }
+        }
+    }
+    return ERR_NONE;
+}
+
+int snapshot_list(const struct unix_filesystem *u){
+    M_REQUIRE_NON_NULL(u);
+    if(u->snap == NULL){
+        pps_printf("snapshot: none\n");
+        return ERR_NONE;
+    }
+    struct bmblock_array *bm = snapshot_new_bitmap(u);
+    if(bm == NULL){
+        return ERR_NOMEM;
+    }
+    int ret = ERR_NONE;
+    for(size_t k = 0; k < SNAPSHOT_MAX && ret == ERR_NONE; k++){
+        const struct snapshot_entry *e = &u->snap->entries[k];
+        if(e->name[0] == '\0'){
+            continue;
+        }
+        unsigned long files = 0;
+        ret = snapshot_files(u, e, &files);
+        if(ret == ERR_NONE){
+            ret = snapshot_read_bitmap(u, e, bm);
+        }
+        if(ret == ERR_NONE){
+            char taken[32];
+            const time_t when = (time_t)e->time;
+            struct tm tm;
+            strftime(taken, sizeof(taken), SNAPSHOT_TIME_FORMAT, localtime_r(&when, &tm));
+            pps_printf("snapshot %s: taken %s, %lu files, %lu sectors\n", e->name, taken, files, snapshot_count(bm));
+        }
+    }
+    free(bm);
+    return ret;
+}
+
+int snapshot_delete(struct unix_filesystem *u, const char *name){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(name);
+    if(u->s.s_ronly){
+        return ERR_BAD_PARAMETER;
+    }
+    struct snapshot_set *set = u->snap;
+    const int index = snapshot_find(set, name);
+    if(index < 0){
+        return ERR_NO_SUCH_FILE;
+    }
+    const struct snapshot_entry e = set->entries[index];
+    struct bmblock_array *gone = snapshot_new_bitmap(u);
+    struct bmblock_array *live = snapshot_new_bitmap(u);
+    int ret = (gone == NULL || live == NULL) ? ERR_NOMEM : snapshot_read_bitmap(u, &e, gone);
+
+    // the sectors used by the files, which stay in use
+    for(uint32_t inr = ROOT_INUMBER; inr < (uint32_t)u->s.s_isize*INODES_PER_SECTOR && ret == ERR_NONE; inr++){
+        struct inode i;
+        ret = inode_read(u, (uint16_t)inr, &i);
+        ret = (ret == ERR_NONE) ? inode_marksectors(u, &i, live) : ret;
+        ret = (ret == ERR_UNALLOCATED_INODE) ? ERR_NONE : ret;
+    }
+
+    // out of the table first: its area and sectors are free once it is written
+    int others = 0;
+    for(size_t k = 0; k < SNAPSHOT_MAX; k++){
+        others += ((int)k != index && set->entries[k].name[0] != '\0');
+    }
+    if(ret == ERR_NONE){
+        memset(&set->entries[index], 0, sizeof(e));
+        ret = others ? sector_write(u->f, set->table, set->entries) : snapshot_write_superblock(u, 0);
+        if(ret != ERR_NONE){
+            set->entries[index] = e;
+        }
+    }
+    struct bmblock_array *frozen = NULL;
+    if(ret == ERR_NONE){
+        ret = snapshot_union(u, set, &frozen);
+    }
+    if(ret != ERR_NONE){
+        free(gone);
+        free(live);
+        return ret;
+    }
+
+    snapshot_reserve(u, &e, 0);
+    snapshot_pin(u, set, frozen);
+    unsigned long freed = 0;
+    for(uint64_t sector = gone->min; sector <= gone->max; sector++){
+        if(bm_get(gone, sector) == 1 && bm_get(live, sector) == 0 && !snapshot_frozen(u, (uint32_t)sector)){
+            bm_clear(u->fbm, sector);
+            freed++;
+        }
+    }
+    if(!others){
+        bm_clear(u->fbm, set->table);
+        snapshot_umount(u);
+    }
+    free(gone);
+    free(live);
+    pps_printf("snapshot %s: deleted, %lu sectors freed\n", name, freed + e.isize + e.fbmsize);
+    return ERR_NONE;
+}
+
+int snapshot_open(struct unix_filesystem *u, const char *name){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(name);
+    const int index = snapshot_find(u->snap, name);
+    if(index < 0){
+        return ERR_NO_SUCH_FILE;
+    }
+
+    u->s.s_inode_start = (sector_addr_t)u->snap->entries[index].start;
+    u->s.s_ronly = 1;
+    inode_indirect_changed();
+    filev6_clusters_changed();
+    // the inode bitmap of the snapshot, as mountv6() builds it
+    for(uint32_t inr = ROOT_INUMBER; inr < (uint32_t)u->s.s_isize*INODES_PER_SECTOR; inr++){
+        struct inode i;
+        if(inode_read(u, (uint16_t)inr, &i) == ERR_UNALLOCATED_INODE){
+            bm_clear(u->ibm, inr);
+        }else{
+            bm_set(u->ibm, inr);
+        }
+    }
+    return ERR_NONE;
+}
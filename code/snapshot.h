@@ -0,0 +1,104 @@
+#pragma once
+
+/**
+ * @file snapshot.h
+ * @brief copy-on-write snapshots of a filesystem
+ *
+ * A snapshot is a copy of the inode table and of the block bitmap of the
+ * files (their data and indirect sectors) at the time it is taken: taking
+ * one costs the metadata, never the data. The snapshots are listed in the
+ * sector named by the superblock (s_snap_start); each has an area of the
+ * data sectors holding its two copies, reserved in the block bitmap at mount.
+ *
+ * The sectors in the bitmap of a snapshot are "frozen": they are pinned in
+ * the block bitmap of the mount (see bm_clear()), so that no file frees
+ * them for good, and they are never written in place: the file writing one,
+ * data sector (filev6.c) or indirect sector (inode.c), gets a copy of its
+ * own first. A snapshot is mounted read-only through FUSE, its inodes being
+ * read from its copy of the table (see snapshot_open()).
+ */
+
+#include <stdint.h>
+#include "mount.h"
+
+#define SNAPSHOT_NAME_MAX 15    /* characters of a name */
+#define SNAPSHOT_MAX (SECTOR_SIZE / sizeof(struct snapshot_entry))
+
+// the entry of a snapshot in the sector listing them, on disk
+struct snapshot_entry {
+    char name[SNAPSHOT_NAME_MAX + 1];   /* null terminated ("": a free entry) */
+    uint32_t time;                      /* when it was taken, in seconds since the epoch */
+    uint32_t start;                     /* first sector of its area: the inodes, then the bitmap */
+    uint32_t isize;                     /* size in sectors of its inode table (s_isize) */
+    uint32_t fbmsize;                   /* size in sectors of its block bitmap */
+};
+
+/**
+ * @brief load the snapshots of a filesystem being mounted, if it has some:
+ *        their areas are reserved in the block bitmap, their frozen sectors
+ *        set and pinned (called by mountv6())
+ * @param u the filesystem, its bitmaps built (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+int snapshot_mount(struct unix_filesystem *u);
+
+/**
+ * @brief forget the snapshots of a filesystem being unmounted (called by umountv6())
+ * @param u the filesystem (IN-OUT)
+ */
+void snapshot_umount(struct unix_filesystem *u);
+
+/**
+ * @brief whether a data sector is frozen by a snapshot, so that a file must
+ *        not write it in place
+ * @param u the filesystem (IN)
+ * @param sector the sector
+ * @return 1 if frozen; 0 otherwise
+ */
+int snapshot_frozen(const struct unix_filesystem *u, uint32_t sector);
+
+/**
+ * @brief whether a data sector is kept by the snapshots, though no file may
+ *        use it: frozen, or in the sector listing them or in their areas
+ * @param u the filesystem (IN)
+ * @param sector the sector
+ * @return 1 if kept; 0 otherwise
+ */
+int snapshot_keeps(const struct unix_filesystem *u, uint32_t sector);
+
+/**
+ * @brief take a snapshot of the files (the "snapshot create" command)
+ * @param u the filesystem (IN-OUT)
+ * @param name its name, at most SNAPSHOT_NAME_MAX characters
+ * @return 0 on success; <0 on error (ERR_FILENAME_ALREADY_EXISTS: the name
+ *         is taken, ERR_BITMAP_FULL: no room for another snapshot)
+ */
+int snapshot_create(struct unix_filesystem *u, const char *name);
+
+/**
+ * @brief print the snapshots, with their number of files and of frozen
+ *        sectors (the "snapshot list" command)
+ * @param u the filesystem (IN)
+ * @return 0 on success; <0 on error
+ */
+int snapshot_list(const struct unix_filesystem *u);
+
+/**
+ * @brief delete a snapshot, freeing its area and the sectors that neither
+ *        the files nor another snapshot use (the "snapshot delete" command)
+ * @param u the filesystem (IN-OUT)
+ * @param name its name
+ * @return 0 on success; <0 on error (ERR_NO_SUCH_FILE: no such snapshot)
+ */
+int snapshot_delete(struct unix_filesystem *u, const char *name);
+
+/**
+ * @brief turn a mount into a read-only view of a snapshot, before it is
+ *        mounted through FUSE: its inodes are read from the copy of the
+ *        snapshot (u->s.s_inode_start), and u->s.s_ronly is set. The
+ *        superblock of such a mount must not be written.
+ * @param u the filesystem, just mounted (IN-OUT)
+ * @param name the name of the snapshot
+ * @return 0 on success; <0 on error (ERR_NO_SUCH_FILE: no such snapshot)
+ */
+int snapshot_open(struct unix_filesystem *u, const char *name);
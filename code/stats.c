@@ -0,0 +1,189 @@
+/**
+ * @file stats.c
+ * @brief per-operation counters and latency histograms
+ *
+ * Every thread owns a struct stats_thread, registered in a global list the
+ * first time it counts something. Only the owner writes to it (relaxed
+ * atomic stores, so concurrent dumps read consistent words); when a thread
+ * exits its counters are added to the retired totals and the block is freed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "stats.h"
+#include "error.h"
+
+struct stats_entry {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[STATS_HIST_BUCKETS];
+};
+
+struct stats_thread {
+    struct stats_entry entries[STATS_NB_COUNTERS];
+    struct stats_thread *next;
+};
+
+static const char *const STATS_NAMES[STATS_NB_COUNTERS] = {
+    "sector_read",
+    "sector_write",
+    "inode_read",
+    "inode_write",
+    "dir_lookup",
+    "bm_alloc",
+    "fuse_getattr",
+    "fuse_readdir",
+    "fuse_read",
+    "csum_verify"
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;  // protects the two below
+static struct stats_thread *stats_threads = NULL;
+static struct stats_thread stats_retired;
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_thread *stats_local = NULL;
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+static void stats_merge(struct stats_thread *dst, const struct stats_thread *src){
+    for(int c = 0; c < STATS_NB_COUNTERS; c++){
+        struct stats_entry *d = &dst->entries[c];
+        const struct stats_entry *s = &src->entries[c];
+        d->count += LOAD(s->count);
+        d->total_ns += LOAD(s->total_ns);
+        const uint64_t max = LOAD(s->max_ns);
+        d->max_ns = max > d->max_ns ? max : d->max_ns;
+        for(int b = 0; b < STATS_HIST_BUCKETS; b++){
+            d->hist[b] += LOAD(s->hist[b]);
+        }
+    }
+}
+
+static void stats_thread_exit(void *arg){
+    struct stats_thread *t = arg;
+    pthread_mutex_lock(&stats_lock);
+    struct stats_thread **p = &stats_threads;
+    while(*p != t){
+        p = &(*p)->next;
+    }
+    *p = t->next;
+    stats_merge(&stats_retired, t);
+    pthread_mutex_unlock(&stats_lock);
+    free(t);
+}
+
+static void stats_key_init(void){
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+static struct stats_thread *stats_get_local(void){
+    if(stats_local == NULL){
+        struct stats_thread *t = calloc(1, sizeof(struct stats_thread));
+        if(t == NULL){
+            return NULL;
+        }
+        pthread_once(&stats_key_once, stats_key_init);
+        pthread_mutex_lock(&stats_lock);
+        t->next = stats_threads;
+        stats_threads = t;
+        pthread_mutex_unlock(&stats_lock);
+        pthread_setspecific(stats_key, t);
+        stats_local = t;
+    }
+    return stats_local;
+}
+
+uint64_t stats_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void stats_add(enum stats_counter counter, uint64_t start){
+    struct stats_thread *t = stats_get_local();
+    if(t == NULL || counter >= STATS_NB_COUNTERS){
+        return;
+    }
+    const uint64_t ns = stats_now() - start;
+    const int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+
+    struct stats_entry *e = &t->entries[counter];
+    STORE(e->count, e->count + 1);
+    STORE(e->total_ns, e->total_ns + ns);
+    if(ns > e->max_ns){
+        STORE(e->max_ns, ns);
+    }
+    const int b = bucket < STATS_HIST_BUCKETS ? bucket : STATS_HIST_BUCKETS - 1;
+    STORE(e->hist[b], e->hist[b] + 1);
+}
+
+void stats_scope_end(struct stats_scope *scope){
+    stats_add(scope->counter, scope->start);
+}
+
+// upper bound, in ns, of the bucket holding the given rank
+static uint64_t stats_percentile(const struct stats_entry *e, double p){
+    const uint64_t rank = (uint64_t)(p * (double)e->count);
+    uint64_t seen = 0;
+    for(int b = 0; b < STATS_HIST_BUCKETS; b++){
+        seen += e->hist[b];
+        if(seen > rank){
+            const uint64_t bound = (uint64_t)1 << (b + 1);
+            return bound < e->max_ns ? bound : e->max_ns;
+        }
+    }
+    return e->max_ns;
+}
+
+size_t stats_render(char *buf, size_t size){
+    if(buf == NULL){
+        size = 0;
+    }
+    struct stats_thread all;
+    memset(&all, 0, sizeof(all));
+    pthread_mutex_lock(&stats_lock);
+    stats_merge(&all, &stats_retired);
+    for(const struct stats_thread *t = stats_threads; t != NULL; t = t->next){
+        stats_merge(&all, t);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    size_t len = 0;
+    for(int c = 0; c < STATS_NB_COUNTERS; c++){
+        const struct stats_entry *e = &all.entries[c];
+        const double avg = e->count ? (double)e->total_ns/(double)e->count/1000.0 : 0.0;
+        const uint64_t p50_ns = stats_percentile(e, 0.50);
+        const uint64_t p99_ns = stats_percentile(e, 0.99);
+        const int n = snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0,
+                               "%-13s count=%" PRIu64 " avg_us=%.3f p50_us=%.3f p99_us=%.3f max_us=%.3f\n",
+                               STATS_NAMES[c], e->count, avg,
+                               (double)p50_ns/1000.0,
+                               (double)p99_ns/1000.0,
+                               (double)e->max_ns/1000.0);
+        if(n > 0){
+            len += (size_t)n;
+        }
+    }
+    return len;
+}
+
+int stats_print(void){
+    const size_t len = stats_render(NULL, 0);
+    char *buf = malloc(len + 1);
+    if(buf == NULL){
+        return ERR_NOMEM;
+    }
+    stats_render(buf, len + 1);
+    const int ret = fputs(buf, stdout) < 0 ? ERR_IO : ERR_NONE;
+    free(buf);
+    return ret;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+/**
+ * @file stats.h
+ * @brief per-operation counters and latency histograms
+ *
+ * Each thread updates its own counters (no lock, no shared cache line);
+ * the dumps add up the counters of all the threads, alive or gone.
+ * Building with -DU6FS_NO_STATS compiles the instrumentation out.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum stats_counter {
+    STATS_SECTOR_READ,
+    STATS_SECTOR_WRITE,
+    STATS_INODE_READ,
+    STATS_INODE_WRITE,
+    STATS_DIR_LOOKUP,
+    STATS_BM_ALLOC,
+    STATS_FUSE_GETATTR,
+    STATS_FUSE_READDIR,
+    STATS_FUSE_READ,
+    STATS_CSUM_VERIFY,
+    STATS_NB_COUNTERS
+};
+
+#define STATS_HIST_BUCKETS 40   /* bucket b: latencies in [2^b, 2^(b+1)) ns */
+
+/* path of the read-only virtual file showing the stats in the FUSE mount */
+#define STATS_FUSE_FILE "/.u6fs_stats"
+
+struct stats_scope {
+    enum stats_counter counter;
+    uint64_t start;
+};
+
+/**
+ * @brief current time, in nanoseconds, of a monotonic clock
+ */
+uint64_t stats_now(void);
+
+/**
+ * @brief count one operation of the given kind, started at start (stats_now())
+ * @param counter the kind of operation
+ * @param start when the operation started
+ */
+void stats_add(enum stats_counter counter, uint64_t start);
+
+/**
+ * @brief end of a STATS_SCOPE (called automatically)
+ */
+void stats_scope_end(struct stats_scope *scope);
+
+#ifdef U6FS_NO_STATS
+#define STATS_SCOPE(counter) do {} while(0)
+#else
+/**
+ * @brief count the enclosing block as one operation, timed until the block is left
+ *        (whatever the return statement taken)
+ */
+#define STATS_SCOPE(counter) \
+    struct stats_scope stats_scope_ __attribute__((cleanup(stats_scope_end))) = { (counter), stats_now() }
+#endif
+
+/**
+ * @brief write a text dump of all the counters into buf (NUL-terminated, truncated if needed)
+ * @param buf the destination (OUT)
+ * @param size the size of buf
+ * @return the length of the whole dump (may be >= size, like snprintf)
+ */
+size_t stats_render(char *buf, size_t size);
+
+/**
+ * @brief print the dump of all the counters to stdout
+ * @return 0 on success; <0 on error
+ */
+int stats_print(void);
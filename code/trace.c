@@ -0,0 +1,342 @@
+/**
+ * @file trace.c
+ * @brief opt-in binary trace of the sector accesses and FUSE operations
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "unixv6fs.h"
+#include "sector.h"
+#include "inode.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+
+#define SUCCESS 1
+
+struct trace_buffer {
+    struct trace_event events[TRACE_BUF_EVENTS];
+    size_t count;
+    uint16_t thread;
+    struct trace_buffer *next;
+};
+
+int trace_enabled = 0;
+__thread uint8_t trace_current_subsys = TRACE_SUB_OTHER;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;  // protects the fields below
+static FILE *trace_file = NULL;
+static struct trace_buffer *trace_buffers = NULL;
+static uint16_t trace_nb_threads = 0;
+static int trace_error = ERR_NONE;
+static uint64_t trace_origin = 0;
+
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_buffer *trace_local = NULL;
+static __thread unsigned trace_depth = 0;
+
+// caller holds trace_lock
+static void trace_write_buffer(struct trace_buffer *b){
+    if(b->count > 0 && trace_file != NULL
+       && fwrite(b->events, sizeof(struct trace_event), b->count, trace_file) != b->count){
+        trace_error = ERR_IO;
+    }
+    b->count = 0;
+}
+
+static void trace_thread_exit(void *arg){
+    struct trace_buffer *b = arg;
+    pthread_mutex_lock(&trace_lock);
+    struct trace_buffer **p = &trace_buffers;
+    while(*p != NULL && *p != b){
+        p = &(*p)->next;
+    }
+    if(*p == b){
+        *p = b->next;
+        trace_write_buffer(b);
+        free(b);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_key_init(void){
+    pthread_key_create(&trace_key, trace_thread_exit);
+}
+
+static struct trace_buffer *trace_get_local(void){
+    if(trace_local == NULL){
+        struct trace_buffer *b = calloc(1, sizeof(struct trace_buffer));
+        if(b == NULL){
+            return NULL;
+        }
+        pthread_mutex_lock(&trace_lock);
+        b->thread = trace_nb_threads++;
+        b->next = trace_buffers;
+        trace_buffers = b;
+        pthread_mutex_unlock(&trace_lock);
+        pthread_setspecific(trace_key, b);
+        trace_local = b;
+    }
+    return trace_local;
+}
+
+int trace_start(const char *path){
+    M_REQUIRE_NON_NULL(path);
+    if(trace_file != NULL){
+        return ERR_BAD_PARAMETER;
+    }
+    pthread_once(&trace_key_once, trace_key_init);
+
+    FILE *f = fopen(path, "wb");
+    if(f == NULL){
+        return ERR_IO;
+    }
+    struct trace_header header = {0};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.event_size = sizeof(struct trace_event);
+    if(fwrite(&header, sizeof(header), 1, f) != 1){
+        fclose(f);
+        return ERR_IO;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    trace_file = f;
+    trace_error = ERR_NONE;
+    trace_nb_threads = 0;
+    trace_origin = stats_now();
+    pthread_mutex_unlock(&trace_lock);
+    trace_enabled = 1;
+    return ERR_NONE;
+}
+
+int trace_stop(void){
+    if(trace_file == NULL){
+        return ERR_NONE;
+    }
+    trace_enabled = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    while(trace_buffers != NULL){
+        struct trace_buffer *b = trace_buffers;
+        trace_buffers = b->next;
+        trace_write_buffer(b);
+        free(b);
+    }
+    if(fclose(trace_file)){
+        trace_error = ERR_IO;
+    }
+    trace_file = NULL;
+    const int ret = trace_error;
+    pthread_mutex_unlock(&trace_lock);
+
+    pthread_setspecific(trace_key, NULL);
+    trace_local = NULL;
+    return ret;
+}
+
+uint64_t trace_scope_begin(void){
+    if(!trace_enabled){
+        return 0;
+    }
+    trace_depth++;
+    return stats_now();
+}
+
+void trace_scope_end(struct trace_scope *scope){
+    if(scope->start == 0){
+        return;
+    }
+    trace_depth--;
+    struct trace_buffer *b = trace_enabled ? trace_get_local() : NULL;
+    if(b == NULL){
+        return;
+    }
+
+    const uint64_t now = stats_now();
+    struct trace_event *e = &b->events[b->count];
+    e->time_ns = scope->start - trace_origin;
+    e->offset = scope->offset;
+    e->latency_ns = (uint32_t)MIN(now - scope->start, UINT32_MAX);
+    e->arg = scope->arg;
+    e->size = scope->size;
+    e->thread = b->thread;
+    e->type = scope->type;
+    e->subsys = (uint8_t)(trace_current_subsys | (trace_depth > 0 ? TRACE_NESTED : 0));
+
+    if(++b->count == TRACE_BUF_EVENTS){
+        pthread_mutex_lock(&trace_lock);
+        trace_write_buffer(b);
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+void trace_subsys_restore(uint8_t *previous){
+    trace_current_subsys = *previous;
+}
+
+
+static int trace_cmp_time(const void *a, const void *b){
+    const struct trace_event *x = a, *y = b;
+    return (x->time_ns > y->time_ns) - (x->time_ns < y->time_ns);
+}
+
+static int trace_load(const char *path, struct trace_event **events, size_t *count){
+    FILE *f = fopen(path, "rb");
+    if(f == NULL){
+        return ERR_IO;
+    }
+    struct trace_header header;
+    if(fread(&header, sizeof(header), 1, f) != 1
+       || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+       || header.event_size != sizeof(struct trace_event)){
+        fclose(f);
+        return ERR_BAD_PARAMETER;
+    }
+
+    size_t max = 0;
+    *events = NULL;
+    *count = 0;
+    int ret = ERR_NONE;
+    for(;;){
+        if(*count == max){
+            max = max ? 2*max : TRACE_BUF_EVENTS;
+            struct trace_event *grown = realloc(*events, max*sizeof(struct trace_event));
+            if(grown == NULL){
+                ret = ERR_NOMEM;
+                break;
+            }
+            *events = grown;
+        }
+        const size_t n = fread(*events + *count, sizeof(struct trace_event), max - *count, f);
+        *count += n;
+        if(*count < max){
+            ret = ferror(f) ? ERR_IO : ERR_NONE;
+            break;
+        }
+    }
+    fclose(f);
+    if(ret != ERR_NONE){
+        free(*events);
+        *events = NULL;
+        return ret;
+    }
+    qsort(*events, *count, sizeof(struct trace_event), trace_cmp_time);
+    return ERR_NONE;
+}
+
+static int trace_replay_read(struct unix_filesystem *u, const struct trace_event *e, uint8_t **buf, size_t *buf_size){
+    struct filev6 fv6;
+    int ret = filev6_open(u, (uint16_t)e->arg, &fv6);
+    if(ret == ERR_NONE){
+        ret = filev6_lseek(&fv6, (int32_t)e->offset);
+    }
+    if(ret == ERR_NONE && e->size > *buf_size){
+        uint8_t *grown = realloc(*buf, e->size);
+        if(grown == NULL){
+            return ERR_NOMEM;
+        }
+        *buf = grown;
+        *buf_size = e->size;
+    }
+    return ret == ERR_NONE ? filev6_readbytes(&fv6, *buf, e->size) : ret;
+}
+
+static int trace_replay_readdir(struct unix_filesystem *u, const struct trace_event *e){
+    struct directory_reader d;
+    int ret = direntv6_opendir(u, (uint16_t)e->arg, &d);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    char name[DIRENT_MAXLEN+1];
+    uint16_t child_inr = 0;
+    while((ret = direntv6_readdir(&d, name, &child_inr)) == SUCCESS){
+    }
+    return ret;
+}
+
+// re-issues one event; returns <0 if it failed
+static int trace_replay_one(struct unix_filesystem *u, const struct trace_event *e, uint8_t **buf, size_t *buf_size){
+    struct inode i;
+    switch(e->type){
+    case TRACE_SECTOR_READ:
+        if((size_t)e->size*SECTOR_SIZE > *buf_size){
+            uint8_t *grown = realloc(*buf, (size_t)e->size*SECTOR_SIZE);
+            if(grown == NULL){
+                return ERR_NOMEM;
+            }
+            *buf = grown;
+            *buf_size = (size_t)e->size*SECTOR_SIZE;
+        }
+        return sector_read_many(u->f, e->arg, e->size, *buf);
+    case TRACE_SECTOR_WRITE: {
+        // same sector, same content: the access pattern without changing the image
+        uint8_t sector[SECTOR_SIZE];
+        const int ret = sector_read(u->f, e->arg, sector);
+        return ret == ERR_NONE ? sector_write(u->f, e->arg, sector) : ret;
+    }
+    case TRACE_FUSE_GETATTR:
+        return inode_read(u, (uint16_t)e->arg, &i);
+    case TRACE_FUSE_READDIR:
+        return trace_replay_readdir(u, e);
+    case TRACE_FUSE_READ:
+        return trace_replay_read(u, e, buf, buf_size);
+    default:
+        return ERR_BAD_PARAMETER;
+    }
+}
+
+int trace_replay(struct unix_filesystem *u, const char *path){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(path);
+
+    struct trace_event *events = NULL;
+    size_t count = 0;
+    int ret = trace_load(path, &events, &count);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    uint64_t per_type[TRACE_NB_TYPES] = {0};
+    uint64_t replayed = 0, failed = 0, traced_ns = 0, skipped = 0;
+    uint8_t *buf = NULL;
+    size_t buf_size = 0;
+    const uint64_t start = stats_now();
+    for(size_t k = 0; k < count && ret == ERR_NONE; k++){
+        const struct trace_event *e = &events[k];
+        traced_ns = MAX(traced_ns, e->time_ns + e->latency_ns);
+        if((e->subsys & TRACE_NESTED) || e->type >= TRACE_NB_TYPES
+           || (e->type >= TRACE_FUSE_GETATTR && e->arg == 0)){
+            // nested, unknown, or a FUSE operation on a path that did not resolve
+            skipped++;
+            continue;
+        }
+        const int r = trace_replay_one(u, e, &buf, &buf_size);
+        if(r == ERR_NOMEM){
+            ret = r;
+        }
+        failed += (r < 0);
+        per_type[e->type]++;
+        replayed++;
+    }
+    const double elapsed = (double)(stats_now() - start)*1e-9;
+    free(buf);
+    free(events);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    pps_printf("replayed %" PRIu64 " of %zu events (%" PRIu64 " sector reads, %" PRIu64 " sector writes, %"
+               PRIu64 " FUSE operations, %" PRIu64 " failed, %" PRIu64 " skipped) in %.3f s; traced span %.3f s\n",
+               replayed, count, per_type[TRACE_SECTOR_READ], per_type[TRACE_SECTOR_WRITE],
+               per_type[TRACE_FUSE_GETATTR] + per_type[TRACE_FUSE_READDIR] + per_type[TRACE_FUSE_READ],
+               failed, skipped, elapsed, (double)traced_ns*1e-9);
+    return ERR_NONE;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+/**
+ * @file trace.h
+ * @brief opt-in binary trace of the sector accesses and FUSE operations
+ *
+ * Set U6FS_TRACE=<file> to record a trace. Each thread appends fixed-size
+ * events to its own buffer, written to the file in one block when full
+ * (and when the thread exits or the trace stops). Events are not in
+ * global time order in the file; sort them by time_ns.
+ */
+
+#include <stdint.h>
+#include "mount.h"
+
+#define TRACE_ENV "U6FS_TRACE"
+#define TRACE_MAGIC "U6TRACE1"
+#define TRACE_BUF_EVENTS 4096   /* events buffered per thread before a write */
+
+enum trace_type {
+    TRACE_SECTOR_READ,      /* arg: first sector, size: number of sectors */
+    TRACE_SECTOR_WRITE,     /* arg: sector, size: 1 */
+    TRACE_FUSE_GETATTR,     /* arg: inode number */
+    TRACE_FUSE_READDIR,     /* arg: inode number */
+    TRACE_FUSE_READ,        /* arg: inode number, size: bytes, offset: byte offset */
+    TRACE_NB_TYPES
+};
+
+/* the subsystem that issued a sector access */
+enum trace_subsys {
+    TRACE_SUB_OTHER,
+    TRACE_SUB_MOUNT,
+    TRACE_SUB_INODE,
+    TRACE_SUB_FILE,
+    TRACE_SUB_DIR,
+    TRACE_NB_SUBSYS
+};
+
+/* set in subsys when the event happened during another traced event of the
+ * same thread (e.g. the sector reads of a FUSE read) */
+#define TRACE_NESTED 0x80
+
+struct trace_header {
+    char magic[8];          /* TRACE_MAGIC, not NUL-terminated */
+    uint32_t event_size;    /* sizeof(struct trace_event) */
+    uint32_t reserved;
+};
+
+struct trace_event {
+    uint64_t time_ns;       /* start, from the beginning of the trace */
+    uint64_t offset;
+    uint32_t latency_ns;
+    uint32_t arg;
+    uint32_t size;
+    uint16_t thread;
+    uint8_t type;           /* enum trace_type */
+    uint8_t subsys;         /* enum trace_subsys, | TRACE_NESTED */
+};
+
+struct trace_scope {
+    uint8_t type;
+    uint32_t arg;
+    uint32_t size;
+    uint64_t offset;
+    uint64_t start;         /* 0 when the trace is off */
+};
+
+extern int trace_enabled;
+extern __thread uint8_t trace_current_subsys;
+
+/**
+ * @brief start recording into the given file (overwritten)
+ * @param path the trace file
+ * @return 0 on success; <0 on error
+ */
+int trace_start(const char *path);
+
+/**
+ * @brief write the buffered events of all the threads and close the trace.
+ *        The traced threads must be done (joined) or be the caller.
+ * @return 0 on success; <0 on error
+ */
+int trace_stop(void);
+
+/**
+ * @brief begin/end of a TRACE_SCOPE (called by the macros)
+ */
+uint64_t trace_scope_begin(void);
+void trace_scope_end(struct trace_scope *scope);
+
+/**
+ * @brief restore the subsystem tag at the end of a TRACE_SUBSYS block (called automatically)
+ */
+void trace_subsys_restore(uint8_t *previous);
+
+/**
+ * @brief record the enclosing block as one event of the given type, timed until
+ *        the block is left; TRACE_SET_ARG() updates its argument once known
+ */
+#define TRACE_SCOPE(type, arg, size, offset) \
+    struct trace_scope trace_scope_ __attribute__((cleanup(trace_scope_end))) = \
+        { (type), (uint32_t)(arg), (uint32_t)(size), (uint64_t)(offset), trace_scope_begin() }
+#define TRACE_SET_ARG(value) (trace_scope_.arg = (uint32_t)(value))
+
+/**
+ * @brief tag the sector accesses of the enclosing block with the given subsystem
+ */
+#define TRACE_SUBSYS(subsys) \
+    uint8_t trace_subsys_ __attribute__((cleanup(trace_subsys_restore))) = trace_current_subsys; \
+    trace_current_subsys = (subsys)
+
+/**
+ * @brief re-issue the operations of a trace against a mounted filesystem, as
+ *        fast as possible and in time order, then print a summary to stdout.
+ *        Sector writes rewrite the current content of the sector;
+ *        nested events are not replayed (their parent is) and FUSE operations
+ *        start from the recorded inode, without the path lookup.
+ * @param u the mounted filesystem
+ * @param path the trace file
+ * @return 0 on success; <0 on error
+ */
+int trace_replay(struct unix_filesystem *u, const char *path);
@@ -9,20 +9,28 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "error.h"
 #include "mount.h"
 #include "u6fs_utils.h"
 #include "inode.h"
 #include "direntv6.h"
 #include "bmblock.h"
+#include "util.h"
+#include "u6fs_import.h"
+#include "u6fs_export.h"
+#include "stats.h"
+#include "trace.h"
+#include "u6fs_serve.h"
+#include "u6fs_fuse.h"
+#include "fsck.h"
+#include "defrag.h"
+#include "csum.h"
+#include "dedup.h"
+#include "snapshot.h"
 
-
-#define FTELL_ERROR -1L
-
-//helper function for add method in shell
-int utils_add_file(struct unix_filesystem *u, const char* destination_file, const char* source_file);
-    
 /* *************************************************** *
  * TODO WEEK 04-07: Add more messages                  *
  * *************************************************** */
@@ -33,12 +41,33 @@ static void usage(const char *execname, int err)
         pps_printf("%s <disk> sb\n", execname);
         pps_printf("%s <disk> inode\n", execname);
         pps_printf("%s <disk> cat1 <inr>\n", execname);
-        pps_printf("%s <disk> shafiles\n", execname);
-        pps_printf("%s <disk> tree\n", execname);
-        pps_printf("%s <disk> fuse <mountpoint>\n", execname);
-        pps_printf("%s <disk> bm", execname);
-        pps_printf("%s <disk> mkdir </path/to/newdir>", execname); //WEEK11
-        pps_printf("%s <disk> add <dest> <disk>", execname);  //pas sur de la commande, je l'ai un peu inventé mdrr
+        pps_printf("%s <disk> shafiles [<threads>]\n", execname);
+        pps_printf("%s <disk> tree [<threads>]\n", execname);
+        pps_printf("%s <disk> fuse <mountpoint> [--defrag | --snapshot <name>]\n", execname);
+        pps_printf("%s <disk> bm\n", execname);
+        pps_printf("%s <disk> mkdir </path/to/newdir>\n", execname); //WEEK11
+        pps_printf("%s <disk> add <dest> <disk>\n", execname);  //pas sur de la commande, je l'ai un peu inventé mdrr
+        pps_printf("%s <disk> import <host_dir> <dest>\n", execname);
+        pps_printf("%s <disk> export <src> <host_dir> [<threads>]\n", execname);
+        pps_printf("%s <disk> compact <dir>\n", execname);
+        pps_printf("%s <disk> dirtree <dir>\n", execname);
+        pps_printf("%s <disk> compress <file>\n", execname);
+        pps_printf("%s <disk> uncompress <file>\n", execname);
+        pps_printf("%s <disk> stats\n", execname);
+        pps_printf("%s <disk> replay <trace>\n", execname);
+        pps_printf("%s <disk> serve <socket>\n", execname);
+        pps_printf("%s <disk> fsck [--repair]\n", execname);
+        pps_printf("%s <disk> defrag\n", execname);
+        pps_printf("%s <disk> csum enable|disable|verify\n", execname);
+        pps_printf("%s <disk> dedup enable\n", execname);
+        pps_printf("%s <disk> dedup scan [<threads>]\n", execname);
+        pps_printf("%s <disk> snapshot create|delete <name>\n", execname);
+        pps_printf("%s <disk> snapshot list\n", execname);
+        pps_printf("%s <disk> shell\n", execname);
+        pps_printf("%s <disk> batch <script>\n", execname);
+        pps_printf("(shell and batch run one of the commands above per line, on a single mount)\n");
+        pps_printf("(set " TRACE_ENV "=<trace> to record the sector accesses and FUSE operations)\n");
+        pps_printf("(set " CSUM_ENV "=off|warn|strict to choose what a read does with a bad checksum)\n");
     } else if (err > ERR_FIRST && err < ERR_LAST) {
         pps_printf("%s: Error: %s\n", execname, ERR_MESSAGES[err - ERR_FIRST]);
     } else {
@@ -50,9 +79,160 @@ static void usage(const char *execname, int err)
 
 #define CMD(a, b) (strcmp(argv[2], a) == 0 && argc == (b))
 
+#define SHELL_MAX_ARGS 8
+#define SHELL_PROMPT "u6fs> "
+
 /* *************************************************** *
  * TODO WEEK 04-11: Add more commands                  *
  * *************************************************** */
+/**
+ * @brief Runs one command on a mounted filesystem, or returns ERR_INVALID_COMMAND if the command is not found.
+ *
+ * @param u the mounted filesystem
+ * @param argc (int) the number of arguments, the command being argv[2]
+ * @param argv (char*[]) the arguments, as passed to main()
+ */
+static int u6fs_run_cmd(struct unix_filesystem *u, int argc, char *argv[])
+{
+    // what the command takes from the scratch arena is released at its end
+    ARENA_SCOPE(scratch);
+    int error = ERR_NONE;
+
+    if (CMD("sb", 3)) {
+        error = utils_print_superblock(u);
+    }else if (CMD("inode", 3)){
+        error = inode_scan_print(u);
+    }else if (CMD("cat1", 4)){
+        uint16_t inr = (uint16_t)atoi(argv[3]);
+        error = utils_cat_first_sector(u, inr);
+    }else if (CMD("shafiles", 3)){
+        error = utils_print_sha_allfiles(u);
+    }else if (CMD("shafiles", 4)){
+        error = utils_print_sha_allfiles_parallel(u, atoi(argv[3]));
+    }else if (CMD("tree", 3)){
+        long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        error = utils_print_tree_parallel(u, (int)MIN(MAX(nb_cpus, 1), UTILS_MAX_THREADS));
+    }else if (CMD("tree", 4)){
+        error = utils_print_tree_parallel(u, atoi(argv[3]));
+    }else if (CMD("fuse", 4)){
+        error = u6fs_fuse_main(u, argv[3]);
+    }else if (CMD("fuse", 5) && strcmp(argv[4], "--defrag") == 0){
+        error = u6fs_fuse_main_opts(u, argv[3], U6FS_FUSE_DEFRAG);
+    }else if (CMD("fuse", 6) && strcmp(argv[4], "--snapshot") == 0){
+        error = snapshot_open(u, argv[5]);
+        if(error == ERR_NONE){
+            error = u6fs_fuse_main(u, argv[3]);
+        }
+    }else if(CMD("bm", 3)){
+        error = utils_print_bitmaps(u);
+    }else if(CMD("mkdir", 4)){
+        int add = direntv6_create(u, argv[3], IWRITE | IREAD | IEXEC | IFDIR);
+        error = (add < ERR_NONE) ? add : ERR_NONE;
+    }else if(CMD("add", 5)){
+        error = import_file(u, argv[4], argv[3]);
+    }else if(CMD("import", 5)){
+        error = import_tree(u, argv[3], argv[4]);
+    }else if(CMD("export", 5)){
+        long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        error = export_tree(u, argv[3], argv[4], (int)MIN(MAX(nb_cpus, 1), EXPORT_MAX_THREADS));
+    }else if(CMD("export", 6)){
+        error = export_tree(u, argv[3], argv[4], atoi(argv[5]));
+    }else if(CMD("compact", 4)){
+        error = utils_compact_dir(u, argv[3], 0);
+    }else if(CMD("dirtree", 4)){
+        error = utils_compact_dir(u, argv[3], 1);
+    }else if(CMD("compress", 4)){
+        error = utils_compress_file(u, argv[3], 1);
+    }else if(CMD("uncompress", 4)){
+        error = utils_compress_file(u, argv[3], 0);
+    }else if(CMD("stats", 3)){
+        error = stats_print();
+    }else if(CMD("replay", 4)){
+        error = trace_replay(u, argv[3]);
+    }else if(CMD("serve", 4)){
+        error = serve_main(u, argv[3]);
+    }else if(CMD("fsck", 3) || (CMD("fsck", 4) && strcmp(argv[3], "--repair") == 0)){
+        long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        error = fsck_run(u, argc == 4, (int)MIN(MAX(nb_cpus, 1), FSCK_MAX_THREADS));
+    }else if(CMD("defrag", 3)){
+        error = defrag_run(u);
+    }else if(CMD("csum", 4) && strcmp(argv[3], "enable") == 0){
+        error = csum_enable(u);
+    }else if(CMD("csum", 4) && strcmp(argv[3], "disable") == 0){
+        error = csum_disable(u);
+    }else if(CMD("csum", 4) && strcmp(argv[3], "verify") == 0){
+        error = csum_scrub(u);
+    }else if(CMD("dedup", 4) && strcmp(argv[3], "enable") == 0){
+        error = dedup_enable(u);
+    }else if(CMD("dedup", 4) && strcmp(argv[3], "scan") == 0){
+        long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        error = dedup_scan(u, (int)MIN(MAX(nb_cpus, 1), DEDUP_MAX_THREADS));
+    }else if(CMD("dedup", 5) && strcmp(argv[3], "scan") == 0){
+        error = dedup_scan(u, atoi(argv[4]));
+    }else if(CMD("snapshot", 5) && strcmp(argv[3], "create") == 0){
+        error = snapshot_create(u, argv[4]);
+    }else if(CMD("snapshot", 4) && strcmp(argv[3], "list") == 0){
+        error = snapshot_list(u);
+    }else if(CMD("snapshot", 5) && strcmp(argv[3], "delete") == 0){
+        error = snapshot_delete(u, argv[4]);
+    }else{
+        error = ERR_INVALID_COMMAND;
+    }
+    return error;
+}
+
+/**
+ * @brief Runs the commands read from a script or from the user, one per line
+ *        ('#' starts a comment), on a single mount: the inode writes are
+ *        batched (see inode_wb_enable()) and reach the disk on umountv6().
+ *
+ * @param u the mounted filesystem
+ * @param argv (char*[]) the arguments of the command line (the program and the disk)
+ * @param f the commands
+ * @param interactive whether to prompt and go on after an error, rather than stop at the first one
+ */
+static int u6fs_run_script(struct unix_filesystem *u, char *argv[], FILE *f, int interactive)
+{
+    int error = inode_wb_enable(u);
+    char *line = NULL;
+    size_t line_size = 0;
+
+    while (error == ERR_NONE) {
+        if (interactive) {
+            pps_printf(SHELL_PROMPT);
+            fflush(stdout);
+        }
+        if (getline(&line, &line_size, f) < 0) {
+            break;
+        }
+
+        char *args[SHELL_MAX_ARGS + 2] = { argv[0], argv[1] };
+        int nb_args = 2;
+        char *save = NULL;
+        for (char *tok = strtok_r(line, " \t\r\n", &save); tok != NULL && tok[0] != '#';
+             tok = strtok_r(NULL, " \t\r\n", &save)) {
+            if (nb_args < SHELL_MAX_ARGS + 2) {
+                args[nb_args] = tok;
+            }
+            nb_args++;
+        }
+        if (nb_args == 2) {
+            continue;
+        }
+        if (strcmp(args[2], "quit") == 0 || strcmp(args[2], "exit") == 0) {
+            break;
+        }
+
+        error = (nb_args > SHELL_MAX_ARGS + 2) ? ERR_INVALID_COMMAND : u6fs_run_cmd(u, nb_args, args);
+        if (error != ERR_NONE && interactive) {
+            usage(argv[0], error);
+            error = ERR_NONE;
+        }
+    }
+    free(line);
+    return error;
+}
+
 /**
  * @brief Runs the command requested by the user in the command line, or returns ERR_INVALID_COMMAND if the command is not found.
  *
@@ -71,28 +251,16 @@ int u6fs_do_one_cmd(int argc, char *argv[])
         return error;
     }
 
-    if (CMD("sb", 3)) {
-        error = utils_print_superblock(&u);
-    }else if (CMD("inode", 3)){
-        error = inode_scan_print(&u);
-    }else if (CMD("cat1", 4)){
-        uint16_t inr = (uint16_t)atoi(argv[3]);
-        error = utils_cat_first_sector(&u, inr);
-    }else if (CMD("shafiles", 3)){
-        error = utils_print_sha_allfiles(&u);
-    }else if (CMD("tree", 3)){
-        error = direntv6_print_tree(&u, ROOT_INUMBER, "");
-    }else if (CMD("fuse", 4)){
-        error = u6fs_fuse_main(&u, argv[3]);
-    }else if(CMD("bm", 3)){
-        error = utils_print_bitmaps(&u);
-    }else if(CMD("mkdir", 4)){
-        int add = direntv6_create(&u, argv[3], IWRITE | IREAD | IEXEC | IFDIR);
-        error = (add < ERR_NONE) ? add : ERR_NONE;
-    }else if(CMD("add", 5)){
-        error = utils_add_file(&u, argv[3], argv[4]);
+    if (CMD("shell", 3)) {
+        error = u6fs_run_script(&u, argv, stdin, isatty(STDIN_FILENO));
+    }else if (CMD("batch", 4)){
+        FILE *script = fopen(argv[3], "r");
+        error = (script == NULL) ? ERR_IO : u6fs_run_script(&u, argv, script, 0);
+        if (script != NULL) {
+            fclose(script);
+        }
     }else{
-        error = ERR_INVALID_COMMAND;
+        error = u6fs_run_cmd(&u, argc, argv);
     }
     err2 = umountv6(&u);
     return (error == ERR_NONE ? err2 : error);
@@ -104,7 +272,17 @@ int u6fs_do_one_cmd(int argc, char *argv[])
  */
 int main(int argc, char *argv[])
 {
-    int ret = u6fs_do_one_cmd(argc, argv);
+    const char *trace_path = getenv(TRACE_ENV);
+    const char *csum_policy = getenv(CSUM_ENV);
+    int ret = (trace_path != NULL) ? trace_start(trace_path) : ERR_NONE;
+    if (ret == ERR_NONE && csum_policy != NULL) {
+        ret = csum_set_policy(csum_policy);
+    }
+    if (ret == ERR_NONE) {
+        ret = u6fs_do_one_cmd(argc, argv);
+        const int traced = trace_stop();
+        ret = (ret == ERR_NONE) ? traced : ret;
+    }
     if (ret != ERR_NONE) {
         usage(argv[0], ret);
     }
@@ -112,35 +290,3 @@ int main(int argc, char *argv[])
 }
 #endif
 
-
-
-int utils_add_file(struct unix_filesystem *u, const char* destination_file, const char* source_file){
-    M_REQUIRE_NON_NULL(u);
-    M_REQUIRE_NON_NULL(destination_file);
-    M_REQUIRE_NON_NULL(source_file);
-
-    FILE* f = fopen(source_file, "rb");
-    if(f == NULL){
-        return ERR_IO;
-    }
-    int seek1 = fseek(f, 0L, SEEK_END);
-    if(seek1){
-        return ERR_IO;
-    }
-    long int size = ftell(f);
-    if(size == FTELL_ERROR){
-        return ERR_IO;
-    }
-    int seek2 = fseek(f, 0L, SEEK_SET);
-    if(seek2){
-        return ERR_IO;
-    }
-
-    uint8_t buf[ADDR_SMALL_LENGTH*SECTOR_SIZE] = {0};
-    unsigned long nb_read = fread(buf, 1, size, f);
-    if(nb_read != size){
-        return ERR_IO;
-    }
-
-    return direntv6_addfile(u, destination_file, IWRITE | IREAD | IEXEC, buf, (size_t) size);
-}
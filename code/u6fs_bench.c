@@ -0,0 +1,408 @@
+/**
+ * @file u6fs_bench.c
+ * @brief micro/macro benchmarks of the UV6 filesystem layers
+ *
+ * Generates synthetic images (many small files, few large files, a deep
+ * tree, a wide directory) in a scratch directory, times the core
+ * operations on them and prints one JSON object per benchmark on stdout:
+ *   {"bench": ..., "image": ..., "ops": ..., "ops_per_s": ...,
+ *    "p50_us": ..., "p90_us": ..., "p99_us": ..., "max_us": ...}
+ *
+ * usage: u6fs_bench [<scratch_dir>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "mount.h"
+#include "inode.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "bmblock.h"
+#include "util.h"
+
+#define BENCH_DISK_BLOCKS 65000
+#define BENCH_DISK_INODES 8192
+#define BENCH_PATH_MAX 1024
+
+#define BENCH_SMALL_DIRS 32
+#define BENCH_SMALL_FILES 3000
+#define BENCH_LARGE_FILES 8
+#define BENCH_LARGE_SIZE (800 * 1024)
+#define BENCH_DEEP_DEPTH 48
+#define BENCH_WIDE_ENTRIES 3000
+
+#define BENCH_MOUNT_ITER 20
+#define BENCH_SCAN_ITER 20
+#define BENCH_LOOKUP_ITER 5000
+#define BENCH_READ_ITER 20000
+#define BENCH_WRITE_SIZE (512 * 1024)
+#define BENCH_BM_ITER 20
+
+/* ********************************************************************** *
+ * timing
+ * ********************************************************************** */
+
+struct bench_samples {
+    double *ns;     // latency of each op
+    size_t n;
+    size_t max;
+    double total_ns;
+};
+
+static double bench_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec*1e9 + (double)ts.tv_nsec;
+}
+
+static int bench_samples_init(struct bench_samples *b, size_t max){
+    memset(b, 0, sizeof(*b));
+    b->ns = calloc(max, sizeof(double));
+    b->max = max;
+    return b->ns == NULL ? ERR_NOMEM : ERR_NONE;
+}
+
+static void bench_record(struct bench_samples *b, double start_ns){
+    double ns = bench_now_ns() - start_ns;
+    b->total_ns += ns;
+    if(b->n < b->max){
+        b->ns[b->n++] = ns;
+    }
+}
+
+static int bench_cmp(const void *a, const void *b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double bench_percentile(const struct bench_samples *b, double p){
+    if(b->n == 0){
+        return 0.0;
+    }
+    size_t k = (size_t)(p*(double)(b->n - 1) + 0.5);
+    return b->ns[k]/1e3;
+}
+
+static void bench_report(const char *bench, const char *image, struct bench_samples *b, int error){
+    qsort(b->ns, b->n, sizeof(double), bench_cmp);
+    printf("{\"bench\": \"%s\", \"image\": \"%s\", \"ops\": %zu, \"ops_per_s\": %.1f, "
+           "\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f, \"error\": %d}\n",
+           bench, image, b->n, b->total_ns > 0 ? (double)b->n*1e9/b->total_ns : 0.0,
+           bench_percentile(b, 0.50), bench_percentile(b, 0.90), bench_percentile(b, 0.99),
+           bench_percentile(b, 1.0), error);
+    fflush(stdout);
+    free(b->ns);
+    b->ns = NULL;
+}
+
+// xorshift: reproducible runs
+static uint64_t bench_seed = 88172645463325252ULL;
+static uint32_t bench_rand(void){
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return (uint32_t)(bench_seed >> 32);
+}
+
+/* ********************************************************************** *
+ * synthetic images
+ * ********************************************************************** */
+
+struct bench_image {
+    const char *name;
+    char path[BENCH_PATH_MAX];
+    char (*lookups)[BENCH_PATH_MAX];    // paths looked up by the lookup bench
+    size_t nb_lookups;
+    uint16_t *files;                    // inodes read by the read benches
+    size_t nb_files;
+};
+
+static int bench_add_file(struct unix_filesystem *u, struct bench_image *img, const char *path,
+                          const uint8_t *content, size_t size){
+    int inr = direntv6_create(u, path, IREAD | IWRITE);
+    if(inr < 0){
+        return inr;
+    }
+    struct filev6 fv6 = {0};
+    int ret = filev6_open(u, (uint16_t)inr, &fv6);
+    if(ret == ERR_NONE && size > 0){
+        ret = filev6_writebytes(&fv6, content, size);
+    }
+    if(ret == ERR_NONE && img->nb_lookups < BENCH_SMALL_FILES){
+        strncpy(img->lookups[img->nb_lookups++], path, BENCH_PATH_MAX - 1);
+    }
+    if(ret == ERR_NONE && img->nb_files < BENCH_SMALL_FILES && size >= SECTOR_SIZE){
+        img->files[img->nb_files++] = (uint16_t)inr;
+    }
+    return ret;
+}
+
+static int bench_mkdir(struct unix_filesystem *u, const char *path){
+    int inr = direntv6_create(u, path, IREAD | IWRITE | IEXEC | IFDIR);
+    return inr < 0 ? inr : ERR_NONE;
+}
+
+static int bench_populate(struct unix_filesystem *u, struct bench_image *img, uint8_t *content){
+    char path[BENCH_PATH_MAX];
+    int ret = ERR_NONE;
+
+    if(strcmp(img->name, "small_files") == 0){
+        for(int d = 0; d < BENCH_SMALL_DIRS && ret == ERR_NONE; d++){
+            snprintf(path, sizeof(path), "/d%d", d);
+            ret = bench_mkdir(u, path);
+        }
+        for(int f = 0; f < BENCH_SMALL_FILES && ret == ERR_NONE; f++){
+            snprintf(path, sizeof(path), "/d%d/f%d", f % BENCH_SMALL_DIRS, f);
+            ret = bench_add_file(u, img, path, content, 100 + bench_rand() % 3000);
+        }
+    }else if(strcmp(img->name, "large_files") == 0){
+        for(int f = 0; f < BENCH_LARGE_FILES && ret == ERR_NONE; f++){
+            snprintf(path, sizeof(path), "/large%d", f);
+            ret = bench_add_file(u, img, path, content, BENCH_LARGE_SIZE);
+        }
+    }else if(strcmp(img->name, "deep_tree") == 0){
+        size_t len = 0;
+        for(int d = 0; d < BENCH_DEEP_DEPTH && ret == ERR_NONE; d++){
+            len += (size_t)snprintf(&path[len], sizeof(path) - len, "/level%d", d);
+            ret = bench_mkdir(u, path);
+            char file[BENCH_PATH_MAX + sizeof("/leaf")]; // the longest path, then the leaf
+            snprintf(file, sizeof(file), "%s/leaf", path);
+            if(ret == ERR_NONE){
+                ret = bench_add_file(u, img, file, content, SECTOR_SIZE + 1);
+            }
+        }
+    }else{
+        ret = bench_mkdir(u, "/wide");
+        for(int f = 0; f < BENCH_WIDE_ENTRIES && ret == ERR_NONE; f++){
+            snprintf(path, sizeof(path), "/wide/entry%d", f);
+            ret = bench_add_file(u, img, path, content, SECTOR_SIZE);
+        }
+    }
+    return ret;
+}
+
+static int bench_make_image(const char *dir, struct bench_image *img){
+    snprintf(img->path, sizeof(img->path), "%s/%s.uv6", dir, img->name);
+    img->lookups = calloc(BENCH_SMALL_FILES, BENCH_PATH_MAX);
+    img->files = calloc(BENCH_SMALL_FILES, sizeof(uint16_t));
+    uint8_t *content = malloc(BENCH_LARGE_SIZE);
+    if(img->lookups == NULL || img->files == NULL || content == NULL){
+        free(content);
+        return ERR_NOMEM;
+    }
+    for(size_t i = 0; i < BENCH_LARGE_SIZE; i++){
+        content[i] = (uint8_t)bench_rand();
+    }
+
+    int ret = mountv6_mkfs(img->path, BENCH_DISK_BLOCKS, BENCH_DISK_INODES);
+    struct unix_filesystem u = {0};
+    if(ret == ERR_NONE){
+        ret = mountv6(img->path, &u);
+    }
+    if(ret == ERR_NONE){
+        ret = inode_wb_enable(&u);
+        if(ret == ERR_NONE){
+            ret = bench_populate(&u, img, content);
+        }
+        int err2 = umountv6(&u);
+        ret = (ret == ERR_NONE) ? err2 : ret;
+    }
+    free(content);
+    return ret;
+}
+
+/* ********************************************************************** *
+ * benchmarks
+ * ********************************************************************** */
+
+static void bench_mount(const struct bench_image *img){
+    struct bench_samples b;
+    int ret = bench_samples_init(&b, BENCH_MOUNT_ITER);
+    for(int i = 0; i < BENCH_MOUNT_ITER && ret == ERR_NONE; i++){
+        struct unix_filesystem u = {0};
+        double start = bench_now_ns();
+        ret = mountv6(img->path, &u);
+        bench_record(&b, start);
+        if(ret == ERR_NONE){
+            ret = umountv6(&u);
+        }
+    }
+    bench_report("mountv6", img->name, &b, ret);
+}
+
+static void bench_scan(const struct unix_filesystem *u, const char *image){
+    struct bench_samples b;
+    int ret = bench_samples_init(&b, BENCH_SCAN_ITER);
+
+    // the listing itself is not wanted
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if(saved < 0 || null < 0 || dup2(null, STDOUT_FILENO) < 0){
+        ret = ERR_IO;
+    }
+    for(int i = 0; i < BENCH_SCAN_ITER && ret == ERR_NONE; i++){
+        double start = bench_now_ns();
+        ret = inode_scan_print(u);
+        fflush(stdout);
+        bench_record(&b, start);
+    }
+    if(saved >= 0){
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+    if(null >= 0){
+        close(null);
+    }
+    bench_report("inode_scan_print", image, &b, ret);
+}
+
+static void bench_lookup(const struct unix_filesystem *u, const struct bench_image *img){
+    struct bench_samples b;
+    int ret = bench_samples_init(&b, BENCH_LOOKUP_ITER);
+    for(int i = 0; i < BENCH_LOOKUP_ITER && ret == ERR_NONE && img->nb_lookups > 0; i++){
+        const char *path = img->lookups[bench_rand() % img->nb_lookups];
+        double start = bench_now_ns();
+        int inr = direntv6_dirlookup(u, ROOT_INUMBER, path);
+        bench_record(&b, start);
+        ret = inr < 0 ? inr : ERR_NONE;
+    }
+    bench_report("direntv6_dirlookup", img->name, &b, ret);
+}
+
+static void bench_read(const struct unix_filesystem *u, const struct bench_image *img, int random){
+    struct bench_samples b;
+    int ret = bench_samples_init(&b, BENCH_READ_ITER);
+    uint8_t buf[SECTOR_SIZE];
+    struct filev6 fv6 = {0};
+    size_t file = 0;
+    if(img->nb_files > 0){
+        ret = filev6_open(u, img->files[file], &fv6);
+    }
+
+    for(int i = 0; i < BENCH_READ_ITER && ret == ERR_NONE && img->nb_files > 0; i++){
+        double start = bench_now_ns();
+        if(random){
+            int32_t nb_sectors = inode_getsize(&fv6.i_node)/SECTOR_SIZE;
+            ret = filev6_lseek(&fv6, (int32_t)(bench_rand() % (uint32_t)MAX(nb_sectors, 1))*SECTOR_SIZE);
+        }
+        int nb = (ret == ERR_NONE) ? filev6_readblock(&fv6, buf) : ret;
+        bench_record(&b, start);
+        if(nb == 0 || random){
+            // next file (the open is not part of the measure)
+            file = (file + 1) % img->nb_files;
+            ret = (nb < 0) ? nb : filev6_open(u, img->files[file], &fv6);
+        }else{
+            ret = (nb < 0) ? nb : ERR_NONE;
+        }
+    }
+    bench_report(random ? "filev6_readblock_random" : "filev6_readblock_seq", img->name, &b, ret);
+}
+
+static void bench_write(struct unix_filesystem *u, const char *image){
+    struct bench_samples b;
+    const size_t chunk = SECTOR_SIZE;
+    int ret = bench_samples_init(&b, BENCH_WRITE_SIZE/chunk);
+    uint8_t buf[SECTOR_SIZE];
+    for(size_t i = 0; i < sizeof(buf); i++){
+        buf[i] = (uint8_t)bench_rand();
+    }
+
+    int inr = direntv6_create(u, "/bench_write", IREAD | IWRITE);
+    struct filev6 fv6 = {0};
+    ret = (inr < 0) ? inr : filev6_open(u, (uint16_t)inr, &fv6);
+    for(size_t done = 0; done < BENCH_WRITE_SIZE && ret == ERR_NONE; done += chunk){
+        double start = bench_now_ns();
+        ret = filev6_writebytes(&fv6, buf, chunk);
+        bench_record(&b, start);
+    }
+    bench_report("filev6_writebytes", image, &b, ret);
+}
+
+static void bench_bitmap(const struct unix_filesystem *u, const char *image){
+    struct bench_samples b;
+    struct bmblock_array *fbm = u->fbm;
+    size_t bytes = sizeof(struct bmblock_array) + (fbm->length - 1)*sizeof(uint64_t);
+    struct bmblock_array *copy = malloc(bytes);
+    int ret = bench_samples_init(&b, (size_t)BENCH_BM_ITER*(size_t)(fbm->max - fbm->min + 1));
+    if(copy == NULL){
+        ret = ERR_NOMEM;
+    }
+
+    // allocate every free sector of a copy of the image bitmap, like writes do
+    for(int i = 0; i < BENCH_BM_ITER && ret == ERR_NONE; i++){
+        memcpy(copy, fbm, bytes);
+        int bit = 0;
+        do{
+            double start = bench_now_ns();
+            bit = bm_find_next(copy);
+            if(bit >= 0){
+                bm_set(copy, (uint64_t)bit);
+            }
+            bench_record(&b, start);
+        }while(bit >= 0);
+    }
+    free(copy);
+    bench_report("bm_find_next", image, &b, ret);
+}
+
+static int bench_image_run(struct bench_image *img){
+    bench_mount(img);
+
+    struct unix_filesystem u = {0};
+    int ret = mountv6(img->path, &u);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    bench_scan(&u, img->name);
+    bench_lookup(&u, img);
+    bench_read(&u, img, 0);
+    bench_read(&u, img, 1);
+    bench_bitmap(&u, img->name);
+    bench_write(&u, img->name);
+    return umountv6(&u);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *dir = (argc > 1) ? argv[1] : "/tmp";
+    char scratch[BENCH_PATH_MAX];
+    snprintf(scratch, sizeof(scratch), "%s/u6fs_bench.XXXXXX", dir);
+    if(mkdtemp(scratch) == NULL){
+        fprintf(stderr, "%s: cannot create a scratch directory in %s\n", argv[0], dir);
+        return ERR_IO;
+    }
+
+    struct bench_image images[] = {
+        { .name = "small_files" },
+        { .name = "large_files" },
+        { .name = "deep_tree" },
+        { .name = "wide_dir" },
+    };
+
+    int ret = ERR_NONE;
+    for(size_t i = 0; i < sizeof(images)/sizeof(images[0]); i++){
+        struct bench_image *img = &images[i];
+        int err = bench_make_image(scratch, img);
+        if(err == ERR_NONE){
+            err = bench_image_run(img);
+        }
+        if(err != ERR_NONE){
+            fprintf(stderr, "%s: %s: %s\n", argv[0], img->name, ERR_MESSAGES[err - ERR_FIRST]);
+            ret = err;
+        }
+        unlink(img->path);
+        free(img->lookups);
+        free(img->files);
+    }
+    rmdir(scratch);
+    return ret;
+}
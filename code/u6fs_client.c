@@ -0,0 +1,235 @@
+/**
+ * @file u6fs_client.c
+ * @brief client library of the "serve" daemon (see u6fs_serve.h)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "error.h"
+#include "u6fs_client.h"
+#include "util.h"
+
+#define CLIENT_RECV_CHUNK (64 * 1024)
+
+static int client_reserve(uint8_t **data, size_t *cap, size_t len, size_t more){
+    if(len + more <= *cap){
+        return ERR_NONE;
+    }
+    size_t new_cap = MAX(*cap*2, len + more);
+    uint8_t *bigger = realloc(*data, new_cap);
+    if(bigger == NULL){
+        return ERR_NOMEM;
+    }
+    *data = bigger;
+    *cap = new_cap;
+    return ERR_NONE;
+}
+
+// one recv() of what is available (blocking if wait)
+static int client_recv(struct u6fs_client *c, int wait){
+    int ret = client_reserve(&c->in, &c->in_cap, c->in_len, CLIENT_RECV_CHUNK);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    ssize_t n = recv(c->fd, c->in + c->in_len, CLIENT_RECV_CHUNK, wait ? 0 : MSG_DONTWAIT);
+    if(n > 0){
+        c->in_len += (size_t)n;
+        return ERR_NONE;
+    }
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+        return ERR_NONE;
+    }
+    return ERR_IO;  // the server is gone
+}
+
+
+int u6fs_client_connect(struct u6fs_client *c, const char *socket_path){
+    M_REQUIRE_NON_NULL(c);
+    M_REQUIRE_NON_NULL(socket_path);
+
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(addr.sun_path)){
+        return ERR_BAD_PARAMETER;
+    }
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(c->fd < 0){
+        return ERR_IO;
+    }
+    if(connect(c->fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0){
+        close(c->fd);
+        c->fd = -1;
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+void u6fs_client_close(struct u6fs_client *c){
+    if(c == NULL){
+        return;
+    }
+    if(c->fd >= 0){
+        close(c->fd);
+    }
+    free(c->out);
+    free(c->in);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+
+int u6fs_client_submit(struct u6fs_client *c, struct serve_request *req, const void *payload, size_t len){
+    M_REQUIRE_NON_NULL(c);
+    M_REQUIRE_NON_NULL(req);
+    if(len > SERVE_MAX_PAYLOAD || (len > 0 && payload == NULL)){
+        return ERR_BAD_PARAMETER;
+    }
+
+    int ret = client_reserve(&c->out, &c->out_cap, c->out_len, sizeof(*req) + len);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    req->id = c->next_id++;
+    req->len = (uint32_t)len;
+    memcpy(c->out + c->out_len, req, sizeof(*req));
+    if(len > 0){
+        memcpy(c->out + c->out_len + sizeof(*req), payload, len);
+    }
+    c->out_len += sizeof(*req) + len;
+    return ERR_NONE;
+}
+
+int u6fs_client_flush(struct u6fs_client *c){
+    M_REQUIRE_NON_NULL(c);
+
+    // the replies are read while sending: the server stops reading requests
+    // when too many replies wait for us
+    size_t sent = 0;
+    int ret = ERR_NONE;
+    while(ret == ERR_NONE && sent < c->out_len){
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN | POLLOUT, .revents = 0 };
+        if(poll(&pfd, 1, -1) < 0){
+            ret = (errno == EINTR) ? ERR_NONE : ERR_IO;
+            continue;
+        }
+        if(pfd.revents & POLLIN){
+            ret = client_recv(c, 0);
+        }
+        if(ret == ERR_NONE && (pfd.revents & POLLOUT)){
+            ssize_t n = send(c->fd, c->out + sent, c->out_len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if(n >= 0){
+                sent += (size_t)n;
+            }else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                ret = ERR_IO;
+            }
+        }
+        if(ret == ERR_NONE && (pfd.revents & (POLLERR | POLLHUP)) && !(pfd.revents & POLLIN)){
+            ret = ERR_IO;
+        }
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+    return ret;
+}
+
+int u6fs_client_receive(struct u6fs_client *c, struct serve_reply *reply, void *buf, size_t size){
+    M_REQUIRE_NON_NULL(c);
+    M_REQUIRE_NON_NULL(reply);
+    if(size > 0 && buf == NULL){
+        return ERR_BAD_PARAMETER;
+    }
+
+    int ret = u6fs_client_flush(c);
+    while(ret == ERR_NONE){
+        if(c->in_len >= sizeof(*reply)){
+            memcpy(reply, c->in, sizeof(*reply));
+            if(c->in_len >= sizeof(*reply) + reply->len){
+                break;
+            }
+        }
+        ret = client_recv(c, 1);
+    }
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    if(size > 0){
+        memcpy(buf, c->in + sizeof(*reply), MIN(size, reply->len));
+    }
+    const size_t used = sizeof(*reply) + reply->len;
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    return ERR_NONE;
+}
+
+
+// one request and its reply; returns the status of the reply
+static int client_call(struct u6fs_client *c, struct serve_request *req, const void *payload, size_t len,
+                       void *buf, size_t size){
+    M_REQUIRE_NON_NULL(c);
+
+    struct serve_reply reply;
+    int ret = u6fs_client_submit(c, req, payload, len);
+    if(ret == ERR_NONE){
+        ret = u6fs_client_receive(c, &reply, buf, size);
+    }
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    // with requests submitted before and not received yet, this is not our reply
+    return (reply.id == req->id) ? reply.status : ERR_BAD_PARAMETER;
+}
+
+int u6fs_client_lookup(struct u6fs_client *c, uint16_t inr, const char *path){
+    M_REQUIRE_NON_NULL(path);
+    struct serve_request req = { .op = SERVE_OP_LOOKUP, .inr = inr };
+    return client_call(c, &req, path, strlen(path), NULL, 0);
+}
+
+int u6fs_client_stat(struct u6fs_client *c, uint16_t inr, struct serve_stat *st){
+    M_REQUIRE_NON_NULL(st);
+    struct serve_request req = { .op = SERVE_OP_STAT, .inr = inr };
+    return client_call(c, &req, NULL, 0, st, sizeof(*st));
+}
+
+int u6fs_client_read(struct u6fs_client *c, uint16_t inr, uint32_t offset, void *buf, size_t len){
+    M_REQUIRE_NON_NULL(buf);
+    if(len > SERVE_MAX_PAYLOAD){
+        return ERR_BAD_PARAMETER;
+    }
+    struct serve_request req = { .op = SERVE_OP_READ, .inr = inr, .offset = offset, .count = (uint32_t)len };
+    return client_call(c, &req, NULL, 0, buf, len);
+}
+
+int u6fs_client_readdir(struct u6fs_client *c, uint16_t inr, uint32_t index, struct serve_dirent *entries,
+                        size_t count){
+    M_REQUIRE_NON_NULL(entries);
+    if(count > SERVE_MAX_PAYLOAD/sizeof(struct serve_dirent)){
+        return ERR_BAD_PARAMETER;
+    }
+    struct serve_request req = { .op = SERVE_OP_READDIR, .inr = inr, .offset = index, .count = (uint32_t)count };
+    return client_call(c, &req, NULL, 0, entries, count*sizeof(struct serve_dirent));
+}
+
+int u6fs_client_write(struct u6fs_client *c, uint16_t inr, uint32_t offset, const void *buf, size_t len){
+    M_REQUIRE_NON_NULL(buf);
+    struct serve_request req = { .op = SERVE_OP_WRITE, .inr = inr, .offset = offset };
+    return client_call(c, &req, buf, len, NULL, 0);
+}
+
+int u6fs_client_create(struct u6fs_client *c, const char *path, uint16_t mode){
+    M_REQUIRE_NON_NULL(path);
+    struct serve_request req = { .op = SERVE_OP_CREATE, .offset = mode };
+    return client_call(c, &req, path, strlen(path), NULL, 0);
+}
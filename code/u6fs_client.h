@@ -0,0 +1,104 @@
+#pragma once
+
+/**
+ * @file u6fs_client.h
+ * @brief client library of the "serve" daemon (see u6fs_serve.h)
+ *
+ * The u6fs_client_<op>() functions send one request and wait for its reply.
+ * To pipeline requests, queue them with u6fs_client_submit() and collect
+ * the replies, in the same order, with u6fs_client_receive().
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "u6fs_serve.h"
+
+struct u6fs_client {
+    int fd;
+    uint32_t next_id;
+    uint8_t *out;       // requests not sent yet
+    size_t out_len;
+    size_t out_cap;
+    uint8_t *in;        // bytes received, not returned yet
+    size_t in_len;
+    size_t in_cap;
+};
+
+/**
+ * @brief connect to a server
+ * @param c the client (OUT)
+ * @param socket_path the path of the socket of the server
+ * @return 0 on success; <0 on error
+ */
+int u6fs_client_connect(struct u6fs_client *c, const char *socket_path);
+
+/**
+ * @brief close the connection (the requests not sent yet are dropped)
+ * @param c the client
+ */
+void u6fs_client_close(struct u6fs_client *c);
+
+/**
+ * @brief queue a request, sent by u6fs_client_flush() or u6fs_client_receive()
+ * @param c the client
+ * @param req the request: its id is set, its len is the one given here (IN-OUT)
+ * @param payload the payload of the request (IN; may be NULL if len is 0)
+ * @param len the bytes of payload, at most SERVE_MAX_PAYLOAD
+ * @return 0 on success; <0 on error
+ */
+int u6fs_client_submit(struct u6fs_client *c, struct serve_request *req, const void *payload, size_t len);
+
+/**
+ * @brief send the queued requests, reading the replies that come meanwhile
+ * @param c the client
+ * @return 0 on success; <0 on error
+ */
+int u6fs_client_flush(struct u6fs_client *c);
+
+/**
+ * @brief wait for the reply to the oldest request not answered yet
+ * @param c the client
+ * @param reply the reply (OUT)
+ * @param buf where to copy its payload (OUT; may be NULL if size is 0)
+ * @param size the size of buf: a longer payload is truncated (reply->len tells its length)
+ * @return 0 on success; <0 on error
+ */
+int u6fs_client_receive(struct u6fs_client *c, struct serve_reply *reply, void *buf, size_t size);
+
+/**
+ * @brief inode number of a path, from the directory inr
+ * @return the inode number on success; <0 on error
+ */
+int u6fs_client_lookup(struct u6fs_client *c, uint16_t inr, const char *path);
+
+/**
+ * @brief attributes of an inode
+ * @return 0 on success; <0 on error
+ */
+int u6fs_client_stat(struct u6fs_client *c, uint16_t inr, struct serve_stat *st);
+
+/**
+ * @brief read at most len bytes of a file from offset (len at most SERVE_MAX_PAYLOAD)
+ * @return the number of bytes read (0 at the end of the file); <0 on error
+ */
+int u6fs_client_read(struct u6fs_client *c, uint16_t inr, uint32_t offset, void *buf, size_t len);
+
+/**
+ * @brief read at most count entries of a directory, from index (0 for the
+ *        first one, else the next field of the last entry read)
+ * @return the number of entries read (0 at the end of the directory); <0 on error
+ */
+int u6fs_client_readdir(struct u6fs_client *c, uint16_t inr, uint32_t index, struct serve_dirent *entries,
+                        size_t count);
+
+/**
+ * @brief write len bytes to a file at offset, growing it if needed (len at most SERVE_MAX_PAYLOAD)
+ * @return 0 on success; <0 on error
+ */
+int u6fs_client_write(struct u6fs_client *c, uint16_t inr, uint32_t offset, const void *buf, size_t len);
+
+/**
+ * @brief create a file, or a directory if mode has IFDIR
+ * @return the inode number of the new file on success; <0 on error
+ */
+int u6fs_client_create(struct u6fs_client *c, const char *path, uint16_t mode);
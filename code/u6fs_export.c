@@ -0,0 +1,241 @@
+/**
+ * @file u6fs_export.c
+ * @brief copy files and directory trees of a mounted UV6 filesystem to the host
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "mount.h"
+#include "inode.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "u6fs_export.h"
+#include "util.h"
+
+#define SUCCESS 1
+#define EXPORT_DIR_MODE 0755
+
+struct export_job {
+    uint16_t inr;
+    char *host_path;
+};
+
+struct export_ctx {
+    const struct unix_filesystem *u;
+    struct export_job *jobs;
+    size_t nb_jobs;
+    size_t max_jobs;
+
+    pthread_mutex_t lock;   // protects the fields below
+    size_t next;            // next job to hand out
+    uint64_t bytes;         // bytes written to the host
+    int error;              // first error met by a worker
+};
+
+static int export_add_job(struct export_ctx *ctx, uint16_t inr, const char *host_path){
+    if(ctx->nb_jobs == ctx->max_jobs){
+        size_t max = ctx->max_jobs ? 2*ctx->max_jobs : 64;
+        struct export_job *jobs = realloc(ctx->jobs, max*sizeof(struct export_job));
+        if(jobs == NULL){
+            return ERR_NOMEM;
+        }
+        ctx->jobs = jobs;
+        ctx->max_jobs = max;
+    }
+    char *copy = strdup(host_path);
+    if(copy == NULL){
+        return ERR_NOMEM;
+    }
+    ctx->jobs[ctx->nb_jobs].inr = inr;
+    ctx->jobs[ctx->nb_jobs].host_path = copy;
+    ctx->nb_jobs++;
+    return ERR_NONE;
+}
+
+static int export_mkdir(const char *host_path){
+    if(mkdir(host_path, EXPORT_DIR_MODE) && errno != EEXIST){
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+// creates the host directories of the subtree of inr and collects its files
+static int export_walk(struct export_ctx *ctx, uint16_t inr, const char *host_path){
+    struct inode i;
+    int ret = inode_read(ctx->u, inr, &i);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    if(!(i.i_mode & IFDIR)){
+        return export_add_job(ctx, inr, host_path);
+    }
+
+    ret = export_mkdir(host_path);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    struct directory_reader d;
+    ret = direntv6_opendir(ctx->u, inr, &d);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    const size_t len = strlen(host_path) + DIRENT_MAXLEN + 2;
+    char *child_path = malloc(len);
+    if(child_path == NULL){
+        return ERR_NOMEM;
+    }
+    char name[DIRENT_MAXLEN+1] = {0};
+    uint16_t child_inr = 0;
+    while((ret = direntv6_readdir(&d, name, &child_inr)) == SUCCESS){
+        if(child_inr == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+            continue;
+        }
+        snprintf(child_path, len, "%s/" STR_LENGTH_FMT(DIRENT_MAXLEN), host_path, name);
+        ret = export_walk(ctx, child_inr, child_path);
+        if(ret != ERR_NONE){
+            break;
+        }
+    }
+    free(child_path);
+    return ret < 0 ? ret : ERR_NONE;
+}
+
+static int export_file(const struct unix_filesystem *u, const struct export_job *job, uint8_t *chunk, uint64_t *bytes){
+    struct filev6 fv6 = {0};
+    int ret = filev6_open(u, job->inr, &fv6);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    FILE *out = fopen(job->host_path, "wb");
+    if(out == NULL){
+        return ERR_IO;
+    }
+    int nb_read = 0;
+    while((nb_read = filev6_readbytes(&fv6, chunk, EXPORT_CHUNK_SIZE)) > 0){
+        if(fwrite(chunk, 1, (size_t)nb_read, out) != (size_t)nb_read){
+            nb_read = ERR_IO;
+            break;
+        }
+        *bytes += (uint64_t)nb_read;
+    }
+    if(fclose(out) && nb_read == 0){
+        nb_read = ERR_IO;
+    }
+    return nb_read;
+}
+
+static void *export_worker(void *arg){
+    struct export_ctx *ctx = arg;
+    uint64_t bytes = 0;
+    int ret = ERR_NONE;
+
+    uint8_t *chunk = malloc(EXPORT_CHUNK_SIZE);
+    if(chunk == NULL){
+        ret = ERR_NOMEM;
+    }
+    while(ret == ERR_NONE){
+        pthread_mutex_lock(&ctx->lock);
+        size_t job = ctx->next++;
+        int stop = (ctx->error != ERR_NONE);
+        pthread_mutex_unlock(&ctx->lock);
+        if(stop || job >= ctx->nb_jobs){
+            break;
+        }
+        ret = export_file(ctx->u, &ctx->jobs[job], chunk, &bytes);
+    }
+    free(chunk);
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->bytes += bytes;
+    if(ctx->error == ERR_NONE){
+        ctx->error = ret;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+static double export_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+
+int export_tree(const struct unix_filesystem *u, const char *src, const char *host_dir, int nb_threads){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(src);
+    M_REQUIRE_NON_NULL(host_dir);
+    if(nb_threads < 1 || nb_threads > EXPORT_MAX_THREADS){
+        return ERR_BAD_PARAMETER;
+    }
+
+    int inr = direntv6_dirlookup(u, ROOT_INUMBER, src);
+    if(inr < 0){
+        return inr;
+    }
+
+    const double start = export_now();
+    struct export_ctx ctx = {0};
+    ctx.u = u;
+    int ret = export_mkdir(host_dir);
+    if(ret == ERR_NONE){
+        ret = export_walk(&ctx, (uint16_t)inr, host_dir);
+    }
+    if(ret == ERR_NONE && ctx.nb_jobs == 1 && ctx.jobs[0].inr == inr){
+        // src is a file: it goes inside host_dir
+        const char *name = strrchr(src, PATH_TOKEN);
+        name = (name == NULL) ? src : name + 1;
+        const size_t len = strlen(host_dir) + strlen(name) + 2;
+        char *path = malloc(len);
+        if(path == NULL){
+            ret = ERR_NOMEM;
+        }else{
+            snprintf(path, len, "%s/%s", host_dir, name);
+            free(ctx.jobs[0].host_path);
+            ctx.jobs[0].host_path = path;
+        }
+    }
+
+    if(ret == ERR_NONE){
+        pthread_t threads[EXPORT_MAX_THREADS];
+        int started = 0;
+        pthread_mutex_init(&ctx.lock, NULL);
+        for(; started < nb_threads; started++){
+            if(pthread_create(&threads[started], NULL, export_worker, &ctx)){
+                break;
+            }
+        }
+        if(started == 0){
+            ret = ERR_NOMEM;
+        }
+        for(int t = 0; t < started; t++){
+            pthread_join(threads[t], NULL);
+        }
+        pthread_mutex_destroy(&ctx.lock);
+        ret = (ret == ERR_NONE) ? ctx.error : ret;
+    }
+
+    if(ret == ERR_NONE){
+        const double elapsed = export_now() - start;
+        pps_printf("exported %zu files, %" PRIu64 " bytes in %.3f s (%.2f MiB/s, %d threads)\n",
+                   ctx.nb_jobs, ctx.bytes, elapsed,
+                   elapsed > 0 ? (double)ctx.bytes/(1024.0*1024.0)/elapsed : 0.0, nb_threads);
+    }
+
+    for(size_t j = 0; j < ctx.nb_jobs; j++){
+        free(ctx.jobs[j].host_path);
+    }
+    free(ctx.jobs);
+    return ret;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+/**
+ * @file u6fs_export.h
+ * @brief copy files and directory trees of a mounted UV6 filesystem to the host
+ */
+
+#include "mount.h"
+
+#define EXPORT_CHUNK_SIZE (128 * SECTOR_SIZE) /* bytes read from the filesystem at once */
+#define EXPORT_MAX_THREADS 64
+
+/**
+ * @brief copy a file or a directory tree of the filesystem into a host
+ *        directory (created if needed). Directories are walked first, then
+ *        the files are copied by a pool of worker threads sharing the mount.
+ *        Prints the throughput to stdout at the end.
+ * @param u the mounted filesystem (only read)
+ * @param src the path of the file or directory in the filesystem
+ * @param host_dir the path of the destination directory on the host
+ * @param nb_threads the number of worker threads (1 to EXPORT_MAX_THREADS)
+ * @return 0 on success; <0 on error
+ */
+int export_tree(const struct unix_filesystem *u, const char *src, const char *host_dir, int nb_threads);
@@ -19,28 +19,203 @@
 #include <math.h> // ???
 
 #include <stdlib.h> // for exit()
+#include <pthread.h>
 #include "mount.h"
+#include "arena.h"
 #include "error.h"
 #include "inode.h"
 #include "direntv6.h"
 #include "u6fs_utils.h"
 #include "u6fs_fuse.h"
 #include "util.h"
+#include "stats.h"
+#include "bmblock.h"
+#include "trace.h"
+#include "defrag.h"
 
 #define MAX_BUF_SIZE 65536
 #define SUCCESS 1
+#define STATS_FILE_MAX_SIZE 4096
+#define READDIR_BATCH 256 // entries whose inodes are read together
+#define READDIR_FIRST_COOKIE 3 // offset given to the filler for the entry of index 0 (after . and ..)
+#define LISTING_MAX_ENTRIES 8192 // attributes kept for the getattrs after a listing
+#define DEFRAG_PAUSE_MS 10      // between two files moved by the background defragmenter
+#define DEFRAG_PERIOD_MS 60000  // between two of its passes over the inodes
 
 static struct unix_filesystem* theFS = NULL; // usefull for tests
 
+/* The callbacks only read the filesystem: they hold fs_lock shared, the
+ * background defragmenter takes it exclusive for each file it moves. */
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_rwlock_t *fs_read_lock(void){
+    pthread_rwlock_rdlock(&fs_lock);
+    return &fs_lock;
+}
+
+static void fs_read_unlock(pthread_rwlock_t **lock){
+    pthread_rwlock_unlock(*lock);
+}
+
+// holds fs_lock shared until the enclosing block is left
+#define FS_READ_SCOPE() \
+    pthread_rwlock_t *fs_scope_lock __attribute__((cleanup(fs_read_unlock))) = fs_read_lock()
+
+// the stats file is rendered again on each access; it is never in the filesystem itself
+static int fs_is_stats_file(const char *path){
+    return strcmp(path, STATS_FUSE_FILE) == 0;
+}
+
+/* The attributes of the entries of the last directory listed: the getattr
+ * that follows each entry of a listing (ls -l) then needs neither a path
+ * lookup nor an inode read. The operations only read the filesystem, but the
+ * background defragmenter (fuse --defrag) moves files: it drops the listing
+ * whenever it moves one, under fs_lock held exclusive. */
+struct fs_listing {
+    const struct unix_filesystem *u;
+    char *dir;                              // path of the directory
+    size_t count;
+    size_t max;
+    size_t next;                            // where the next search starts
+    uint32_t end;                           // index in the directory after the last entry added
+    char (*names)[DIRENT_MAXLEN+1];
+    struct stat *stats;
+};
+
+static pthread_mutex_t listing_lock = PTHREAD_MUTEX_INITIALIZER;   // protects the one below
+static struct fs_listing last_listing;
+
+static void fs_listing_free(struct fs_listing *l){
+    free(l->dir);
+    free(l->names);
+    free(l->stats);
+    memset(l, 0, sizeof(*l));
+}
+
+// a listing that cannot grow is dropped: it only makes the next getattrs slower
+static void fs_listing_add(struct fs_listing *l, const char *name, const struct stat *st){
+    if(l->dir == NULL || l->count == LISTING_MAX_ENTRIES){
+        return;
+    }
+    if(l->count == l->max){
+        const size_t max = l->max ? 2*l->max : READDIR_BATCH;
+        char (*names)[DIRENT_MAXLEN+1] = realloc(l->names, max*sizeof(*names));
+        if(names != NULL){
+            l->names = names;
+        }
+        struct stat *stats = realloc(l->stats, max*sizeof(*stats));
+        if(stats != NULL){
+            l->stats = stats;
+        }
+        if(names == NULL || stats == NULL){
+            fs_listing_free(l);
+            return;
+        }
+        l->max = max;
+    }
+    strcpy(l->names[l->count], name);
+    l->stats[l->count] = *st;
+    l->count++;
+}
+
+// the listing to go on with when a directory is read from the entry of the given index
+static void fs_listing_resume(struct fs_listing *l, const char *path, uint32_t index){
+    memset(l, 0, sizeof(*l));
+    pthread_mutex_lock(&listing_lock);
+    if(index > 0 && last_listing.u == theFS && last_listing.dir != NULL
+       && last_listing.end == index && strcmp(last_listing.dir, path) == 0){
+        *l = last_listing;
+        memset(&last_listing, 0, sizeof(last_listing));
+    }
+    pthread_mutex_unlock(&listing_lock);
+    if(l->dir == NULL){
+        l->u = theFS;
+        l->dir = strdup(path);
+        l->end = index;
+    }
+}
+
+static void fs_listing_publish(struct fs_listing *l){
+    pthread_mutex_lock(&listing_lock);
+    fs_listing_free(&last_listing);
+    last_listing = *l;
+    pthread_mutex_unlock(&listing_lock);
+    memset(l, 0, sizeof(*l));
+}
+
+// the attributes of the files moved (st_blocks, ...) may have changed: called under fs_lock held exclusive
+static void fs_listing_drop(void){
+    pthread_mutex_lock(&listing_lock);
+    fs_listing_free(&last_listing);
+    pthread_mutex_unlock(&listing_lock);
+}
+
+// 1 and the attributes if path is an entry of the last directory listed, 0 otherwise
+static int fs_listing_find(const char *path, struct stat *stbuf){
+    const char *slash = strrchr(path, '/');
+    if(slash == NULL || slash[1] == '\0'){
+        return 0;
+    }
+    const size_t dir_len = (slash == path) ? 1 : (size_t)(slash - path);
+    int found = 0;
+    pthread_mutex_lock(&listing_lock);
+    const struct fs_listing *l = &last_listing;
+    if(l->u == theFS && l->dir != NULL && strlen(l->dir) == dir_len && strncmp(l->dir, path, dir_len) == 0){
+        // the entries are asked for in the listing order: start after the last one found
+        for(size_t k = 0; k < l->count && !found; k++){
+            const size_t e = (last_listing.next + k)%l->count;
+            if(strcmp(l->names[e], slash + 1) == 0){
+                *stbuf = l->stats[e];
+                last_listing.next = e + 1;
+                found = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&listing_lock);
+    return found;
+}
+
+static void fs_fill_stat(uint16_t inr, const struct inode *i, struct stat *stbuf){
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    stbuf->st_mode |= (i->i_mode & IFDIR) ? __S_IFDIR : __S_IFREG;
+    stbuf->st_size = inode_getsize(i);
+    stbuf->st_ino = inr;
+    stbuf->st_blksize = SECTOR_SIZE;
+    int allocated = inode_nbsectors(theFS, i); // holes are not counted
+    stbuf->st_blocks = allocated < 0 ? 0 : (blkcnt_t)allocated*(SECTOR_SIZE/512); // in 512-byte units
+    stbuf->st_uid = i->i_uid;
+    stbuf->st_gid = i->i_gid;
+    stbuf->st_nlink = i->i_nlink;
+}
+
 int fs_getattr(const char *path, struct stat *stbuf){
     M_REQUIRE_NON_NULL(path);
     M_REQUIRE_NON_NULL(stbuf);
     M_REQUIRE_NON_NULL(theFS);
+    STATS_SCOPE(STATS_FUSE_GETATTR);
+    ARENA_SCOPE(scratch);
+    FS_READ_SCOPE();
+    TRACE_SCOPE(TRACE_FUSE_GETATTR, 0, 0, 0);
+
+    if(fs_is_stats_file(path)){
+        memset(stbuf, 0, sizeof(*stbuf));
+        stbuf->st_mode = __S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = (off_t)MIN(stats_render(NULL, 0), STATS_FILE_MAX_SIZE - 1);
+        stbuf->st_blksize = SECTOR_SIZE;
+        return ERR_NONE;
+    }
+    if(fs_listing_find(path, stbuf)){
+        TRACE_SET_ARG(stbuf->st_ino);
+        return ERR_NONE;
+    }
 
     int inr = direntv6_dirlookup(theFS, ROOT_INUMBER, path);
     if(inr < 0){
         return inr;
     }
+    TRACE_SET_ARG(inr);
 
     struct inode i;
     int read = inode_read(theFS, inr, &i);
@@ -48,30 +223,26 @@ int fs_getattr(const char *path, struct stat *stbuf){
         return read;
     }
 
-    stbuf->st_mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
-    stbuf->st_mode |= (i.i_mode & IFDIR) ? __S_IFDIR : __S_IFREG;
-    stbuf->st_size = inode_getsize(&i);
-    stbuf->st_ino = inr;
-    stbuf->st_blksize = SECTOR_SIZE;
-    stbuf->st_blocks = ceil(1.0*stbuf->st_size / SECTOR_SIZE); // Use math.h
-    stbuf->st_uid = i.i_uid;
-    stbuf->st_gid = i.i_gid;
-    stbuf->st_nlink = i.i_nlink;
-
+    fs_fill_stat((uint16_t)inr, &i, stbuf);
     return ERR_NONE;
 }
 
 // Insert directory entries into the directory structure, which is also passed to it as buf
-int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset _unused, struct fuse_file_info *fi){
+int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi){
     M_REQUIRE_NON_NULL(path);
     M_REQUIRE_NON_NULL(buf);
     M_REQUIRE_NON_NULL(fi);
     M_REQUIRE_NON_NULL(filler);
+    STATS_SCOPE(STATS_FUSE_READDIR);
+    ARENA_SCOPE(scratch);
+    FS_READ_SCOPE();
+    TRACE_SCOPE(TRACE_FUSE_READDIR, 0, 0, 0);
 
     int inr = direntv6_dirlookup(theFS, ROOT_INUMBER, path);
     if (inr < 0){
         return inr;
     }
+    TRACE_SET_ARG(inr);
 
     struct directory_reader d;
 
@@ -80,34 +251,65 @@ int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
         return check;
     }
     
-    uint16_t child_inr = 0; 
-
-    struct stat stdbuf = {0};
-
-    char name[DIRENT_MAXLEN+1];
-
-    check = filler(buf, ".", NULL, 0);
+    // the offsets are cookies: 1 for ., 2 for .., then READDIR_FIRST_COOKIE + the index of the entry
+    if(offset < 1 && filler(buf, ".", NULL, 1) != ERR_NONE){
+        return ERR_NONE;
+    }
+    if(offset < 2 && filler(buf, "..", NULL, 2) != ERR_NONE){
+        return ERR_NONE;
+    }
+    uint32_t first = offset < READDIR_FIRST_COOKIE ? 0 : (uint32_t)(offset - READDIR_FIRST_COOKIE + 1);
+    check = direntv6_seekdir(&d, first);
     if(check != ERR_NONE){
-        return ERR_NOMEM;
+        return check;
     }
 
-    check = filler(buf, "..", NULL, 0);
-    if(check != ERR_NONE){
+    // the entries go by batches, so that the child inodes sharing an inode sector are read once;
+    // a full reply buffer (non-zero filler) ends the call, the next one starts after the last entry taken
+    struct fs_listing listing;
+    fs_listing_resume(&listing, path, first);
+    uint32_t *indexes = arena_alloc(scratch, READDIR_BATCH*sizeof(*indexes));
+    uint16_t *inrs = arena_alloc(scratch, READDIR_BATCH*sizeof(*inrs));
+    char (*names)[DIRENT_MAXLEN+1] = arena_alloc(scratch, READDIR_BATCH*sizeof(*names));
+    struct inode *inodes = arena_alloc(scratch, READDIR_BATCH*sizeof(*inodes));
+    if(indexes == NULL || inrs == NULL || names == NULL || inodes == NULL){
+        fs_listing_free(&listing);
         return ERR_NOMEM;
     }
-
-    int cont_read = 0;
-    while((cont_read = direntv6_readdir(&d, name, &child_inr)) == SUCCESS){
-        if(cont_read <= 0){
-            return cont_read;
-        } 
-
-        check = filler(buf, name, NULL, 0);
+    int cont_read = SUCCESS;
+    int full = 0;
+    while(cont_read == SUCCESS && !full){
+        size_t n = 0;
+        for(; n < READDIR_BATCH; n++){
+            cont_read = direntv6_readdir(&d, names[n], &inrs[n]);
+            if(cont_read != SUCCESS){
+                break;
+            }
+            indexes[n] = direntv6_telldir(&d) - 1; // free slots are skipped: the slot just read
+        }
+        check = (cont_read < 0) ? cont_read : inode_read_batch(theFS, inrs, n, inodes);
         if(check != ERR_NONE){
-            return ERR_NOMEM;
+            fs_listing_free(&listing);
+            return check;
+        }
+
+        for(size_t k = 0; k < n && !full; k++){
+            struct stat st;
+            const int allocated = (inodes[k].i_mode & IALLOC) != 0;
+            if(allocated){
+                fs_fill_stat(inrs[k], &inodes[k], &st);
+            }
+            full = filler(buf, names[k], allocated ? &st : NULL, READDIR_FIRST_COOKIE + (off_t)indexes[k]) != ERR_NONE;
+            if(!full){
+                listing.end = indexes[k] + 1;
+            }
+            if(allocated && !full){
+                fs_listing_add(&listing, names[k], &st);
+            }
         }
     }
 
+    fs_listing_publish(&listing);
     return ERR_NONE;
 }
 
@@ -117,12 +319,28 @@ int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
     M_REQUIRE_NON_NULL(buf);
     M_REQUIRE_NON_NULL(fi);
     M_REQUIRE_NON_NULL(theFS);
+    STATS_SCOPE(STATS_FUSE_READ);
+    ARENA_SCOPE(scratch);
+    FS_READ_SCOPE();
+    TRACE_SCOPE(TRACE_FUSE_READ, 0, size, offset);
+
+    if(fs_is_stats_file(path)){
+        char stats[STATS_FILE_MAX_SIZE];
+        const size_t len = MIN(stats_render(stats, sizeof(stats)), sizeof(stats) - 1);
+        if(offset < 0 || (size_t)offset >= len){
+            return 0;
+        }
+        const size_t n = MIN(size, len - (size_t)offset);
+        memcpy(buf, stats + offset, n);
+        return (int)n;
+    }
 
     struct filev6 fv6;;
     int inr = direntv6_dirlookup(theFS, ROOT_INUMBER, path);
     if(inr < 0){
         return inr;
     }
+    TRACE_SET_ARG(inr);
 
     int read = filev6_open(theFS, inr, &fv6);
     if(read != ERR_NONE){
@@ -134,19 +352,8 @@ int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
         return read;
     }
 
-    int num_bytes = -1;
-    size_t l = 0;
-    do{
-        num_bytes = filev6_readblock(&fv6, buf);
-        if (num_bytes < 0){
-            return num_bytes;
-        }
-        l += num_bytes;
-        buf += num_bytes;
-
-    }while(num_bytes > 0 && l < size);
-
-    return l;
+    // never more than size bytes into buf, whatever the alignment of size
+    return filev6_readbytes(&fv6, buf, size);
 }
 
 
@@ -156,28 +363,108 @@ static struct fuse_operations available_ops = {
     .read    = fs_read,
 };
 
+/* The background defragmenter: it moves one file at a time, pausing in
+ * between so that the callbacks are never kept waiting long. */
+static struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;               // set by fs_defrag_stop(), under mutex
+} fs_defrag = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// waits for ms milliseconds; 1 if the defragmenter is to stop
+static int fs_defrag_wait(long ms){
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms/1000;
+    until.tv_nsec += (ms%1000)*1000000;
+    if(until.tv_nsec >= 1000000000){
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&fs_defrag.mutex);
+    while(!fs_defrag.stop && pthread_cond_timedwait(&fs_defrag.cond, &fs_defrag.mutex, &until) == 0){
+    }
+    const int stop = fs_defrag.stop;
+    pthread_mutex_unlock(&fs_defrag.mutex);
+    return stop;
+}
+
+static void *fs_defrag_main(void *arg){
+    struct unix_filesystem *u = arg;
+    const uint32_t nb_inodes = (uint32_t)u->s.s_isize*INODES_PER_SECTOR;
+    int stop = 0;
+    while(!stop){
+        for(uint32_t inr = ROOT_INUMBER; inr < nb_inodes && !stop; inr++){
+            pthread_rwlock_wrlock(&fs_lock);
+            const int moved = bm_get(u->ibm, inr) ? defrag_inode(u, (uint16_t)inr) : 0;
+            if(moved > 0){
+                fs_listing_drop();
+            }
+            pthread_rwlock_unlock(&fs_lock);
+            if(moved > 0){
+                stop = fs_defrag_wait(DEFRAG_PAUSE_MS);
+            }
+        }
+        stop = stop || fs_defrag_wait(DEFRAG_PERIOD_MS);
+    }
+    return NULL;
+}
+
+static int fs_defrag_start(struct unix_filesystem *u){
+    fs_defrag.stop = 0;
+    return pthread_create(&fs_defrag.thread, NULL, fs_defrag_main, u) == 0 ? ERR_NONE : ERR_NOMEM;
+}
+
+static void fs_defrag_stop(void){
+    pthread_mutex_lock(&fs_defrag.mutex);
+    fs_defrag.stop = 1;
+    pthread_cond_signal(&fs_defrag.cond);
+    pthread_mutex_unlock(&fs_defrag.mutex);
+    pthread_join(fs_defrag.thread, NULL);
+}
+
 int u6fs_fuse_main(struct unix_filesystem *u, const char *mountpoint)
+{
+    return u6fs_fuse_main_opts(u, mountpoint, 0);
+}
+
+int u6fs_fuse_main_opts(struct unix_filesystem *u, const char *mountpoint, int flags)
 {
     M_REQUIRE_NON_NULL(mountpoint);
 
     theFS = u;  // /!\ GLOBAL ASSIGNMENT
-    const char *argv[] = {
-        "u6fs",
-        "-s",               // * `-s` : single threaded operation
-        "-f",              // foreground operation (no fork).  alternative "-d" for more debug messages
-        "-odirect_io",      //  no caching in the kernel.
+    const char *argv[6] = { "u6fs" };
+    int argc = 1;
+    if (!(flags & U6FS_FUSE_MULTITHREAD)) {
+        argv[argc++] = "-s";            // * `-s` : single threaded operation
+    }
+    argv[argc++] = "-f";                // foreground operation (no fork).  alternative "-d" for more debug messages
+    if (!(flags & U6FS_FUSE_CACHED)) {
+        argv[argc++] = "-odirect_io";   //  no caching in the kernel.
+    }
 #ifdef DEBUG
-        "-d",
+    argv[argc++] = "-d";
 #endif
-        //  "-ononempty",    // unused
-        mountpoint
-    };
+    //  "-ononempty",    // unused
+    argv[argc++] = mountpoint;
     // very ugly trick when a cast is required to avoid a warning
     void *argv_alias = argv;
 
     utils_print_superblock(theFS);
-    int ret = fuse_main(sizeof(argv) / sizeof(char *), argv_alias, &available_ops, NULL);
+    if (flags & U6FS_FUSE_DEFRAG) {
+        int err = fs_defrag_start(u);
+        if (err != ERR_NONE) {
+            theFS = NULL; // /!\ GLOBAL ASSIGNMENT
+            return err;
+        }
+    }
+    int ret = fuse_main(argc, argv_alias, &available_ops, NULL);
+    if (flags & U6FS_FUSE_DEFRAG) {
+        fs_defrag_stop();
+    }
     theFS = NULL; // /!\ GLOBAL ASSIGNMENT
+    fs_listing_free(&last_listing);
     return ret;
 }
 
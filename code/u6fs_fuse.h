@@ -32,8 +32,9 @@ int fs_getattr(const char *path, struct stat *stbuf);
  *
  * @param path absolute path to the directory
  * @param buf buffer given to the filler function
- * @param filler function called for each entries, with the name of the entry and the buf parameter
- * @param offset ignored
+ * @param filler function called for each entries, with the name of the entry and the buf parameter;
+ *        stops the listing when it returns non-zero (full buffer)
+ * @param offset where to resume: 0 for the start, else the offset given to filler with the last entry taken
  * @param fi fuse info -- ignored
  * @return 0 on success, <0 on error
  */
@@ -68,3 +69,16 @@ void fuse_set_fs(struct unix_filesystem *u);
  */
 int u6fs_fuse_main(struct unix_filesystem *u, const char *mountpoint);
 
+#define U6FS_FUSE_MULTITHREAD 0x1   /* callbacks run from several FUSE threads (no "-s") */
+#define U6FS_FUSE_CACHED      0x2   /* the kernel may cache file data (no "-odirect_io") */
+#define U6FS_FUSE_DEFRAG      0x4   /* a background thread defragments the files (see defrag.h) */
+
+/**
+ * @brief same as u6fs_fuse_main() with a choice of FUSE options
+ * @param u the filesystem (IN)
+ * @param mountpoint the mount point in the host filesystem
+ * @param flags a combination of the U6FS_FUSE_* flags (0: as u6fs_fuse_main())
+ * @return 0 on success; the appropriate error code (<0) on error
+ */
+int u6fs_fuse_main_opts(struct unix_filesystem *u, const char *mountpoint, int flags);
+
@@ -0,0 +1,396 @@
+/**
+ * @file u6fs_fuse_bench.c
+ * @brief end-to-end throughput and latency of the FUSE mount
+ *
+ * For each FUSE configuration (single/multithreaded, direct_io/cached),
+ * mounts the image with u6fs_fuse_main_opts() in a child process, drives
+ * stat, readdir, sequential read and random read workloads from several
+ * client threads through the host VFS, then unmounts with fusermount.
+ * Prints one JSON object per (configuration, workload) on stdout, with
+ * the throughput and percentiles taken from a log2 latency histogram.
+ *
+ * usage: u6fs_fuse_bench <disk> <mountpoint> [<clients>]
+ *   The disk is created with synthetic content if it does not exist.
+ *   Linux + FUSE only; needs fusermount in the PATH.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "error.h"
+#include "mount.h"
+#include "inode.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "u6fs_fuse.h"
+#include "util.h"
+
+#define FB_MAX_CLIENTS 64
+#define FB_HIST_BUCKETS 48      // bucket b: latencies in [2^b, 2^(b+1)) ns
+#define FB_PATH_MAX 512
+#define FB_MAX_PATHS 4096
+#define FB_OPS_PER_CLIENT 2000
+#define FB_READ_SIZE 4096
+#define FB_SEQ_BUF (64 * 1024)
+#define FB_MOUNT_TIMEOUT_MS 5000
+
+#define FB_GEN_BLOCKS 60000
+#define FB_GEN_INODES 2048
+#define FB_GEN_DIRS 16
+#define FB_GEN_FILES 64
+#define FB_GEN_SIZE (24 * 1024)
+
+enum fb_workload { FB_STAT, FB_READDIR, FB_SEQREAD, FB_RANDREAD, FB_NB_WORKLOADS };
+static const char * const FB_WORKLOAD_NAMES[] = { "stat", "readdir", "seqread", "randread" };
+
+struct fb_hist {
+    uint64_t count[FB_HIST_BUCKETS];
+    uint64_t ops;
+    uint64_t bytes;
+    int errors;
+};
+
+struct fb_paths {
+    char (*files)[FB_PATH_MAX];
+    size_t nb_files;
+    char (*dirs)[FB_PATH_MAX];
+    size_t nb_dirs;
+};
+
+struct fb_client {
+    pthread_t thread;
+    const struct fb_paths *paths;
+    enum fb_workload workload;
+    uint64_t seed;
+    struct fb_hist hist;
+};
+
+static uint64_t fb_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t fb_rand(uint64_t *seed){
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return (uint32_t)(*seed >> 32);
+}
+
+static void fb_hist_add(struct fb_hist *h, uint64_t ns){
+    int b = 0;
+    while(b < FB_HIST_BUCKETS - 1 && (ns >> (b + 1)) != 0){
+        b++;
+    }
+    h->count[b]++;
+    h->ops++;
+}
+
+// upper bound of the bucket holding the p-th percentile, in microseconds
+static double fb_hist_percentile(const struct fb_hist *h, double p){
+    uint64_t rank = (uint64_t)(p*(double)h->ops);
+    uint64_t seen = 0;
+    for(int b = 0; b < FB_HIST_BUCKETS; b++){
+        seen += h->count[b];
+        if(seen > rank){
+            return (double)(1ULL << (b + 1))/1e3;
+        }
+    }
+    return 0.0;
+}
+
+/* ********************************************************************** *
+ * workloads, through the host VFS
+ * ********************************************************************** */
+
+static int fb_op(struct fb_client *c, char *buf){
+    const struct fb_paths *p = c->paths;
+    const char *file = p->files[fb_rand(&c->seed) % p->nb_files];
+
+    switch(c->workload){
+    case FB_STAT: {
+        struct stat st;
+        return stat(file, &st);
+    }
+    case FB_READDIR: {
+        DIR *d = opendir(p->dirs[fb_rand(&c->seed) % p->nb_dirs]);
+        if(d == NULL){
+            return -1;
+        }
+        while(readdir(d) != NULL){
+        }
+        return closedir(d);
+    }
+    case FB_SEQREAD: {
+        int fd = open(file, O_RDONLY);
+        if(fd < 0){
+            return -1;
+        }
+        ssize_t n = 0;
+        while((n = read(fd, buf, FB_SEQ_BUF)) > 0){
+            c->hist.bytes += (uint64_t)n;
+        }
+        close(fd);
+        return n < 0 ? -1 : 0;
+    }
+    default: {
+        int fd = open(file, O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st)){
+            if(fd >= 0){
+                close(fd);
+            }
+            return -1;
+        }
+        off_t nb_blocks = MAX(st.st_size/FB_READ_SIZE, 1);
+        ssize_t n = pread(fd, buf, FB_READ_SIZE, (off_t)(fb_rand(&c->seed) % (uint32_t)nb_blocks)*FB_READ_SIZE);
+        c->hist.bytes += n > 0 ? (uint64_t)n : 0;
+        close(fd);
+        return n < 0 ? -1 : 0;
+    }
+    }
+}
+
+static void *fb_client_main(void *arg){
+    struct fb_client *c = arg;
+    char *buf = malloc(FB_SEQ_BUF);
+    if(buf == NULL){
+        c->hist.errors++;
+        return NULL;
+    }
+    for(int i = 0; i < FB_OPS_PER_CLIENT; i++){
+        uint64_t start = fb_now_ns();
+        if(fb_op(c, buf)){
+            c->hist.errors++;
+        }
+        fb_hist_add(&c->hist, fb_now_ns() - start);
+    }
+    free(buf);
+    return NULL;
+}
+
+static void fb_run_workload(const char *config, enum fb_workload w, const struct fb_paths *paths, int nb_clients){
+    struct fb_client clients[FB_MAX_CLIENTS];
+    memset(clients, 0, sizeof(clients));
+
+    uint64_t start = fb_now_ns();
+    int started = 0;
+    for(; started < nb_clients; started++){
+        clients[started].paths = paths;
+        clients[started].workload = w;
+        clients[started].seed = 88172645463325252ULL + (uint64_t)started*7919;
+        if(pthread_create(&clients[started].thread, NULL, fb_client_main, &clients[started])){
+            break;
+        }
+    }
+    struct fb_hist total = {0};
+    for(int t = 0; t < started; t++){
+        pthread_join(clients[t].thread, NULL);
+        for(int b = 0; b < FB_HIST_BUCKETS; b++){
+            total.count[b] += clients[t].hist.count[b];
+        }
+        total.ops += clients[t].hist.ops;
+        total.bytes += clients[t].hist.bytes;
+        total.errors += clients[t].hist.errors;
+    }
+    double elapsed = (double)(fb_now_ns() - start)/1e9;
+
+    printf("{\"config\": \"%s\", \"workload\": \"%s\", \"clients\": %d, \"ops\": %llu, \"ops_per_s\": %.1f, "
+           "\"mib_per_s\": %.2f, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"errors\": %d, \"hist_log2_ns\": [",
+           config, FB_WORKLOAD_NAMES[w], started, (unsigned long long)total.ops,
+           elapsed > 0 ? (double)total.ops/elapsed : 0.0,
+           elapsed > 0 ? (double)total.bytes/(1024.0*1024.0)/elapsed : 0.0,
+           fb_hist_percentile(&total, 0.50), fb_hist_percentile(&total, 0.90),
+           fb_hist_percentile(&total, 0.99), total.errors);
+    for(int b = 0; b < FB_HIST_BUCKETS; b++){
+        printf("%s%llu", b ? ", " : "", (unsigned long long)total.count[b]);
+    }
+    printf("]}\n");
+    fflush(stdout);
+}
+
+// collects the files and directories of the mounted tree
+static void fb_collect(struct fb_paths *p, const char *dir){
+    if(p->nb_dirs < FB_MAX_PATHS){
+        strncpy(p->dirs[p->nb_dirs++], dir, FB_PATH_MAX - 1);
+    }
+    DIR *d = opendir(dir);
+    if(d == NULL){
+        return;
+    }
+    struct dirent *e;
+    char path[FB_PATH_MAX];
+    while((e = readdir(d)) != NULL){
+        if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0){
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        struct stat st;
+        if(stat(path, &st)){
+            continue;
+        }
+        if(S_ISDIR(st.st_mode)){
+            fb_collect(p, path);
+        }else if(p->nb_files < FB_MAX_PATHS){
+            strncpy(p->files[p->nb_files++], path, FB_PATH_MAX - 1);
+        }
+    }
+    closedir(d);
+}
+
+/* ********************************************************************** *
+ * mount / unmount
+ * ********************************************************************** */
+
+static int fb_is_mounted(const char *mountpoint){
+    char parent[FB_PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s/..", mountpoint);
+    struct stat mnt, up;
+    return stat(mountpoint, &mnt) == 0 && stat(parent, &up) == 0 && mnt.st_dev != up.st_dev;
+}
+
+static pid_t fb_mount(const char *disk, const char *mountpoint, int flags){
+    pid_t pid = fork();
+    if(pid == 0){
+        struct unix_filesystem u = {0};
+        if(freopen("/dev/null", "w", stdout) == NULL || mountv6(disk, &u) != ERR_NONE){
+            _exit(1);
+        }
+        int ret = u6fs_fuse_main_opts(&u, mountpoint, flags);
+        umountv6(&u);
+        _exit(ret ? 1 : 0);
+    }
+    for(int waited = 0; pid > 0 && waited < FB_MOUNT_TIMEOUT_MS; waited += 10){
+        if(fb_is_mounted(mountpoint)){
+            return pid;
+        }
+        if(waitpid(pid, NULL, WNOHANG) == pid){
+            return -1;
+        }
+        usleep(10000);
+    }
+    return -1;
+}
+
+static void fb_unmount(const char *mountpoint, pid_t pid){
+    pid_t umount = fork();
+    if(umount == 0){
+        execlp("fusermount", "fusermount", "-u", mountpoint, (char*)NULL);
+        _exit(1);
+    }
+    if(umount > 0){
+        waitpid(umount, NULL, 0);
+    }
+    if(pid > 0){
+        waitpid(pid, NULL, 0);
+    }
+}
+
+static int fb_generate(const char *disk){
+    int ret = mountv6_mkfs(disk, FB_GEN_BLOCKS, FB_GEN_INODES);
+    struct unix_filesystem u = {0};
+    if(ret == ERR_NONE){
+        ret = mountv6(disk, &u);
+    }
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    uint8_t *content = malloc(FB_GEN_SIZE);
+    ret = (content == NULL) ? ERR_NOMEM : inode_wb_enable(&u);
+    uint64_t seed = 42;
+    for(size_t i = 0; content != NULL && i < FB_GEN_SIZE; i++){
+        content[i] = (uint8_t)fb_rand(&seed);
+    }
+
+    char path[FB_PATH_MAX];
+    for(int d = 0; d < FB_GEN_DIRS && ret == ERR_NONE; d++){
+        snprintf(path, sizeof(path), "/dir%d", d);
+        int inr = direntv6_create(&u, path, IREAD | IWRITE | IEXEC | IFDIR);
+        for(int f = 0; f < FB_GEN_FILES && inr > 0; f++){
+            snprintf(path, sizeof(path), "/dir%d/file%d", d, f);
+            inr = direntv6_create(&u, path, IREAD | IWRITE);
+            struct filev6 fv6 = {0};
+            ret = (inr < 0) ? inr : filev6_open(&u, (uint16_t)inr, &fv6);
+            if(ret == ERR_NONE){
+                ret = filev6_writebytes(&fv6, content, FB_GEN_SIZE - (size_t)f*SECTOR_SIZE/2);
+            }
+            inr = (ret == ERR_NONE) ? inr : ret;
+        }
+        ret = (inr < 0) ? inr : ret;
+    }
+    free(content);
+    int err2 = umountv6(&u);
+    return ret == ERR_NONE ? err2 : ret;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if(argc < 3){
+        fprintf(stderr, "usage: %s <disk> <mountpoint> [<clients>]\n", argv[0]);
+        return ERR_INVALID_COMMAND;
+    }
+    const char *disk = argv[1];
+    const char *mountpoint = argv[2];
+    int nb_clients = (argc > 3) ? atoi(argv[3]) : 4;
+    if(nb_clients < 1 || nb_clients > FB_MAX_CLIENTS){
+        return ERR_BAD_PARAMETER;
+    }
+    if(access(disk, F_OK) != 0){
+        int ret = fb_generate(disk);
+        if(ret != ERR_NONE){
+            fprintf(stderr, "%s: cannot generate %s: %s\n", argv[0], disk, ERR_MESSAGES[ret - ERR_FIRST]);
+            return ret;
+        }
+    }
+
+    static const struct { const char *name; int flags; } configs[] = {
+        { "single_direct_io", 0 },
+        { "multi_direct_io", U6FS_FUSE_MULTITHREAD },
+        { "single_cached", U6FS_FUSE_CACHED },
+        { "multi_cached", U6FS_FUSE_MULTITHREAD | U6FS_FUSE_CACHED },
+    };
+
+    struct fb_paths paths = {0};
+    paths.files = calloc(FB_MAX_PATHS, FB_PATH_MAX);
+    paths.dirs = calloc(FB_MAX_PATHS, FB_PATH_MAX);
+    if(paths.files == NULL || paths.dirs == NULL){
+        free(paths.files);
+        free(paths.dirs);
+        return ERR_NOMEM;
+    }
+
+    int ret = ERR_NONE;
+    for(size_t c = 0; c < sizeof(configs)/sizeof(configs[0]) && ret == ERR_NONE; c++){
+        pid_t pid = fb_mount(disk, mountpoint, configs[c].flags);
+        if(pid < 0){
+            fprintf(stderr, "%s: cannot mount %s on %s\n", argv[0], disk, mountpoint);
+            ret = ERR_IO;
+            break;
+        }
+        paths.nb_files = paths.nb_dirs = 0;
+        fb_collect(&paths, mountpoint);
+        if(paths.nb_files == 0){
+            fprintf(stderr, "%s: no file in %s\n", argv[0], disk);
+            ret = ERR_NO_SUCH_FILE;
+        }
+        for(int w = 0; w < FB_NB_WORKLOADS && ret == ERR_NONE; w++){
+            fb_run_workload(configs[c].name, (enum fb_workload)w, &paths, nb_clients);
+        }
+        fb_unmount(mountpoint, pid);
+    }
+
+    free(paths.files);
+    free(paths.dirs);
+    return ret;
+}
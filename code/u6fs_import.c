@@ -0,0 +1,283 @@
+/**
+ * @file u6fs_import.c
+ * @brief copy files and directory trees of the host into a mounted UV6 filesystem
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "error.h"
+#include "mount.h"
+#include "inode.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "dirtree.h"
+#include "bmblock.h"
+#include "u6fs_import.h"
+
+#define IMPORT_FILE_MODE (IWRITE | IREAD | IEXEC)
+#define IMPORT_DIR_MODE (IWRITE | IREAD | IEXEC | IFDIR)
+
+struct import_ctx {
+    struct unix_filesystem *u;
+    uint8_t *chunk;         // IMPORT_CHUNK_SIZE bytes, reused for every file
+    char path[PATH_MAX];    // host path of the current entry
+    size_t len;             // strlen(path)
+};
+
+// number of disk sectors (data + indirect) taken by a file of the given size
+static size_t import_nb_sectors(size_t size){
+    size_t nb_data = (size + SECTOR_SIZE - 1)/SECTOR_SIZE;
+    if(size < ADDR_SMALL_LENGTH*SECTOR_SIZE){
+        return nb_data;
+    }
+    return nb_data + (nb_data + ADDRESSES_PER_SECTOR - 1)/ADDRESSES_PER_SECTOR;
+}
+
+// appends the content of the host file f (of the given size) to the empty file fv6
+static int import_stream(struct filev6 *fv6, FILE *f, size_t size, uint8_t *chunk){
+    if(size > FILEV6_MAX_SIZE){
+        return ERR_FILE_TOO_LARGE;
+    }
+    if(size == 0){
+        return ERR_NONE;
+    }
+
+    // start the file where it fits in one extent, if there is such a place
+    int run = bm_find_run(fv6->u->fbm, import_nb_sectors(size));
+    if(run > 0){
+        fv6->alloc_hint = (sector_addr_t)run;
+    }
+
+    size_t nb_read = 0;
+    while((nb_read = fread(chunk, 1, IMPORT_CHUNK_SIZE, f)) > 0){
+        int write = filev6_append(fv6, chunk, nb_read);
+        if(write != ERR_NONE){
+            return write;
+        }
+    }
+    return ferror(f) ? ERR_IO : ERR_NONE;
+}
+
+static int import_host_file(struct filev6 *fv6, const char *host_file, uint8_t *chunk){
+    FILE *f = fopen(host_file, "rb");
+    if(f == NULL){
+        return ERR_IO;
+    }
+    struct stat st;
+    int ret = fstat(fileno(f), &st) ? ERR_IO : import_stream(fv6, f, (size_t)st.st_size, chunk);
+    fclose(f);
+    return ret;
+}
+
+
+int import_file(struct unix_filesystem *u, const char *host_file, const char *dest){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(host_file);
+    M_REQUIRE_NON_NULL(dest);
+
+    struct stat st;
+    if(stat(host_file, &st) || !S_ISREG(st.st_mode)){
+        return ERR_IO;
+    }
+    if(st.st_size > FILEV6_MAX_SIZE){
+        return ERR_FILE_TOO_LARGE;
+    }
+
+    uint8_t *chunk = malloc(IMPORT_CHUNK_SIZE);
+    if(chunk == NULL){
+        return ERR_NOMEM;
+    }
+
+    int inr = direntv6_create(u, dest, IMPORT_FILE_MODE);
+    if(inr < 0){
+        free(chunk);
+        return inr;
+    }
+
+    struct filev6 fv6 = {0};
+    int ret = filev6_open(u, (uint16_t)inr, &fv6);
+    if(ret == ERR_NONE){
+        ret = import_host_file(&fv6, host_file, chunk);
+    }
+    if(ret == ERR_NONE){
+        ret = inode_write(u, fv6.i_number, &fv6.i_node);
+    }
+
+    free(chunk);
+    return ret;
+}
+
+
+// reads the names already present in directory inr (n_names entries)
+static int import_existing_names(struct unix_filesystem *u, uint16_t inr, char (**names)[DIRENT_MAXLEN+1], size_t *n_names){
+    struct directory_reader d;
+    int ret = direntv6_opendir(u, inr, &d);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    size_t max = (size_t)inode_getsize(&d.fv6.i_node)/sizeof(struct direntv6);
+    *n_names = 0;
+    *names = NULL;
+    if(max == 0){
+        return ERR_NONE;
+    }
+    *names = calloc(max, DIRENT_MAXLEN+1);
+    if(*names == NULL){
+        return ERR_NOMEM;
+    }
+
+    uint16_t child_inr = 0;
+    while(*n_names < max && (ret = direntv6_readdir(&d, (*names)[*n_names], &child_inr)) > 0){
+        *n_names += 1;
+    }
+    return ret < 0 ? ret : ERR_NONE;
+}
+
+static int import_name_exists(char (*names)[DIRENT_MAXLEN+1], size_t n_names, const char *name){
+    for(size_t i = 0; i < n_names; i++){
+        if(strncmp(names[i], name, DIRENT_MAXLEN) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int import_dir(struct import_ctx *ctx, uint16_t dir_inr);
+
+// imports one entry of the host directory (ctx->path is its host path), filling in its direntv6
+static int import_entry(struct import_ctx *ctx, const char *name, struct direntv6 *entry, int *skipped){
+    struct stat st;
+    if(lstat(ctx->path, &st)){
+        return ERR_IO;
+    }
+    *skipped = !S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode); // links, devices, ...
+    if(*skipped){
+        return ERR_NONE;
+    }
+
+    struct filev6 child = {0};
+    int ret = filev6_create(ctx->u, S_ISDIR(st.st_mode) ? IMPORT_DIR_MODE : IMPORT_FILE_MODE, &child);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    memset(entry, 0, sizeof(*entry));
+    entry->d_inumber = child.i_number;
+    strncpy(entry->d_name, name, DIRENT_MAXLEN);
+
+    if(S_ISDIR(st.st_mode)){
+        return import_dir(ctx, child.i_number);
+    }
+
+    ret = import_host_file(&child, ctx->path, ctx->chunk);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    return inode_write(ctx->u, child.i_number, &child.i_node);
+}
+
+static int import_dir(struct import_ctx *ctx, uint16_t dir_inr){
+    struct dirent **host_entries = NULL;
+    int n = scandir(ctx->path, &host_entries, NULL, alphasort);
+    if(n < 0){
+        return ERR_IO;
+    }
+
+    char (*names)[DIRENT_MAXLEN+1] = NULL;
+    size_t n_names = 0;
+    struct direntv6 *entries = calloc((size_t)n + 1, sizeof(struct direntv6));
+    int ret = (entries == NULL) ? ERR_NOMEM : import_existing_names(ctx->u, dir_inr, &names, &n_names);
+
+    size_t n_entries = 0;
+    const size_t len = ctx->len;
+    for(int i = 0; i < n && ret == ERR_NONE; i++){
+        const char *name = host_entries[i]->d_name;
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+            continue;
+        }
+        if(strlen(name) > DIRENT_MAXLEN){
+            ret = ERR_FILENAME_TOO_LONG;
+        }else if(import_name_exists(names, n_names, name)){
+            ret = ERR_FILENAME_ALREADY_EXISTS;
+        }else if(len + 1 + strlen(name) >= sizeof(ctx->path)){
+            ret = ERR_BAD_PARAMETER;
+        }else{
+            snprintf(&ctx->path[len], sizeof(ctx->path) - len, "/%s", name);
+            ctx->len = strlen(ctx->path);
+            int skipped = 0;
+            ret = import_entry(ctx, name, &entries[n_entries], &skipped);
+            n_entries += !skipped;
+            ctx->len = len;
+            ctx->path[len] = '\0';
+        }
+    }
+
+    if(ret == ERR_NONE && n_entries > 0){
+        // all the entries of the directory in one write
+        struct filev6 dir = {0};
+        ret = filev6_open(ctx->u, dir_inr, &dir);
+        if(ret == ERR_NONE && (dir.i_node.i_mode & IDIRTREE)){
+            // a B+tree keeps its entries in the leaves, one insert each
+            for(size_t k = 0; k < n_entries && ret == ERR_NONE; k++){
+                ret = dirtree_insert(&dir, &entries[k]);
+            }
+        }else if(ret == ERR_NONE){
+            ret = filev6_append(&dir, entries, n_entries*sizeof(struct direntv6));
+        }
+        if(ret == ERR_NONE){
+            ret = inode_write(ctx->u, dir_inr, &dir.i_node);
+        }
+    }
+
+    for(int i = 0; i < n; i++){
+        free(host_entries[i]);
+    }
+    free(host_entries);
+    free(names);
+    free(entries);
+    return ret;
+}
+
+
+int import_tree(struct unix_filesystem *u, const char *host_dir, const char *dest){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(host_dir);
+    M_REQUIRE_NON_NULL(dest);
+
+    struct import_ctx *ctx = calloc(1, sizeof(struct import_ctx));
+    if(ctx == NULL){
+        return ERR_NOMEM;
+    }
+    ctx->u = u;
+    ctx->len = strlen(host_dir);
+    ctx->chunk = malloc(IMPORT_CHUNK_SIZE);
+    if(ctx->chunk == NULL || ctx->len >= sizeof(ctx->path)){
+        int err = (ctx->chunk == NULL) ? ERR_NOMEM : ERR_BAD_PARAMETER;
+        free(ctx->chunk);
+        free(ctx);
+        return err;
+    }
+    strncpy(ctx->path, host_dir, sizeof(ctx->path) - 1);
+
+    int inr = direntv6_dirlookup(u, ROOT_INUMBER, dest);
+    if(inr == ERR_NO_SUCH_FILE){
+        inr = direntv6_create(u, dest, IMPORT_DIR_MODE);
+    }
+
+    const int batching = (u->iwb != NULL);
+    int ret = (inr < 0) ? inr : inode_wb_enable(u);
+    if(ret == ERR_NONE){
+        ret = import_dir(ctx, (uint16_t)inr);
+        int flush = batching ? inode_wb_flush(u) : inode_wb_disable(u);
+        ret = (ret == ERR_NONE) ? flush : ret;
+    }
+
+    free(ctx->chunk);
+    free(ctx);
+    return ret;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+/**
+ * @file u6fs_import.h
+ * @brief copy files and directory trees of the host into a mounted UV6 filesystem
+ */
+
+#include "mount.h"
+
+#define IMPORT_CHUNK_SIZE (128 * SECTOR_SIZE) /* bytes read from the host at once */
+
+/**
+ * @brief copy a host file into a new file of the filesystem, streaming its
+ *        content in chunks of IMPORT_CHUNK_SIZE bytes
+ * @param u the mounted filesystem
+ * @param host_file the path of the file on the host
+ * @param dest the path of the new file in the filesystem
+ * @return 0 on success; <0 on error
+ */
+int import_file(struct unix_filesystem *u, const char *host_file, const char *dest);
+
+/**
+ * @brief copy the content of a host directory, recursively, into a directory
+ *        of the filesystem (created if it does not exist).
+ *        All the entries of a directory are written at once and inode writes
+ *        are batched.
+ * @param u the mounted filesystem
+ * @param host_dir the path of the directory on the host
+ * @param dest the path of the destination directory in the filesystem
+ * @return 0 on success; <0 on error
+ */
+int import_tree(struct unix_filesystem *u, const char *host_dir, const char *dest);
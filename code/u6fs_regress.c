@@ -0,0 +1,592 @@
+/**
+ * @file u6fs_regress.c
+ * @brief regression tests of the u6fs commands
+ *
+ * Runs the u6fs program on images generated in a scratch directory and
+ * checks its exit status and output. Prints one line per test on stdout:
+ *   PASS <test>
+ *   FAIL <test>: <what went wrong>
+ * and exits non-zero if any test failed.
+ *
+ * usage: u6fs_regress <u6fs> [<scratch_dir>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "error.h"
+#include "mount.h"
+#include "inode.h"
+#include "filev6.h"
+#include "snapshot.h"
+#include "sector.h"
+#include "util.h"
+
+#define REGRESS_DISK_BLOCKS 4096
+#define REGRESS_DISK_INODES 256
+#define REGRESS_PATH_MAX 1024
+#define REGRESS_OUTPUT_MAX (64 * 1024)
+#define REGRESS_EMPTY_DIRS 64
+#define REGRESS_TREE_RUNS 10     // a parallel tree is scheduled differently each time
+#define REGRESS_DIRTREE_FILES 100 // over three leaves of a B+tree directory with 512-byte sectors
+#define REGRESS_HOST_DIR "import"
+#define REGRESS_TEXT_LINES 1000     // a compressible host file of about 30 KB
+#define REGRESS_WRITTEN "overwritten" // the bytes written over the start of a file
+#define REGRESS_SMALL_FILE 3000     // bytes of a file of direct sectors only
+
+struct regress_env {
+    const char *u6fs;               // the program tested
+    char dir[REGRESS_PATH_MAX];     // scratch directory
+    char image[REGRESS_PATH_MAX];   // a fresh image for each test
+    char out[REGRESS_OUTPUT_MAX];   // output of the last command
+};
+
+/* ********************************************************************** *
+ * helpers
+ * ********************************************************************** */
+
+// runs "u6fs <image> <args>", its stdout and stderr in env->out; returns its exit status
+static int regress_u6fs(struct regress_env *env, const char *args){
+    char cmd[4 * REGRESS_PATH_MAX];    // the program, the image and up to 2 paths of arguments
+    snprintf(cmd, sizeof(cmd), "'%s' '%s' %s 2>&1", env->u6fs, env->image, args);
+    env->out[0] = '\0';
+    FILE *p = popen(cmd, "r");
+    if(p == NULL){
+        return -1;
+    }
+    size_t len = fread(env->out, 1, sizeof(env->out) - 1, p);
+    env->out[len] = '\0';
+    int status = pclose(p);
+    return (status != -1 && WIFEXITED(status)) ? WEXITSTATUS(status) : -1;
+}
+
+// number of lines of env->out equal to line, or only starting with it if prefix
+static int regress_count(const struct regress_env *env, const char *line, int prefix){
+    const size_t len = strlen(line);
+    int count = 0;
+    for(const char *s = env->out; *s != '\0'; ){
+        const char *end = strchr(s, '\n');
+        const size_t n = (end != NULL) ? (size_t)(end - s) : strlen(s);
+        count += ((prefix ? n >= len : n == len) && strncmp(s, line, len) == 0);
+        s += n + (end != NULL);
+    }
+    return count;
+}
+
+static int regress_count_lines(const struct regress_env *env, const char *line){
+    return regress_count(env, line, 0);
+}
+
+// writes a host file of the scratch directory
+static int regress_host_file(const struct regress_env *env, const char *name, const char *content,
+                             char *path, size_t cap){
+    snprintf(path, cap, "%.*s/%s", REGRESS_PATH_MAX - 64, env->dir, name);
+    FILE *f = fopen(path, "w");
+    if(f == NULL){
+        return ERR_IO;
+    }
+    const int ok = fputs(content, f) >= 0;
+    return (fclose(f) == 0 && ok) ? ERR_NONE : ERR_IO;
+}
+
+// the host directory REGRESS_HOST_DIR of the scratch directory: files f000, f001...
+// of REGRESS_DIRTREE_FILES, the kth holding k + 1 bytes
+static int regress_host_dir(const struct regress_env *env, char *path, size_t cap){
+    char name[sizeof(REGRESS_HOST_DIR) + 16];
+    char content[REGRESS_DIRTREE_FILES + 1];
+    snprintf(path, cap, "%.*s/" REGRESS_HOST_DIR, REGRESS_PATH_MAX - 16, env->dir);
+    mkdir(path, 0755);
+    for(int k = 0; k < REGRESS_DIRTREE_FILES; k++){
+        memset(content, '0', (size_t)k + 1);
+        content[k + 1] = '\0';
+        snprintf(name, sizeof(name), REGRESS_HOST_DIR "/f%03d", k);
+        char file[REGRESS_PATH_MAX];
+        if(regress_host_file(env, name, content, file, sizeof(file)) != ERR_NONE){
+            return ERR_IO;
+        }
+    }
+    return ERR_NONE;
+}
+
+// a compressible text of REGRESS_TEXT_LINES lines
+static const char *regress_text(void){
+    static char text[REGRESS_TEXT_LINES * 32];
+    if(text[0] == '\0'){
+        for(int k = 0; k < REGRESS_TEXT_LINES; k++){
+            const size_t len = strlen(text);
+            snprintf(text + len, sizeof(text) - len, "line %04d of a text file\n", k);
+        }
+    }
+    return text;
+}
+
+// the host file f.txt of the scratch directory, holding regress_text()
+static int regress_host_text(const struct regress_env *env, char *path, size_t cap){
+    return regress_host_file(env, "f.txt", regress_text(), path, cap);
+}
+
+// number of lines of env->out starting with prefix if they come in strictly increasing order, -1 otherwise
+static int regress_count_sorted(const struct regress_env *env, const char *prefix){
+    const size_t len = strlen(prefix);
+    const char *last = NULL;
+    size_t last_n = 0;
+    int count = 0;
+    for(const char *s = env->out; *s != '\0'; ){
+        const char *end = strchr(s, '\n');
+        const size_t n = (end != NULL) ? (size_t)(end - s) : strlen(s);
+        if(n >= len && strncmp(s, prefix, len) == 0){
+            const int cmp = (last == NULL) ? 1 : strncmp(s, last, MIN(n, last_n) + 1);
+            if(cmp <= 0){
+                return -1;
+            }
+            last = s;
+            last_n = n;
+            count++;
+        }
+        s += n + (end != NULL);
+    }
+    return count;
+}
+
+// copies the first line of env->out starting with prefix to line; 0 if there is none
+static int regress_line(const struct regress_env *env, const char *prefix, char *line, size_t cap){
+    for(const char *s = env->out; *s != '\0'; ){
+        const char *end = strchr(s, '\n');
+        const size_t n = (end != NULL) ? (size_t)(end - s) : strlen(s);
+        if(strncmp(s, prefix, strlen(prefix)) == 0){
+            snprintf(line, cap, "%.*s", (int)n, s);
+            return 1;
+        }
+        s += n + (end != NULL);
+    }
+    return 0;
+}
+
+// calls patch on the file_sec_off-th sector of the data of inode inr, then writes it back
+static int regress_patch_sector(const struct regress_env *env, uint16_t inr, int32_t file_sec_off,
+                                void (*patch)(uint8_t *data)){
+    struct unix_filesystem u;
+    int err = mountv6(env->image, &u);
+    if(err != ERR_NONE){
+        return err;
+    }
+    struct inode i;
+    uint8_t data[SECTOR_SIZE];
+    err = inode_read(&u, inr, &i);
+    const int sector = (err == ERR_NONE) ? inode_findsector(&u, &i, file_sec_off) : err;
+    err = (sector < 0) ? sector : sector_read(u.f, (uint32_t)sector, data);
+    if(err == ERR_NONE){
+        patch(data);
+        err = sector_write(u.f, (uint32_t)sector, data);
+    }
+    const int umount = umountv6(&u);
+    return (err != ERR_NONE) ? err : umount;
+}
+
+// calls patch on inode inr of a mount of the image, then writes it back
+static int regress_patch_inode(const struct regress_env *env, uint16_t inr,
+                               void (*patch)(const struct unix_filesystem *u, struct inode *i)){
+    struct unix_filesystem u;
+    int err = mountv6(env->image, &u);
+    if(err != ERR_NONE){
+        return err;
+    }
+    struct inode i;
+    err = inode_read(&u, inr, &i);
+    if(err == ERR_NONE){
+        patch(&u, &i);
+        err = inode_write(&u, inr, &i);
+    }
+    const int umount = umountv6(&u);
+    return (err != ERR_NONE) ? err : umount;
+}
+
+// writes len bytes at offset of the file of inode inr, as a write through FUSE does
+static int regress_writeat(const struct regress_env *env, uint16_t inr, int32_t offset,
+                           const void *bytes, size_t len){
+    struct unix_filesystem u;
+    int err = mountv6(env->image, &u);
+    if(err != ERR_NONE){
+        return err;
+    }
+    struct filev6 fv6;
+    err = filev6_open(&u, inr, &fv6);
+    if(err == ERR_NONE){
+        err = filev6_writeat(&fv6, offset, bytes, len);
+    }
+    const int umount = umountv6(&u);
+    return (err != ERR_NONE) ? err : umount;
+}
+
+// reads the file of inode inr, of the snapshot given or of the files if NULL; its size, or <0 on error
+static int regress_read(const struct regress_env *env, const char *snapshot, uint16_t inr,
+                        uint8_t *buf, size_t cap){
+    struct unix_filesystem u;
+    int err = mountv6(env->image, &u);
+    if(err != ERR_NONE){
+        return err;
+    }
+    struct filev6 fv6;
+    err = (snapshot != NULL) ? snapshot_open(&u, snapshot) : ERR_NONE;
+    if(err == ERR_NONE){
+        err = filev6_open(&u, inr, &fv6);
+    }
+    size_t done = 0;
+    int read = 1;
+    while(err == ERR_NONE && read > 0){
+        read = filev6_readbytes(&fv6, &buf[done], cap - done);
+        err = (read < 0) ? read : ERR_NONE;
+        done += (read > 0) ? (size_t)read : 0;
+    }
+    const int umount = umountv6(&u);
+    err = (err != ERR_NONE) ? err : umount;
+    return (err != ERR_NONE) ? err : (int)done;
+}
+
+// runs fsck (repairing if asked): the number of problems it reports, -1 if it fails
+// before its summary (it also exits with an error on the problems it does not repair)
+static int regress_fsck(struct regress_env *env, int repair){
+    (void)regress_u6fs(env, repair ? "fsck --repair" : "fsck");
+    const char *line = strstr(env->out, "fsck: ");
+    const char *problems = (line != NULL) ? strstr(line, " sectors in use, ") : NULL;
+    int count = -1;
+    return (problems != NULL && sscanf(problems, " sectors in use, %d problems", &count) == 1) ? count : -1;
+}
+
+#define REGRESS_EXPECT(cond, msg) \
+    do { if(!(cond)) return (msg); } while(0)
+
+/* ********************************************************************** *
+ * tests: each returns NULL on success, what failed otherwise
+ * ********************************************************************** */
+
+static const char *regress_tree_empty_root(struct regress_env *env){
+    REGRESS_EXPECT(regress_u6fs(env, "tree") == 0, "tree fails on an empty root");
+    REGRESS_EXPECT(regress_count_lines(env, "DIR /") == 1, "tree does not print the root");
+    REGRESS_EXPECT(regress_u6fs(env, "tree 1") == 0, "tree 1 fails on an empty root");
+    REGRESS_EXPECT(regress_count_lines(env, "DIR /") == 1, "tree 1 does not print the root");
+    return NULL;
+}
+
+static const char *regress_tree_empty_subdir(struct regress_env *env){
+    // many empty directories, for the workers of a parallel tree to pick first
+    char script[(REGRESS_EMPTY_DIRS + 4) * 16] = "mkdir /a\nmkdir /a/empty\nmkdir /b\n";
+    for(int k = 0; k < REGRESS_EMPTY_DIRS; k++){
+        const size_t len = strlen(script);
+        snprintf(script + len, sizeof(script) - len, "mkdir /e%d\n", k);
+    }
+    char path[REGRESS_PATH_MAX];
+    char args[2 * REGRESS_PATH_MAX];
+    REGRESS_EXPECT(regress_host_file(env, "script.txt", script, path, sizeof(path)) == ERR_NONE,
+                   "cannot write the script");
+    snprintf(args, sizeof(args), "batch '%s'", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "mkdir of the directories fails");
+    REGRESS_EXPECT(regress_host_file(env, "f.txt", "content\n", path, sizeof(path)) == ERR_NONE,
+                   "cannot write the host file");
+    snprintf(args, sizeof(args), "add /b/f '%s'", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "add /b/f fails");
+
+    REGRESS_EXPECT(regress_u6fs(env, "tree 1") == 0, "tree 1 fails with an empty subdirectory");
+    REGRESS_EXPECT(regress_count_lines(env, "DIR /a/empty/") == 1, "tree 1 misses the empty subdirectory");
+    REGRESS_EXPECT(regress_count_lines(env, "FIL /b/f") == 1, "tree 1 misses a file");
+    for(int run = 0; run < REGRESS_TREE_RUNS; run++){
+        REGRESS_EXPECT(regress_u6fs(env, "tree 8") == 0, "tree 8 fails with empty subdirectories");
+        REGRESS_EXPECT(regress_count_lines(env, "DIR /a/empty/") == 1, "tree 8 misses the empty subdirectory");
+        REGRESS_EXPECT(regress_count_lines(env, "FIL /b/f") == 1, "tree 8 misses a file");
+    }
+    return NULL;
+}
+
+// the parallel shafiles of a batch must see the inodes written before it
+static const char *regress_batch_shafiles(struct regress_env *env){
+    char path[REGRESS_PATH_MAX];
+    char script[3 * REGRESS_PATH_MAX];
+    char args[2 * REGRESS_PATH_MAX];
+    REGRESS_EXPECT(regress_host_file(env, "f.txt", "content\n", path, sizeof(path)) == ERR_NONE,
+                   "cannot write the host file");
+    snprintf(script, sizeof(script), "add /x %s\nshafiles\nshafiles 4\nshafiles 1\n", path);
+    REGRESS_EXPECT(regress_host_file(env, "script.txt", script, path, sizeof(path)) == ERR_NONE,
+                   "cannot write the script");
+    snprintf(args, sizeof(args), "batch '%s'", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "the batch fails");
+    REGRESS_EXPECT(regress_count(env, "SHA inode 2: ", 1) == 3, "a shafiles misses the file just added");
+    REGRESS_EXPECT(regress_count_lines(env, "SHA inode 2: DIR") == 0, "a shafiles sees the file as a directory");
+    return NULL;
+}
+
+// a B+tree directory of several leaves, built at once (dirtree) or grown by inserts (import)
+static const char *regress_dirtree_leaves(struct regress_env *env){
+    char path[REGRESS_PATH_MAX];
+    char args[2 * REGRESS_PATH_MAX];
+    REGRESS_EXPECT(regress_host_dir(env, path, sizeof(path)) == ERR_NONE, "cannot write the host directory");
+    snprintf(args, sizeof(args), "import '%s' /built", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "import to /built fails");
+    REGRESS_EXPECT(regress_u6fs(env, "dirtree /built") == 0, "dirtree /built fails");
+    REGRESS_EXPECT(regress_u6fs(env, "mkdir /grown") == 0, "mkdir /grown fails");
+    REGRESS_EXPECT(regress_u6fs(env, "dirtree /grown") == 0, "dirtree of the empty /grown fails");
+    snprintf(args, sizeof(args), "import '%s' /grown", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "import to the B+tree /grown fails");
+
+    REGRESS_EXPECT(regress_u6fs(env, "tree 1") == 0, "tree 1 fails on B+tree directories");
+    REGRESS_EXPECT(regress_count_sorted(env, "FIL /built/") == REGRESS_DIRTREE_FILES,
+                   "readdir of /built misses entries or is not in name order");
+    REGRESS_EXPECT(regress_count_sorted(env, "FIL /grown/") == REGRESS_DIRTREE_FILES,
+                   "readdir of /grown misses entries or is not in name order");
+    // uncompress leaves an ordinary file as is, and prints its size: a lookup
+    const char *lookups[][2] = {
+        { "uncompress /built/f000", "/built/f000: 1 bytes" },
+        { "uncompress /built/f057", "/built/f057: 58 bytes" },
+        { "uncompress /grown/f099", "/grown/f099: 100 bytes" },
+        { "uncompress /grown/f031", "/grown/f031: 32 bytes" },
+    };
+    for(size_t k = 0; k < sizeof(lookups)/sizeof(lookups[0]); k++){
+        REGRESS_EXPECT(regress_u6fs(env, lookups[k][0]) == 0, "a lookup in a B+tree directory fails");
+        REGRESS_EXPECT(regress_count(env, lookups[k][1], 1) == 1, "a lookup in a B+tree directory finds another file");
+    }
+    REGRESS_EXPECT(regress_u6fs(env, "uncompress /grown/f100") != 0, "a lookup finds a name not in the directory");
+    REGRESS_EXPECT(regress_fsck(env, 0) == 0, "fsck finds problems in B+tree directories");
+    return NULL;
+}
+
+// a compressed file reads the same as before, and back as an ordinary file
+static const char *regress_compress_readback(struct regress_env *env){
+    char path[REGRESS_PATH_MAX];
+    char args[2 * REGRESS_PATH_MAX];
+    char sha[REGRESS_PATH_MAX];
+    char line[REGRESS_PATH_MAX];
+    int before = 0;
+    int after = 0;
+    REGRESS_EXPECT(regress_host_text(env, path, sizeof(path)) == ERR_NONE, "cannot write the host file");
+    snprintf(args, sizeof(args), "add /z '%s'", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "add /z fails");
+    REGRESS_EXPECT(regress_u6fs(env, "shafiles") == 0 && regress_line(env, "SHA inode 2: ", sha, sizeof(sha)),
+                   "shafiles of the file fails");
+
+    REGRESS_EXPECT(regress_u6fs(env, "compress /z") == 0, "compress fails");
+    REGRESS_EXPECT(regress_line(env, "/z: ", line, sizeof(line))
+                   && sscanf(line, "/z: %*d bytes, %d -> %d sectors", &before, &after) == 2,
+                   "compress does not print the sectors of the file");
+    REGRESS_EXPECT(after < before, "compress does not save sectors on a text file");
+    REGRESS_EXPECT(regress_u6fs(env, "shafiles") == 0 && regress_count_lines(env, sha) == 1,
+                   "the compressed file does not read the same");
+    REGRESS_EXPECT(regress_fsck(env, 0) == 0, "fsck finds problems with a compressed file");
+
+    REGRESS_EXPECT(regress_u6fs(env, "uncompress /z") == 0, "uncompress fails");
+    REGRESS_EXPECT(regress_count(env, "/z: ", 1) == 1 && regress_line(env, "/z: ", line, sizeof(line))
+                   && sscanf(line, "/z: %*d bytes, %*d -> %d sectors", &after) == 1 && after == before,
+                   "uncompress does not give back the sectors of the file");
+    REGRESS_EXPECT(regress_u6fs(env, "shafiles") == 0 && regress_count_lines(env, sha) == 1,
+                   "the uncompressed file does not read the same");
+    return NULL;
+}
+
+// shortens the length of the compr_header at the start of a sector
+static void regress_truncate_header(uint8_t *data){
+    struct compr_header header;
+    memcpy(&header, data, sizeof(header));
+    header.length = (uint16_t)(header.length/2);
+    memcpy(data, &header, sizeof(header));
+}
+
+// a compressed cluster whose header is shorter than its LZ4 block is an error, not garbage
+static const char *regress_compress_truncated(struct regress_env *env){
+    char path[REGRESS_PATH_MAX];
+    char args[2 * REGRESS_PATH_MAX];
+    REGRESS_EXPECT(regress_host_text(env, path, sizeof(path)) == ERR_NONE, "cannot write the host file");
+    snprintf(args, sizeof(args), "add /z '%s'", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "add /z fails");
+    REGRESS_EXPECT(regress_u6fs(env, "compress /z") == 0, "compress fails");
+    REGRESS_EXPECT(regress_patch_sector(env, 2, 0, regress_truncate_header) == ERR_NONE,
+                   "cannot patch the first cluster");
+    REGRESS_EXPECT(regress_u6fs(env, "uncompress /z") != 0, "a truncated compressed cluster reads without error");
+    return NULL;
+}
+
+// sectors in use, as fsck counts them; -1 on error
+static int regress_sectors_in_use(struct regress_env *env){
+    char line[REGRESS_PATH_MAX];
+    int sectors = -1;
+    return (regress_fsck(env, 0) == 0 && regress_line(env, "fsck: ", line, sizeof(line))
+            && sscanf(line, "fsck: %*d inodes, %d sectors", &sectors) == 1) ? sectors : -1;
+}
+
+// a file writing a sector shared by dedup scan gets its own copy: the other file is unchanged
+static const char *regress_dedup_overwrite(struct regress_env *env){
+    char path[REGRESS_PATH_MAX];
+    char args[2 * REGRESS_PATH_MAX];
+    char sha_a[REGRESS_PATH_MAX];
+    char sha_b[REGRESS_PATH_MAX];
+    REGRESS_EXPECT(regress_host_text(env, path, sizeof(path)) == ERR_NONE, "cannot write the host file");
+    snprintf(args, sizeof(args), "add /a '%s'", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "add /a fails");
+    snprintf(args, sizeof(args), "add /b '%s'", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "add /b fails");
+    REGRESS_EXPECT(regress_u6fs(env, "shafiles") == 0 && regress_line(env, "SHA inode 3: ", sha_b, sizeof(sha_b)),
+                   "shafiles of the files fails");
+
+    REGRESS_EXPECT(regress_u6fs(env, "dedup enable") == 0, "dedup enable fails");
+    const int before = regress_sectors_in_use(env); // with the area of the dedup entries
+    REGRESS_EXPECT(regress_u6fs(env, "dedup scan") == 0, "dedup scan fails");
+    const int after = regress_sectors_in_use(env);
+    REGRESS_EXPECT(before > 0 && after > 0 && after < before, "dedup scan does not share the sectors of the copies");
+
+    REGRESS_EXPECT(regress_writeat(env, 2, 0, REGRESS_WRITTEN, strlen(REGRESS_WRITTEN)) == ERR_NONE,
+                   "the write to /a fails");
+    REGRESS_EXPECT(regress_u6fs(env, "shafiles") == 0 && regress_count_lines(env, sha_b) == 1,
+                   "writing /a changes /b");
+    REGRESS_EXPECT(regress_line(env, "SHA inode 2: ", sha_a, sizeof(sha_a))
+                   && strcmp(strchr(sha_a, ':'), strchr(sha_b, ':')) != 0, "the write to /a is lost");
+    REGRESS_EXPECT(regress_fsck(env, 0) == 0, "fsck finds problems after writing a shared sector");
+    return NULL;
+}
+
+// a snapshot keeps the bytes of a file written after it, and its deletion leaves a clean image
+static const char *regress_snapshot_lifecycle(struct regress_env *env){
+    static uint8_t bytes[REGRESS_TEXT_LINES * 32 + SECTOR_SIZE];
+    const char *text = regress_text();
+    const size_t len = strlen(text);
+    const size_t written = strlen(REGRESS_WRITTEN);
+    char path[REGRESS_PATH_MAX];
+    char args[2 * REGRESS_PATH_MAX];
+    REGRESS_EXPECT(regress_host_text(env, path, sizeof(path)) == ERR_NONE, "cannot write the host file");
+    snprintf(args, sizeof(args), "add /s '%s'", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "add /s fails");
+    REGRESS_EXPECT(regress_u6fs(env, "snapshot create before") == 0, "snapshot create fails");
+    REGRESS_EXPECT(regress_writeat(env, 2, 0, REGRESS_WRITTEN, written) == ERR_NONE,
+                   "the write to /s fails");
+
+    REGRESS_EXPECT(regress_read(env, NULL, 2, bytes, sizeof(bytes)) == (int)len
+                   && memcmp(bytes, REGRESS_WRITTEN, written) == 0
+                   && memcmp(&bytes[written], &text[written], len - written) == 0,
+                   "the file does not read what was written");
+    REGRESS_EXPECT(regress_read(env, "before", 2, bytes, sizeof(bytes)) == (int)len && memcmp(bytes, text, len) == 0,
+                   "the snapshot does not read the file as it was");
+    REGRESS_EXPECT(regress_fsck(env, 0) == 0, "fsck finds problems with a snapshot");
+
+    REGRESS_EXPECT(regress_u6fs(env, "snapshot delete before") == 0, "snapshot delete fails");
+    REGRESS_EXPECT(regress_read(env, "before", 2, bytes, sizeof(bytes)) == ERR_NO_SUCH_FILE,
+                   "the deleted snapshot still opens");
+    REGRESS_EXPECT(regress_read(env, NULL, 2, bytes, sizeof(bytes)) == (int)len
+                   && memcmp(bytes, REGRESS_WRITTEN, written) == 0,
+                   "deleting the snapshot changes the file");
+    REGRESS_EXPECT(regress_fsck(env, 0) == 0, "fsck finds problems after deleting a snapshot");
+    return NULL;
+}
+
+// an inline file larger than the i_addr holding it
+static void regress_bad_size(const struct unix_filesystem *u, struct inode *i){
+    (void)u;
+    (void)inode_setsize(i, REGRESS_TEXT_LINES);
+}
+
+// a file whose first data sector is the one of inode 3
+static void regress_shared_sector(const struct unix_filesystem *u, struct inode *i){
+    struct inode other;
+    if(inode_read(u, 3, &other) == ERR_NONE){
+        i->i_addr[0] = other.i_addr[0];
+    }
+}
+
+// fsck finds a bad size and a sector used twice, and its repair leaves a clean image
+static const char *regress_fsck_repair(struct regress_env *env){
+    char path[REGRESS_PATH_MAX];
+    char args[2 * REGRESS_PATH_MAX];
+    char sha[REGRESS_PATH_MAX];
+    REGRESS_EXPECT(regress_host_file(env, "f.txt", "tiny\n", path, sizeof(path)) == ERR_NONE,
+                   "cannot write the host file");
+    snprintf(args, sizeof(args), "add /tiny '%s'", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "add /tiny fails");
+    // small files: i_addr holds their data sectors
+    char small[REGRESS_SMALL_FILE + 1];
+    snprintf(small, sizeof(small), "%s", regress_text());
+    REGRESS_EXPECT(regress_host_file(env, "f.txt", small, path, sizeof(path)) == ERR_NONE,
+                   "cannot write the host file");
+    snprintf(args, sizeof(args), "add /a '%s'", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "add /a fails");
+    snprintf(args, sizeof(args), "add /b '%s'", path);
+    REGRESS_EXPECT(regress_u6fs(env, args) == 0, "add /b fails");
+    REGRESS_EXPECT(regress_u6fs(env, "shafiles") == 0 && regress_line(env, "SHA inode 3: ", sha, sizeof(sha)),
+                   "shafiles of the files fails");
+    REGRESS_EXPECT(regress_fsck(env, 0) == 0, "fsck finds problems in a fresh image");
+
+    REGRESS_EXPECT(regress_patch_inode(env, 2, regress_bad_size) == ERR_NONE, "cannot patch the size of /tiny");
+    REGRESS_EXPECT(regress_patch_inode(env, 4, regress_shared_sector) == ERR_NONE, "cannot patch the block map of /b");
+    REGRESS_EXPECT(regress_fsck(env, 0) == 2, "fsck does not report the two problems");
+    REGRESS_EXPECT(regress_count(env, "fsck: inode 2: inline file larger than i_addr", 1) == 1,
+                   "fsck misses the size of /tiny");
+    REGRESS_EXPECT(regress_count(env, "fsck: inode 4: data sector ", 1) == 1, "fsck misses the sector used twice");
+    REGRESS_EXPECT(regress_u6fs(env, "fsck") != 0, "fsck exits without error on an inconsistent image");
+
+    REGRESS_EXPECT(regress_fsck(env, 1) == 2 && regress_count(env, "fsck: ", 1) == 3
+                   && strstr(env->out, " 2 problems, 2 repaired") != NULL, "fsck --repair does not repair both");
+    REGRESS_EXPECT(regress_fsck(env, 0) == 0, "fsck finds problems after the repair");
+    REGRESS_EXPECT(regress_u6fs(env, "shafiles") == 0 && regress_count_lines(env, sha) == 1,
+                   "the repair changes the file first using the sector");
+    return NULL;
+}
+
+struct regress_test {
+    const char *name;
+    const char *(*run)(struct regress_env *env);
+};
+
+static const struct regress_test regress_tests[] = {
+    { "tree_empty_root", regress_tree_empty_root },
+    { "tree_empty_subdir", regress_tree_empty_subdir },
+    { "batch_shafiles", regress_batch_shafiles },
+    { "dirtree_leaves", regress_dirtree_leaves },
+    { "compress_readback", regress_compress_readback },
+    { "compress_truncated", regress_compress_truncated },
+    { "dedup_overwrite", regress_dedup_overwrite },
+    { "snapshot_lifecycle", regress_snapshot_lifecycle },
+    { "fsck_repair", regress_fsck_repair },
+};
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2){
+        fprintf(stderr, "usage: %s <u6fs> [<scratch_dir>]\n", argv[0]);
+        return ERR_INVALID_COMMAND;
+    }
+    static struct regress_env env;
+    env.u6fs = argv[1];
+    snprintf(env.dir, sizeof(env.dir), "%s/u6fs_regress.XXXXXX", (argc > 2) ? argv[2] : "/tmp");
+    if(mkdtemp(env.dir) == NULL){
+        fprintf(stderr, "%s: cannot create a scratch directory\n", argv[0]);
+        return ERR_IO;
+    }
+    snprintf(env.image, sizeof(env.image), "%.*s/test.uv6", REGRESS_PATH_MAX - 16, env.dir);
+
+    int failed = 0;
+    for(size_t i = 0; i < sizeof(regress_tests)/sizeof(regress_tests[0]); i++){
+        const struct regress_test *t = &regress_tests[i];
+        const char *error = (mountv6_mkfs(env.image, REGRESS_DISK_BLOCKS, REGRESS_DISK_INODES) == ERR_NONE)
+                            ? t->run(&env) : "cannot create the image";
+        if(error == NULL){
+            printf("PASS %s\n", t->name);
+        }else{
+            printf("FAIL %s: %s\n", t->name, error);
+            printf("%s", env.out);
+            failed++;
+        }
+    }
+
+    char path[2 * REGRESS_PATH_MAX];
+    const char *files[] = { "test.uv6", "f.txt", "script.txt" };
+    for(size_t k = 0; k < sizeof(files)/sizeof(files[0]); k++){
+        snprintf(path, sizeof(path), "%s/%s", env.dir, files[k]);
+        unlink(path);
+    }
+    for(int k = 0; k < REGRESS_DIRTREE_FILES; k++){
+        snprintf(path, sizeof(path), "%s/" REGRESS_HOST_DIR "/f%03d", env.dir, k);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/" REGRESS_HOST_DIR, env.dir);
+    rmdir(path);
+    rmdir(env.dir);
+    return failed ? 1 : 0;
+}
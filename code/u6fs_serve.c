@@ -0,0 +1,413 @@
+/**
+ * @file u6fs_serve.c
+ * @brief "serve" daemon: one mounted filesystem shared by local processes
+ *        through a Unix domain socket (see u6fs_serve.h for the protocol)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "error.h"
+#include "mount.h"
+#include "inode.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "u6fs_serve.h"
+#include "util.h"
+
+#define SUCCESS 1
+#define SERVE_MAX_PATH 1024
+#define SERVE_READDIR_BATCH 256     /* entries per READDIR reply, at most */
+#define SERVE_RECV_CHUNK (64 * 1024)
+#define SERVE_OUT_HIGH (4 * SERVE_MAX_PAYLOAD) /* replies waiting before a client's requests are no longer read */
+#define SERVE_CREATE_MODE_MASK (IFDIR | IREAD | IWRITE | IEXEC | 077)
+
+struct serve_buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+};
+
+struct serve_client {
+    int fd;
+    struct serve_buf in;    // requests received, not run yet
+    struct serve_buf out;   // replies not sent yet
+    size_t sent;            // bytes of out already sent
+    int closed;             // the client closed its end
+};
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_on_signal(int sig){
+    (void)sig;
+    serve_stop = 1;
+}
+
+static int serve_buf_reserve(struct serve_buf *b, size_t more){
+    if(b->len + more <= b->cap){
+        return ERR_NONE;
+    }
+    size_t cap = MAX(b->cap*2, b->len + more);
+    uint8_t *data = realloc(b->data, cap);
+    if(data == NULL){
+        return ERR_NOMEM;
+    }
+    b->data = data;
+    b->cap = cap;
+    return ERR_NONE;
+}
+
+static int serve_buf_append(struct serve_buf *b, const void *bytes, size_t len){
+    int ret = serve_buf_reserve(b, len);
+    if(ret == ERR_NONE){
+        memcpy(b->data + b->len, bytes, len);
+        b->len += len;
+    }
+    return ret;
+}
+
+
+static int serve_path(const uint8_t *payload, uint32_t len, char *path){
+    if(len >= SERVE_MAX_PATH){
+        return ERR_BAD_PARAMETER;
+    }
+    memcpy(path, payload, len);
+    path[len] = '\0';
+    return ERR_NONE;
+}
+
+static int serve_stat(struct unix_filesystem *u, const struct serve_request *req, struct serve_buf *out){
+    struct inode i;
+    int ret = inode_read(u, req->inr, &i);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    int sectors = inode_nbsectors(u, &i);
+    if(sectors < 0){
+        return sectors;
+    }
+    struct serve_stat st = { .inr = req->inr, .mode = i.i_mode, .size = (uint32_t)inode_getsize(&i),
+                             .sectors = (uint32_t)sectors };
+    return serve_buf_append(out, &st, sizeof(st));
+}
+
+static int serve_read(struct unix_filesystem *u, const struct serve_request *req, struct serve_buf *out){
+    struct filev6 fv6;
+    int ret = filev6_open(u, req->inr, &fv6);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    const int32_t size = inode_getsize(&fv6.i_node);
+    if((int64_t)req->offset >= size){
+        return 0;
+    }
+
+    // from the start of the sector holding offset, the bytes before it dropped
+    const size_t skew = req->offset%SECTOR_SIZE;
+    const size_t count = MIN(req->count, SERVE_MAX_PAYLOAD);
+    ret = filev6_lseek(&fv6, (int32_t)(req->offset - skew));
+    if(ret == ERR_NONE){
+        ret = serve_buf_reserve(out, skew + count);
+    }
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    int read = filev6_readbytes(&fv6, out->data + out->len, skew + count);
+    if(read < 0){
+        return read;
+    }
+    const size_t n = ((size_t)read > skew) ? (size_t)read - skew : 0;
+    memmove(out->data + out->len, out->data + out->len + skew, n);
+    out->len += n;
+    return (int)n;
+}
+
+static int serve_readdir(struct unix_filesystem *u, const struct serve_request *req, struct serve_buf *out){
+    struct directory_reader d;
+    int ret = direntv6_opendir(u, req->inr, &d);
+    if(ret == ERR_NONE){
+        ret = direntv6_seekdir(&d, req->offset);
+    }
+    if(ret != ERR_NONE){
+        return ret;
+    }
+
+    const size_t count = MIN(req->count, SERVE_READDIR_BATCH);
+    struct serve_dirent entries[SERVE_READDIR_BATCH];
+    uint16_t inrs[SERVE_READDIR_BATCH];
+    struct inode inodes[SERVE_READDIR_BATCH];
+    char name[DIRENT_MAXLEN+1];
+    size_t n = 0;
+    while(n < count && (ret = direntv6_readdir(&d, name, &inrs[n])) == SUCCESS){
+        memset(&entries[n], 0, sizeof(entries[n]));
+        entries[n].inr = inrs[n];
+        entries[n].next = direntv6_telldir(&d);
+        strncpy(entries[n].name, name, DIRENT_MAXLEN);
+        n++;
+    }
+    if(ret < 0){
+        return ret;
+    }
+
+    // the attributes of the entries, their inodes read in sector order
+    ret = inode_read_batch(u, inrs, n, inodes);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    for(size_t k = 0; k < n; k++){
+        entries[k].mode = inodes[k].i_mode;
+        entries[k].size = (uint32_t)inode_getsize(&inodes[k]);
+    }
+    ret = serve_buf_append(out, entries, n*sizeof(struct serve_dirent));
+    return ret == ERR_NONE ? (int)n : ret;
+}
+
+static int serve_write(struct unix_filesystem *u, const struct serve_request *req, const uint8_t *payload){
+    struct filev6 fv6;
+    int ret = filev6_open(u, req->inr, &fv6);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    if(fv6.i_node.i_mode & IFDIR){
+        return ERR_BAD_PARAMETER; // directories only change through CREATE
+    }
+    if((uint64_t)req->offset + req->len > FILEV6_MAX_SIZE){
+        return ERR_FILE_TOO_LARGE;
+    }
+    return filev6_writeat(&fv6, (int32_t)req->offset, payload, req->len);
+}
+
+// runs one request, its reply payload appended to out; returns the status of the reply
+static int serve_run(struct unix_filesystem *u, const struct serve_request *req, const uint8_t *payload,
+                     struct serve_buf *out){
+    char path[SERVE_MAX_PATH];
+    int ret = ERR_NONE;
+
+    switch(req->op){
+    case SERVE_OP_LOOKUP:
+        ret = serve_path(payload, req->len, path);
+        return (ret == ERR_NONE) ? direntv6_dirlookup(u, req->inr, path) : ret;
+    case SERVE_OP_STAT:
+        return serve_stat(u, req, out);
+    case SERVE_OP_READ:
+        return serve_read(u, req, out);
+    case SERVE_OP_READDIR:
+        return serve_readdir(u, req, out);
+    case SERVE_OP_WRITE:
+        return serve_write(u, req, payload);
+    case SERVE_OP_CREATE:
+        ret = serve_path(payload, req->len, path);
+        return (ret == ERR_NONE) ? direntv6_create(u, path, (uint16_t)(req->offset & SERVE_CREATE_MODE_MASK)) : ret;
+    default:
+        return ERR_INVALID_COMMAND;
+    }
+}
+
+// runs the complete requests received from a client, as long as its replies
+// do not pile up; returns <0 if the client breaks the protocol
+static int serve_client_run(struct unix_filesystem *u, struct serve_client *c){
+    size_t done = 0;
+    int ret = ERR_NONE;
+    while(ret == ERR_NONE && c->out.len - c->sent < SERVE_OUT_HIGH
+          && c->in.len - done >= sizeof(struct serve_request)){
+        struct serve_request req;
+        memcpy(&req, c->in.data + done, sizeof(req));
+        if(req.len > SERVE_MAX_PAYLOAD){
+            return ERR_BAD_PARAMETER;
+        }
+        if(c->in.len - done < sizeof(req) + req.len){
+            break;  // the rest of its payload is still to come
+        }
+
+        const size_t at = c->out.len;
+        struct serve_reply reply = { .id = req.id, .status = 0, .len = 0 };
+        ret = serve_buf_append(&c->out, &reply, sizeof(reply));
+        if(ret != ERR_NONE){
+            break;
+        }
+        reply.status = serve_run(u, &req, c->in.data + done + sizeof(req), &c->out);
+        if(reply.status < 0){
+            c->out.len = at + sizeof(reply);  // no payload with an error
+        }
+        reply.len = (uint32_t)(c->out.len - at - sizeof(reply));
+        memcpy(c->out.data + at, &reply, sizeof(reply));
+        done += sizeof(req) + req.len;
+    }
+    memmove(c->in.data, c->in.data + done, c->in.len - done);
+    c->in.len -= done;
+    return ret;
+}
+
+// whether serve_client_run() has a request to run without receiving more
+static int serve_client_ready(const struct serve_client *c){
+    struct serve_request req;
+    if(c->out.len - c->sent >= SERVE_OUT_HIGH || c->in.len < sizeof(req)){
+        return 0;
+    }
+    memcpy(&req, c->in.data, sizeof(req));
+    return c->in.len >= sizeof(req) + req.len;
+}
+
+// returns 0 while the connection is usable, else <0
+static int serve_client_recv(struct serve_client *c){
+    int ret = serve_buf_reserve(&c->in, SERVE_RECV_CHUNK);
+    if(ret != ERR_NONE){
+        return ret;
+    }
+    ssize_t n = recv(c->fd, c->in.data + c->in.len, SERVE_RECV_CHUNK, MSG_DONTWAIT);
+    if(n > 0){
+        c->in.len += (size_t)n;
+    }else if(n == 0){
+        c->closed = 1;
+    }else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+static int serve_client_send(struct serve_client *c){
+    while(c->sent < c->out.len){
+        ssize_t n = send(c->fd, c->out.data + c->sent, c->out.len - c->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n < 0){
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? ERR_NONE : ERR_IO;
+        }
+        c->sent += (size_t)n;
+    }
+    c->out.len = 0;
+    c->sent = 0;
+    return ERR_NONE;
+}
+
+static void serve_client_free(struct serve_client *c){
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+    memset(c, 0, sizeof(*c));
+}
+
+
+static int serve_listen(const char *socket_path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(addr.sun_path)){
+        return ERR_BAD_PARAMETER;
+    }
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    // a socket left by a previous server is replaced, nothing else
+    struct stat st;
+    if(lstat(socket_path, &st) == 0){
+        if(!S_ISSOCK(st.st_mode)){
+            return ERR_BAD_PARAMETER;
+        }
+        unlink(socket_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0){
+        return ERR_IO;
+    }
+    if(bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0){
+        close(fd);
+        return ERR_IO;
+    }
+    return fd;
+}
+
+int serve_main(struct unix_filesystem *u, const char *socket_path){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(socket_path);
+
+    int listen_fd = serve_listen(socket_path);
+    if(listen_fd < 0){
+        return listen_fd;
+    }
+
+    // no SA_RESTART: poll() returns on these signals
+    struct sigaction action, old_int, old_term;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serve_on_signal;
+    sigemptyset(&action.sa_mask);
+    serve_stop = 0;
+    sigaction(SIGINT, &action, &old_int);
+    sigaction(SIGTERM, &action, &old_term);
+
+    struct serve_client clients[SERVE_MAX_CLIENTS];
+    struct pollfd fds[SERVE_MAX_CLIENTS + 1];
+    size_t nb_clients = 0;
+    memset(clients, 0, sizeof(clients));
+
+    int ret = inode_wb_enable(u);
+    while(ret == ERR_NONE && !serve_stop){
+        int timeout = -1;
+        for(size_t k = 0; k < nb_clients; k++){
+            const size_t pending = clients[k].out.len - clients[k].sent;
+            fds[k].fd = clients[k].fd;
+            fds[k].events = (short)((pending > 0 ? POLLOUT : 0) | (pending < SERVE_OUT_HIGH ? POLLIN : 0));
+            fds[k].revents = 0;
+            if(serve_client_ready(&clients[k])){
+                timeout = 0;  // requests left when its replies piled up
+            }
+        }
+        fds[nb_clients].fd = listen_fd;
+        fds[nb_clients].events = POLLIN;
+        fds[nb_clients].revents = 0;
+
+        if(poll(fds, nb_clients + 1, timeout) < 0){
+            ret = (errno == EINTR) ? ERR_NONE : ERR_IO;
+            continue;
+        }
+
+        const size_t listen_slot = nb_clients;
+        // from the last one, as a closed connection is replaced by the last one
+        for(size_t k = nb_clients; k-- > 0;){
+            struct serve_client *c = &clients[k];
+            int alive = ERR_NONE;
+            if(fds[k].revents & (POLLIN | POLLHUP | POLLERR)){
+                alive = serve_client_recv(c);
+            }
+            if(alive == ERR_NONE){
+                alive = serve_client_run(u, c);
+            }
+            if(alive == ERR_NONE){
+                alive = serve_client_send(c);
+            }
+            if(alive != ERR_NONE || (c->closed && c->out.len == c->sent)){
+                serve_client_free(c);
+                clients[k] = clients[--nb_clients];
+            }
+        }
+
+        if(fds[listen_slot].revents & POLLIN){
+            int fd = accept(listen_fd, NULL, NULL);
+            if(fd >= 0 && nb_clients < SERVE_MAX_CLIENTS){
+                memset(&clients[nb_clients], 0, sizeof(clients[nb_clients]));
+                clients[nb_clients++].fd = fd;
+            }else if(fd >= 0){
+                close(fd);
+            }
+        }
+
+        // the inodes written by this round reach the disk before the next one
+        ret = inode_wb_flush(u);
+    }
+
+    for(size_t k = 0; k < nb_clients; k++){
+        serve_client_free(&clients[k]);
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    return ret;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+/**
+ * @file u6fs_serve.h
+ * @brief "serve" daemon: one mounted filesystem shared by local processes
+ *        through a Unix domain socket, and its binary protocol
+ *
+ * A client sends requests (a serve_request, then len bytes of payload) and
+ * gets one reply per request, in order (a serve_reply, then len bytes of
+ * payload). Requests can be pipelined: the server reads all the requests
+ * available on a connection, runs them and sends their replies at once.
+ * All the integers are in the byte order of the host.
+ */
+
+#include <stdint.h>
+#include "mount.h"
+
+#define SERVE_MAX_PAYLOAD (1 << 20)  /* bytes, both ways */
+#define SERVE_MAX_CLIENTS 64
+
+enum serve_op {
+    SERVE_OP_LOOKUP = 1, /* payload: a path from inr; status: its inode number */
+    SERVE_OP_STAT,       /* reply payload: a serve_stat */
+    SERVE_OP_READ,       /* count bytes at offset; reply payload: the bytes read (status: how many) */
+    SERVE_OP_READDIR,    /* count entries from index offset; reply payload: serve_dirent's (status: how many) */
+    SERVE_OP_WRITE,      /* payload: the bytes to write at offset, the file growing if needed */
+    SERVE_OP_CREATE,     /* payload: an absolute path; offset: the mode; status: the new inode number */
+};
+
+struct serve_request {
+    uint32_t id;        /* echoed in the reply */
+    uint8_t  op;        /* SERVE_OP_* */
+    uint8_t  pad;
+    uint16_t inr;       /* the inode the request is about (LOOKUP: where the path starts) */
+    uint32_t offset;
+    uint32_t count;
+    uint32_t len;       /* bytes of payload after the request */
+};
+
+struct serve_reply {
+    uint32_t id;        /* of the request */
+    int32_t  status;    /* <0: an error code (see error.h), else as per the operation */
+    uint32_t len;       /* bytes of payload after the reply */
+};
+
+struct serve_stat {
+    uint16_t inr;
+    uint16_t mode;      /* i_mode */
+    uint32_t size;
+    uint32_t sectors;   /* data and indirect sectors (see inode_nbsectors()) */
+};
+
+struct serve_dirent {
+    uint16_t inr;
+    uint16_t mode;      /* of the entry's inode */
+    uint32_t size;
+    uint32_t next;      /* index to give READDIR to continue after this entry */
+    char     name[DIRENT_MAXLEN];   /* not NUL-terminated if DIRENT_MAXLEN long */
+    uint8_t  pad[2];
+};
+
+/**
+ * @brief serve the mounted filesystem on a Unix domain socket (created, and
+ *        removed on return) until SIGINT or SIGTERM. Inode writes are batched
+ *        and flushed after each round of requests.
+ * @param u the mounted filesystem
+ * @param socket_path the path of the socket
+ * @return 0 on success; <0 on error
+ */
+int serve_main(struct unix_filesystem *u, const char *socket_path);
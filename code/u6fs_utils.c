@@ -6,47 +6,93 @@
  */
 
 #include <string.h> 
+#include <stdlib.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include "mount.h"
 #include "sector.h"
 #include "error.h"
 #include "u6fs_utils.h"
 #include "filev6.h"
 #include "inode.h"
+#include "direntv6.h"
 #include "bmblock.h"
+#include "util.h"
+#include "arena.h"
+
+#define SUCCESS 1
 
 int utils_print_superblock(const struct unix_filesystem *u){
     M_REQUIRE_NON_NULL(u);
 
     pps_printf("**********FS SUPERBLOCK START**********\n");
-    pps_printf("%-20s: %" PRIu16 "\n", "s_isize", u->s.s_isize);
-    pps_printf("%-20s: %" PRIu16 "\n", "s_fsize", u->s.s_fsize);
-    pps_printf("%-20s: %" PRIu16 "\n", "s_fbmsize", u->s.s_fbmsize);
-    pps_printf("%-20s: %" PRIu16 "\n", "s_ibmsize", u->s.s_ibmsize);
-    pps_printf("%-20s: %" PRIu16 "\n", "s_inode_start", u->s.s_inode_start);
-    pps_printf("%-20s: %" PRIu16 "\n", "s_block_start", u->s.s_block_start);
-    pps_printf("%-20s: %" PRIu16 "\n", "s_fbm_start", u->s.s_fbm_start);
-    pps_printf("%-20s: %" PRIu16 "\n", "s_ibm_start", u->s.s_ibm_start);
+    pps_printf("%-20s: %" PRIsector "\n", "s_isize", u->s.s_isize);
+    pps_printf("%-20s: %" PRIsector "\n", "s_fsize", u->s.s_fsize);
+    pps_printf("%-20s: %" PRIsector "\n", "s_fbmsize", u->s.s_fbmsize);
+    pps_printf("%-20s: %" PRIsector "\n", "s_ibmsize", u->s.s_ibmsize);
+    pps_printf("%-20s: %" PRIsector "\n", "s_inode_start", u->s.s_inode_start);
+    pps_printf("%-20s: %" PRIsector "\n", "s_block_start", u->s.s_block_start);
+    pps_printf("%-20s: %" PRIsector "\n", "s_fbm_start", u->s.s_fbm_start);
+    pps_printf("%-20s: %" PRIsector "\n", "s_ibm_start", u->s.s_ibm_start);
     pps_printf("%-20s: %" PRIu8 "\n", "s_flock", u->s.s_flock);
     pps_printf("%-20s: %" PRIu8 "\n", "s_ilock", u->s.s_ilock);
     pps_printf("%-20s: %" PRIu8 "\n", "s_fmod", u->s.s_fmod);
     pps_printf("%-20s: %" PRIu8 "\n", "s_ronly", u->s.s_ronly);
     pps_printf("%-20s: [%" PRIu16 "] %" PRIu16 "\n", "s_time", u->s.s_time[0], u->s.s_time[1]);
+    if(u->s.s_csum_start != 0){
+        pps_printf("%-20s: %" PRIsector "\n", "s_csum_start", u->s.s_csum_start);
+        pps_printf("%-20s: %" PRIsector "\n", "s_csum_size", u->s.s_csum_size);
+    }
+    if(u->s.s_dedup_start != 0){
+        pps_printf("%-20s: %" PRIsector "\n", "s_dedup_start", u->s.s_dedup_start);
+        pps_printf("%-20s: %" PRIsector "\n", "s_dedup_size", u->s.s_dedup_size);
+    }
+    if(u->s.s_snap_start != 0){
+        pps_printf("%-20s: %" PRIsector "\n", "s_snap_start", u->s.s_snap_start);
+    }
     pps_printf("**********FS SUPERBLOCK END**********\n");
 
     return ERR_NONE;
 }
 
-static void utils_print_SHA_buffer(unsigned char *buffer, size_t len){
-    unsigned char sha[SHA256_DIGEST_LENGTH];
-    SHA256(buffer, len, sha);
+static void utils_print_SHA_digest(const unsigned char *sha){
     for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i){
         pps_printf("%02x", sha[i]);
     }
     pps_printf("\n");
 }
 
+#define UTILS_SHA_CHUNK (8 * SECTOR_SIZE)
+
+// streams the first UTILS_HASHED_LENGTH bytes of an open file into SHA256
+static int utils_sha_file(struct filev6 *fv6, unsigned char *sha){
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == NULL || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)){
+        EVP_MD_CTX_free(ctx);
+        return ERR_NOMEM;
+    }
+
+    uint8_t buf[UTILS_SHA_CHUNK];
+    int num_bytes = -1;
+    size_t l = 0;
+    do{
+        num_bytes = filev6_readbytes(fv6, buf, MIN(sizeof(buf), UTILS_HASHED_LENGTH - l));
+        if (num_bytes < 0){
+            EVP_MD_CTX_free(ctx);
+            return num_bytes;
+        }
+        EVP_DigestUpdate(ctx, buf, (size_t)num_bytes);
+        l += (size_t)num_bytes;
+    }while(num_bytes > 0 && l < UTILS_HASHED_LENGTH);
+
+    EVP_DigestFinal_ex(ctx, sha, NULL);
+    EVP_MD_CTX_free(ctx);
+    return ERR_NONE;
+}
+
 int utils_print_inode(const struct inode *inode){
     pps_printf("**********FS INODE START**********\n");
     if (inode == NULL){
@@ -118,20 +164,12 @@ int utils_print_shafile(const struct unix_filesystem *u, uint16_t inr){
     if ((fv6.i_node).i_mode & IFDIR){
         pps_printf("DIR\n");
     }else{
-        uint8_t buf[SECTOR_SIZE*INODES_PER_SECTOR+1];
-
-        int num_bytes = -1;
-        size_t l = 0;
-        do{
-            num_bytes = filev6_readblock(&fv6, &buf[l]);
-            if (num_bytes < 0){
-                return num_bytes;
-            }
-            
-            l += num_bytes;
-        }while(num_bytes > 0 && l < SECTOR_SIZE*INODES_PER_SECTOR);
-
-        utils_print_SHA_buffer(buf, l);
+        unsigned char sha[SHA256_DIGEST_LENGTH];
+        read = utils_sha_file(&fv6, sha);
+        if (read != ERR_NONE){
+            return read;
+        }
+        utils_print_SHA_digest(sha);
     }
 
     return ERR_NONE;
@@ -154,6 +192,483 @@ int utils_print_sha_allfiles(const struct unix_filesystem *u){
 }
 
 
+struct sha_result {
+    int status;     // ERR_NONE, ERR_UNALLOCATED_INODE, or the error met
+    int is_dir;
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+};
+
+struct sha_ctx {
+    const struct unix_filesystem *u;
+    struct sha_result *results;     // indexed by inode number
+    uint32_t nb_sectors;            // inode sectors to hash
+    pthread_mutex_t lock;
+    uint32_t next;                  // next inode sector to hand out
+};
+
+// hashes the files of one inode sector, read once (through the write-back
+// inode sector, which may hold inodes not written yet, see inode.h)
+static void utils_sha_inode_sector(struct sha_ctx *ctx, uint32_t sector){
+    struct inode_sector inodes;
+    uint16_t inrs[INODES_PER_SECTOR];
+    for (uint32_t k = 0; k < INODES_PER_SECTOR; k++){
+        inrs[k] = (uint16_t)(sector*(uint32_t)INODES_PER_SECTOR + k);
+    }
+    int read = inode_read_batch(ctx->u, inrs, INODES_PER_SECTOR, inodes.inodes);
+
+    for (uint32_t k = 0; k < INODES_PER_SECTOR; k++){
+        uint32_t inr = sector*(uint32_t)INODES_PER_SECTOR + k;
+        struct sha_result *res = &ctx->results[inr];
+        if (inr < ROOT_INUMBER){
+            res->status = ERR_UNALLOCATED_INODE;
+        }else if (read != ERR_NONE){
+            res->status = read;
+        }else if (!(inodes.inodes[k].i_mode & IALLOC)){
+            res->status = ERR_UNALLOCATED_INODE;
+        }else if (inodes.inodes[k].i_mode & IFDIR){
+            res->is_dir = 1;
+            res->status = ERR_NONE;
+        }else{
+            struct filev6 fv6 = {0};
+            fv6.u = (struct unix_filesystem *)ctx->u;
+            fv6.i_number = (uint16_t)inr;
+            fv6.i_node = inodes.inodes[k];
+            res->status = utils_sha_file(&fv6, res->sha);
+        }
+    }
+}
+
+static void *utils_sha_worker(void *arg){
+    struct sha_ctx *ctx = arg;
+    for (;;){
+        pthread_mutex_lock(&ctx->lock);
+        uint32_t sector = ctx->next++;
+        pthread_mutex_unlock(&ctx->lock);
+        if (sector >= ctx->nb_sectors){
+            return NULL;
+        }
+        utils_sha_inode_sector(ctx, sector);
+    }
+}
+
+
+int utils_print_sha_allfiles_parallel(const struct unix_filesystem *u, int nb_threads){
+    M_REQUIRE_NON_NULL(u);
+    if (nb_threads < 1 || nb_threads > UTILS_MAX_THREADS){
+        return ERR_BAD_PARAMETER;
+    }
+
+    struct sha_ctx ctx = {0};
+    ctx.u = u;
+    ctx.nb_sectors = u->s.s_isize;
+    ARENA_SCOPE(scratch);
+    ctx.results = arena_calloc(scratch, (size_t)ctx.nb_sectors*INODES_PER_SECTOR, sizeof(struct sha_result));
+    if (ctx.results == NULL){
+        return ERR_NOMEM;
+    }
+
+    pthread_t threads[UTILS_MAX_THREADS];
+    int started = 0;
+    pthread_mutex_init(&ctx.lock, NULL);
+    for (; started < nb_threads; started++){
+        if (pthread_create(&threads[started], NULL, utils_sha_worker, &ctx)){
+            break;
+        }
+    }
+    if (started == 0){
+        utils_sha_worker(&ctx);
+    }
+    for (int t = 0; t < started; t++){
+        pthread_join(threads[t], NULL);
+    }
+    pthread_mutex_destroy(&ctx.lock);
+
+    // same output as utils_print_sha_allfiles(), in inode order
+    pps_printf("Listing inodes SHA\n");
+    int ret = ERR_NONE;
+    for (uint32_t i = ROOT_INUMBER; i < ctx.nb_sectors*INODES_PER_SECTOR && ret == ERR_NONE; i++){
+        const struct sha_result *res = &ctx.results[i];
+        if (res->status == ERR_UNALLOCATED_INODE){
+            continue;
+        }
+        if (res->status != ERR_NONE){
+            ret = res->status;
+            break;
+        }
+        pps_printf("SHA inode %" PRIu32 ": ", i);
+        if (res->is_dir){
+            pps_printf("DIR\n");
+        }else{
+            utils_print_SHA_digest(res->sha);
+        }
+    }
+
+    return ret;
+}
+
+
+#define UTILS_SHA_BATCH 64  // sectors taken by a worker at once
+
+struct sha_sectors_ctx {
+    const struct unix_filesystem *u;
+    const uint32_t *sectors;
+    size_t count;
+    unsigned char *shas;
+    pthread_mutex_t lock;
+    size_t next;                    // next sector to hand out
+    int error;                      // first error met
+};
+
+static int utils_sha_sector_batch(struct sha_sectors_ctx *ctx, size_t first, size_t n){
+    uint8_t data[UTILS_SHA_BATCH*SECTOR_SIZE];
+    size_t k = 0;
+    while (k < n){
+        size_t run = 1;
+        while (k + run < n && ctx->sectors[first + k + run] == ctx->sectors[first + k] + run){
+            run++;
+        }
+        int read = sector_read_many(ctx->u->f, ctx->sectors[first + k], run, &data[k*SECTOR_SIZE]);
+        if (read != ERR_NONE){
+            return read;
+        }
+        k += run;
+    }
+    for (k = 0; k < n; k++){
+        if (!EVP_Digest(&data[k*SECTOR_SIZE], SECTOR_SIZE, &ctx->shas[(first + k)*UTILS_SHA_LENGTH],
+                        NULL, EVP_sha256(), NULL)){
+            return ERR_NOMEM;
+        }
+    }
+    return ERR_NONE;
+}
+
+static void *utils_sha_sectors_worker(void *arg){
+    struct sha_sectors_ctx *ctx = arg;
+    for (;;){
+        pthread_mutex_lock(&ctx->lock);
+        const size_t first = ctx->next;
+        ctx->next += UTILS_SHA_BATCH;
+        const int stop = (ctx->error != ERR_NONE);
+        pthread_mutex_unlock(&ctx->lock);
+        if (first >= ctx->count || stop){
+            return NULL;
+        }
+        int ret = utils_sha_sector_batch(ctx, first, MIN(UTILS_SHA_BATCH, ctx->count - first));
+        if (ret != ERR_NONE){
+            pthread_mutex_lock(&ctx->lock);
+            ctx->error = ret;
+            pthread_mutex_unlock(&ctx->lock);
+        }
+    }
+}
+
+
+int utils_sha_sectors(const struct unix_filesystem *u, const uint32_t *sectors, size_t count,
+                      unsigned char *shas, int nb_threads){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(sectors);
+    M_REQUIRE_NON_NULL(shas);
+    if (nb_threads < 1 || nb_threads > UTILS_MAX_THREADS){
+        return ERR_BAD_PARAMETER;
+    }
+
+    struct sha_sectors_ctx ctx = {0};
+    ctx.u = u;
+    ctx.sectors = sectors;
+    ctx.count = count;
+    ctx.shas = shas;
+
+    pthread_t threads[UTILS_MAX_THREADS];
+    int started = 0;
+    pthread_mutex_init(&ctx.lock, NULL);
+    for (; started < nb_threads; started++){
+        if (pthread_create(&threads[started], NULL, utils_sha_sectors_worker, &ctx)){
+            break;
+        }
+    }
+    if (started == 0){
+        utils_sha_sectors_worker(&ctx);
+    }
+    for (int t = 0; t < started; t++){
+        pthread_join(threads[t], NULL);
+    }
+    pthread_mutex_destroy(&ctx.lock);
+    return ctx.error;
+}
+
+#define TREE_NO_DIR UINT32_MAX
+
+struct tree_entry {
+    uint32_t dir;                   // its tree_dir if a directory, else TREE_NO_DIR
+    int status;                     // ERR_NONE, or why it cannot be listed
+    char name[DIRENT_MAXLEN+1];
+};
+
+struct tree_dir {
+    uint16_t inr;
+    int status;                     // error met walking the directory
+    struct tree_entry *entries;     // in readdir order
+    uint32_t nb_entries;
+};
+
+struct tree_worker {
+    struct tree_ctx *ctx;
+    int id;
+    pthread_mutex_t lock;           // protects the queue
+    uint32_t *queue;                // directories to walk: the owner takes the
+    size_t head;                    // last one queued (depth first), the other
+    size_t tail;                    // workers steal the first one
+    size_t queue_cap;
+    struct arena entries;           // of the directories it walked
+    uint16_t *inrs;                 // scratch, for one directory
+    struct inode *inodes;
+    size_t scratch_cap;
+};
+
+struct tree_ctx {
+    const struct unix_filesystem *u;
+    struct tree_dir *dirs;          // at most one per inode
+    uint32_t max_dirs;
+    uint32_t nb_dirs;               // atomic
+    uint32_t pending;               // directories queued or being walked (atomic)
+    int nb_workers;
+    struct tree_worker workers[UTILS_MAX_THREADS];
+};
+
+static int tree_queue_push(struct tree_worker *w, uint32_t dir){
+    int ret = ERR_NONE;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->queue_cap && w->head > 0){
+        memmove(w->queue, &w->queue[w->head], (w->tail - w->head)*sizeof(uint32_t));
+        w->tail -= w->head;
+        w->head = 0;
+    }
+    if (w->tail == w->queue_cap){
+        size_t cap = MAX(2*w->queue_cap, 64);
+        uint32_t *queue = realloc(w->queue, cap*sizeof(uint32_t));
+        if (queue == NULL){
+            ret = ERR_NOMEM;
+        }else{
+            w->queue = queue;
+            w->queue_cap = cap;
+        }
+    }
+    if (ret == ERR_NONE){
+        w->queue[w->tail++] = dir;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+static int tree_queue_pop(struct tree_worker *w, uint32_t *dir, int steal){
+    pthread_mutex_lock(&w->lock);
+    const int found = (w->head < w->tail);
+    if (found){
+        *dir = steal ? w->queue[w->head++] : w->queue[--w->tail];
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+// the entries of one directory, their inodes read in batch; queues its subdirectories
+static int tree_walk_dir(struct tree_worker *w, struct tree_dir *d){
+    struct tree_ctx *ctx = w->ctx;
+    struct directory_reader reader;
+    int ret = direntv6_opendir(ctx->u, d->inr, &reader);
+    if (ret != ERR_NONE){
+        return ret;
+    }
+
+    // never more entries than slots, whatever the format
+    const size_t max = (size_t)inode_getsize(&reader.fv6.i_node)/sizeof(struct direntv6);
+    if (max > w->scratch_cap){
+        uint16_t *inrs = realloc(w->inrs, max*sizeof(uint16_t));
+        w->inrs = (inrs != NULL) ? inrs : w->inrs;
+        struct inode *inodes = realloc(w->inodes, max*sizeof(struct inode));
+        w->inodes = (inodes != NULL) ? inodes : w->inodes;
+        if (inrs == NULL || inodes == NULL){
+            return ERR_NOMEM;
+        }
+        w->scratch_cap = max;
+    }
+    d->entries = arena_calloc(&w->entries, max, sizeof(struct tree_entry));
+    if (d->entries == NULL && max > 0){
+        return ERR_NOMEM;
+    }
+
+    size_t n = 0;
+    while (n < max && (ret = direntv6_readdir(&reader, d->entries[n].name, &w->inrs[n])) == SUCCESS){
+        n++;
+    }
+    d->nb_entries = (uint32_t)n;
+    if (ret < 0){
+        return ret;
+    }
+    if (n == 0){
+        return ERR_NONE; // an empty directory: no scratch arrays, no inodes to read
+    }
+    ret = inode_read_batch(ctx->u, w->inrs, n, w->inodes);
+    if (ret != ERR_NONE){
+        d->nb_entries = 0;
+        return ret;
+    }
+
+    for (size_t k = 0; k < n; k++){
+        struct tree_entry *e = &d->entries[k];
+        const uint16_t mode = w->inodes[k].i_mode;
+        e->dir = TREE_NO_DIR;
+        if (!(mode & IALLOC)){
+            e->status = (w->inrs[k] < ROOT_INUMBER || w->inrs[k] >= ctx->max_dirs)
+                        ? ERR_INODE_OUT_OF_RANGE : ERR_UNALLOCATED_INODE;
+        }else if (mode & IFDIR){
+            const uint32_t child = __atomic_fetch_add(&ctx->nb_dirs, 1, __ATOMIC_RELAXED);
+            if (child >= ctx->max_dirs){
+                e->status = ERR_INVALID_DIRECTORY_INODE; // more directories than inodes: a cycle
+                continue;
+            }
+            ctx->dirs[child].inr = w->inrs[k];
+            __atomic_add_fetch(&ctx->pending, 1, __ATOMIC_ACQ_REL);
+            e->status = tree_queue_push(w, child);
+            if (e->status != ERR_NONE){
+                __atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_ACQ_REL);
+            }else{
+                e->dir = child;
+            }
+        }
+    }
+    return ERR_NONE;
+}
+
+static void *tree_worker_run(void *arg){
+    struct tree_worker *w = arg;
+    struct tree_ctx *ctx = w->ctx;
+    for (;;){
+        uint32_t dir = 0;
+        int found = tree_queue_pop(w, &dir, 0);
+        for (int k = 1; !found && k < ctx->nb_workers; k++){
+            found = tree_queue_pop(&ctx->workers[(w->id + k) % ctx->nb_workers], &dir, 1);
+        }
+        if (found){
+            ctx->dirs[dir].status = tree_walk_dir(w, &ctx->dirs[dir]);
+            __atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_ACQ_REL);
+        }else if (__atomic_load_n(&ctx->pending, __ATOMIC_ACQUIRE) == 0){
+            return NULL;
+        }else{
+            sched_yield();  // a directory being walked may queue more
+        }
+    }
+}
+
+// the path being printed, grown as needed and reused for all the entries
+struct tree_path {
+    char *buf;
+    size_t cap;
+};
+
+// same output as direntv6_print_tree(), depth first in readdir order
+static int tree_render(const struct tree_ctx *ctx, uint32_t index, struct tree_path *path, size_t len){
+    const struct tree_dir *d = &ctx->dirs[index];
+    pps_printf("%s %s/\n", SHORT_DIR_NAME, path->buf);
+    for (uint32_t k = 0; k < d->nb_entries; k++){
+        const struct tree_entry *e = &d->entries[k];
+        if (e->status != ERR_NONE){
+            return e->status;
+        }
+        const size_t name_len = strlen(e->name);
+        if (len + name_len + 2 > path->cap){
+            size_t cap = MAX(2*path->cap, len + name_len + 2);
+            char *buf = realloc(path->buf, cap);
+            if (buf == NULL){
+                return ERR_NOMEM;
+            }
+            path->buf = buf;
+            path->cap = cap;
+        }
+        path->buf[len] = '/';
+        memcpy(&path->buf[len + 1], e->name, name_len + 1);
+        if (e->dir == TREE_NO_DIR){
+            pps_printf("%s %s\n", SHORT_FIL_NAME, path->buf);
+        }else{
+            int ret = tree_render(ctx, e->dir, path, len + 1 + name_len);
+            if (ret != ERR_NONE){
+                return ret;
+            }
+        }
+        path->buf[len] = '\0';
+    }
+    return d->status;
+}
+
+int utils_print_tree_parallel(const struct unix_filesystem *u, int nb_threads){
+    M_REQUIRE_NON_NULL(u);
+    if (nb_threads < 1 || nb_threads > UTILS_MAX_THREADS){
+        return ERR_BAD_PARAMETER;
+    }
+
+    struct inode root;
+    int ret = inode_read(u, ROOT_INUMBER, &root);
+    if (ret != ERR_NONE){
+        return ret;
+    }
+    if (!(root.i_mode & IFDIR)){
+        pps_printf("%s %s\n", SHORT_FIL_NAME, "");
+        return ERR_NONE;
+    }
+
+    ARENA_SCOPE(scratch);
+    struct tree_ctx *ctx = arena_calloc(scratch, 1, sizeof(struct tree_ctx));
+    if (ctx == NULL){
+        return ERR_NOMEM;
+    }
+    ctx->u = u;
+    ctx->max_dirs = u->s.s_isize*INODES_PER_SECTOR;
+    ctx->dirs = arena_calloc(scratch, ctx->max_dirs, sizeof(struct tree_dir));
+    ctx->nb_workers = nb_threads;
+    for (int t = 0; t < nb_threads; t++){
+        ctx->workers[t].ctx = ctx;
+        ctx->workers[t].id = t;
+        pthread_mutex_init(&ctx->workers[t].lock, NULL);
+        arena_init(&ctx->workers[t].entries, 0);
+    }
+    ret = (ctx->dirs == NULL) ? ERR_NOMEM : ERR_NONE;
+    if (ret == ERR_NONE){
+        ctx->dirs[0].inr = ROOT_INUMBER;
+        ctx->nb_dirs = 1;
+        ctx->pending = 1;
+        ret = tree_queue_push(&ctx->workers[0], 0);
+    }
+
+    if (ret == ERR_NONE){
+        // the directories are walked in parallel, then printed in order
+        pthread_t threads[UTILS_MAX_THREADS];
+        int started = 1;
+        for (; started < nb_threads; started++){
+            if (pthread_create(&threads[started], NULL, tree_worker_run, &ctx->workers[started])){
+                break;
+            }
+        }
+        tree_worker_run(&ctx->workers[0]);
+        for (int t = 1; t < started; t++){
+            pthread_join(threads[t], NULL);
+        }
+
+        struct tree_path path = { .buf = calloc(1, 1), .cap = 1 };
+        ret = (path.buf == NULL) ? ERR_NOMEM : tree_render(ctx, 0, &path, 0);
+        free(path.buf);
+    }
+
+    for (int t = 0; t < nb_threads; t++){
+        struct tree_worker *w = &ctx->workers[t];
+        pthread_mutex_destroy(&w->lock);
+        arena_free(&w->entries);
+        free(w->queue);
+        free(w->inrs);
+        free(w->inodes);
+    }
+    return ret;
+}
+
+
 int utils_print_bitmaps(const struct unix_filesystem *u){
     M_REQUIRE_NON_NULL(u);
 
@@ -163,3 +678,62 @@ int utils_print_bitmaps(const struct unix_filesystem *u){
     return ERR_NONE;
 }
 
+
+int utils_compact_dir(struct unix_filesystem *u, const char *path, int to_tree){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(path);
+
+    int inr = direntv6_dirlookup(u, ROOT_INUMBER, path);
+    if(inr < 0){
+        return inr;
+    }
+    struct inode i;
+    int read = inode_read(u, (uint16_t)inr, &i);
+    if(read != ERR_NONE){
+        return read;
+    }
+    const int32_t size_before = inode_getsize(&i);
+
+    int entries = to_tree ? direntv6_make_tree(u, (uint16_t)inr) : direntv6_compact(u, (uint16_t)inr);
+    if(entries < 0){
+        return entries;
+    }
+    read = inode_read(u, (uint16_t)inr, &i);
+    if(read != ERR_NONE){
+        return read;
+    }
+
+    pps_printf("%s: %d entries, %" PRId32 " -> %" PRId32 " sectors\n", path, entries,
+               (size_before + SECTOR_SIZE - 1)/SECTOR_SIZE, (inode_getsize(&i) + SECTOR_SIZE - 1)/SECTOR_SIZE);
+    return ERR_NONE;
+}
+
+int utils_compress_file(struct unix_filesystem *u, const char *path, int compressed){
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(path);
+
+    int inr = direntv6_dirlookup(u, ROOT_INUMBER, path);
+    if(inr < 0){
+        return inr;
+    }
+    struct filev6 fv6;
+    int err = filev6_open(u, (uint16_t)inr, &fv6);
+    if(err != ERR_NONE){
+        return err;
+    }
+    const int before = inode_nbsectors(u, &fv6.i_node);
+    if(before < 0){
+        return before;
+    }
+    err = filev6_set_compressed(&fv6, compressed);
+    if(err != ERR_NONE){
+        return err;
+    }
+    const int after = inode_nbsectors(u, &fv6.i_node);
+    if(after < 0){
+        return after;
+    }
+
+    pps_printf("%s: %" PRId32 " bytes, %d -> %d sectors\n", path, inode_getsize(&fv6.i_node), before, after);
+    return ERR_NONE;
+}
@@ -65,6 +65,42 @@ int utils_print_shafile(const struct unix_filesystem *u, uint16_t inr);
  */
 int utils_print_sha_allfiles(const struct unix_filesystem *u);
 
+#define UTILS_MAX_THREADS 64
+
+/**
+ * @brief same as utils_print_sha_allfiles(), but the inode sectors are
+ *        shared among worker threads; the output stays in inode order
+ * @param u - the mounted filesystem
+ * @param nb_threads - the number of worker threads (1 to UTILS_MAX_THREADS)
+ * @return 0 on success, <0 on error
+ */
+int utils_print_sha_allfiles_parallel(const struct unix_filesystem *u, int nb_threads);
+
+#define UTILS_SHA_LENGTH 32     /* bytes of a SHA-256 */
+
+/**
+ * @brief SHA-256 of each of the given sectors, the sectors being shared
+ *        among worker threads (see dedup_scan())
+ * @param u - the mounted filesystem
+ * @param sectors - the sectors to hash, best in increasing order (the consecutive ones are read at once)
+ * @param count - their number
+ * @param shas - count*UTILS_SHA_LENGTH bytes, the hash of sectors[k] at k*UTILS_SHA_LENGTH (OUT)
+ * @param nb_threads - the number of worker threads (1 to UTILS_MAX_THREADS)
+ * @return 0 on success, <0 on error
+ */
+int utils_sha_sectors(const struct unix_filesystem *u, const uint32_t *sectors, size_t count,
+                      unsigned char *shas, int nb_threads);
+
+/**
+ * @brief same output as direntv6_print_tree() from the root, the directories
+ *        being walked by worker threads that steal them from one another;
+ *        the inodes of the entries of a directory are read in batch
+ * @param u - the mounted filesystem
+ * @param nb_threads - the number of worker threads (1 to UTILS_MAX_THREADS)
+ * @return 0 on success, <0 on error
+ */
+int utils_print_tree_parallel(const struct unix_filesystem *u, int nb_threads);
+
 /* *************************************************** *
  * TODO WEEK 10										   *
  * *************************************************** */
@@ -74,3 +110,25 @@ int utils_print_sha_allfiles(const struct unix_filesystem *u);
  * @return 0 on success, <0 on error
  */
 int utils_print_bitmaps(const struct unix_filesystem *u);
+
+/**
+ * @brief compact a directory (see direntv6_compact()), or convert it to a
+ *        B+tree (see direntv6_make_tree()), and print how many sectors it
+ *        takes before and after
+ * @param u - the mounted filesystem
+ * @param path - the path of the directory
+ * @param to_tree - convert the directory to a B+tree
+ * @return 0 on success, <0 on error
+ */
+int utils_compact_dir(struct unix_filesystem *u, const char *path, int to_tree);
+
+/**
+ * @brief store a file in compressed clusters, or back as an ordinary file
+ *        (see filev6_set_compressed()), and print how many sectors it takes
+ *        before and after
+ * @param u - the mounted filesystem
+ * @param path - the path of the file
+ * @param compressed - 1 to compress the file, 0 to uncompress it
+ * @return 0 on success, <0 on error
+ */
+int utils_compress_file(struct unix_filesystem *u, const char *path, int compressed);
@@ -20,7 +20,8 @@
  */
 
 /*
- * The disk is organized in 512-byte size units called sectors.
+ * The disk is organized in 512-byte size units called sectors
+ * (by default: see "Geometry" below).
  *
  * Each disk can have one filesystem (i.e. there are no partitions);
  * the disk is split into non-overlapping regions. The exact start and
@@ -35,6 +36,11 @@
  * inodes                | s_inode_start  | s_inode_start+s_isize-1
  * data sectors          | s_block_start  | s_fsize
  * -----------------------------------------------------------------
+ * The checksums of the data sectors (optional, see csum.h) take
+ * s_csum_size sectors from s_csum_start, within the data sectors.
+ * So do the dedup entries (optional, see dedup.h), s_dedup_size sectors
+ * from s_dedup_start, and the snapshots (optional, see snapshot.h), listed
+ * in sector s_snap_start.
  */
 
 /*
@@ -141,17 +147,54 @@
 #define PATH_TOKEN '/'
 #define ROOTDIR_NAME "/"
 
+/*
+ * Geometry, fixed at build time (make U6FS_SECTOR_SIZE=4096 U6FS_ADDRESS_SIZE=4):
+ *   - the sector size, a power of two from 512 bytes;
+ *   - the size of a sector address, 2 bytes (UNIX v6) or 4 bytes.
+ * Everything below derives from these two constants, so that each build is
+ * specialized for its geometry. Images are only readable by a build with the
+ * same geometry; the default one is the original on-disk format.
+ */
+#ifndef U6FS_SECTOR_SIZE
+#define U6FS_SECTOR_SIZE 512
+#endif
+#ifndef U6FS_ADDRESS_SIZE
+#define U6FS_ADDRESS_SIZE 2
+#endif
+
 // Max. number of sector locations held in an inode
 #define ADDR_SMALL_LENGTH 8
 
-#define SECTOR_SIZE 512 /* bytes */
+#define SECTOR_SIZE U6FS_SECTOR_SIZE /* bytes */
 
 #define BOOTBLOCK_SECTOR   0
 #define SUPERBLOCK_SECTOR  1
 
-#define ADDRESS_SIZE 2 /* bytes */
+#define ADDRESS_SIZE U6FS_ADDRESS_SIZE /* bytes */
 #define ADDRESSES_PER_SECTOR (SECTOR_SIZE / ADDRESS_SIZE)
 
+/* a sector number, as stored on disk (superblock, inodes, indirect sectors) */
+#if ADDRESS_SIZE == 2
+typedef uint16_t sector_addr_t;
+#define PRIsector PRIu16
+#elif ADDRESS_SIZE == 4
+typedef uint32_t sector_addr_t;
+#define PRIsector PRIu32
+#else
+#error "U6FS_ADDRESS_SIZE must be 2 or 4"
+#endif
+
+/*
+ * A file of at least ADDR_SMALL_LENGTH sectors is "large": i_addr[0..6] are
+ * indirect sectors (holding ADDRESSES_PER_SECTOR sector addresses each) and
+ * i_addr[ADDR_DINDIRECT] is a double-indirect sector, holding the addresses
+ * of more indirect sectors (the "huge" files of UNIX v6).
+ */
+#define ADDR_DINDIRECT (ADDR_SMALL_LENGTH - 1)
+
+/* largest file size held by i_size0:i_size1 (24 bits) */
+#define INODE_MAX_SIZE 0xFFFFFF
+
 #define UTILS_HASHED_LENGTH (16 * SECTOR_SIZE)
 
 /*
@@ -167,35 +210,44 @@
  * Definition of the unix super block.
  * 1 sector in size (not all entries are used)
  */
+#define SUPERBLOCK_USED_SIZE (13 * ADDRESS_SIZE + 4 + 2 * 2) /* bytes before pad */
+
 struct superblock {
 
-    uint16_t	s_isize;    	/* size in sectors of the inodes */
-    uint16_t	s_fsize;	    /* size in sectors of entire volume */
-    uint16_t    s_fbmsize;      /* size in sectors of the freelist bitmap */
-    uint16_t    s_ibmsize;      /* size in sectors of the inode bitmap */
-    uint16_t    s_inode_start;  /* first sector with inodes */
-    uint16_t    s_block_start;  /* first sector with data */
-    uint16_t    s_fbm_start;    /* first sector with the freebitmap (==2) */
-    uint16_t    s_ibm_start;    /* first sector with the inode bitmap */
+    sector_addr_t	s_isize;    	/* size in sectors of the inodes */
+    sector_addr_t	s_fsize;	    /* size in sectors of entire volume */
+    sector_addr_t   s_fbmsize;      /* size in sectors of the freelist bitmap */
+    sector_addr_t   s_ibmsize;      /* size in sectors of the inode bitmap */
+    sector_addr_t   s_inode_start;  /* first sector with inodes */
+    sector_addr_t   s_block_start;  /* first sector with data */
+    sector_addr_t   s_fbm_start;    /* first sector with the freebitmap (==2) */
+    sector_addr_t   s_ibm_start;    /* first sector with the inode bitmap */
 
     uint8_t	    s_flock;	    /* lock during free list manipulation */
     uint8_t	    s_ilock;	    /* lock during I list manipulation */
     uint8_t	    s_fmod;		    /* super block modified flag */
     uint8_t	    s_ronly;	    /* mounted read-only flag */
     uint16_t	s_time[2];	    /* current date of last update */
-    uint16_t	pad[244];       /* unused entries:
+    sector_addr_t   s_csum_start;   /* first sector with the checksums (0: none) */
+    sector_addr_t   s_csum_size;    /* size in sectors of the checksums */
+    sector_addr_t   s_dedup_start;  /* first sector with the dedup entries (0: none) */
+    sector_addr_t   s_dedup_size;   /* size in sectors of the dedup entries */
+    sector_addr_t   s_snap_start;   /* sector listing the snapshots (0: none) */
+    uint16_t	pad[(SECTOR_SIZE - SUPERBLOCK_USED_SIZE) / 2]; /* unused entries:
                                  * padding to ensure sizeof(superblock) == SECTOR_SIZE */
 };
 
 /*
  * Definition of the on-disk inode.
- * 32 bytes in size
+ * 32 bytes in size (64 bytes with 4-byte addresses, padded to a power of two)
  * The original Unix 6 inode assumed 16-bit integers;
  * the structure is here adapted for 32-bit and 64-bit compilers.
  * The maximum file size is 16MB (24 bits).
  * See manpage inode(7) for more infos
  */
 
+#define INODE_SIZE (ADDRESS_SIZE == 2 ? 32 : 64) /* bytes */
+
 struct inode {
     uint16_t	i_mode;     /* inode infos: valid, directory, permissions, ... */
     uint8_t 	i_nlink;	/* directory entries -- unused in our project*/
@@ -203,13 +255,19 @@ struct inode {
     uint8_t 	i_gid;		/* group of owner -- unused in our project*/
     uint8_t  	i_size0;	/* most  significant bits of size */
     uint16_t	i_size1;	/* least significant bits of size */
-    uint16_t	i_addr[ADDR_SMALL_LENGTH];	/* sector locations constituting file */
+    sector_addr_t	i_addr[ADDR_SMALL_LENGTH];	/* sector locations constituting file */
     uint16_t	i_atime[2]; /* access time -- unused in our project */
     uint16_t	i_mtime[2]; /* modify time -- unused in our project */
+#if ADDRESS_SIZE == 4
+    uint8_t 	i_pad[INODE_SIZE - 16 - ADDR_SMALL_LENGTH * ADDRESS_SIZE];
+#endif
 };
 
 #define INODES_PER_SECTOR (SECTOR_SIZE / sizeof(struct inode))
 
+/* largest file stored inline, in place of its sector map (see IINLINE) */
+#define INODE_INLINE_SIZE (ADDR_SMALL_LENGTH * ADDRESS_SIZE)
+
 struct inode_sector {
     struct inode inodes[INODES_PER_SECTOR];
 };
@@ -225,6 +283,9 @@ struct inode_sector {
 #define	ISUID	04000		/* set user  id on execution */
 #define	ISGID	02000		/* set group id on execution */
 #define ISVTX	01000		/* save swapped text even after use */
+#define	IINLINE	ISVTX		/* regular file whose data is held in i_addr (unused bit here) */
+#define	IDIRTREE	ISGID	/* directory in the B+tree format (unused bit here) */
+#define	ICOMPR	ISUID		/* regular file stored in compressed clusters (unused bit here) */
 #define	IREAD	0400		/* read    permission */
 #define	IWRITE	0200        /* write   permission */
 #define	IEXEC	0100        /* execute permission */
@@ -252,6 +313,52 @@ struct direntv6 {
 
 #define DIRENTRIES_PER_SECTOR ((int)(SECTOR_SIZE/sizeof(struct direntv6)))
 
+/*
+ * B+tree directories (IDIRTREE):
+ *   the directory is an array of sector-sized nodes, node 0 being the root.
+ *   Each node starts with a dirtree_header in place of its first direntv6;
+ *   the other slots hold count entries sorted by name:
+ *   - in a leaf, the direntv6 of the directory; the leaves are chained in
+ *     name order by their next field (0 after the last one)
+ *   - in an internal node, a key (d_name) and in d_inumber the node holding
+ *     the names from that key up to the next one; next is the node holding
+ *     the names below the first key
+ */
+
+#define DIRTREE_MAGIC 0x7472   /* "rt" */
+#define DIRTREE_MAX_KEYS (DIRENTRIES_PER_SECTOR - 1)
+
+struct dirtree_header {
+    uint16_t magic;     /* DIRTREE_MAGIC */
+    uint8_t  leaf;      /* 1: a leaf, 0: an internal node */
+    uint8_t  pad0;
+    uint16_t count;     /* entries (or keys) after the header */
+    uint16_t next;      /* leaf: next leaf; internal: child of the names below the first key */
+    uint8_t  pad[8];
+};
+
+/*
+ * Compressed files (ICOMPR):
+ *   the data is cut in clusters of COMPR_CLUSTER_SECTORS sectors (the last
+ *   one may be shorter), each taking the same entries of the sector map as
+ *   in an ordinary file. A cluster of n sectors whose m first entries are set
+ *   and the others 0 holds:
+ *   - m == 0: zeroes only (a hole)
+ *   - m == n: its data as is
+ *   - 0 < m < n: a compr_header then the LZ4 block of its data (see lz4.h),
+ *     over its m sectors
+ * A cluster has 8 sectors, fewer with large sectors so that the LZ4 block of
+ * n - 1 of them still fits the 16 bits of compr_header.length (at least 2:
+ * the block of a single sector never saves one).
+ */
+
+#define COMPR_CLUSTER_SECTORS (UINT16_MAX/SECTOR_SIZE >= 7 ? 8 : UINT16_MAX/SECTOR_SIZE >= 1 ? UINT16_MAX/SECTOR_SIZE + 1 : 2)
+#define COMPR_CLUSTER_SIZE (COMPR_CLUSTER_SECTORS * SECTOR_SIZE)
+
+struct compr_header {
+    uint16_t length;    /* of the LZ4 block, in bytes */
+};
+
 /*
  * Static checks below -- always very useful:
  * this code will only compile if BUILD_BUG_ON condition expands to
@@ -264,10 +371,13 @@ static inline void unixfs_static_checks(void)
 {
     BUILD_BUG_ON(sizeof(int) < 4); // if ints have less than 32 bits, we're quite in trouble
     BUILD_BUG_ON(sizeof(struct superblock) != SECTOR_SIZE);
-    BUILD_BUG_ON(sizeof(struct inode) != 32);
+    BUILD_BUG_ON(SECTOR_SIZE < 512 || (SECTOR_SIZE & (SECTOR_SIZE - 1)) != 0);
+    BUILD_BUG_ON(sizeof(sector_addr_t) != ADDRESS_SIZE);
+    BUILD_BUG_ON(sizeof(struct inode) != INODE_SIZE);
     BUILD_BUG_ON(sizeof(struct inode) * INODES_PER_SECTOR != SECTOR_SIZE);
     BUILD_BUG_ON(sizeof(struct inode_sector) != SECTOR_SIZE);
     BUILD_BUG_ON(sizeof(struct direntv6) * DIRENTRIES_PER_SECTOR != SECTOR_SIZE);
+    BUILD_BUG_ON(sizeof(struct dirtree_header) != sizeof(struct direntv6));
     BUILD_BUG_ON(sizeof(1ULL) != 8); // in bmblock.c we make use of 1ULL has 64 bits
 }
 
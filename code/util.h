@@ -42,3 +42,4 @@
 #define STR_LENGTH_FMT(x) "%." STR(x) "s"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))